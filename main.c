@@ -13,31 +13,101 @@
  * @date 2025-07-20
  */
 
+#define _GNU_SOURCE    // For memrchr
+
 #include <ncurses.h>   // For terminal UI
 #include <stdio.h>     // For file I/O
 #include <stdlib.h>    // For malloc, free, exit
 #include <string.h>    // For string manipulation
 #include <stdbool.h>   // For bool type
 #include <ctype.h>     // For isalnum, isdigit, isspace, isxdigit, tolower, toupper
+#include <wchar.h>     // For wcwidth() and wide-character drawing
+#include <locale.h>    // For setlocale()
+#include <langinfo.h>  // For nl_langinfo(CODESET)
 #include <time.h>      // For status message timestamp
 #include <stdarg.h>    // For variadic functions (set_status_message)
 #include <errno.h>     // For strerror
+#include <limits.h>    // For INT_MAX
 #include <sys/stat.h>  // For stat()
+#include <sys/mman.h>  // For mmap-backed file loading
+#include <sys/uio.h>   // For writev() batched saving
+#include <fcntl.h>     // For open()
+#include <signal.h>    // For catching SIGBUS on truncated mappings
 #include <unistd.h>    // For usleep
+#include <stdint.h>    // For uint64_t search masks
+#include <stddef.h>    // For offsetof()
+#include <pthread.h>   // For the background match index
+#include <stdatomic.h>
+#include <sys/wait.h>  // For batch mode worker processes
+#include <sys/resource.h> // For the peak RSS bench mode reports
+#include <dirent.h>    // For walking the tree in project search
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h> // For the vectorized search kernel
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 // --- Editor Configuration Constants ---
 #define TAB_STOP 4
-#define MAX_LINE_LENGTH_BUFFER 256
+#define MIN_LINE_ALLOCATION 16
+#define LINE_CHUNK_CAPACITY 512
 #define MAX_STATUS_MESSAGE_LENGTH 256
 #define BORDER_WIDTH 1
 #define HINT_ROWS 2
 #define SUGGESTION_ROWS 3
 #define MAX_RECENT_FILES 10
-#define MAX_UNDO_HISTORY 100
+#define SAVE_IOV_BATCH 1024           // iovec entries per writev() when saving
+#define UNDO_RING_CAPACITY 4096       // Undo records kept at most
+#define UNDO_ARENA_BYTES (4 * 1024 * 1024) // Bytes of undo text kept at most
+#define UNDO_OVERSIZE_BYTES (256 * 1024 * 1024) // Bytes of payloads too big for the arena kept at most
 #define COMMAND_TIMEOUT_MS 1500
 #define MAX_COMMAND_SEQUENCE_LENGTH 10
 #define MAX_MACROS 50
 #define MAX_MACRO_ACTION_LENGTH 50
+#define COMMAND_TRIE_FANOUT ('~' - ' ' + 1) // Printable ASCII
+#define MATCH_INDEX_SLICE_BYTES (1024 * 1024) // Bytes of text indexed per turn
+#define MATCH_INDEX_STEP_BYTES 65536  // Bytes of a long line a regex counts between checks for input
+#define MATCH_INDEX_POLL_MS 100       // Status bar refresh interval while the index builds
+#define MAPPING_CHECK_MS 1000         // How often a key press re-checks the mapped file on disk
+#define LOAD_SLICE_LINES (LINE_CHUNK_CAPACITY * 32) // Lines split off the mapping per background turn
+#define CLIPBOARD_REGISTERS 10        // Copies kept in the register ring
+#define CLIPBOARD_BYTE_BUDGET (64 * 1024 * 1024) // Copied bytes the ring keeps; older registers are dropped
+#define HL_CACHE_LINES 4096           // Lines that keep their highlight arrays before off-screen chunks are dropped
+#define RX_INDEX_STRIDE 256           // Bytes between display-column checkpoints on long lines
+#define RX_INDEX_MIN_BYTES 4096       // Lines shorter than this are measured from column 0
+#define LEX_KEYWORD_SLOTS 256         // Keyword hash size per language (power of two, at most half full)
+#define STATUS_MESSAGE_MS 5000        // How long a status message stays up
+#define FRAME_INTERVAL_MS 16          // Repaint at most this often (about 60 Hz) while keys keep coming
+#define KEY_PASTE_BEGIN (KEY_MAX + 1) // Bracketed paste start, ESC [ 2 0 0 ~
+#define KEY_PASTE_END (KEY_MAX + 2)   // Bracketed paste end, ESC [ 2 0 1 ~
+#define AUTOSAVE_DELAY_MS 2000       // Edits reach the journal at most this long after they are made
+#define JOURNAL_MAGIC "UNIEDJ01"      // First eight bytes of a journal file
+#define SESSION_MAGIC "UNIEDS01"      // First eight bytes of a session file
+#define SESSION_MACROS_MAGIC "UNIEDM01" // First eight bytes of the saved macros
+#define LATENCY_BUCKETS 104           // Frame time histogram buckets, four per power of two microseconds
+#define BATCH_SCREEN_ROWS 24          // Page size Page Up/Down use when there is no terminal
+#define BATCH_SCREEN_COLS 80
+#define BENCH_SCREEN_ROWS 50          // Size of the null terminal bench mode draws into
+#define BENCH_SCREEN_COLS 160
+#define BENCH_DEFAULT_BYTES (16 * 1024 * 1024) // Input size when --size is not given
+#define BENCH_DEFAULT_OPS 1000        // Edits timed per workload; renders and searches run a fifth as often
+#define BENCH_MAX_RESULTS 16          // Operations one workload reports
+#define LINE_POOL_MIN_SHIFT 4         // Smallest pooled block is 1 << this bytes (MIN_LINE_ALLOCATION)
+#define LINE_POOL_CLASSES 9           // Power-of-two block sizes, 16 bytes to 4 KiB
+#define LINE_POOL_MAX_BYTES (1 << (LINE_POOL_MIN_SHIFT + LINE_POOL_CLASSES - 1)) // Larger blocks come from malloc()
+#define LINE_SLAB_BYTES (256 * 1024)  // Size of the slabs pooled blocks are carved from
+#define PROJECT_MAX_WORKERS 16        // Threads a project search or replace runs at most
+#define PROJECT_QUEUE_SLOTS 1024      // Paths the directory walk may get ahead of the searchers
+#define PROJECT_MAX_MATCHES 100000    // Matches a project search lists; later ones are only counted
+#define PROJECT_PREVIEW_BYTES 160     // Text of the matching line kept for the list
+#define PROJECT_BINARY_PROBE 8192     // Leading bytes checked for a NUL to skip binary files
+#define REGEX_MAX_PROGRAM 4096        // Instructions a compiled pattern may take
+#define REGEX_MAX_REPEAT 1000         // Largest count a {m,n} repetition may give
+#define REGEX_MAX_DEPTH 64            // Groups a pattern may nest
+#define REGEX_MAX_GROUPS 9            // Capture groups a replacement can refer to, \1 to \9
+#define REGEX_CAPTURE_SLOTS (2 * (REGEX_MAX_GROUPS + 1)) // Start and end of each group and of the whole match
+#define REGEX_DFA_BUDGET (1024 * 1024) // Bytes of DFA states a pattern caches before starting over
+#define REGEX_CACHE_SLOTS 8           // Compiled patterns kept for reuse
 
 // --- Ncurses Color Pair Definitions ---
 #define COLOR_PAIR_DEFAULT 1
@@ -66,20 +136,123 @@ typedef enum {
     HL_KEYWORD,
 } HighlightType;
 
+// --- Syntax Language Structures ---
+// A LanguageDef is plain data; syntax_language_for() compiles it once into a
+// byte class table and a keyword hash that update_highlighting() runs on.
+typedef struct {
+    const char *name;
+    const char *extensions;          // Space-separated extensions and whole file names
+    const char *keywords;            // Space-separated, NULL for none
+    const char *line_comment;        // NULL if the language has none
+    const char *block_comment_start; // NULL if the language has none
+    const char *block_comment_end;
+    const char *quotes;              // Bytes that open and close a string
+    bool ignore_case;                // Keywords match regardless of case
+} LanguageDef;
+
+// Byte classes of a compiled language
+enum {
+    LEX_WORD = 1 << 0,     // Identifier or number byte
+    LEX_DIGIT = 1 << 1,    // Starts a number
+    LEX_SPACE = 1 << 2,
+    LEX_OPERATOR = 1 << 3,
+    LEX_QUOTE = 1 << 4,
+    LEX_COMMENT = 1 << 5,  // First byte of a comment token
+    LEX_KEYWORD_START = 1 << 6, // Some keyword starts with this byte
+};
+
+typedef struct {
+    const char *word;      // Points into LanguageDef.keywords, NULL for an empty slot
+    int len;
+} KeywordSlot;
+
+typedef struct {
+    const LanguageDef *def;
+    unsigned char classes[256];
+    KeywordSlot keywords[LEX_KEYWORD_SLOTS];
+    int keyword_min_len;   // Shorter or longer words skip the hash
+    int keyword_max_len;
+    int line_comment_len;
+    int block_start_len;
+    int block_end_len;
+} SyntaxLanguage;
+
+// --- Display Column Index ---
+// Checkpoints for converting between byte offsets and display columns on long
+// lines: marks[k] is the first character boundary at or after byte
+// k * RX_INDEX_STRIDE, and the display column it starts at. A UTF-8 sequence
+// can straddle the stride, so the boundary may be up to 3 bytes further on.
+// Marks are filled in lazily from the left and dropped when the line changes.
+typedef struct {
+    int cx;                 // Byte offset of the character
+    int rx;                 // Display column it starts at
+} RxMark;
+
+typedef struct RxIndex {
+    int revision;           // hl_revision the marks were computed for
+    int count;              // Leading entries of marks that are valid
+    int allocated;          // Capacity of marks
+    RxMark marks[];
+} RxIndex;
+
 // --- Editor Line Structure ---
+// A line with allocated == 0 is borrowed: chars points straight into the
+// read-only file mapping and is NOT NUL-terminated. Any edit first copies it
+// out to the heap through editor_line_reserve().
 typedef struct {
     char *chars;
     int size;
     int allocated;
-    HighlightType *hl;
-    int hl_revision;
+    uint8_t *hl;            // HighlightType of each byte; only cached for lines near the viewport
+    int hl_revision;        // Bumped on every change to chars
+    int hl_lexed_revision;  // hl_revision the comment state (and hl, if cached) was computed for, -1 if never
+    bool hl_comment_in;     // Lexer state hl was computed from (inside a block comment)
+    bool hl_comment_out;    // Lexer state at end of line, carried into the next line
+    uint8_t hl_class;       // Line pool size class of hl, LINE_POOL_CLASSES if it came from malloc()
+    int match_count;        // Matches of the indexed search query on this line
+    int match_generation;   // Match index generation match_count belongs to
+    int match_revision;     // hl_revision match_count was computed for, -1 if never
+    struct RxIndex *rx_index; // Display-column checkpoints; only built for long lines
 } EditorLine;
 
+// --- Line Chunk Structure ---
+// The buffer is a rope of fixed-capacity line chunks. Inserting or deleting a
+// line only shifts entries inside one chunk, and a Fenwick tree over the chunk
+// line counts maps a line index to its chunk in O(log n). Blocks of lines are
+// spliced in or out whole chunks at a time.
+typedef struct {
+    EditorLine lines[LINE_CHUNK_CAPACITY];
+    int count;
+    int match_total;        // Sum of match_count, valid once the match index has passed the chunk
+    unsigned hl_stamp;      // Frame its lines were last highlighted for the screen, 0 if none hold an hl array
+} LineChunk;
+
+// --- Line Pool Structures ---
+// Owned line text and highlight arrays come from the buffer's pool: slabs
+// carved into power-of-two blocks, with a free list per block size. Closing
+// or reloading the buffer hands the slabs back whole instead of freeing
+// every line. Text longer than LINE_POOL_MAX_BYTES is left to malloc().
+typedef struct LineSlab {
+    struct LineSlab *next;
+    size_t bytes;           // Size of the slab, this header included
+} LineSlab;
+
+typedef struct {
+    void *free_list[LINE_POOL_CLASSES]; // Freed blocks of each size, linked through their first bytes
+    LineSlab *slabs;
+    char *bump;             // Part of the newest slab no block was carved from yet
+    char *bump_end;
+    size_t reserved;        // Bytes of slabs
+    size_t used;            // Bytes of pooled blocks in use
+    size_t large;           // Bytes of line text allocated with malloc()
+    int slab_count;
+} LinePool;
+
 // --- Command State Structure ---
 typedef struct {
     char sequence[MAX_COMMAND_SEQUENCE_LENGTH];
     int length;
-    time_t last_key_time;
+    double last_key_time;   // editor_now_ms() of the last key typed in command mode
     bool active;
     bool show_help;
 } CommandState;
@@ -91,15 +264,16 @@ typedef enum {
 } KeyboardMode;
 
 // --- Undo/Redo Type Enum ---
+// Each record describes the edit that was made; undo applies its inverse.
 typedef enum {
-    UNDO_INSERT_CHAR,
-    UNDO_DELETE_CHAR,
     UNDO_INSERT_EMPTY_LINE,
     UNDO_SPLIT_LINE,
     UNDO_JOIN_LINES,
     UNDO_INSERT_BLOCK,
     UNDO_DELETE_BLOCK,
-    UNDO_MODIFY_LINE_CASE
+    UNDO_MODIFY_LINE_CASE,
+    UNDO_REPLACE_ALL,       // Payload: ReplaceHeader, find text, replace text, ReplaceMatch[count]
+    UNDO_REGEX_REPLACE_ALL  // Payload: ReplaceHeader, found texts, replacements, RegexReplaceMatch[count]
 } UndoType;
 
 // --- Undo/Redo Action Structure ---
@@ -108,22 +282,656 @@ typedef struct {
     int y;
     int x;
     char char_val;
-    char *text_content;
+    char *text_content;     // Points into the undo arena once pushed
     int text_len;
     int num_lines_affected;
+    int group;              // Records sharing a non-zero group are undone together
+    bool owned;             // text_content is its own malloc'd block, too big for the arena
 } UndoAction;
 
+// --- Replace-All Record Layout ---
+// Where one find & replace match started, in the line as it was before the
+// replacement. Payloads sit at arbitrary arena offsets, so all of these are
+// read and written with memcpy.
+typedef struct {
+    int y;
+    int x;
+} ReplaceMatch;
+
+// A regex replace records the text of each match and of what replaced it,
+// the found texts first, in match order, then the replacements.
+typedef struct {
+    int y;
+    int x;
+    int found_len;
+    int replace_len;
+} RegexReplaceMatch;
+
+typedef struct {
+    int find_len;           // Bytes of find text: all the found texts for a regex replace
+    int replace_len;        // Bytes of replace text, likewise
+    int count;
+} ReplaceHeader;
+
+// One range of a line to swap for other text; see line_splice_ranges().
+typedef struct {
+    int x;
+    int len;
+    const char *to;
+    int to_len;
+} SpliceRange;
+
+// --- Undo Log Structure ---
+// Records live in a ring and their text in a circular byte arena filled in the
+// same order, so dropping the oldest record frees the arena tail and dropping
+// the redo records rewinds the arena head. History is bounded by
+// UNDO_ARENA_BYTES of text rather than by a number of keystrokes. A payload
+// bigger than the whole arena gets a block of its own instead, and the oldest
+// records go once those blocks pass UNDO_OVERSIZE_BYTES; the newest record is
+// always kept.
+typedef struct {
+    UndoAction *records;    // Ring of UNDO_RING_CAPACITY records
+    int first;              // Ring index of the oldest record
+    int count;              // Records in the ring
+    int current;            // Records [0, current) can be undone, [current, count) redone
+    char *arena;            // UNDO_ARENA_BYTES of payload storage
+    size_t arena_head;      // Offset where the next payload goes
+    size_t arena_tail;      // Offset of the oldest live payload
+    int live_payloads;      // Records whose text is in the arena
+    size_t owned_bytes;     // Bytes held by records with owned payloads
+    int discards;           // Times the history was thrown away (out of memory)
+    int group_depth;
+    int open_group;
+    int next_group;
+    bool run_open;          // The newest record may still absorb typed characters
+    int suspended;          // Edits are not recorded while non-zero (macro replay)
+} UndoLog;
+
+// --- Regex Structures ---
+// A pattern is parsed into a tree and compiled twice. The reversed program
+// drives a DFA built lazily from it, which finds every position a match
+// starts at in one right-to-left pass over a line. The forward program, with
+// capture saves, runs on a Pike VM from one of those starts to find where
+// the match ends and what its groups hold. Matches never span lines.
+typedef enum {
+    REGEX_SET,              // Consume one byte that is in sets[x]
+    REGEX_SPLIT,            // Continue at x, or else at y
+    REGEX_JMP,              // Continue at x
+    REGEX_SAVE,             // Record the position in capture slot x
+    REGEX_BOL,              // Only where the input starts
+    REGEX_EOL,              // Only where the input ends
+    REGEX_MATCH
+} RegexOp;
+
+typedef struct {
+    RegexOp op;
+    int x;
+    int y;
+} RegexInst;
+
+typedef enum {
+    REGEX_NODE_EMPTY,
+    REGEX_NODE_SET,         // value: index into the sets
+    REGEX_NODE_CONCAT,      // a then b
+    REGEX_NODE_ALT,         // a or b, a preferred
+    REGEX_NODE_REPEAT,      // a, min to max times (max -1: no limit)
+    REGEX_NODE_GROUP,       // a, captured as group value (0: not captured)
+    REGEX_NODE_BOL,
+    REGEX_NODE_EOL
+} RegexNodeType;
+
+typedef struct {
+    RegexNodeType type;
+    int a;
+    int b;
+    int min;
+    int max;
+    bool greedy;
+    int value;
+} RegexNode;
+
+typedef struct {
+    const char *pos;
+    const char *end;
+    RegexNode *nodes;
+    int node_count;
+    int node_allocated;
+    uint32_t (*sets)[8];
+    int set_count;
+    int set_allocated;
+    int group_count;
+    int depth;
+    const char *error;      // Set on the first error
+} RegexParser;
+
+typedef struct {
+    int pcs;                // Offset of its program states in Regex.dfa_pcs
+    int pc_count;
+    bool begin;             // Nothing has been read yet
+    bool accept;            // A match starts where the scan has got to
+    bool accept_end;        // Same, once the scan has reached the start of the line
+} RegexDfaState;
+
+typedef struct {
+    RegexInst *prog;        // Forward program, with capture saves
+    int prog_len;
+    RegexInst *rprog;       // Reversed program the DFA is built from
+    int rprog_len;
+    uint32_t (*sets)[8];    // Byte sets of the SET instructions of both
+    int set_count;
+    int group_count;        // Capture groups past the whole match, at most REGEX_MAX_GROUPS
+    unsigned char byte_class[256]; // Bytes no set tells apart share a class
+    unsigned char class_byte[256]; // One byte of each class
+    int class_count;
+
+    RegexDfaState *states;
+    int *next;              // class_count transitions per state, -1 until computed
+    int state_count;
+    int state_allocated;
+    int *dfa_pcs;           // Sorted program states of every DFA state
+    int dfa_pcs_count;
+    int dfa_pcs_allocated;
+    int *table;             // Open-addressing hash of the states
+    int table_size;
+    int start_state;        // -1 until built
+    size_t dfa_bytes;       // Charged against REGEX_DFA_BUDGET
+    int *dfa_list;          // Scratch, rprog_len each
+    int *dfa_end_list;
+    int *dfa_stack;
+    unsigned *dfa_seen;
+    unsigned dfa_gen;
+
+    int *vm_pcs[2];         // Pike VM thread lists, prog_len each
+    int vm_count[2];
+    int *vm_caps[2];        // REGEX_CAPTURE_SLOTS per program state
+    int *vm_stack;
+    unsigned *vm_seen;
+    unsigned vm_gen;
+
+    int *starts;            // Match starts of the line regex_matches_begin() scanned
+    int start_count;
+    int starts_allocated;
+} Regex;
+
+// Progress of regex_count_more() through a line, from its end to its start.
+typedef struct {
+    int pos;                // Match starts past this are counted
+    int state;              // DFA state at pos, -1 if memory ran out
+    int total;              // Match starts found so far
+} RegexCount;
+
+// Walks the non-overlapping matches of a line, leftmost first.
+typedef struct {
+    int start;
+    int end;
+    int caps[REGEX_CAPTURE_SLOTS]; // -1 for groups that took no part
+    int next;               // Next entry of Regex.starts to try
+    int pos;                // Matches may not start before this
+} RegexMatch;
+
+typedef struct {
+    char pattern[MAX_STATUS_MESSAGE_LENGTH];
+    Regex *regex;           // NULL while the slot is free
+    unsigned long used;     // Tick of the last lookup, for eviction
+} RegexCacheEntry;
+
+typedef struct {
+    RegexCacheEntry entries[REGEX_CACHE_SLOTS];
+    unsigned long tick;
+} RegexCache;
+
+// --- Search Pattern Structure ---
+// What find, the match index and project search look for: literal text
+// through the search kernel, or a compiled regex.
+typedef struct {
+    const char *text;
+    size_t len;
+    Regex *regex;           // NULL for a literal search
+} SearchPattern;
+
+// --- Match Index Structure ---
+typedef struct {
+    pthread_t thread;
+    bool running;
+    pthread_mutex_t lock;   // Guards the whole buffer; see the Match Index section
+    pthread_cond_t wake;
+    atomic_bool main_waiting; // The main thread is blocked on the lock
+    bool quit;
+    char query[MAX_STATUS_MESSAGE_LENGTH];
+    size_t query_len;       // 0 when there is nothing to index
+    bool regex;             // The query is a regex
+    int generation;         // Bumped whenever the query changes
+    int scan_from;          // Lines before this index have fresh match counts
+    Regex *compiled;        // The worker's own copy of a regex query, which keeps DFA states across turns
+    int compiled_generation;
+    RegexCount partial;     // A long line a turn left half counted
+    const char *partial_chars; // Which line that is, NULL for none
+    int partial_size;
+    int partial_revision;
+    // The line match_index_position() last counted on, as every repaint asks again
+    const char *position_chars; // NULL for none
+    int position_size;
+    int position_revision;
+    int position_generation;
+    int position_x;
+    int position_before;    // Matches on the line starting at or before position_x
+} MatchIndex;
+
+// --- Autosave Journal Structures ---
+// A journal file is a JournalHeader naming the version of the file it applies
+// to, then JournalRecords, each followed by its new_count '\n'-terminated
+// lines. Fields are in host byte order: journals are not portable.
+typedef struct {
+    char magic[8];          // JOURNAL_MAGIC
+    int64_t base_size;      // Size of the file the records apply to, -1 if it did not exist
+    int64_t base_mtime_sec; // Its modification time
+    int64_t base_mtime_nsec;
+} JournalHeader;
+
+// Replaces lines [first, first + old_count) with the new_count lines that follow.
+typedef struct {
+    uint32_t checksum;      // FNV-1a of the record, this field zeroed, and of its lines
+    uint32_t sequence;      // Records before this one in the journal
+    int64_t bytes;          // Length of the lines that follow
+    int64_t first;
+    int64_t old_count;
+    int64_t new_count;
+} JournalRecord;
+
+typedef enum {
+    JOURNAL_OPEN,           // Open path, keep its first `keep` bytes, then write data
+    JOURNAL_APPEND,         // Write data and flush it to disk
+    JOURNAL_DISCARD         // Close and delete path
+} JournalJobType;
+
+typedef struct JournalJob {
+    JournalJobType type;
+    char *path;
+    size_t keep;
+    char *data;
+    size_t len;
+    struct JournalJob *next;
+} JournalJob;
+
+// One buffer's journal. Between snapshots the edit primitives only narrow
+// down which lines changed: the top keep_head and bottom keep_tail lines are
+// as they were.
+typedef struct {
+    char *path;             // Journal of the buffer's file, NULL if there is none
+    JournalHeader base;     // The file on disk the journal applies to
+    bool opened;            // Opening path has been queued since the file was loaded or saved
+    bool rewrite;           // The writer failed: the next snapshot starts the journal over with the whole buffer
+    int keep_head;          // Lines at the top unchanged since the last snapshot, INT_MAX if nothing changed
+    int keep_tail;          // Lines at the bottom unchanged since then
+    int line_delta;         // Lines added minus lines removed since then
+    double changed_ms;      // editor_now_ms() of the first change since then
+    uint32_t records;       // Records queued for the journal since it was opened
+} JournalFile;
+
+// The main thread snapshots edits into jobs and a writer thread does all the
+// file I/O.
+typedef struct {
+    pthread_t thread;
+    bool running;
+    pthread_mutex_t lock;   // Guards the job queue, never the buffer
+    pthread_cond_t wake;
+    pthread_cond_t idle;    // Signalled when the queue runs empty
+    JournalJob *head;
+    JournalJob *tail;
+    bool busy;              // The writer is running a job it took off the queue
+    bool quit;
+    int error;              // errno of the writer's latest failure, 0 if none
+    char *error_path;       // Journal that failed, NULL if the failure was not the writer's
+    JournalFile file;       // Journal of the buffer being edited
+} Journal;
+
+// --- Session Cache Structures ---
+// What the editor remembers between runs about each recent file, kept in
+// unied/ under the user's cache directory as one file per path. A session
+// file is a SessionHeader, the path, the length of every line but the last as
+// a LEB128 varint, and a bit per lexed line telling whether it ends inside a
+// block comment. Like journals, fields are in host byte order.
+typedef struct {
+    char magic[8];          // SESSION_MAGIC
+    uint32_t checksum;      // FNV-1a of the whole file with this field zeroed
+    uint32_t path_len;      // Bytes of path after the header
+    int64_t size;           // Size and modification time of the file the entry is for
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t opened;         // Nanoseconds since the epoch when the file was last opened
+    int32_t cursor_x;
+    int32_t cursor_y;
+    int32_t scroll_x;
+    int32_t scroll_y;
+    int32_t code_file;      // 1 if it was highlighted as code, 0 if as text
+    int32_t index_lines;    // Lines the index holds, -1 if there is none
+    int64_t index_bytes;
+    int32_t lexed_lines;    // Lines with a comment state bit
+    int32_t reserved;
+} SessionHeader;
+
+// A session file read back for the file being loaded.
+typedef struct {
+    SessionHeader header;
+    unsigned char *data;    // The whole session file
+    const unsigned char *index;
+    const unsigned char *lexed;
+} Session;
+
+// The macros file is a MacroFileHeader and `count` MacroFileRecords, each
+// followed by its key_count recorded keys as int32_t.
+typedef struct {
+    char magic[8];          // SESSION_MACROS_MAGIC
+    uint32_t checksum;      // FNV-1a of the whole file with this field zeroed
+    uint32_t count;
+} MacroFileHeader;
+
+typedef struct {
+    char sequence[MAX_COMMAND_SEQUENCE_LENGTH];
+    char action[MAX_MACRO_ACTION_LENGTH];
+    int32_t key_count;
+} MacroFileRecord;
+
+// --- Recent File Structure ---
+typedef struct {
+    char *path;             // Absolute path
+    int64_t opened;         // Nanoseconds since the epoch of the last open; orders the list
+} RecentFile;
+
+// --- Project Search Structures ---
+// A walker thread lists the files under the working directory into a bounded
+// queue and a pool of workers searches them. A file's matches are appended
+// to the list once it has been searched, so the list fills in while it is
+// on screen. Replace all runs the same pool over the files with matches.
+typedef struct {
+    char *path;             // Relative to the working directory
+    long total;             // Matches in the file, listed or not
+} ProjectFile;
+
+typedef struct {
+    int file;               // Index into files
+    int line;               // 0-based line number
+    int col;                // Byte offset in the line
+    char *preview;          // The line, cut to PROJECT_PREVIEW_BYTES, leading blanks and control bytes dropped
+} ProjectMatch;
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+} ProjectOpenFile;
+
+typedef struct {
+    pthread_t walker;
+    pthread_t workers[PROJECT_MAX_WORKERS];
+    int worker_count;
+    bool walking;           // The walker thread was started for this run
+    bool running;           // Threads started and not joined yet
+    atomic_bool cancel;     // Makes every thread stop early
+    pthread_mutex_t lock;   // Guards everything below; never the buffer
+    pthread_cond_t queue_ready; // A path was queued or the walk ended
+    pthread_cond_t queue_room;  // A path was taken off the queue
+    char *queue[PROJECT_QUEUE_SLOTS];
+    int queue_head;
+    int queue_count;
+    bool walk_done;
+    int workers_busy;       // Workers that have not finished yet
+    char query[MAX_STATUS_MESSAGE_LENGTH];
+    size_t query_len;
+    char replacement[MAX_STATUS_MESSAGE_LENGTH];
+    size_t replacement_len;
+    bool regex;             // The query is a regex and the replacement may use its groups
+    bool has_replacement;   // Started by project replace, so the list offers replace all
+    bool replacing;         // The workers are rewriting files rather than searching
+    ProjectFile *files;     // Files with at least one match
+    int file_count;
+    int file_allocated;
+    ProjectMatch *matches;
+    int match_count;
+    int match_allocated;
+    long total_matches;     // Matches found, listed or not
+    long files_scanned;
+    int next_file;          // Next entry of files replace all rewrites
+    long replaced;          // Matches replaced so far
+    int files_written;
+    int files_skipped;      // Open in a buffer, or no longer matching
+    int files_failed;
+    int last_error;         // errno of the latest failed file
+    ProjectOpenFile *open_files; // Files open in buffers, which replace all leaves alone
+    int open_file_count;
+    bool list_open;         // The result list is on screen
+    int selected;
+    int list_top;           // First match shown in the suggestion area
+} ProjectSearch;
+
+// Where a worker is in the file it searches or rewrites.
+typedef struct {
+    const char *data;
+    const char *end;
+    Regex *regex;           // The worker's own copy, NULL for a literal query
+    const char *line;       // Line the regex has found the match starts of, NULL before the first
+    const char *line_end;
+    RegexMatch match;
+} ProjectScan;
+
+// --- Command Table Structures ---
+typedef void (*CommandHandler)(void);
+
+typedef struct {
+    const char *sequence;
+    const char *description;
+    CommandHandler handler;
+} EditorCommand;
+
+typedef struct {
+    const char *name;
+    CommandHandler handler;
+} MacroAction;
+
+// Trie over case-folded command sequences; child 0 means "none", since node
+// 0 is the root and never anyone's child.
+typedef struct {
+    int children[COMMAND_TRIE_FANOUT];
+    const EditorCommand *command; // Built-in bound to this sequence, or NULL
+    int macro;                    // Index into E.macros, or -1
+} CommandTrieNode;
+
+typedef struct {
+    CommandTrieNode *nodes;
+    int count;
+    int allocated;
+} CommandTrie;
+
+// --- Suggestion List Layout ---
+typedef struct {
+    int start_y;
+    int col;
+    int row;
+} SuggestionLayout;
+
 // --- Editor Macro Structure ---
 typedef struct {
     char sequence[MAX_COMMAND_SEQUENCE_LENGTH];
     char action[MAX_MACRO_ACTION_LENGTH];
+    CommandHandler handler; // Resolved from action when defined, NULL if unknown
+    int *keys;              // Recorded key stream for the "recorded" action, else NULL
+    int key_count;
 } EditorMacro;
 
+// --- Macro Recorder Structure ---
+typedef struct {
+    int *keys;
+    int count;
+    int allocated;
+    bool active;
+    int command_start;      // Recorded length when the latest Ctrl+\ was pressed
+} MacroRecorder;
+
+// --- Macro Replay State ---
+typedef struct {
+    const int *keys;        // Keys editor_read_key() hands out instead of reading the terminal
+    int count;
+    int pos;
+    bool active;
+    int keep_head;          // Lines at the top no replayed edit has touched, INT_MAX if none was made
+    int keep_tail;          // Lines at the bottom no replayed edit has touched
+} MacroReplay;
+
+// --- Clipboard Register Structures ---
+// A register is a list of byte pieces whose concatenation is the copied text.
+// Unedited lines live in the read-only file mapping, so pieces of them point
+// straight into it; only edited lines, which can still change, are copied
+// into the register's own buffer.
+typedef struct {
+    const char *chars;
+    size_t len;
+} ClipPiece;
+
+typedef struct {
+    ClipPiece *pieces;      // NULL for an empty slot
+    int count;
+    char *owned;            // Copies of edited lines that pieces point into
+    size_t owned_size;
+    size_t bytes;           // Length of the text
+    int lines;              // Lines of text, one more than the newlines in it
+} ClipRegister;
+
+// --- Startup Profile ---
+// Milliseconds spent in each startup phase, for --startup-profile.
+typedef struct {
+    bool enabled;
+    double splash_ms;
+    double ncurses_ms;
+    double load_ms;
+    double paint_ms;
+} StartupProfile;
+
+// --- Latency Profile ---
+// Every key read from the terminal starts a frame that ends when the repaint
+// it caused has been sent. Frames are split into input (getch() returning to
+// the key being handed out), edit (the handler), highlight and draw phases.
+typedef struct {
+    bool overlay;           // Draw the last/avg/p99 overlay over the top border
+    FILE *trace;            // --trace file of Chrome trace events, or NULL
+    long trace_events;      // Events written to trace so far
+    bool frame_open;        // A key was read and its repaint has not finished
+    double key_ms;          // When the open frame's key arrived
+    double highlight_start_ms;
+    double input_ms;        // Phase times of the open frame
+    double edit_ms;
+    double highlight_ms;
+    double draw_ms;
+    int lines_lexed;        // Lines lexed during the open frame
+    double last_ms;         // The last finished frame
+    double last_input_ms;
+    double last_edit_ms;
+    double last_highlight_ms;
+    double last_draw_ms;
+    int last_lines_lexed;
+    double total_ms;        // All finished frames
+    long frames;
+    long histogram[LATENCY_BUCKETS]; // Frame counts by time, see latency_bucket()
+} LatencyProfile;
+
+// --- Batch Script Structure ---
+// A --batch script compiled down to the keystrokes it stands for.
+typedef struct {
+    int *keys;
+    int count;
+    int allocated;
+} BatchScript;
+
+// --- Bench Mode Structures ---
+// Synthetic inputs `unied --bench` generates, in the order they run.
+typedef enum {
+    BENCH_LONG_LINES,
+    BENCH_SHORT_LINES,
+    BENCH_TAB_HEAVY,
+    BENCH_COMMENT_HEAVY,
+    BENCH_WORKLOAD_COUNT
+} BenchWorkload;
+
+// Timings of one operation, summarized over all its runs.
+typedef struct {
+    const char *op;
+    int ops;
+    double ops_per_sec;
+    double p50_us;
+    double p99_us;
+} BenchResult;
+
+// --- Atomic Save Structure ---
+// A file is saved by writing a temporary file next to it, flushing it to disk
+// and renaming it over the original.
+typedef struct {
+    char *target;           // realpath() of the file, NULL if it could not be resolved
+    const char *path;       // File being replaced: target, or the name as given
+    char *tmp_path;         // Temporary file next to it
+    int fd;                 // Open on tmp_path
+} AtomicSave;
+
+// --- File Mapping Structure ---
+// A read-only mapping of a loaded file. Buffers holding the same unchanged
+// file borrow their lines from one mapping, which goes away with the last.
+// The pages are the file's own, so a program rewriting the file in place
+// changes unedited lines under the editor, and truncating it makes reads
+// past the new end fault; both are caught and reported, not prevented.
+typedef struct FileMapping {
+    char *base;
+    size_t size;
+    dev_t dev;              // Identity of the file when it was mapped
+    ino_t ino;
+    struct timespec mtime;
+    int refs;               // Buffers (and loads in progress) using it
+    volatile sig_atomic_t changed; // The file was rewritten or truncated in place since
+    bool reported;          // The user has been warned about it
+    struct FileMapping *next;
+} FileMapping;
+
+// --- Editor Buffer Structure ---
+// An open file other than the one being edited: everything that belongs to a
+// file lives in E while it is on screen, and buffer_switch() parks it here and
+// moves another one in. No text is copied and the lines keep their
+// highlighting, so switching is instant.
+typedef struct {
+    LineChunk **chunks;
+    int num_chunks;
+    int allocated_chunks;
+    int *chunk_tree;
+    int num_lines;
+    FileMapping *mapping;
+    size_t map_indexed;
+    bool map_load_failed;
+    LinePool pool;
+    int cursor_x;
+    int cursor_y;
+    int scroll_y;
+    int scroll_x;
+    char *filename;
+    bool dirty;
+    int hl_frontier;
+    int hl_cached_lines;
+    bool is_code_file;
+    const SyntaxLanguage *syntax;
+    UndoLog undo;
+    JournalFile journal;
+} EditorBuffer;
+
 // --- Global Editor State Structure ---
 typedef struct {
-    EditorLine *lines;
+    LineChunk **chunks;
+    int num_chunks;
+    int allocated_chunks;
+    int *chunk_tree;        // Fenwick tree of chunk line counts (1-based)
+    int chunk_cache_index;  // Chunk of the last editor_get_line() lookup, -1 if none
+    int chunk_cache_start;  // Line index of the first line in that chunk
     int num_lines;
-    int allocated_lines;
+
+    char *map_base;         // Read-only mapping of the loaded file, or NULL
+    size_t map_size;
+    FileMapping *mapping;   // The shared mapping map_base belongs to
+    size_t map_indexed;     // Bytes of the mapping already split into lines
+    bool map_load_failed;   // Splitting the rest of the mapping ran out of memory
+    LinePool pool;          // Where the buffer's owned line text and highlight arrays live
 
     int cursor_x;
     int cursor_y;
@@ -139,25 +947,49 @@ typedef struct {
     bool dirty;
 
     char status_message[MAX_STATUS_MESSAGE_LENGTH];
-    time_t status_message_time;
+    double status_message_time; // editor_now_ms() when the status message was set
 
-    bool in_multiline_comment_global;
+    int hl_frontier;        // Lines before this index have an up-to-date comment state
+    int hl_cached_lines;    // Lines holding an hl array
+    unsigned hl_clock;      // Counts highlighting passes, for the LRU stamps on chunks
 
-    int dirty_line_start;
+    int dirty_line_start;   // Lines whose content changed since the last frame, -1 if none
     int dirty_line_end;
 
+    // What the previous frame drew, so the next one only repaints the damage
+    bool full_redraw;
+    int drawn_scroll_y;
+    int drawn_scroll_x;
+    int drawn_cursor_y;
+    int drawn_num_lines;
+    int drawn_line_num_width;
+    int drawn_screen_rows;
+    int drawn_screen_cols;
+    bool drawn_visual_mode;
+    double drawn_ms;        // editor_now_ms() when the last frame was sent to the terminal
+
     CommandState cmd;
 
-    char *clipboard_buffer;
-    int clipboard_size;
-    int clipboard_allocated;
+    ClipRegister registers[CLIPBOARD_REGISTERS]; // Ring of copies; see clipboard_register()
+    int register_newest;
+    int register_count;
 
     EditorMacro macros[MAX_MACROS];
     int macro_count;
+    CommandTrie command_trie;
+    MacroRecorder recorder;
+    MacroReplay replay;
+    MacroReplay script;     // Batch mode input, replayed as if typed
+    bool headless;          // Running a --batch script: no terminal is touched
+    bool offscreen;         // --bench: headless, but still drawn into a null terminal
+    bool fast_start;        // --fast: no splash, file type taken from the extension
+    StartupProfile startup;
+    LatencyProfile latency;
     bool creative_mode;
 
     KeyboardMode keyboard_mode;
     bool is_code_file;
+    const SyntaxLanguage *syntax; // Language of the file, used while is_code_file is set
 
     bool visual_mode;
     int visual_start_x, visual_start_y;
@@ -166,16 +998,28 @@ typedef struct {
     int last_search_found_y;
     int last_search_found_x;
     bool search_active;
+    bool last_search_regex; // last_search_query is a regex
+    bool search_regex;      // New searches and replaces take a regex
+    RegexCache regex_cache;
 
     bool show_line_numbers;
 
-    char *recent_files[MAX_RECENT_FILES];
+    RecentFile recent_files[MAX_RECENT_FILES]; // Unordered; the session cache holds an entry for each
     int num_recent_files;
+    char *session_dir;      // Where session files go, NULL to keep nothing between runs
 
-    UndoAction undo_history[MAX_UNDO_HISTORY];
-    int undo_head;
-    UndoAction redo_history[MAX_UNDO_HISTORY];
-    int redo_head;
+    UndoLog undo;
+
+    MatchIndex match_index;
+    Journal journal;
+    ProjectSearch project;
+
+    EditorBuffer *buffers;  // Open files; the slot of the one being edited is stale while it is in E
+    int buffer_count;
+    int buffer_current;
+    FileMapping *mappings;  // Every live mapping, so buffers of the same file can share one
+    size_t page_size;       // For the SIGBUS handler, which cannot ask for it
+    double mapping_checked_ms; // When the current buffer's file was last stat()ed
 
 } EditorState;
 
@@ -185,44 +1029,308 @@ EditorState E;
 // --- Function Prototypes (all functions declared before main) ---
 // Core Editor Functions
 void init_editor(void);
+static void init_editor_state(void);
+static void init_color_pairs(void);
 void deinit_editor(void);
 int editor_read_key(void);
+static bool editor_key_pending(int wait_ms);
+void editor_drain_input(void);
 void editor_move_cursor(int key);
+bool editor_line_reserve(EditorLine *line, int capacity);
+void editor_line_truncate(EditorLine *line, int len);
+bool editor_line_append(EditorLine *line, const char *s, int len);
+void editor_line_free(EditorLine *line);
+void editor_line_drop_highlight(EditorLine *line);
+bool editor_line_init(EditorLine *line, const char *s, int len);
+void editor_line_set_buffer(EditorLine *line, char *chars, int size, int allocated);
 void editor_line_insert_char(EditorLine *line, int at, int c);
 void editor_line_delete_char(EditorLine *line, int at);
+static void editor_line_changed(EditorLine *line);
+EditorLine *editor_get_line(int at);
 void editor_insert_line(int at, const char *s, int len);
+static bool line_store_insert_text(int at, const char *s, int len);
+static void line_store_remove_range(int at, int count);
+static bool line_store_insert_range(int at, const EditorLine *lines, int count);
 void editor_delete_line(int at);
+void editor_free_lines(void);
 void editor_insert_char(int c);
 void editor_delete_char(void);
 void editor_insert_newline(void);
+static bool editor_load_more(int max_lines);
+bool editor_load_pending(void);
+void editor_load_through(int line);
+void editor_load_all(void);
+static FileMapping *mapping_acquire(int fd, const struct stat *st);
+static void mapping_release(FileMapping *mapping);
+void mapping_catch_faults(void);
+static void mapping_on_sigbus(int sig, siginfo_t *info, void *context);
+static bool mapping_changed_on_disk(FileMapping *mapping, const char *path);
+static void mapping_check(void);
 void editor_load_file(const char *filename);
+static bool save_write_batch(int fd, struct iovec *iov, int count);
+static bool atomic_save_begin(AtomicSave *save, const char *filename);
+static bool atomic_save_commit(AtomicSave *save, bool ok);
+static bool editor_write_lines(int fd, size_t *bytes);
 void editor_save_file(void);
-int editor_row_cx_to_rx(const EditorLine *row, int cx);
-int editor_row_rx_to_cx(const EditorLine *row, int cx);
+static int utf8_decode(const char *s, int avail, uint32_t *cp);
+static int utf8_width(uint32_t cp);
+static int line_char_width(const EditorLine *row, int cx, int rx, int *len);
+int line_next_char(const EditorLine *row, int cx);
+int line_prev_char(const EditorLine *row, int cx);
+static int rx_advance(const EditorLine *row, int *cx, int to, int rx);
+static RxIndex *line_rx_index(EditorLine *row);
+static void rx_index_extend(const EditorLine *row, RxIndex *index, int k);
+int editor_row_cx_to_rx(EditorLine *row, int cx);
+int editor_row_rx_to_cx(EditorLine *row, int rx);
+double editor_now_ms(void);
+static void startup_profile_format(char *buf, size_t size);
+static int latency_bucket(double ms);
+static double latency_bucket_upper_ms(int bucket);
+static double latency_percentile_ms(double fraction);
+bool latency_trace_open(const char *path);
+void latency_trace_close(void);
+static void latency_trace_event(const char *name, double start_ms, double duration_ms, int lines_lexed);
+static void latency_key_read(double arrived_ms);
+static void latency_frame_end(void);
+static void latency_draw_overlay(void);
+
+// Line Pool
+static int line_pool_class(size_t bytes);
+static void *line_pool_alloc(int cls);
+static void line_pool_free(void *block, int cls);
+static char *line_chars_alloc(int *capacity);
+static char *line_chars_resize(char *chars, int old_capacity, int *capacity, int keep);
+static void line_chars_free(char *chars, int capacity);
+static uint8_t *line_hl_reserve(EditorLine *line, int bytes);
+static void line_hl_free(EditorLine *line);
+static void line_pool_release(LinePool *pool);
+static void memory_format_bytes(char *out, size_t out_size, size_t bytes);
+void editor_show_memory_stats(void);
 
 // UI Functions
 void set_status_message(const char *fmt, ...);
-bool is_operator_char(char c);
-bool is_double_operator(const char *str, int index);
 void mark_lines_dirty(int start, int end);
-void update_highlighting(EditorLine *line);
-static void print_char_with_highlight(int c, int base_color_pair, bool is_cursor_char);
+void update_highlighting(EditorLine *line, bool in_comment);
+static void update_highlighting_state(EditorLine *line, bool in_comment);
+void editor_update_highlighting_range(int first, int last);
+static void highlight_cache_trim(void);
+static void emit_highlight_run(const wchar_t *run, int len, int color_pair, int attrs);
 static int get_color_pair_for_highlight_type(HighlightType type);
-void editor_draw_line_highlighted(const EditorLine *line, int line_idx, int screen_y, int line_num_offset_x);
+void editor_draw_line_highlighted(EditorLine *line, int line_idx, int screen_y, int line_num_offset_x);
 void clear_suggestion_area(void);
 void show_command_suggestions(void);
+static bool draw_command_suggestion(const CommandTrieNode *entry, void *ctx);
 void editor_draw_hints(void);
+static void editor_draw_row(int y, int line_num_width);
 void editor_refresh_screen(void);
 char *editor_prompt(const char *prompt_msg, char *buffer, size_t buf_size);
 bool show_confirmation_dialog(const char *prompt_msg);
 void display_loading_screen(void);
 void editor_set_file_type(bool is_code);
+bool editor_infer_file_type(const char *filename);
 void prompt_file_type(void);
 void show_command_help_screen(void);
 
+// Search Kernel
+const char *text_search_forward(const char *hay, size_t hay_len, const char *needle, size_t needle_len);
+const char *text_search_backward(const char *hay, size_t hay_len, const char *needle, size_t needle_len);
+
+// Regex
+static int regex_node(RegexParser *parser, RegexNodeType type, int a, int b);
+static int regex_new_set(RegexParser *parser);
+static void regex_set_add(uint32_t *set, int lo, int hi);
+static bool regex_set_has(const uint32_t *set, unsigned char c);
+static int regex_byte_node(RegexParser *parser, int lo, int hi);
+static int regex_multibyte_node(RegexParser *parser);
+static int regex_char_node(RegexParser *parser);
+static bool regex_class_escape(char c, uint32_t *set, bool *multibyte);
+static int regex_parse_escape(RegexParser *parser);
+static int regex_parse_class(RegexParser *parser);
+static int regex_parse_atom(RegexParser *parser);
+static bool regex_parse_count(RegexParser *parser, int *min, int *max);
+static int regex_parse_repeat(RegexParser *parser);
+static int regex_parse_concat(RegexParser *parser);
+static int regex_parse_alt(RegexParser *parser);
+static long regex_node_size(const RegexNode *nodes, int n, bool saves);
+static void regex_emit(const RegexNode *nodes, int n, RegexInst *prog, int *len, bool reverse);
+static void regex_byte_classes(Regex *re);
+Regex *regex_compile(const char *pattern, char *error, size_t error_size);
+void regex_free(Regex *re);
+static void regex_dfa_closure(Regex *re, int pc, bool at_begin, bool at_end, int *list, int *count);
+static void regex_dfa_flush(Regex *re);
+static int regex_int_compare(const void *a, const void *b);
+static int regex_dfa_add(Regex *re, const int *pcs, int count, bool begin);
+static int regex_dfa_start(Regex *re);
+static int regex_dfa_next(Regex *re, int state, unsigned char c);
+static int regex_scan(Regex *re, const char *s, int len, int from, int to, int *first, int *last, bool collect);
+static void regex_count_begin(Regex *re, int len, RegexCount *count);
+static bool regex_count_more(Regex *re, const char *s, RegexCount *count, int budget);
+static void regex_vm_add(Regex *re, int list, int pc, int *caps, int pos, int len);
+static int regex_match_at(Regex *re, const char *s, int len, int start, int *caps);
+void regex_matches_begin(Regex *re, const char *s, int len, RegexMatch *m);
+bool regex_matches_next(Regex *re, const char *s, int len, RegexMatch *m);
+size_t regex_expand(const char *tmpl, size_t tmpl_len, const char *s, const RegexMatch *m, char *out);
+static Regex *regex_cache_get(const char *pattern, char *error, size_t error_size);
+static void regex_cache_clear(void);
+static bool search_pattern_init(SearchPattern *pattern, const char *query, bool regex, char *error, size_t error_size);
+static int search_first(const SearchPattern *pattern, const char *s, int len, int from, int to);
+static int search_last(const SearchPattern *pattern, const char *s, int len, int from, int to);
+static int search_count(const SearchPattern *pattern, const char *s, int len, int from, int to);
+
+// Syntax Lexer
+static unsigned syntax_hash(const char *s, int len, bool ignore_case);
+static void syntax_compile(SyntaxLanguage *lang, const LanguageDef *def);
+static bool syntax_is_keyword(const SyntaxLanguage *lang, const char *s, int len);
+const SyntaxLanguage *syntax_language_for(const char *filename);
+static int lex_skip_run(const SyntaxLanguage *lang, const char *s, int i, int len, unsigned char cls);
+static bool lex_token_at(const char *s, int i, int len, const char *token, int token_len);
+static int lex_block_comment_end(const SyntaxLanguage *lang, const char *s, int i, int len);
+static inline void lex_mark(uint8_t *hl, int from, int to, HighlightType type);
+static bool lex_line(const SyntaxLanguage *lang, const char *s, int len, bool in_comment, uint8_t *hl);
+
+// Match Index
+void match_index_start(void);
+void match_index_stop(void);
+void editor_buffer_release(void);
+void editor_buffer_acquire(void);
+void match_index_set_query(const char *query, bool regex);
+bool match_index_pending(void);
+static bool match_index_active(void);
+static bool match_index_line_fresh(const EditorLine *line);
+static int match_index_count_line(const SearchPattern *pattern, const EditorLine *line, size_t *scanned);
+static void match_index_scan_slice(void);
+static void *match_index_worker(void *arg);
+static int match_index_next_candidate(int y, int step);
+bool match_index_position(int y, int x, int *nth, int *total);
+
+// Autosave Journal
+void journal_start(void);
+void journal_stop(void);
+static void journal_queue(JournalJobType type, const char *path, size_t keep, char *data, size_t len);
+static bool journal_run_job(const JournalJob *job);
+static void *journal_worker(void *arg);
+void journal_flush(void);
+static uint32_t journal_checksum(uint32_t hash, const void *data, size_t len);
+static void journal_reset_changes(void);
+static void journal_note_change(int at, int count, int delta);
+static void journal_note_line(const EditorLine *line);
+static void journal_note_loaded(int count);
+int journal_due_ms(void);
+void journal_snapshot(void);
+void journal_report_error(void);
+static char *journal_path_for(const char *filename);
+static bool journal_path_taken(const char *path);
+static void journal_stat_base(const char *filename, JournalHeader *base);
+static int journal_replay(const char *data, size_t len, size_t *valid);
+void journal_attach(void);
+void journal_saved(void);
+void journal_discard(void);
+
+// Buffer List
+static void buffer_park(EditorBuffer *buf);
+static void buffer_unpark(const EditorBuffer *buf);
+static void buffer_reset_view(void);
+static void buffer_reset(void);
+static void buffer_free_current(void);
+static bool buffer_is_dirty(int n);
+static bool buffer_add(void);
+void buffer_switch(int n);
+void buffer_open(const char *filename);
+void buffer_close(void);
+static void buffer_free_all(void);
+static void command_buffer_next(void);
+static void command_buffer_prev(void);
+void editor_show_buffers(void);
+void editor_reload_file(void);
+
+// Session Cache
+void session_start(void);
+static int64_t session_now_ns(void);
+static char *session_path_for(const char *path);
+static bool session_dir_make(void);
+static bool session_write(const char *path, struct iovec *iov, int count, uint32_t *checksum);
+static bool session_read_file(const char *path, unsigned char **data, size_t *len, size_t header_size, size_t checksum_at);
+static bool session_read(const char *filename, Session *session);
+static void session_store(void);
+static bool editor_load_indexed(const Session *session);
+static void session_restore_lexer(const Session *session);
+static void session_restore_view(const Session *session);
+static void recent_files_order(int *order);
+static void macros_load(void);
+static void macros_store(void);
+
+// Project Search
+static char *project_join(const char *dir, const char *name);
+static bool project_queue_push(char *path);
+static char *project_queue_pop(void);
+static void *project_walk(void *arg);
+static bool project_map_file(const char *path, char **data, size_t *size);
+static const char *project_next_match(ProjectScan *scan, const char *pos, size_t *match_len);
+static void project_search_file(char *path, Regex *regex);
+static void *project_search_worker(void *arg);
+static int project_replace_file(const char *path, Regex *regex, long *replaced, int *error);
+static void *project_replace_worker(void *arg);
+static bool project_threads_start(void *(*worker)(void *), bool walk);
+static void project_threads_join(void);
+void project_search_stop(void);
+void project_search_clear(void);
+static bool project_search_start(const char *query, const char *replacement);
+bool project_search_poll(void);
+static void project_replace_all(void);
+static void project_open_match(int n);
+static void project_draw_list(void);
+static void project_draw_status(int y);
+static void project_list_run(void);
+void command_project_search(void);
+void command_project_replace(void);
+void command_project_list(void);
+
+// Command Table
+static void command_keyboard_normal(void);
+static void command_text_to_code(void);
+static void command_code_to_text(void);
+static void command_move_left(void);
+static void command_move_down(void);
+static void command_move_up(void);
+static void command_move_right(void);
+static void command_delete_line(void);
+static void command_upper_line(void);
+static void command_lower_line(void);
+static void command_quit_force(void);
+static void command_quit_confirm(void);
+static void command_latency_overlay(void);
+static int command_trie_branch(char c);
+static int command_trie_new_node(void);
+static int command_trie_walk(const char *seq, bool create);
+void command_table_init(void);
+bool command_table_add_macro(const char *seq, int macro);
+const CommandTrieNode *command_table_find(const char *seq);
+void command_table_visit_prefix(const char *prefix, bool (*visit)(const CommandTrieNode *, void *), void *ctx);
+static CommandHandler macro_action_lookup(const char *action);
+
+// Macro Recording
+void macro_record_key(int key);
+static void command_macro_record(void);
+static void command_macro_play(void);
+static size_t buffer_write_lines(int from, int to, bool leading, char *dst);
+static void macro_push_replay_undo(const ClipRegister *old, int old_lines);
+void macro_replay(const int *keys, int count, int times, int first_line, int last_line);
+
+// Clipboard Registers
+static ClipRegister *clipboard_register(int n);
+static void clipboard_register_free(ClipRegister *reg);
+static bool clipboard_capture(ClipRegister *reg, int sy, int sx, int ey, int ex);
+bool clipboard_copy_range(int sy, int sx, int ey, int ex);
+static void clipboard_flatten(const ClipRegister *reg, char *dst);
+static void clipboard_read(const ClipRegister *reg, size_t from, size_t len, char *dst);
+void clipboard_detach_mapping(const char *base, size_t size);
+static bool clipboard_paste(const ClipRegister *reg, int y, int x, int *end_y, int *end_x);
+void editor_paste_register(int n);
+static void command_paste_register(void);
+
 // Command and Extended Functions
 void reset_command_mode(void);
-void execute_custom_command(const char* action);
+void execute_custom_command(const EditorMacro *macro);
 void execute_command_sequence(void);
 void handle_command_mode_input(int key);
 void autocomplete_command(void);
@@ -233,6 +1341,14 @@ void editor_find(void);
 void editor_find_next(void);
 void editor_find_prev(void);
 void editor_find_replace(void);
+static bool line_splice_matches(int y, const int *xs, int n, int from_len, const char *to, int to_len);
+int editor_replace_all(const char *find, int find_len, const char *replace, int replace_len);
+static void replace_all_apply(const UndoAction *action, bool reverse);
+static bool line_splice_ranges(int y, const SpliceRange *ranges, int n);
+int editor_regex_replace_all(Regex *regex, const char *replace, int replace_len);
+static bool regex_replace_append(char **buf, size_t *len, size_t *allocated, const char *text, size_t text_len);
+static void regex_replace_apply(const UndoAction *action, bool reverse);
+void command_regex_toggle(void);
 void editor_copy_line(void);
 void editor_cut_line(void);
 void editor_paste_line(void);
@@ -241,9 +1357,11 @@ void editor_goto_line(void);
 void editor_toggle_line_numbers(void);
 void editor_show_recent_files(void);
 void enter_creative_mode(void);
+static bool macro_define(const char *sequence, const char *action, const int *keys, int key_count);
 void editor_duplicate_line(void);
 void editor_change_line_case(bool to_upper);
 void editor_set_keyboard_mode(KeyboardMode mode);
+static bool is_word_byte(char c);
 void move_to_word_start(void);
 void move_to_word_end(void);
 void editor_toggle_visual_mode(void);
@@ -254,18 +1372,57 @@ void editor_delete_selection(void);
 void get_normalized_selection_coords(int *sy, int *sx, int *ey, int *ex);
 char *get_selection_content(int sy, int sx, int ey, int ex, int *num_lines);
 void editor_insert_text_block(int y, int x, const char *text, int text_len);
+static void editor_insert_pasted(const char *text, int len);
+void editor_paste_bracketed(void);
 void editor_delete_text_block(int sy, int sx, int ey, int ex);
 void add_to_recent_files(const char *filename);
 void init_undo_redo(void);
-void free_undo_action(UndoAction *action);
+static UndoAction *undo_record_at(int i);
+static void undo_drop_oldest(void);
+static char *undo_arena_alloc(size_t n);
+static bool undo_payload_extend(UndoAction *action, int extra);
+static void undo_release_payload(UndoAction *action);
+static void undo_release_all(void);
+static char *undo_oversize_alloc(size_t n);
+void undo_discard_history(const char *message);
+static char *push_undo_record(UndoAction action, size_t payload_len);
 void push_undo_action(UndoAction action);
-void push_redo_action(UndoAction action);
+void undo_begin_group(void);
+void undo_end_group(void);
+void undo_record_insert_char(int y, int x, char c);
+void undo_record_delete_char(int y, int x, char c, bool backward);
+void push_line_delete_undo(int y);
 void clear_redo_history(void);
+static void undo_block_end(const UndoAction *action, int *ey, int *ex);
+static void undo_apply(UndoAction *action, bool reverse);
 void editor_undo(void);
 void editor_redo(void);
 void editor_select_all(void);
 void editor_process_keypress(void);
 
+// Batch Mode
+static bool batch_append_key(BatchScript *script, int key);
+static bool batch_append_text(BatchScript *script, const char *text, bool escapes);
+static int batch_key_by_name(const char *name);
+static bool batch_compile_line(BatchScript *script, char *line, const char **error);
+static bool batch_load_script(const char *path, BatchScript *script);
+static int batch_process_file(const BatchScript *script, const char *path);
+static bool batch_worker_failed(pid_t pid, int status, pid_t *workers, const char **paths, int slots);
+static int batch_main(int argc, char *argv[]);
+
+// Bench Mode
+static uint64_t bench_random(uint64_t *state);
+static int bench_put_tokens(FILE *out, uint64_t *state, int len, bool tabs);
+static bool bench_generate(FILE *out, BenchWorkload kind, size_t bytes);
+static bool bench_screen_open(void);
+static void bench_run_keys(const int *keys, int count);
+static void bench_place_cursor(uint64_t *state);
+static int bench_compare_us(const void *a, const void *b);
+static void bench_summarize(BenchResult *result, const char *op, double *samples_us, int count);
+static int bench_run_workload(BenchWorkload kind, size_t bytes, int ops, bool render);
+static bool bench_parse_size(const char *arg, size_t *bytes);
+static int bench_main(int argc, char *argv[]);
+
 // --- Core Editor Function Implementations ---
 
 /**
@@ -280,7 +1437,33 @@ void init_editor(void) {
     noecho();              // Don't echo input characters
     keypad(stdscr, TRUE);  // Enable special keys (arrow keys, F-keys)
     curs_set(1);           // Set cursor to visible (1 for underline, 2 for block)
+    idlok(stdscr, TRUE);   // Let wscrl() use the terminal's scrolling region
+    init_color_pairs();
+
+    // Have the terminal wrap pasted text in markers so it goes in as one edit
+    define_key("\033[200~", KEY_PASTE_BEGIN);
+    define_key("\033[201~", KEY_PASTE_END);
+    printf("\033[?2004h");
+    fflush(stdout);
+
+    init_editor_state();
+    match_index_start();
+    journal_start();
+    session_start();
+
+    getmaxyx(stdscr, E.total_screen_rows, E.screen_cols);
+    E.screen_rows = E.total_screen_rows - HINT_ROWS - 1 - SUGGESTION_ROWS - 2 * BORDER_WIDTH;
+
+    // Add explicit hint for new users
+    set_status_message("Help: Ctrl+S = Save | Ctrl+O = Open | Ctrl+Q = Quit | Ctrl+H = Help");
+}
 
+/**
+ * @brief Starts color on the current screen and defines the editor's color pairs.
+ *
+ * Does nothing on a terminal without color support.
+ */
+static void init_color_pairs(void) {
     // Check for color support
     if (has_colors()) {
         start_color();
@@ -298,21 +1481,53 @@ void init_editor(void) {
         init_pair(COLOR_PAIR_SELECTION, COLOR_BLACK, COLOR_YELLOW);
         init_pair(COLOR_PAIR_BORDER, COLOR_WHITE, COLOR_BLACK);
     }
+}
 
+/**
+ * @brief Resets the editor state to an empty buffer without touching the terminal.
+ *
+ * Shared by the interactive editor and batch mode, which never starts ncurses.
+ */
+static void init_editor_state(void) {
+    E.chunks = NULL;
+    E.num_chunks = 0;
+    E.allocated_chunks = 0;
+    E.chunk_tree = NULL;
+    E.chunk_cache_index = -1;
+    E.chunk_cache_start = 0;
     E.num_lines = 0;
-    E.allocated_lines = 0;
-    E.lines = NULL;
+    E.map_base = NULL;
+    E.map_size = 0;
+    E.mapping = NULL;
+    E.map_indexed = 0;
+    E.map_load_failed = false;
+    memset(&E.pool, 0, sizeof(E.pool));
     E.cursor_x = 0;
     E.cursor_y = 0;
     E.scroll_y = 0;
     E.scroll_x = 0;
     E.filename = NULL;
     E.dirty = false;
+    E.buffers = NULL;
+    E.buffer_count = 1;
+    E.buffer_current = 0;
+    E.mappings = NULL;
     E.status_message[0] = '\0';
     E.status_message_time = 0;
-    E.in_multiline_comment_global = false;
+    E.hl_frontier = 0;
+    E.hl_cached_lines = 0;
+    E.hl_clock = 0;
     E.dirty_line_start = -1;
     E.dirty_line_end = -1;
+    E.full_redraw = true;
+    E.drawn_scroll_y = 0;
+    E.drawn_scroll_x = 0;
+    E.drawn_cursor_y = 0;
+    E.drawn_num_lines = 0;
+    E.drawn_line_num_width = 0;
+    E.drawn_screen_rows = 0;
+    E.drawn_screen_cols = 0;
+    E.drawn_visual_mode = false;
 
     // Command State Init
     E.cmd.active = false;
@@ -322,17 +1537,19 @@ void init_editor(void) {
     E.cmd.show_help = false;
 
     // Clipboard Init
-    E.clipboard_buffer = NULL;
-    E.clipboard_size = 0;
-    E.clipboard_allocated = 0;
+    memset(E.registers, 0, sizeof(E.registers));
+    E.register_newest = 0;
+    E.register_count = 0;
 
     // Macro System Init
     E.macro_count = 0;
     E.creative_mode = false;
+    command_table_init();
 
     // Keyboard Mode Init
     E.keyboard_mode = NORMAL_KB_MODE;
     E.is_code_file = false;
+    E.syntax = NULL;
 
     // Visual Mode Init
     E.visual_mode = false;
@@ -344,49 +1561,60 @@ void init_editor(void) {
     E.last_search_found_y = -1;
     E.last_search_found_x = -1;
     E.search_active = false;
+    E.last_search_regex = false;
+    E.search_regex = false;
 
     E.show_line_numbers = false;
 
     // Recent Files Init
     E.num_recent_files = 0;
     for (int i = 0; i < MAX_RECENT_FILES; i++) {
-        E.recent_files[i] = NULL;
+        E.recent_files[i] = (RecentFile){ NULL, 0 };
     }
+    E.session_dir = NULL;
 
     // Undo/Redo Init
     init_undo_redo();
-
-    getmaxyx(stdscr, E.total_screen_rows, E.screen_cols);
-    E.screen_rows = E.total_screen_rows - HINT_ROWS - 1 - SUGGESTION_ROWS - 2 * BORDER_WIDTH;
-
-    // Add explicit hint for new users
-    set_status_message("Help: Ctrl+S = Save | Ctrl+O = Open | Ctrl+Q = Quit | Ctrl+H = Help");
+    journal_reset_changes();
 }
 
 /**
  * @brief Deinitializes the ncurses environment and frees allocated memory.
  */
 void deinit_editor(void) {
-    endwin();
+    if (!E.headless) {
+        endwin();
+        printf("\033[?2004l"); // Bracketed paste off again
+        fflush(stdout);
+    }
+    if (E.startup.enabled) {
+        char report[MAX_STATUS_MESSAGE_LENGTH];
+        startup_profile_format(report, sizeof(report));
+        fprintf(stderr, "unied: %s\n", report);
+    }
+    latency_trace_close();
+    match_index_stop();
+    project_search_clear();
+    regex_cache_clear();
+    journal_stop();
 
-    for (int i = 0; i < E.num_lines; i++) {
-        free(E.lines[i].chars);
-        free(E.lines[i].hl);
+    for (int i = 0; i < CLIPBOARD_REGISTERS; i++) {
+        clipboard_register_free(&E.registers[i]);
     }
-    free(E.lines);
-    free(E.filename);
-    free(E.clipboard_buffer);
+    E.register_count = 0; // Nothing left to detach from the mapping
+    buffer_free_all();
+    macros_store();
 
     for (int i = 0; i < E.num_recent_files; i++) {
-        free(E.recent_files[i]);
+        free(E.recent_files[i].path);
     }
+    free(E.session_dir);
 
-    for (int i = 0; i < E.undo_head; i++) {
-        free_undo_action(&E.undo_history[i]);
-    }
-    for (int i = 0; i < E.redo_head; i++) {
-        free_undo_action(&E.redo_history[i]);
+    free(E.command_trie.nodes);
+    for (int i = 0; i < E.macro_count; i++) {
+        free(E.macros[i].keys);
     }
+    free(E.recorder.keys);
 }
 
 /**
@@ -395,37 +1623,114 @@ void deinit_editor(void) {
  * @return The integer value of the key pressed.
  */
 int editor_read_key(void) {
-    int c = getch();
+    if (E.replay.active) {
+        // Escape out of any prompt the macro left open
+        return E.replay.pos < E.replay.count ? E.replay.keys[E.replay.pos++] : 27;
+    }
+
+    int c;
+    double arrived_ms = -1;
+    if (E.headless) {
+        // Script keys count as typed, so they can be recorded into macros
+        c = E.script.pos < E.script.count ? E.script.keys[E.script.pos++] : 27;
+    } else {
+        while (true) {
+            // Poll while the file loads, the match index builds or a project search runs so their progress keeps moving
+            bool poll = editor_load_pending() || (match_index_active() && match_index_pending()) || project_search_poll();
+            int wait = poll ? MATCH_INDEX_POLL_MS : -1;
+            // Snapshot edits for the journal once they are due, and wake up for the next ones
+            journal_report_error();
+            int autosave = journal_due_ms();
+            if (autosave == 0) {
+                journal_snapshot();
+                autosave = journal_due_ms();
+            }
+            if (autosave > 0 && (wait < 0 || autosave < wait)) wait = autosave;
+            timeout(wait);
+            editor_buffer_release();
+            c = getch();
+            arrived_ms = editor_now_ms();
+            editor_buffer_acquire();
+            if (c != ERR || wait < 0) break;
+            if (poll) editor_refresh_screen();
+        }
+        timeout(-1);
+    }
+    if (E.recorder.active && c != KEY_RESIZE && c != ERR) {
+        macro_record_key(c);
+    }
     if (c == KEY_RESIZE) {
         getmaxyx(stdscr, E.total_screen_rows, E.screen_cols);
         E.screen_rows = E.total_screen_rows - HINT_ROWS - 1 - SUGGESTION_ROWS - 2 * BORDER_WIDTH;
+        E.full_redraw = true;
         editor_refresh_screen(); // Trigger redraw on resize
     }
+    if (arrived_ms >= 0 && c != ERR) {
+        latency_key_read(arrived_ms);
+    }
     return c;
 }
 
+/**
+ * @brief Waits up to `wait_ms` for a key without taking it.
+ *
+ * A key that arrives is pushed back with ungetch() for editor_read_key().
+ *
+ * @param wait_ms How long to wait, 0 to only look.
+ * @return true if a key is waiting, false if none came in time or there is no terminal.
+ */
+static bool editor_key_pending(int wait_ms) {
+    if (E.headless) return false;
+    timeout(wait_ms);
+    editor_buffer_release();
+    int c = getch();
+    editor_buffer_acquire();
+    timeout(-1);
+    if (c == ERR) return false;
+    ungetch(c);
+    return true;
+}
+
+/**
+ * @brief Handles the keys that come in before the next frame is due.
+ *
+ * Called after a key was processed. Keys arriving within FRAME_INTERVAL_MS of
+ * the last repaint are processed straight away, so a burst of typing or an
+ * unbracketed paste costs one repaint per frame instead of one per key. A key
+ * after a pause is still drawn at once.
+ */
+void editor_drain_input(void) {
+    while (true) {
+        double remaining = E.drawn_ms + FRAME_INTERVAL_MS - editor_now_ms();
+        if (remaining <= 0 || !editor_key_pending((int)remaining)) return;
+        editor_process_keypress();
+    }
+}
+
 /**
  * @brief Moves the editor cursor based on the key pressed.
  *
+ * Left and right step over whole UTF-8 characters; up and down keep the
+ * display column rather than the byte offset.
+ *
  * @param key The ncurses key code (e.g., KEY_UP, KEY_DOWN, KEY_LEFT, KEY_RIGHT).
  */
 void editor_move_cursor(int key) {
-    mark_lines_dirty(E.cursor_y, E.cursor_y); // Mark current line dirty before move
-
-    EditorLine *line = (E.cursor_y >= E.num_lines) ? NULL : &E.lines[E.cursor_y];
+    EditorLine *line = (E.cursor_y >= E.num_lines) ? NULL : editor_get_line(E.cursor_y);
+    int rx = editor_row_cx_to_rx(line, E.cursor_x);
 
     switch (key) {
         case KEY_LEFT:
             if (E.cursor_x > 0) {
-                E.cursor_x--;
+                E.cursor_x = line_prev_char(line, E.cursor_x);
             } else if (E.cursor_y > 0) {
                 E.cursor_y--;
-                E.cursor_x = E.lines[E.cursor_y].size;
+                E.cursor_x = editor_get_line(E.cursor_y)->size;
             }
             break;
         case KEY_RIGHT:
             if (line && E.cursor_x < line->size) {
-                E.cursor_x++;
+                E.cursor_x = line_next_char(line, E.cursor_x);
             } else if (line && E.cursor_x == line->size && E.cursor_y < E.num_lines - 1) {
                 E.cursor_y++;
                 E.cursor_x = 0;
@@ -434,21 +1739,173 @@ void editor_move_cursor(int key) {
         case KEY_UP:
             if (E.cursor_y > 0) {
                 E.cursor_y--;
+                E.cursor_x = editor_row_rx_to_cx(editor_get_line(E.cursor_y), rx);
             }
             break;
         case KEY_DOWN:
             if (E.cursor_y < E.num_lines) {
                 E.cursor_y++;
+                E.cursor_x = E.cursor_y < E.num_lines ? editor_row_rx_to_cx(editor_get_line(E.cursor_y), rx) : 0;
             }
             break;
     }
 
-    line = (E.cursor_y >= E.num_lines) ? NULL : &E.lines[E.cursor_y];
+    line = (E.cursor_y >= E.num_lines) ? NULL : editor_get_line(E.cursor_y);
     int line_len = line ? line->size : 0;
     if (E.cursor_x > line_len) {
         E.cursor_x = line_len;
     }
-    mark_lines_dirty(E.cursor_y, E.cursor_y); // Mark new line dirty after move
+}
+
+/**
+ * @brief Ensures a line buffer can hold at least `capacity` bytes.
+ *
+ * Grows geometrically so repeated single-character inserts stay amortized O(1);
+ * the new buffer comes from the line pool, rounded up to its block size.
+ * A line borrowed from the file mapping is copied out to the heap here, so this
+ * is also the "make writable" step every edit goes through.
+ *
+ * @param line Pointer to the EditorLine to grow.
+ * @param capacity Required capacity in bytes, including the terminating NUL.
+ * @return true on success, false if memory could not be allocated.
+ */
+bool editor_line_reserve(EditorLine *line, int capacity) {
+    if (line->allocated == 0) {
+        int new_allocated = capacity < MIN_LINE_ALLOCATION ? MIN_LINE_ALLOCATION : capacity;
+        if (new_allocated < line->size + 1) new_allocated = line->size + 1;
+        char *owned = line_chars_alloc(&new_allocated);
+        if (owned == NULL) {
+            set_status_message("Error: Failed to allocate line memory.");
+            return false;
+        }
+        memcpy(owned, line->chars, (size_t)line->size);
+        owned[line->size] = '\0';
+        line->chars = owned;
+        line->allocated = new_allocated;
+        return true;
+    }
+    if (capacity <= line->allocated) return true;
+
+    int new_allocated = line->allocated * 2;
+    if (new_allocated < MIN_LINE_ALLOCATION) new_allocated = MIN_LINE_ALLOCATION;
+    if (new_allocated < capacity) new_allocated = capacity;
+
+    char *new_chars = line_chars_resize(line->chars, line->allocated, &new_allocated, line->size + 1);
+    if (new_chars == NULL) {
+        set_status_message("Error: Failed to reallocate line memory.");
+        return false;
+    }
+    line->chars = new_chars;
+    line->allocated = new_allocated;
+    return true;
+}
+
+/**
+ * @brief Shortens a line to `len` characters.
+ *
+ * Borrowed lines stay borrowed: only their length changes.
+ *
+ * @param line Pointer to the EditorLine to truncate.
+ * @param len New length, 0 <= len <= line->size.
+ */
+void editor_line_truncate(EditorLine *line, int len) {
+    line->size = len;
+    if (line->allocated > 0) {
+        line->chars[len] = '\0';
+    }
+    editor_line_changed(line);
+}
+
+/**
+ * @brief Appends `len` bytes to the end of a line.
+ *
+ * @param line Pointer to the EditorLine to extend.
+ * @param s Bytes to append; need not be NUL-terminated.
+ * @param len Number of bytes to append.
+ * @return true on success, false if memory could not be allocated.
+ */
+bool editor_line_append(EditorLine *line, const char *s, int len) {
+    if (!editor_line_reserve(line, line->size + len + 1)) return false;
+    memcpy(&line->chars[line->size], s, (size_t)len);
+    line->size += len;
+    line->chars[line->size] = '\0';
+    editor_line_changed(line);
+    return true;
+}
+
+/**
+ * @brief Releases the memory owned by a line. Borrowed text is left alone.
+ *
+ * @param line Pointer to the EditorLine to free.
+ */
+void editor_line_free(EditorLine *line) {
+    if (line->allocated > 0) {
+        line_chars_free(line->chars, line->allocated);
+    }
+    editor_line_drop_highlight(line);
+    free(line->rx_index);
+    line->rx_index = NULL;
+    line->chars = NULL;
+    line->size = 0;
+    line->allocated = 0;
+}
+
+/**
+ * @brief Frees a line's cached highlight array; the comment state is kept.
+ *
+ * @param line Pointer to the EditorLine to update.
+ */
+void editor_line_drop_highlight(EditorLine *line) {
+    if (line->hl != NULL) {
+        line_hl_free(line);
+        E.hl_cached_lines--;
+    }
+}
+
+/**
+ * @brief Builds a fresh owned line, in the line pool, holding a copy of `s`.
+ *
+ * @param line The line to fill in; its previous contents are ignored.
+ * @param s Initial text; need not be NUL-terminated.
+ * @param len Length of the initial text.
+ * @return true on success, false if memory could not be allocated.
+ */
+bool editor_line_init(EditorLine *line, const char *s, int len) {
+    line->size = len;
+    line->allocated = len + 1 < MIN_LINE_ALLOCATION ? MIN_LINE_ALLOCATION : len + 1;
+    line->chars = line_chars_alloc(&line->allocated);
+    line->hl = NULL; // Will be allocated by update_highlighting
+    line->hl_revision = 0;
+    line->hl_lexed_revision = -1;
+    line->hl_comment_in = false;
+    line->hl_comment_out = false;
+    line->match_count = 0;
+    line->match_generation = 0;
+    line->match_revision = -1;
+    line->rx_index = NULL;
+    if (line->chars == NULL) return false;
+    memcpy(line->chars, s, (size_t)len);
+    line->chars[len] = '\0';
+    return true;
+}
+
+/**
+ * @brief Gives a line a new heap buffer, releasing the old text and highlight.
+ *
+ * @param line Pointer to the EditorLine to update.
+ * @param chars Buffer from line_chars_alloc() holding the new text, NUL-terminated; the line takes ownership.
+ * @param size Length of the new text.
+ * @param allocated Capacity of `chars` in bytes.
+ */
+void editor_line_set_buffer(EditorLine *line, char *chars, int size, int allocated) {
+    if (line->allocated > 0) {
+        line_chars_free(line->chars, line->allocated);
+    }
+    editor_line_drop_highlight(line);
+    line->chars = chars;
+    line->size = size;
+    line->allocated = allocated;
+    editor_line_changed(line);
 }
 
 /**
@@ -463,23 +1920,13 @@ void editor_move_cursor(int key) {
 void editor_line_insert_char(EditorLine *line, int at, int c) {
     if (at < 0 || at > line->size) return;
 
-    if (line->size + 2 > line->allocated) {
-        int new_allocated = line->allocated == 0 ? MAX_LINE_LENGTH_BUFFER : line->allocated * 2;
-        line->chars = realloc(line->chars, (size_t)new_allocated);
-        line->hl = realloc(line->hl, sizeof(HighlightType) * (size_t)new_allocated);
-        if (line->chars == NULL || line->hl == NULL) {
-            set_status_message("Error: Failed to reallocate line memory.");
-            return;
-        }
-        line->allocated = new_allocated;
-    }
+    if (!editor_line_reserve(line, line->size + 2)) return;
 
     memmove(&line->chars[at + 1], &line->chars[at], (size_t)(line->size - at + 1));
-    memmove(&line->hl[at + 1], &line->hl[at], sizeof(HighlightType) * (size_t)(line->size - at + 1));
     line->chars[at] = (char)c;
     line->size++;
     line->chars[line->size] = '\0';
-    line->hl_revision++;
+    editor_line_changed(line);
 }
 
 /**
@@ -490,69 +1937,439 @@ void editor_line_insert_char(EditorLine *line, int at, int c) {
  */
 void editor_line_delete_char(EditorLine *line, int at) {
     if (at < 0 || at >= line->size) return;
+    if (!editor_line_reserve(line, line->size + 1)) return;
 
     memmove(&line->chars[at], &line->chars[at + 1], (size_t)(line->size - at));
-    memmove(&line->hl[at], &line->hl[at + 1], sizeof(HighlightType) * (size_t)(line->size - at));
     line->size--;
     line->chars[line->size] = '\0';
-    line->hl_revision++;
+    editor_line_changed(line);
 }
 
 /**
- * @brief Inserts a new line into the editor at the specified row index.
+ * @brief Records that a line's text changed: invalidates everything derived
+ * from it and tells the journal.
  *
- * @param at The row index where the new line should be inserted.
- * @param s Optional string to initialize the new line with.
- * @param len Length of the initial string.
+ * Every edit to a line's chars ends with this call.
+ *
+ * @param line The line that changed, in the buffer or not yet inserted.
  */
-void editor_insert_line(int at, const char *s, int len) {
-    if (at < 0 || at > E.num_lines) return;
-
-    if (E.num_lines + 1 > E.allocated_lines) {
-        int new_allocated = E.allocated_lines == 0 ? 16 : E.allocated_lines * 2;
-        EditorLine *new_lines = realloc(E.lines, sizeof(EditorLine) * (size_t)new_allocated);
-        if (new_lines == NULL) {
-            set_status_message("Error: Failed to reallocate lines array.");
-            return;
-        }
-        E.lines = new_lines;
-        E.allocated_lines = new_allocated;
-    }
-
-    memmove(&E.lines[at + 1], &E.lines[at], sizeof(EditorLine) * (size_t)(E.num_lines - at));
+static void editor_line_changed(EditorLine *line) {
+    line->hl_revision++;
+    journal_note_line(line);
+}
 
-    E.lines[at].size = len;
-    E.lines[at].allocated = len + 1 < MAX_LINE_LENGTH_BUFFER ? MAX_LINE_LENGTH_BUFFER : len + 1;
-    E.lines[at].chars = malloc((size_t)E.lines[at].allocated);
-    E.lines[at].hl = NULL; // Will be allocated by update_highlighting
-    E.lines[at].hl_revision = 0;
-    if (E.lines[at].chars == NULL) {
-        set_status_message("Error: Failed to allocate new line memory.");
+/**
+ * @brief Rebuilds the Fenwick tree over chunk line counts.
+ *
+ * Called after chunks are added, removed or split; single-line inserts and
+ * deletes update the tree incrementally with line_index_add().
+ */
+static void line_index_rebuild(void) {
+    free(E.chunk_tree);
+    E.chunk_tree = calloc((size_t)E.num_chunks + 1, sizeof(int));
+    if (E.chunk_tree == NULL) {
+        set_status_message("Error: Failed to allocate line index.");
         return;
     }
-    memcpy(E.lines[at].chars, s, (size_t)len);
-    E.lines[at].chars[len] = '\0';
-    E.num_lines++;
-    E.dirty = true;
-    mark_lines_dirty(at, E.num_lines);
+    for (int i = 1; i <= E.num_chunks; i++) {
+        E.chunk_tree[i] += E.chunks[i - 1]->count;
+        int parent = i + (i & -i);
+        if (parent <= E.num_chunks) E.chunk_tree[parent] += E.chunk_tree[i];
+    }
+    E.chunk_cache_index = -1;
 }
 
 /**
- * @brief Deletes a line from the editor at the specified row index.
+ * @brief Adds `delta` to the line count of chunk `chunk` in the Fenwick tree.
+ */
+static void line_index_add(int chunk, int delta) {
+    for (int i = chunk + 1; i <= E.num_chunks; i += i & -i) {
+        E.chunk_tree[i] += delta;
+    }
+    E.chunk_cache_index = -1;
+}
+
+/**
+ * @brief Finds the chunk holding line `at`.
+ *
+ * @param at Line index, 0 <= at < E.num_lines.
+ * @param offset Receives the position of the line inside the chunk.
+ * @return Index of the chunk in E.chunks.
+ */
+static int line_index_locate(int at, int *offset) {
+    int ci = E.chunk_cache_index;
+    if (ci >= 0 && at >= E.chunk_cache_start && at < E.chunk_cache_start + E.chunks[ci]->count) {
+        *offset = at - E.chunk_cache_start;
+        return ci;
+    }
+
+    int pos = 0;
+    int remaining = at;
+    int step = 1;
+    while (step * 2 <= E.num_chunks) step *= 2;
+    for (; step > 0; step /= 2) {
+        if (pos + step <= E.num_chunks && E.chunk_tree[pos + step] <= remaining) {
+            pos += step;
+            remaining -= E.chunk_tree[pos];
+        }
+    }
+
+    E.chunk_cache_index = pos;
+    E.chunk_cache_start = at - remaining;
+    *offset = remaining;
+    return pos;
+}
+
+/**
+ * @brief Returns the line at the specified row index.
+ *
+ * @param at The row index (0-indexed).
+ * @return Pointer to the EditorLine, or NULL if out of range. The pointer is
+ * only valid until the next line insertion or deletion.
+ */
+EditorLine *editor_get_line(int at) {
+    if (at < 0 || at >= E.num_lines) return NULL;
+    int offset;
+    int ci = line_index_locate(at, &offset);
+    return &E.chunks[ci]->lines[offset];
+}
+
+/**
+ * @brief Inserts an empty chunk into the chunk list at position `at`.
+ *
+ * @return The new chunk, or NULL on allocation failure.
+ */
+static LineChunk *line_chunk_insert(int at) {
+    if (E.num_chunks + 1 > E.allocated_chunks) {
+        int new_allocated = E.allocated_chunks == 0 ? 16 : E.allocated_chunks * 2;
+        LineChunk **new_chunks = realloc(E.chunks, sizeof(LineChunk *) * (size_t)new_allocated);
+        if (new_chunks == NULL) return NULL;
+        E.chunks = new_chunks;
+        E.allocated_chunks = new_allocated;
+    }
+    LineChunk *chunk = malloc(sizeof(LineChunk));
+    if (chunk == NULL) return NULL;
+    chunk->count = 0;
+    chunk->match_total = 0;
+    chunk->hl_stamp = 0;
+
+    memmove(&E.chunks[at + 1], &E.chunks[at], sizeof(LineChunk *) * (size_t)(E.num_chunks - at));
+    E.chunks[at] = chunk;
+    E.num_chunks++;
+    return chunk;
+}
+
+/**
+ * @brief Removes chunk `at` from the chunk list. Its lines must already be
+ * freed or moved elsewhere.
+ */
+static void line_chunk_remove(int at) {
+    free(E.chunks[at]);
+    memmove(&E.chunks[at], &E.chunks[at + 1], sizeof(LineChunk *) * (size_t)(E.num_chunks - at - 1));
+    E.num_chunks--;
+}
+
+/**
+ * @brief Places an already-built line at row `at` of the chunk rope.
+ *
+ * @param at The row index where the line should be inserted.
+ * @param new_line The line to store; ownership of its buffers moves to the rope.
+ * @return true on success, false if the chunk list could not grow.
+ */
+static bool line_store_insert(int at, const EditorLine *new_line) {
+    int ci;
+    int offset;
+    if (E.num_chunks == 0) {
+        if (line_chunk_insert(0) == NULL) return false;
+        line_index_rebuild();
+        ci = 0;
+        offset = 0;
+    } else if (at == E.num_lines) {
+        ci = E.num_chunks - 1;
+        offset = E.chunks[ci]->count;
+    } else {
+        ci = line_index_locate(at, &offset);
+    }
+
+    if (E.chunks[ci]->count == LINE_CHUNK_CAPACITY) {
+        // Split the full chunk in half; the new line goes into whichever half owns `offset`.
+        // Both halves need their match totals recounted.
+        if (E.match_index.scan_from > at - offset) E.match_index.scan_from = at - offset;
+        LineChunk *tail = line_chunk_insert(ci + 1);
+        if (tail == NULL) return false;
+        LineChunk *head = E.chunks[ci];
+        int half = LINE_CHUNK_CAPACITY / 2;
+        memcpy(tail->lines, &head->lines[half], sizeof(EditorLine) * (size_t)(LINE_CHUNK_CAPACITY - half));
+        tail->count = LINE_CHUNK_CAPACITY - half;
+        tail->hl_stamp = head->hl_stamp;
+        head->count = half;
+        if (offset > half) {
+            ci++;
+            offset -= half;
+        }
+        line_index_rebuild();
+    }
+
+    LineChunk *chunk = E.chunks[ci];
+    memmove(&chunk->lines[offset + 1], &chunk->lines[offset], sizeof(EditorLine) * (size_t)(chunk->count - offset));
+    chunk->lines[offset] = *new_line;
+    chunk->count++;
+    line_index_add(ci, 1);
+    E.num_lines++;
+    return true;
+}
+
+/**
+ * @brief Inserts a new line into the editor at the specified row index.
+ *
+ * @param at The row index where the new line should be inserted.
+ * @param s Optional string to initialize the new line with.
+ * @param len Length of the initial string.
+ */
+void editor_insert_line(int at, const char *s, int len) {
+    if (at < 0 || at > E.num_lines) return;
+
+    if (!line_store_insert_text(at, s, len)) {
+        set_status_message("Error: Failed to allocate new line memory.");
+        return;
+    }
+    E.dirty = true;
+    mark_lines_dirty(at, E.num_lines);
+}
+
+/**
+ * @brief Builds a heap line holding a copy of `s` and places it at row `at`.
+ *
+ * Unlike editor_insert_line(), leaves the dirty state and damage tracking to
+ * the caller.
+ *
+ * @return true on success, false on allocation failure.
+ */
+static bool line_store_insert_text(int at, const char *s, int len) {
+    EditorLine new_line;
+    if (!editor_line_init(&new_line, s, len)) return false;
+
+    if (!line_store_insert(at, &new_line)) {
+        editor_line_free(&new_line);
+        return false;
+    }
+    journal_note_change(at, 1, 1);
+    return true;
+}
+
+/**
+ * @brief Deletes a line from the editor at the specified row index.
  *
  * @param at The row index of the line to delete.
  */
 void editor_delete_line(int at) {
     if (at < 0 || at >= E.num_lines) return;
 
-    free(E.lines[at].chars);
-    free(E.lines[at].hl);
-    memmove(&E.lines[at], &E.lines[at + 1], sizeof(EditorLine) * (size_t)(E.num_lines - at - 1));
-    E.num_lines--;
+    line_store_remove_range(at, 1);
     E.dirty = true;
     mark_lines_dirty(at, E.num_lines);
 }
 
+/**
+ * @brief Frees lines [at, at + count) and closes the gap in the chunk rope.
+ *
+ * Chunks emptied by the removal leave the chunk list in one move and the
+ * line index is rebuilt at most once, however many lines go. Leaves the dirty
+ * state and damage tracking to the caller.
+ *
+ * @param at First line to remove.
+ * @param count Number of lines to remove; at + count <= E.num_lines.
+ */
+static void line_store_remove_range(int at, int count) {
+    if (count <= 0) return;
+
+    int first_offset, last_offset;
+    int first = line_index_locate(at, &first_offset);
+    int last = line_index_locate(at + count - 1, &last_offset);
+    for (int c = first; c <= last; c++) {
+        LineChunk *chunk = E.chunks[c];
+        int from = c == first ? first_offset : 0;
+        int to = c == last ? last_offset + 1 : chunk->count;
+        for (int i = from; i < to; i++) {
+            editor_line_free(&chunk->lines[i]);
+        }
+    }
+    // The head chunk's match total no longer covers what is left in it
+    if (E.match_index.scan_from > at - first_offset) E.match_index.scan_from = at - first_offset;
+    E.num_lines -= count;
+    journal_note_change(at, 0, -count);
+
+    LineChunk *head = E.chunks[first];
+    bool restructured = false;
+    if (first == last) {
+        memmove(&head->lines[first_offset], &head->lines[last_offset + 1], sizeof(EditorLine) * (size_t)(head->count - last_offset - 1));
+        head->count -= count;
+    } else {
+        LineChunk *tail = E.chunks[last];
+        memmove(tail->lines, &tail->lines[last_offset + 1], sizeof(EditorLine) * (size_t)(tail->count - last_offset - 1));
+        tail->count -= last_offset + 1;
+        head->count = first_offset;
+        for (int c = first + 1; c < last; c++) {
+            free(E.chunks[c]);
+        }
+        memmove(&E.chunks[first + 1], &E.chunks[last], sizeof(LineChunk *) * (size_t)(E.num_chunks - last));
+        E.num_chunks -= last - first - 1;
+        restructured = true;
+    }
+
+    // Drop emptied chunks and merge sparse neighbours so mass deletions don't
+    // leave a long tail of near-empty chunks.
+    for (int c = first + 1; c >= first; c--) {
+        if (c < E.num_chunks && E.chunks[c]->count == 0 && E.num_chunks > 1) {
+            line_chunk_remove(c);
+            restructured = true;
+        }
+    }
+    if (first >= E.num_chunks) first = E.num_chunks - 1;
+    if (first + 1 < E.num_chunks && E.chunks[first]->count + E.chunks[first + 1]->count <= LINE_CHUNK_CAPACITY / 2) {
+        LineChunk *chunk = E.chunks[first];
+        LineChunk *next = E.chunks[first + 1];
+        memcpy(&chunk->lines[chunk->count], next->lines, sizeof(EditorLine) * (size_t)next->count);
+        chunk->count += next->count;
+        if (next->hl_stamp > chunk->hl_stamp) chunk->hl_stamp = next->hl_stamp;
+        line_chunk_remove(first + 1);
+        restructured = true;
+    }
+
+    if (restructured) {
+        line_index_rebuild();
+    } else {
+        line_index_add(first, -count);
+    }
+}
+
+/**
+ * @brief Places `count` already-built lines at row `at` of the chunk rope.
+ *
+ * The chunk holding `at` is split at most once: the lines that don't fit
+ * behind `at` and the rest of that chunk are laid out evenly over fresh
+ * chunks, which enter the chunk list in one move. Leaves the dirty state and
+ * damage tracking to the caller.
+ *
+ * @param at The row index where the first line should go.
+ * @param lines The lines to store; on success ownership of their buffers moves to the rope.
+ * @param count Number of lines.
+ * @return true on success, false if memory ran out; the rope is then unchanged.
+ */
+static bool line_store_insert_range(int at, const EditorLine *lines, int count) {
+    if (count <= 0) return true;
+    if (E.num_chunks == 0) {
+        if (line_chunk_insert(0) == NULL) return false;
+        line_index_rebuild();
+    }
+
+    int ci, offset;
+    if (at == E.num_lines) {
+        ci = E.num_chunks - 1;
+        offset = E.chunks[ci]->count;
+    } else {
+        ci = line_index_locate(at, &offset);
+    }
+    LineChunk *head = E.chunks[ci];
+    int suffix = head->count - offset;
+
+    if (head->count + count <= LINE_CHUNK_CAPACITY) {
+        memmove(&head->lines[offset + count], &head->lines[offset], sizeof(EditorLine) * (size_t)suffix);
+        memcpy(&head->lines[offset], lines, sizeof(EditorLine) * (size_t)count);
+        head->count += count;
+        line_index_add(ci, count);
+        E.num_lines += count;
+        journal_note_change(at, count, count);
+        return true;
+    }
+
+    // The head keeps its lines before `at` and takes new lines up to capacity;
+    // the remaining new lines and the head's old suffix go to fresh chunks.
+    int fill = LINE_CHUNK_CAPACITY - offset < count ? LINE_CHUNK_CAPACITY - offset : count;
+    int rest = count - fill + suffix;
+    int fresh = (rest + LINE_CHUNK_CAPACITY - 1) / LINE_CHUNK_CAPACITY;
+
+    if (E.num_chunks + fresh > E.allocated_chunks) {
+        int new_allocated = E.allocated_chunks == 0 ? 16 : E.allocated_chunks;
+        while (new_allocated < E.num_chunks + fresh) new_allocated *= 2;
+        LineChunk **new_chunks = realloc(E.chunks, sizeof(LineChunk *) * (size_t)new_allocated);
+        if (new_chunks == NULL) return false;
+        E.chunks = new_chunks;
+        E.allocated_chunks = new_allocated;
+    }
+    LineChunk **made = malloc(sizeof(LineChunk *) * (size_t)fresh);
+    if (made == NULL) return false;
+    for (int k = 0; k < fresh; k++) {
+        made[k] = malloc(sizeof(LineChunk));
+        if (made[k] == NULL) {
+            while (k-- > 0) free(made[k]);
+            free(made);
+            return false;
+        }
+        made[k]->count = 0;
+        made[k]->match_total = 0;
+        made[k]->hl_stamp = head->hl_stamp;
+    }
+
+    // The suffix is read out of the head before the new lines overwrite it
+    int k = 0;
+    for (int j = fill; j < count + suffix; j++) {
+        if (made[k]->count == rest / fresh + (k < rest % fresh ? 1 : 0)) k++;
+        made[k]->lines[made[k]->count++] = j < count ? lines[j] : head->lines[offset + j - count];
+    }
+    memcpy(&head->lines[offset], lines, sizeof(EditorLine) * (size_t)fill);
+    head->count = offset + fill;
+
+    memmove(&E.chunks[ci + 1 + fresh], &E.chunks[ci + 1], sizeof(LineChunk *) * (size_t)(E.num_chunks - ci - 1));
+    memcpy(&E.chunks[ci + 1], made, sizeof(LineChunk *) * (size_t)fresh);
+    E.num_chunks += fresh;
+    free(made);
+
+    if (E.match_index.scan_from > at - offset) E.match_index.scan_from = at - offset;
+    E.num_lines += count;
+    journal_note_change(at, count, count);
+    line_index_rebuild();
+    return true;
+}
+
+/**
+ * @brief Frees every line and chunk of the buffer, leaving it empty.
+ */
+void editor_free_lines(void) {
+    for (int c = 0; c < E.num_chunks; c++) {
+        LineChunk *chunk = E.chunks[c];
+        for (int i = 0; i < chunk->count; i++) {
+            // Pooled text and highlighting go back with the slabs below
+            EditorLine *line = &chunk->lines[i];
+            if (line->allocated > LINE_POOL_MAX_BYTES) free(line->chars);
+            if (line->hl != NULL && line->hl_class == LINE_POOL_CLASSES) free(line->hl);
+            free(line->rx_index);
+        }
+        free(chunk);
+    }
+    free(E.chunks);
+    free(E.chunk_tree);
+    E.chunks = NULL;
+    E.chunk_tree = NULL;
+    E.num_chunks = 0;
+    E.allocated_chunks = 0;
+    E.chunk_cache_index = -1;
+    E.chunk_cache_start = 0;
+    E.num_lines = 0;
+    E.match_index.scan_from = 0;
+    E.match_index.partial_chars = NULL;
+    E.match_index.position_chars = NULL;
+    line_pool_release(&E.pool);
+    E.hl_cached_lines = 0;
+
+    mapping_release(E.mapping);
+    E.mapping = NULL;
+    E.map_base = NULL;
+    E.map_size = 0;
+    E.map_indexed = 0;
+    E.map_load_failed = false;
+}
+
 /**
  * @brief Inserts a character at the current cursor position.
  *
@@ -561,13 +2378,17 @@ void editor_delete_line(int at) {
  * @param c The character to insert.
  */
 void editor_insert_char(int c) {
-    UndoAction ua = { .type = UNDO_DELETE_CHAR, .y = E.cursor_y, .x = E.cursor_x, .char_val = (char)c, .text_content = NULL, .text_len = 0, .num_lines_affected = 0 };
-    push_undo_action(ua);
-
     if (E.cursor_y == E.num_lines) {
+        UndoAction ua = { .type = UNDO_INSERT_EMPTY_LINE, .y = E.num_lines, .x = 0, .char_val = '\0', .text_content = NULL, .text_len = 0, .num_lines_affected = 0 };
+        push_undo_action(ua);
         editor_insert_line(E.num_lines, "", 0);
     }
-    editor_line_insert_char(&E.lines[E.cursor_y], E.cursor_x, c);
+    EditorLine *line = editor_get_line(E.cursor_y);
+    if (E.cursor_x > line->size) E.cursor_x = line->size; // Left past the end by an edit elsewhere
+    int size = line->size;
+    editor_line_insert_char(line, E.cursor_x, c);
+    if (line->size == size) return; // Out of memory; there is nothing to undo
+    undo_record_insert_char(E.cursor_y, E.cursor_x, (char)c);
     E.cursor_x++;
     E.dirty = true;
     mark_lines_dirty(E.cursor_y, E.cursor_y);
@@ -576,8 +2397,8 @@ void editor_insert_char(int c) {
 /**
  * @brief Deletes a character at or before the current cursor position.
  *
- * Handles backspace (deletes char before cursor) and delete (deletes char at cursor).
- * Also handles joining lines if backspace is pressed at the beginning of a line.
+ * Handles backspace (deletes the UTF-8 character before the cursor) and
+ * also joins lines if backspace is pressed at the beginning of a line.
  */
 void editor_delete_char(void) {
     if (E.cursor_y == E.num_lines) return;
@@ -585,42 +2406,34 @@ void editor_delete_char(void) {
 
     mark_lines_dirty(E.cursor_y, E.cursor_y);
 
-    EditorLine *line = &E.lines[E.cursor_y];
+    EditorLine *line = editor_get_line(E.cursor_y);
+    if (E.cursor_x > line->size) E.cursor_x = line->size; // Left past the end by an edit elsewhere
     if (E.cursor_x > 0) {
-        UndoAction ua = { .type = UNDO_INSERT_CHAR, .y = E.cursor_y, .x = E.cursor_x - 1, .char_val = line->chars[E.cursor_x - 1], .text_content = NULL, .text_len = 0, .num_lines_affected = 0 };
-        push_undo_action(ua);
-
-        editor_line_delete_char(line, E.cursor_x - 1);
-        E.cursor_x--;
+        // Every byte of the character goes, into one delete run
+        int start = line_prev_char(line, E.cursor_x);
+        while (E.cursor_x > start) {
+            undo_record_delete_char(E.cursor_y, E.cursor_x - 1, line->chars[E.cursor_x - 1], true);
+            editor_line_delete_char(line, E.cursor_x - 1);
+            E.cursor_x--;
+        }
     } else {
-        char *merged_line_content = strdup(line->chars);
-        int prev_line_size = E.lines[E.cursor_y - 1].size;
+        int prev_line_size = editor_get_line(E.cursor_y - 1)->size;
 
         UndoAction ua = {
             .type = UNDO_JOIN_LINES,
             .y = E.cursor_y - 1,
             .x = prev_line_size,
             .char_val = '\0',
-            .text_content = merged_line_content,
-            .text_len = line->size,
+            .text_content = NULL,
+            .text_len = 0,
             .num_lines_affected = 0
         };
         push_undo_action(ua);
 
-        EditorLine *prev_line = &E.lines[E.cursor_y - 1];
-        if ((size_t)prev_line->size + (size_t)line->size + 1 > (size_t)prev_line->allocated) {
-            int new_allocated = prev_line->allocated + line->size + 1;
-            prev_line->chars = realloc(prev_line->chars, (size_t)new_allocated);
-            prev_line->hl = realloc(prev_line->hl, sizeof(HighlightType) * (size_t)new_allocated);
-            if (prev_line->chars == NULL || prev_line->hl == NULL) {
-                set_status_message("Error: Failed to reallocate line memory for join.");
-                return;
-            }
-            prev_line->allocated = new_allocated;
+        EditorLine *prev_line = editor_get_line(E.cursor_y - 1);
+        if (!editor_line_append(prev_line, line->chars, line->size)) {
+            return;
         }
-        memcpy(&prev_line->chars[prev_line->size], line->chars, (size_t)line->size + 1);
-        prev_line->size += line->size;
-        prev_line->hl_revision++;
         
         editor_delete_line(E.cursor_y);
         E.cursor_y--;
@@ -648,26 +2461,21 @@ void editor_insert_newline(void) {
         push_undo_action(ua);
         editor_insert_line(E.cursor_y, "", 0);
     } else {
-        char *split_off_content = strdup(&E.lines[E.cursor_y].chars[E.cursor_x]);
-        int split_off_len = (int)strlen(split_off_content);
-
         UndoAction ua = {
             .type = UNDO_SPLIT_LINE,
             .y = E.cursor_y,
             .x = E.cursor_x,
             .char_val = '\0',
-            .text_content = split_off_content,
-            .text_len = split_off_len,
+            .text_content = NULL,
+            .text_len = 0,
             .num_lines_affected = 0
         };
         push_undo_action(ua);
 
-        EditorLine *line = &E.lines[E.cursor_y];
+        EditorLine *line = editor_get_line(E.cursor_y);
         editor_insert_line(E.cursor_y + 1, &line->chars[E.cursor_x], line->size - E.cursor_x);
-        line = &E.lines[E.cursor_y];
-        line->size = E.cursor_x;
-        line->chars[line->size] = '\0';
-        line->hl_revision++;
+        line = editor_get_line(E.cursor_y);
+        editor_line_truncate(line, E.cursor_x);
     }
     E.cursor_y++;
     E.cursor_x = 0;
@@ -676,542 +2484,1532 @@ void editor_insert_newline(void) {
 }
 
 /**
- * @brief Loads the content of a file into the editor's memory.
+ * @brief Splits up to `max_lines` more lines off the file mapping and appends them.
  *
- * @param filename The path to the file to load.
+ * Runs on the main thread or on the match index worker, with the buffer lock held.
+ *
+ * @param max_lines Upper bound on the lines to add.
+ * @return true on success, false if memory ran out; the lines split so far are kept.
  */
-void editor_load_file(const char *filename) {
-    for (int i = 0; i < E.num_lines; i++) {
-        free(E.lines[i].chars);
-        free(E.lines[i].hl);
-    }
-    free(E.lines);
-    E.lines = NULL;
-    E.num_lines = 0;
-    E.allocated_lines = 0;
-    E.cursor_x = 0;
-    E.cursor_y = 0;
-    E.scroll_x = 0;
-    E.scroll_y = 0;
-
-    free(E.filename);
-    E.filename = strdup(filename);
-
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        set_status_message("Error: Could not open file %s: %s", filename, strerror(errno));
-        editor_insert_line(0, "", 0);
-        E.dirty = false;
-        prompt_file_type();
-        return;
-    }
-
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        if (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
-            linelen--;
+static bool editor_load_more(int max_lines) {
+    const char *p = E.map_base + E.map_indexed;
+    const char *end = E.map_base + E.map_size;
+    int first_new = E.num_lines;
+    bool ok = true;
+
+    for (int n = 0; n < max_lines && p < end; n++) {
+        const char *newline = memchr(p, '\n', (size_t)(end - p));
+        int len = (int)((newline ? newline : end) - p);
+        if (newline == NULL && len > 0 && p[len - 1] == '\r') {
+            len--;
         }
-        editor_insert_line(E.num_lines, line, (int)linelen);
+        EditorLine line = { .chars = (char *)p, .size = len, .allocated = 0, .hl = NULL, .hl_revision = 0, .hl_lexed_revision = -1, .match_revision = -1 };
+        if (!line_store_insert(E.num_lines, &line)) {
+            ok = false;
+            break;
+        }
+        p = newline ? newline + 1 : end;
     }
-    free(line);
-    fclose(fp);
-    E.dirty = false;
-    set_status_message("File loaded: %s (%d lines)", E.filename, E.num_lines);
-    mark_lines_dirty(0, E.num_lines - 1);
-    prompt_file_type();
+    E.map_indexed = (size_t)(p - E.map_base);
+    if (E.num_lines > first_new) {
+        mark_lines_dirty(first_new, E.num_lines - 1);
+        journal_note_loaded(E.num_lines - first_new);
+    }
+    return ok;
+}
 
-    add_to_recent_files(filename);
-    init_undo_redo();
+/**
+ * @brief Tells whether part of the mapped file has not been split into lines yet.
+ */
+bool editor_load_pending(void) {
+    return E.map_indexed < E.map_size && !E.map_load_failed;
 }
 
 /**
- * @brief Saves the current editor content to the file.
+ * @brief Makes sure line `line` is loaded, or the whole file if it is shorter.
+ *
+ * The rest of a mapped file is split off in the background while the editor
+ * waits for input; anything that needs lines further down calls this first
+ * and only waits for the part it needs.
  *
- * If no filename is set, it prompts the user for one.
+ * @param line Index of the line that must exist.
  */
-void editor_save_file(void) {
-    if (E.filename == NULL) {
-        // Автоматичний виклик "Save As" для нових файлів
-        editor_save_as();
-        // Якщо editor_save_as() скасовано або не вдалося, E.dirty залишиться true
-        if (E.dirty) {
-            set_status_message("Save cancelled or failed.");
-        }
-        return;
-    } else {
-        // Звичайне збереження
-        FILE *fp = fopen(E.filename, "w");
-        if (!fp) {
-            set_status_message("Error saving: %s", strerror(errno));
-            return;
+void editor_load_through(int line) {
+    while (editor_load_pending() && E.num_lines <= line) {
+        if (!editor_load_more(LOAD_SLICE_LINES)) {
+            E.map_load_failed = true;
+            set_status_message("Error: Out of memory loading %s; saving is disabled.", E.filename);
         }
-        
-        for (int i = 0; i < E.num_lines; i++) {
-            fputs(E.lines[i].chars, fp);
-            fputc('\n', fp);
-        }
-        
-        fclose(fp);
-        E.dirty = false;
-        set_status_message("Saved %s (%d lines)", E.filename, E.num_lines);
     }
 }
 
 /**
- * @brief Converts a character index (cx) within a line to a rendered column index (rx).
+ * @brief Loads the rest of the file.
+ */
+void editor_load_all(void) {
+    editor_load_through(INT_MAX - 1);
+}
+
+/**
+ * @brief Loads a regular file by mapping it read-only.
  *
- * Accounts for tab characters expanding to multiple spaces.
+ * Lines are not copied: each EditorLine borrows its bytes from the mapping and
+ * only lines that get edited are copied out to the heap. If another buffer
+ * already maps the same unchanged file, its mapping is shared. Only the
+ * first chunk of lines is split off here, so the first screen paints right
+ * away; the match index worker splits the rest while the editor is idle.
+ * With a session that indexed the file, every line is laid out at once.
  *
- * @param row Pointer to the EditorLine.
- * @param cx The character index (0-indexed).
- * @return The rendered column index.
+ * @param filename The path to the file to load.
+ * @param session The file's session, or NULL.
+ * @return true if the file was loaded from a mapping, false if the caller
+ * should fall back to reading it with stdio (non-regular or empty file, or
+ * mmap unavailable).
  */
-int editor_row_cx_to_rx(const EditorLine *row, int cx) {
-    int rx = 0;
-    if (!row) return 0;
-    for (int i = 0; i < cx; i++) {
-        if (row->chars[i] == '\t') {
-            rx += (TAB_STOP - (rx % TAB_STOP));
-        } else {
-            rx++;
-        }
+static bool editor_load_file_mapped(const char *filename, const Session *session) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return false;
     }
-    return rx;
+    FileMapping *mapping = mapping_acquire(fd, &st);
+    close(fd);
+    if (mapping == NULL) return false;
+
+    E.mapping = mapping;
+    E.map_base = mapping->base;
+    E.map_size = mapping->size;
+    E.map_indexed = 0;
+
+    // Whatever the index could not lay out is split the usual way
+    if ((session == NULL || !editor_load_indexed(session)) && !editor_load_more(LINE_CHUNK_CAPACITY)) {
+        editor_free_lines();
+        return false;
+    }
+    if (!E.match_index.running) {
+        editor_load_all(); // Nobody to finish the job in the background
+    }
+    return true;
 }
 
 /**
- * @brief Converts a rendered column index (rx) to a character index (cx) within a line.
- *
- * Accounts for tab characters. This is useful for placing the cursor accurately.
+ * @brief Maps a file read-only, or shares the mapping some buffer already has
+ * of it if the file has not changed since.
  *
- * @param row Pointer to the EditorLine.
- * @param rx The rendered column index (0-indexed).
- * @return The character index.
+ * @param fd Open descriptor of the file.
+ * @param st Its fstat() result.
+ * @return The mapping, with a reference taken for the caller, or NULL if mmap failed.
  */
-int editor_row_rx_to_cx(const EditorLine *row, int rx) {
-    int cur_rx = 0;
-    int cx = 0;
-    if (!row) return 0;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t') {
-            cur_rx += (TAB_STOP - (cur_rx % TAB_STOP));
-        } else {
-            cur_rx++;
+static FileMapping *mapping_acquire(int fd, const struct stat *st) {
+    size_t size = (size_t)st->st_size;
+    for (FileMapping *m = E.mappings; m != NULL; m = m->next) {
+        if (m->dev == st->st_dev && m->ino == st->st_ino && m->size == size &&
+            m->mtime.tv_sec == st->st_mtim.tv_sec && m->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+            m->refs++;
+            return m;
         }
-        if (cur_rx > rx) return cx;
     }
-    return cx;
-}
 
-// --- UI Function Implementations ---
+    FileMapping *mapping = malloc(sizeof(FileMapping));
+    if (mapping == NULL) return NULL;
+    char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        free(mapping);
+        return NULL;
+    }
+    madvise(base, size, MADV_SEQUENTIAL);
+    mapping->base = base;
+    mapping->size = size;
+    mapping->dev = st->st_dev;
+    mapping->ino = st->st_ino;
+    mapping->mtime = st->st_mtim;
+    mapping->refs = 1;
+    mapping->changed = 0;
+    mapping->reported = false;
+    mapping->next = E.mappings;
+    E.mappings = mapping;
+    return mapping;
+}
 
 /**
- * @brief Sets a message to be displayed in the status bar.
- *
- * The message will be displayed for a short period.
+ * @brief Drops a reference to a mapping and unmaps it after the last one.
  *
- * @param fmt Format string for the message (like printf).
- * @param ... Variable arguments for the format string.
+ * @param mapping The mapping, or NULL.
  */
-void set_status_message(const char *fmt, ...) {
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(E.status_message, sizeof(E.status_message), fmt, ap);
-    va_end(ap);
-    E.status_message_time = time(NULL);
+static void mapping_release(FileMapping *mapping) {
+    if (mapping == NULL || --mapping->refs > 0) return;
+    clipboard_detach_mapping(mapping->base, mapping->size);
+    munmap(mapping->base, mapping->size);
+    FileMapping **link = &E.mappings;
+    while (*link != mapping) link = &(*link)->next;
+    *link = mapping->next;
+    free(mapping);
 }
 
 /**
- * @brief Checks if a given character is part of a common operator or delimiter set.
- *
- * @param c The character to check.
- * @return true if the character is an operator/delimiter, false otherwise.
+ * @brief Installs the SIGBUS handler that keeps reads of truncated mappings
+ * from killing the editor, and with it the user's unsaved edits.
  */
-bool is_operator_char(char c) {
-    return (c == '+' || c == '-' || c == '*' || c == '/' || c == '%' ||
-            c == '=' || c == '<' || c == '>' || c == '!' || c == '&' ||
-            c == '|' || c == '^' || c == '~' || c == '?' || c == ':' ||
-            c == ';' || c == ',' || c == '.' || c == '(' || c == ')' ||
-            c == '[' || c == ']' || c == '{' || c == '}');
+void mapping_catch_faults(void) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    E.page_size = page_size > 0 ? (size_t)page_size : 4096;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = mapping_on_sigbus;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
 }
 
 /**
- * @brief Checks if the characters at the given index form a common two-character operator.
+ * @brief SIGBUS handler: a read from a mapped file past the end another
+ * program truncated it to.
  *
- * @param str The string to check within.
- * @param index The starting index of the potential operator.
- * @return true if a two-character operator is found, false otherwise.
+ * The page is replaced with zeros so the read completes, on whichever thread
+ * made it, and the mapping is flagged for mapping_check() to report. Faults
+ * anywhere else get the default action when the read is retried.
  */
-bool is_double_operator(const char *str, int index) {
-    if (str[index + 1] == '\0') return false;
-
-    char c1 = str[index];
-    char c2 = str[index + 1];
-
-    if ((c1 == '=' && c2 == '=') || (c1 == '!' && c2 == '=') ||
-        (c1 == '&' && c2 == '&') || (c1 == '|' && c2 == '|') ||
-        (c1 == '+' && c2 == '+') || (c1 == '-' && c2 == '-') ||
-        (c1 == '<' && c2 == '=') || (c1 == '>' && c2 == '=') ||
-        (c1 == '<' && c2 == '<') || (c1 == '>' && c2 == '>') ||
-        (c1 == '+' && c2 == '=') || (c1 == '-' && c2 == '=') ||
-        (c1 == '*' && c2 == '=') || (c1 == '/' && c2 == '=') ||
-        (c1 == '%' && c2 == '=') || (c1 == '&' && c2 == '=') ||
-        (c1 == '|' && c2 == '=') || (c1 == '^' && c2 == '=') ||
-        (c1 == '-' && c2 == '>')) {
-        return true;
+static void mapping_on_sigbus(int sig, siginfo_t *info, void *context) {
+    (void)context;
+    char *addr = info->si_addr;
+    for (FileMapping *m = E.mappings; m != NULL; m = m->next) {
+        if (addr < m->base || addr >= m->base + m->size) continue;
+        void *page = (void *)((uintptr_t)addr & ~(uintptr_t)(E.page_size - 1));
+        if (mmap(page, E.page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+            m->changed = 1;
+            return;
+        }
+        break;
     }
-    return false;
+    signal(sig, SIG_DFL);
 }
 
 /**
- * @brief Marks a range of lines as dirty, requiring a redraw.
+ * @brief Tells whether the file a mapping was made from has been rewritten
+ * or truncated in place since.
  *
- * @param start The starting line index (inclusive).
- * @param end The ending line index (inclusive).
+ * A file replaced by a new one (a rename, as editors and our own save do)
+ * leaves the mapping with the old contents, so only the same inode with a
+ * new size or modification time counts.
+ *
+ * @param mapping The mapping; flagged if it changed.
+ * @param path Where the file was loaded from.
  */
-void mark_lines_dirty(int start, int end) {
-    if (start < 0) start = 0;
-    if (end >= E.num_lines) end = E.num_lines - 1;
-
-    if (E.dirty_line_start == -1 || start < E.dirty_line_start) {
-        E.dirty_line_start = start;
-    }
-    if (end > E.dirty_line_end) {
-        E.dirty_line_end = end;
+static bool mapping_changed_on_disk(FileMapping *mapping, const char *path) {
+    struct stat st;
+    if (!mapping->changed && stat(path, &st) == 0 && st.st_dev == mapping->dev && st.st_ino == mapping->ino &&
+        ((size_t)st.st_size != mapping->size || st.st_mtim.tv_sec != mapping->mtime.tv_sec ||
+         st.st_mtim.tv_nsec != mapping->mtime.tv_nsec)) {
+        mapping->changed = 1;
     }
+    return mapping->changed;
 }
 
 /**
- * @brief Updates the highlighting information for a given line.
+ * @brief Warns once when the current buffer's mapped file changed under it.
+ *
+ * Called after each key the main loop handles, so coming back to the
+ * editor after touching the file elsewhere shows the warning on the next
+ * key, over that key's own message; the file is stat()ed at most every
+ * MAPPING_CHECK_MS.
+ */
+static void mapping_check(void) {
+    FileMapping *mapping = E.mapping;
+    if (mapping == NULL || mapping->reported || E.filename == NULL) return;
+    double now = editor_now_ms();
+    if (!mapping->changed && now - E.mapping_checked_ms < MAPPING_CHECK_MS) return;
+    E.mapping_checked_ms = now;
+    if (!mapping_changed_on_disk(mapping, E.filename)) return;
+    mapping->reported = true;
+    E.full_redraw = true;
+    set_status_message("Warning: %s was changed on disk by another program; unedited lines may show its new text.",
+                       E.filename);
+}
+
+/**
+ * @brief Loads the content of a file into the current buffer, replacing it.
  *
- * This function performs a DFA-like analysis to determine the HighlightType
- * for each character in the line. It also manages the global multi-line
- * comment state.
+ * Reloading a file that has not changed on disk keeps sharing its mapping.
+ * If the session cache has an entry for this version of the file, the cursor,
+ * scroll position and file type come back and the lines and comment states
+ * it recorded are laid out without reading the text to find them.
  *
- * @param line Pointer to the EditorLine to update.
+ * @param filename The path to the file to load.
  */
-void update_highlighting(EditorLine *line) {
-    if (line->hl == NULL || (size_t)line->allocated < (size_t)line->size + 1) {
-        if (line->hl) free(line->hl);
-        line->hl = malloc(sizeof(HighlightType) * (size_t)(line->allocated));
-        if (line->hl == NULL) {
-            set_status_message("Error: Failed to allocate highlighting memory.");
+void editor_load_file(const char *filename) {
+    session_store(); // Of the file this buffer held until now
+    FileMapping *previous = E.mapping;
+    if (previous != NULL) previous->refs++; // Kept until the new load had a chance to share it
+    editor_free_lines();
+    E.cursor_x = 0;
+    E.cursor_y = 0;
+    E.scroll_x = 0;
+    E.scroll_y = 0;
+
+    free(E.filename);
+    E.filename = strdup(filename);
+
+    Session session;
+    bool restored = session_read(filename, &session);
+    if (!editor_load_file_mapped(filename, restored ? &session : NULL)) {
+        FILE *fp = fopen(filename, "r");
+        if (!fp) {
+            set_status_message("Error: Could not open file %s: %s", filename, strerror(errno));
+            editor_insert_line(0, "", 0);
+            E.dirty = false;
+            mapping_release(previous);
+            if (restored) free(session.data);
+            prompt_file_type();
+            journal_attach();
             return;
         }
-    }
 
-    if (!E.is_code_file) {
-        for (int i = 0; i < line->size; i++) {
-            line->hl[i] = HL_NORMAL;
+        char *line = NULL;
+        size_t linecap = 0;
+        ssize_t linelen;
+
+        while ((linelen = getline(&line, &linecap, fp)) != -1) {
+            if (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
+                linelen--;
+            }
+            editor_insert_line(E.num_lines, line, (int)linelen);
         }
-        line->hl_revision++;
-        E.in_multiline_comment_global = false;
-        return;
+        free(line);
+        fclose(fp);
     }
-
-    for (int i = 0; i < line->size; i++) {
-        line->hl[i] = HL_NORMAL;
+    mapping_release(previous);
+    E.dirty = false;
+    if (editor_load_pending()) {
+        set_status_message("File loaded: %s (indexing lines)", E.filename);
+    } else {
+        set_status_message("File loaded: %s (%d lines)", E.filename, E.num_lines);
+    }
+    mark_lines_dirty(0, E.num_lines - 1);
+    if (restored) {
+        editor_set_file_type(session.header.code_file != 0);
+        session_restore_lexer(&session);
+    } else {
+        prompt_file_type();
     }
 
-    bool in_multiline_comment_this_line = E.in_multiline_comment_global;
-    bool in_string = false;
-    char string_quote_char = '\0';
-    bool first_word_on_line_highlighted = false;
-
-    for (int i = 0; i < line->size; i++) {
-        char c = line->chars[i];
+    add_to_recent_files(filename);
+    init_undo_redo();
+    journal_attach();
+    if (restored) {
+        session_restore_view(&session);
+        free(session.data);
+    }
+}
 
-        if (in_multiline_comment_this_line) {
-            line->hl[i] = HL_COMMENT;
-            if (c == '*' && i + 1 < line->size && line->chars[i+1] == '/') {
-                line->hl[i+1] = HL_COMMENT;
-                in_multiline_comment_this_line = false;
-                i++;
-            }
-            continue;
+/**
+ * @brief Writes a batch of iovecs completely, resuming after short writes.
+ *
+ * @param fd Destination file descriptor.
+ * @param iov The batch; entries are adjusted in place as they are consumed.
+ * @param count Number of entries in `iov`.
+ * @return true on success, false with errno set on a write error.
+ */
+static bool save_write_batch(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
         }
+    }
+    return true;
+}
 
-        if (in_string) {
-            line->hl[i] = HL_STRING;
-            if (c == '\\' && i + 1 < line->size) {
-                line->hl[i+1] = HL_STRING;
-                i++;
-            } else if (c == string_quote_char) {
-                in_string = false;
-                string_quote_char = '\0';
-            }
-            continue;
+/**
+ * @brief Creates the temporary file a save writes into.
+ *
+ * It sits next to the file, through any symlink, and gets the original's
+ * mode and owner, or the umask default for a new file.
+ *
+ * @param save Receives the open temporary file; pass it to atomic_save_commit().
+ * @param filename The file to replace.
+ * @return true on success, false with errno set (nothing is left behind).
+ */
+static bool atomic_save_begin(AtomicSave *save, const char *filename) {
+    // Write through symlinks rather than replacing them with a regular file
+    save->target = realpath(filename, NULL);
+    save->path = save->target ? save->target : filename;
+
+    const char *slash = strrchr(save->path, '/');
+    int dir_len = slash ? (int)(slash - save->path) + 1 : 0;
+    save->tmp_path = malloc((size_t)dir_len + strlen(save->path + dir_len) + sizeof(".~XXXXXX") + 1);
+    if (save->tmp_path == NULL) {
+        free(save->target);
+        errno = ENOMEM;
+        return false;
+    }
+    sprintf(save->tmp_path, "%.*s.%s.~XXXXXX", dir_len, save->path, save->path + dir_len);
+
+    save->fd = mkstemp(save->tmp_path);
+    if (save->fd == -1) {
+        int saved_errno = errno;
+        free(save->tmp_path);
+        free(save->target);
+        errno = saved_errno;
+        return false;
+    }
+
+    // mkstemp creates the file 0600; keep the original's mode and owner, or the umask default
+    struct stat st;
+    if (stat(save->path, &st) == 0) {
+        fchmod(save->fd, st.st_mode & 07777);
+        if (fchown(save->fd, st.st_uid, st.st_gid) == -1) {
+            // Not permitted for other users' files; the mode is what matters
         }
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(save->fd, 0666 & ~mask);
+    }
+    return true;
+}
 
-        if (c == '\'' || c == '"' || c == '`') {
-            in_string = true;
-            string_quote_char = c;
-            line->hl[i] = HL_STRING;
-        } else if (c == '/' && i + 1 < line->size && line->chars[i+1] == '/') {
-            for (int k = i; k < line->size; k++) {
-                line->hl[k] = HL_COMMENT;
-            }
-            break;
-        } else if (c == '#') {
-            for (int k = i; k < line->size; k++) {
-                line->hl[k] = HL_COMMENT;
-            }
-            break;
-        } else if (c == '/' && i + 1 < line->size && line->chars[i+1] == '*') {
-            for (int k = i; k < line->size; k++) {
-                line->hl[k] = HL_COMMENT;
-            }
-            in_multiline_comment_this_line = true;
-            i++;
-        } else if (isdigit(c)) {
-            int start_num = i;
-            while (i < line->size && (isdigit(line->chars[i]) || line->chars[i] == '.' ||
-                                tolower((unsigned char)line->chars[i]) == 'x' ||
-                                (i > start_num && tolower((unsigned char)line->chars[i-1]) == 'x' && isxdigit((unsigned char)line->chars[i])) ||
-                                tolower((unsigned char)line->chars[i]) == 'e' || tolower((unsigned char)line->chars[i]) == 'f' ||
-                                (i > start_num && (line->chars[i-1] == 'e' || line->chars[i-1] == 'E') && (line->chars[i] == '+' || line->chars[i] == '-'))
-                                )) {
-                line->hl[i] = HL_NUMBER;
-                i++;
-            }
-            i--;
-        } else if (is_double_operator(line->chars, i)) {
-            line->hl[i] = HL_OPERATOR;
-            line->hl[i+1] = HL_OPERATOR;
-            i++;
-        } else if (is_operator_char(c)) {
-            line->hl[i] = HL_OPERATOR;
-        } else if (isalnum((unsigned char)c) || c == '_') {
-            int start = i;
-            while (i < line->size && (isalnum((unsigned char)line->chars[i]) || line->chars[i] == '_')) {
-                i++;
-            }
-            
-            if (!first_word_on_line_highlighted) {
-                int prev_char_idx = start - 1;
-                bool only_whitespace_before = true;
-                while (prev_char_idx >= 0) {
-                    if (!isspace((unsigned char)line->chars[prev_char_idx])) {
-                        only_whitespace_before = false;
-                        break;
-                    }
-                    prev_char_idx--;
-                }
-                if (only_whitespace_before) {
-                    for (int k = start; k < i; k++) {
-                        line->hl[k] = HL_KEYWORD;
-                    }
-                    first_word_on_line_highlighted = true;
+/**
+ * @brief Finishes a save: flushes the temporary file and renames it over the
+ * original, or throws it away.
+ *
+ * @param save From atomic_save_begin(); released either way.
+ * @param ok Whether everything was written; false discards the temporary file.
+ * @return true if the file was replaced, false with errno set otherwise.
+ */
+static bool atomic_save_commit(AtomicSave *save, bool ok) {
+    ok = ok && fsync(save->fd) == 0;
+    int saved_errno = errno;
+    if (close(save->fd) == -1 && ok) {
+        ok = false;
+        saved_errno = errno;
+    }
+    if (ok && rename(save->tmp_path, save->path) == -1) {
+        ok = false;
+        saved_errno = errno;
+    }
+    if (!ok) unlink(save->tmp_path);
+    free(save->tmp_path);
+    free(save->target);
+    errno = saved_errno;
+    return ok;
+}
+
+/**
+ * @brief Streams every line of the buffer, newline-terminated, to `fd`.
+ *
+ * Lines are gathered into SAVE_IOV_BATCH-entry writev() calls. Runs of
+ * borrowed lines that still sit back to back in the file mapping go out as a
+ * single entry covering their newlines too, so an unmodified region of
+ * the loaded file is written straight from the mapping.
+ *
+ * @param fd Destination file descriptor.
+ * @param bytes Receives the number of bytes written.
+ * @return true on success, false with errno set on a write error.
+ */
+static bool editor_write_lines(int fd, size_t *bytes) {
+    static char newline = '\n';
+    struct iovec iov[SAVE_IOV_BATCH];
+    int count = 0;
+    *bytes = 0;
+
+    for (int c = 0; c < E.num_chunks; c++) {
+        const LineChunk *chunk = E.chunks[c];
+        for (int i = 0; i < chunk->count; i++) {
+            const EditorLine *line = &chunk->lines[i];
+            *bytes += (size_t)line->size + 1;
+
+            // A borrowed line is followed by its '\n' in the mapping unless it was the unterminated last line or truncated
+            bool mapped_newline = line->allocated == 0 && line->chars + line->size < E.map_base + E.map_size &&
+                                  line->chars[line->size] == '\n';
+            if (count > 0 && line->allocated == 0 &&
+                (char *)iov[count - 1].iov_base + iov[count - 1].iov_len == line->chars &&
+                iov[count - 1].iov_base != &newline) {
+                // Extends the previous mapped run
+                iov[count - 1].iov_len += (size_t)line->size + (mapped_newline ? 1 : 0);
+                if (mapped_newline) continue;
+            } else {
+                if (count + 2 > SAVE_IOV_BATCH) {
+                    if (!save_write_batch(fd, iov, count)) return false;
+                    count = 0;
                 }
+                iov[count].iov_base = line->chars;
+                iov[count].iov_len = (size_t)line->size + (mapped_newline ? 1 : 0);
+                count++;
+                if (mapped_newline) continue;
             }
-            
-            for (int k = start; k < i; k++) {
-                if (line->hl[k] == HL_NORMAL) {
-                    line->hl[k] = HL_NORMAL;
-                }
+            if (count + 1 > SAVE_IOV_BATCH) {
+                if (!save_write_batch(fd, iov, count)) return false;
+                count = 0;
             }
-            i--;
+            iov[count].iov_base = &newline;
+            iov[count].iov_len = 1;
+            count++;
         }
     }
-    line->hl_revision++;
-    E.in_multiline_comment_global = in_multiline_comment_this_line;
+    return save_write_batch(fd, iov, count);
 }
 
 /**
- * @brief Prints a character to the ncurses window with the specified color pair,
- * handling tab expansion and custom cursor highlighting.
+ * @brief Saves the current editor content to the file.
  *
- * @param c The character to print.
- * @param base_color_pair The base color pair for syntax highlighting.
- * @param is_cursor_char True if this character is at the cursor position, false otherwise.
+ * If no filename is set, it prompts the user for one. The text goes through
+ * atomic_save_begin() and atomic_save_commit(), so a crash mid-save never
+ * leaves a truncated file behind. The old file's mapping stays valid across
+ * the rename, so borrowed lines need no copying.
  */
-static void print_char_with_highlight(int c, int base_color_pair, bool is_cursor_char) {
-    int final_color_pair = base_color_pair;
-    int attrs = A_NORMAL;
+void editor_save_file(void) {
+    if (E.filename == NULL) {
+        // Автоматичний виклик "Save As" для нових файлів
+        editor_save_as();
+        // Якщо editor_save_as() скасовано або не вдалося, E.dirty залишиться true
+        if (E.dirty) {
+            set_status_message("Save cancelled or failed.");
+        }
+        return;
+    } else {
+        // Звичайне збереження
+        editor_load_all();
+        if (E.map_load_failed) {
+            set_status_message("Error saving: %s is not fully loaded.", E.filename);
+            return;
+        }
+        // Unedited lines are written from the mapping, which now holds whatever the other program left
+        if (E.mapping != NULL && mapping_changed_on_disk(E.mapping, E.filename)) {
+            E.mapping->reported = true;
+            if (E.headless || !show_confirmation_dialog("File changed on disk; unedited lines may have changed with it. Save anyway?")) {
+                set_status_message("Error saving: %s was changed on disk by another program.", E.filename);
+                return;
+            }
+        }
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
 
-    int current_screen_y, current_screen_x;
-    getyx(stdscr, current_screen_y, current_screen_x);
+        AtomicSave save;
+        if (!atomic_save_begin(&save, E.filename)) {
+            set_status_message("Error saving: %s", strerror(errno));
+            return;
+        }
+        size_t bytes;
+        bool ok = editor_write_lines(save.fd, &bytes);
+        if (!atomic_save_commit(&save, ok)) {
+            set_status_message("Error saving: %s", strerror(errno));
+            return;
+        }
 
-    int file_y = current_screen_y - BORDER_WIDTH + E.scroll_y;
-    int file_x_rendered = current_screen_x - BORDER_WIDTH;
-    int line_num_width = 0;
-    if (E.show_line_numbers) {
-        line_num_width = snprintf(NULL, 0, "%d", E.num_lines > 0 ? E.num_lines : 1) + 1;
-        if (line_num_width < 4) line_num_width = 4;
-        file_x_rendered -= line_num_width;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+        double rate = seconds > 0 ? (double)bytes / seconds : 0.0;
+        E.dirty = false;
+        journal_saved();
+        set_status_message("Saved %s (%d lines, %.1f %s)", E.filename, E.num_lines,
+                           rate >= 1e6 ? rate / 1e6 : rate / 1e3, rate >= 1e6 ? "MB/s" : "KB/s");
     }
-    int file_x = editor_row_rx_to_cx((file_y >=0 && file_y < E.num_lines) ? &E.lines[file_y] : NULL, file_x_rendered + E.scroll_x);
+}
 
-    if (E.visual_mode && is_char_in_selection(file_y, file_x)) {
-        final_color_pair = COLOR_PAIR_SELECTION;
-        attrs = A_NORMAL;
-    }
+/**
+ * @brief Reads the monotonic clock.
+ *
+ * @return Milliseconds since an arbitrary fixed point.
+ */
+double editor_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec * 1e3 + (double)now.tv_nsec / 1e6;
+}
 
-    if (is_cursor_char) {
-        final_color_pair = COLOR_PAIR_CURSOR;
-        attrs = A_REVERSE;
-    }
-    
-    attron(COLOR_PAIR(final_color_pair) | attrs);
+/**
+ * @brief Formats the recorded startup phase timings on one line.
+ *
+ * @param buf Destination buffer.
+ * @param size Size of `buf`.
+ */
+static void startup_profile_format(char *buf, size_t size) {
+    const StartupProfile *p = &E.startup;
+    snprintf(buf, size, "Startup: splash %.1f ms, ncurses %.1f ms, load %.1f ms, first paint %.1f ms, total %.1f ms",
+             p->splash_ms, p->ncurses_ms, p->load_ms, p->paint_ms,
+             p->splash_ms + p->ncurses_ms + p->load_ms + p->paint_ms);
+}
 
-    if (c == '\t') {
-        waddnstr(stdscr, "    ", TAB_STOP);
-    } else {
-        waddch(stdscr, (chtype)c);
-    }
+/**
+ * @brief Maps a frame time to its latency histogram bucket.
+ *
+ * Buckets are exact below 4 microseconds, then four per power of two.
+ *
+ * @param ms Frame time in milliseconds.
+ * @return Bucket index, below LATENCY_BUCKETS.
+ */
+static int latency_bucket(double ms) {
+    unsigned long long us = ms > 0 ? (unsigned long long)(ms * 1000.0) : 0;
+    if (us < 4) return (int)us;
+    int octave = 63 - __builtin_clzll(us);
+    int bucket = 4 * (octave - 1) + (int)((us >> (octave - 2)) & 3);
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
 
-    attroff(COLOR_PAIR(final_color_pair) | attrs);
+/**
+ * @brief Returns the exclusive upper bound of a latency histogram bucket.
+ *
+ * @param bucket Bucket index, as returned by latency_bucket().
+ * @return The bucket's upper bound in milliseconds.
+ */
+static double latency_bucket_upper_ms(int bucket) {
+    if (bucket < 4) return (bucket + 1) / 1000.0;
+    int shift = bucket / 4 - 1;
+    unsigned long long lower = (unsigned long long)(4 + bucket % 4) << shift;
+    return (double)(lower + (1ULL << shift)) / 1000.0;
 }
 
+/**
+ * @brief Estimates a frame time percentile from the latency histogram.
+ *
+ * @param fraction The percentile as a fraction, e.g. 0.99.
+ * @return Upper bound of the bucket holding that percentile in milliseconds, 0 before the first frame.
+ */
+static double latency_percentile_ms(double fraction) {
+    const LatencyProfile *p = &E.latency;
+    if (p->frames == 0) return 0;
+    long rank = (long)(fraction * (double)(p->frames - 1));
+    long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += p->histogram[i];
+        if (seen > rank) return latency_bucket_upper_ms(i);
+    }
+    return latency_bucket_upper_ms(LATENCY_BUCKETS - 1);
+}
 
 /**
- * @brief Maps a HighlightType to its corresponding ncurses color pair.
+ * @brief Opens the --trace file; frames are appended to it as they finish.
  *
- * @param type The HighlightType enum value.
- * @return The ncurses color pair ID.
+ * @param path The file to write.
+ * @return true on success, false if the file could not be created.
  */
-static int get_color_pair_for_highlight_type(HighlightType type) {
-    switch (type) {
-        case HL_COMMENT: return COLOR_PAIR_COMMENT;
-        case HL_STRING: return COLOR_PAIR_STRING;
-        case HL_NUMBER: return COLOR_PAIR_NUMBER;
-        case HL_OPERATOR: return COLOR_PAIR_OPERATOR;
-        case HL_KEYWORD: return COLOR_PAIR_KEYWORD;
-        default: return COLOR_PAIR_DEFAULT;
-    }
+bool latency_trace_open(const char *path) {
+    E.latency.trace = fopen(path, "w");
+    if (E.latency.trace == NULL) return false;
+    fputs("[", E.latency.trace);
+    E.latency.trace_events = 0;
+    return true;
 }
 
 /**
- * @brief Draws a single line of text to the ncurses window with syntax highlighting.
+ * @brief Finishes and closes the --trace file, if one is open.
+ */
+void latency_trace_close(void) {
+    if (E.latency.trace == NULL) return;
+    fputs("\n]\n", E.latency.trace);
+    fclose(E.latency.trace);
+    E.latency.trace = NULL;
+}
+
+/**
+ * @brief Appends one complete ("X") event to the trace file.
  *
- * @param line Pointer to the EditorLine to highlight.
- * @param line_idx The 0-indexed index of the current line being drawn.
- * @param screen_y The screen row where this line should be drawn.
- * @param line_num_offset_x The horizontal offset for the actual line content due to line numbers.
+ * @param name Event name.
+ * @param start_ms When the event began, on the editor_now_ms() clock.
+ * @param duration_ms How long it lasted.
+ * @param lines_lexed Lines lexed during the event, recorded as an argument; -1 to leave it out.
  */
-void editor_draw_line_highlighted(const EditorLine *line, int line_idx, int screen_y, int line_num_offset_x) {
-    update_highlighting((EditorLine *)line);
+static void latency_trace_event(const char *name, double start_ms, double duration_ms, int lines_lexed) {
+    fprintf(E.latency.trace, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.1f,\"dur\":%.1f",
+            E.latency.trace_events++ ? "," : "", name, start_ms * 1000.0, duration_ms * 1000.0);
+    if (lines_lexed >= 0) fprintf(E.latency.trace, ",\"args\":{\"lines_lexed\":%d}", lines_lexed);
+    fputc('}', E.latency.trace);
+}
 
-    wmove(stdscr, screen_y, BORDER_WIDTH + line_num_offset_x);
+/**
+ * @brief Starts timing a frame for a key that was just read from the terminal.
+ *
+ * Keys read before the open frame is repainted, such as a burst that
+ * editor_drain_input() batches, join that frame.
+ *
+ * @param arrived_ms When getch() returned the key.
+ */
+static void latency_key_read(double arrived_ms) {
+    LatencyProfile *p = &E.latency;
+    double now = editor_now_ms();
+    if (p->frame_open) {
+        p->input_ms += now - arrived_ms;
+        return;
+    }
+    p->frame_open = true;
+    p->key_ms = arrived_ms;
+    p->input_ms = now - arrived_ms;
+    p->edit_ms = 0;
+    p->highlight_ms = 0;
+    p->draw_ms = 0;
+    p->lines_lexed = 0;
+}
 
-    int chars_skipped = 0;
-    int rendered_x_at_scroll = 0;
-    for (int i = 0; i < line->size; i++) {
-        int char_width = (line->chars[i] == '\t') ? (TAB_STOP - (rendered_x_at_scroll % TAB_STOP)) : 1;
-        if (rendered_x_at_scroll + char_width > E.scroll_x) {
-            break;
+/**
+ * @brief Records the open frame in the histogram and the trace file.
+ */
+static void latency_frame_end(void) {
+    LatencyProfile *p = &E.latency;
+    if (!p->frame_open) return;
+    p->frame_open = false;
+    double total = p->input_ms + p->edit_ms + p->highlight_ms + p->draw_ms;
+    p->last_ms = total;
+    p->last_input_ms = p->input_ms;
+    p->last_edit_ms = p->edit_ms;
+    p->last_highlight_ms = p->highlight_ms;
+    p->last_draw_ms = p->draw_ms;
+    p->last_lines_lexed = p->lines_lexed;
+    p->total_ms += total;
+    p->frames++;
+    p->histogram[latency_bucket(total)]++;
+
+    if (p->trace) {
+        double edit_start = p->key_ms + p->input_ms;
+        double refresh_start = edit_start + p->edit_ms;
+        // Highlighting runs in the middle of the repaint, so it nests inside it
+        latency_trace_event("frame", p->key_ms, total, p->lines_lexed);
+        latency_trace_event("input", p->key_ms, p->input_ms, -1);
+        latency_trace_event("edit", edit_start, p->edit_ms, -1);
+        latency_trace_event("refresh", refresh_start, p->highlight_ms + p->draw_ms, -1);
+        latency_trace_event("highlight", p->highlight_start_ms, p->highlight_ms, -1);
+    }
+}
+
+/**
+ * @brief Draws the profiling overlay over the top border: times of the last
+ * frame and its phases, the running average and p99, and lines lexed.
+ */
+static void latency_draw_overlay(void) {
+    const LatencyProfile *p = &E.latency;
+    char text[MAX_STATUS_MESSAGE_LENGTH];
+    snprintf(text, sizeof(text), " frame %.2f ms avg %.2f p99 %.2f | in %.2f ed %.2f hl %.2f dr %.2f | lexed %d ",
+             p->last_ms, p->frames ? p->total_ms / (double)p->frames : 0, latency_percentile_ms(0.99),
+             p->last_input_ms, p->last_edit_ms, p->last_highlight_ms, p->last_draw_ms, p->last_lines_lexed);
+
+    int width = E.screen_cols - 2 * BORDER_WIDTH;
+    if (width <= 0) return;
+    wattron(stdscr, COLOR_PAIR(COLOR_PAIR_BORDER));
+    mvhline(0, BORDER_WIDTH, ACS_HLINE, width);
+    wattroff(stdscr, COLOR_PAIR(COLOR_PAIR_BORDER));
+    int len = (int)strlen(text);
+    if (len > width) len = width;
+    wattron(stdscr, COLOR_PAIR(COLOR_PAIR_STATUS_BAR));
+    mvaddnstr(0, BORDER_WIDTH + width - len, text, len);
+    wattroff(stdscr, COLOR_PAIR(COLOR_PAIR_STATUS_BAR));
+}
+
+/**
+ * @brief Decodes one UTF-8 sequence.
+ *
+ * Overlong forms, surrogates and code points past U+10FFFF count as invalid,
+ * like a truncated sequence or a stray continuation byte.
+ *
+ * @param s Text to decode; need not be NUL-terminated.
+ * @param avail Bytes readable at `s`, at least 1.
+ * @param cp Receives the code point, or U+FFFD for an invalid byte.
+ * @return Length of the sequence, 1 for an invalid byte.
+ */
+static int utf8_decode(const char *s, int avail, uint32_t *cp) {
+    const unsigned char *u = (const unsigned char *)s;
+    uint32_t c = u[0];
+    int len;
+    uint32_t min;
+    if (c < 0x80) {
+        *cp = c;
+        return 1;
+    } else if (c >= 0xc2 && c <= 0xdf) {
+        len = 2;
+        min = 0x80;
+        c &= 0x1f;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        len = 3;
+        min = 0x800;
+        c &= 0x0f;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        len = 4;
+        min = 0x10000;
+        c &= 0x07;
+    } else {
+        *cp = 0xfffd;
+        return 1;
+    }
+    if (avail < len) {
+        *cp = 0xfffd;
+        return 1;
+    }
+    for (int i = 1; i < len; i++) {
+        if ((u[i] & 0xc0) != 0x80) {
+            *cp = 0xfffd;
+            return 1;
         }
-        rendered_x_at_scroll += char_width;
-        chars_skipped++;
+        c = (c << 6) | (u[i] & 0x3f);
     }
+    if (c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) {
+        *cp = 0xfffd;
+        return 1;
+    }
+    *cp = c;
+    return len;
+}
 
-    int current_render_x = rendered_x_at_scroll - E.scroll_x;
-    int editor_content_cols = E.screen_cols - 2 * BORDER_WIDTH;
-    if (E.show_line_numbers) {
-        editor_content_cols -= (snprintf(NULL, 0, "%d", E.num_lines > 0 ? E.num_lines : 1) + 1);
+/**
+ * @brief Returns the number of terminal columns a code point takes.
+ *
+ * Combining marks take 0 and East Asian wide characters 2. Code points the
+ * locale cannot print are drawn as U+FFFD, which takes 1.
+ */
+static int utf8_width(uint32_t cp) {
+    if (cp < 0x80) return 1;
+    int width = wcwidth((wchar_t)cp);
+    return width < 0 ? 1 : width;
+}
+
+/**
+ * @brief Measures the character starting at byte `cx` of a line.
+ *
+ * @param row The line.
+ * @param cx Byte offset of a character boundary, less than row->size.
+ * @param rx Display column the character starts at, for tab stops.
+ * @param len Receives the character's length in bytes.
+ * @return Its width in display columns.
+ */
+static int line_char_width(const EditorLine *row, int cx, int rx, int *len) {
+    unsigned char c = (unsigned char)row->chars[cx];
+    if (c < 0x80) {
+        *len = 1;
+        return c == '\t' ? TAB_STOP - (rx % TAB_STOP) : 1;
+    }
+    uint32_t cp;
+    *len = utf8_decode(&row->chars[cx], row->size - cx, &cp);
+    return utf8_width(cp);
+}
+
+/**
+ * @brief Returns the offset of the character after the one at `cx`.
+ *
+ * Combining marks that follow are skipped too, so the cursor steps over a
+ * letter and its accents as one character.
+ *
+ * @param row The line.
+ * @param cx A character boundary.
+ * @return The next boundary, or row->size at the end of the line.
+ */
+int line_next_char(const EditorLine *row, int cx) {
+    if (cx >= row->size) return row->size;
+    int len;
+    line_char_width(row, cx, 0, &len);
+    cx += len;
+    while (cx < row->size && (unsigned char)row->chars[cx] >= 0x80 && line_char_width(row, cx, 0, &len) == 0) {
+        cx += len;
     }
+    return cx;
+}
 
-    for (int i = chars_skipped; i < line->size; i++) {
-        if (current_render_x >= editor_content_cols) {
+/**
+ * @brief Returns the offset of the character before `cx`.
+ *
+ * A valid sequence ending right at `cx` is one character; anything else is a
+ * single invalid byte, which matches how the line decodes from its start.
+ * Combining marks are stepped back over along with the character they follow.
+ *
+ * @param row The line.
+ * @param cx A character boundary.
+ * @return The previous boundary, or 0 at the start of the line.
+ */
+int line_prev_char(const EditorLine *row, int cx) {
+    while (cx > 0) {
+        int start = cx - 1;
+        for (int back = 2; back <= 4 && cx - back >= 0; back++) {
+            unsigned char lead = (unsigned char)row->chars[cx - back];
+            if ((lead & 0xc0) == 0x80) continue;
+            uint32_t cp;
+            if (utf8_decode(&row->chars[cx - back], back, &cp) == back) start = cx - back;
             break;
         }
+        int len;
+        bool mark = (unsigned char)row->chars[start] >= 0x80 && line_char_width(row, start, 0, &len) == 0;
+        cx = start;
+        if (!mark) break;
+    }
+    return cx;
+}
 
-        bool is_cursor = (line_idx == E.cursor_y && i == E.cursor_x);
-        int color_pair = get_color_pair_for_highlight_type(line->hl[i]);
-        
-        if (line->chars[i] == '\t') {
-            int tab_width = TAB_STOP - (current_render_x % TAB_STOP);
-            for (int k = 0; k < tab_width; k++) {
-                if (current_render_x + k >= editor_content_cols) break;
-                print_char_with_highlight(' ', color_pair, is_cursor && k == 0);
-            }
-            current_render_x += tab_width;
+/**
+ * @brief Advances a display column over the characters in [*cx, to).
+ *
+ * @param row The line to measure.
+ * @param cx Character boundary to start at; receives the first boundary at
+ * or after `to`, which is past `to` when a character straddles it.
+ * @param to Byte offset to stop at, at most row->size.
+ * @param rx Display column at *cx.
+ * @return The display column at the new *cx.
+ */
+static int rx_advance(const EditorLine *row, int *cx, int to, int rx) {
+    const char *s = row->chars;
+    int i = *cx;
+    while (i < to) {
+        unsigned char c = (unsigned char)s[i];
+        if (c >= ' ' && c < 0x80) {
+            // Printable ASCII, the common case
+            rx++;
+            i++;
         } else {
-            print_char_with_highlight(line->chars[i], color_pair, is_cursor);
-            current_render_x++;
+            int len;
+            rx += line_char_width(row, i, rx, &len);
+            i += len;
         }
     }
+    *cx = i;
+    return rx;
+}
 
-    if (line_idx == E.cursor_y && E.cursor_x == line->size && current_render_x < editor_content_cols) {
-        print_char_with_highlight(' ', COLOR_PAIR_DEFAULT, true);
-        current_render_x++;
-    }
-
-    for (int i = current_render_x; i < editor_content_cols; i++) {
-        waddch(stdscr, ' ');
+/**
+ * @brief Returns a long line's display-column index, valid for its current text.
+ *
+ * The index is reset when the line has changed since it was built; marks are
+ * then filled in again on demand by rx_index_extend().
+ *
+ * @param row Pointer to the EditorLine.
+ * @return The index, or NULL if the line is too short to need one or memory ran out.
+ */
+static RxIndex *line_rx_index(EditorLine *row) {
+    if (row->size < RX_INDEX_MIN_BYTES) {
+        free(row->rx_index);
+        row->rx_index = NULL;
+        return NULL;
     }
+    int needed = row->size / RX_INDEX_STRIDE + 1;
+    RxIndex *index = row->rx_index;
+    if (index == NULL || index->allocated < needed) {
+        RxIndex *grown = realloc(index, sizeof(RxIndex) + sizeof(RxMark) * (size_t)needed);
+        if (grown == NULL) return NULL;
+        if (index == NULL) grown->revision = row->hl_revision - 1;
+        grown->allocated = needed;
+        row->rx_index = index = grown;
+    }
+    if (index->revision != row->hl_revision) {
+        index->revision = row->hl_revision;
+        index->marks[0].cx = 0;
+        index->marks[0].rx = 0;
+        index->count = 1;
+    }
+    return index;
 }
 
 /**
- * @brief Clears the suggestion area at the bottom of the screen.
+ * @brief Fills in marks up to and including marks[k].
+ *
+ * @param row The line the index belongs to.
+ * @param index The line's index, as returned by line_rx_index().
+ * @param k Last mark needed, at most row->size / RX_INDEX_STRIDE.
  */
-void clear_suggestion_area(void) {
-    int start_y = E.screen_rows + BORDER_WIDTH;
-    for (int y = 0; y < SUGGESTION_ROWS; y++) {
-        mvhline(start_y + y, 0, ' ', (chtype)(E.screen_cols + 2 * BORDER_WIDTH));
+static void rx_index_extend(const EditorLine *row, RxIndex *index, int k) {
+    while (index->count <= k) {
+        const RxMark *last = &index->marks[index->count - 1];
+        RxMark *next = &index->marks[index->count++];
+        next->cx = last->cx;
+        next->rx = rx_advance(row, &next->cx, (index->count - 1) * RX_INDEX_STRIDE, last->rx);
     }
 }
 
 /**
- * @brief Displays command suggestions in a dedicated area.
+ * @brief Converts a byte index (cx) within a line to a rendered column index (rx).
+ *
+ * Accounts for tabs and for UTF-8 characters, which may take 0, 1 or 2
+ * columns. Long lines start from the nearest checkpoint in their
+ * display-column index.
+ *
+ * @param row Pointer to the EditorLine.
+ * @param cx The byte index (0-indexed), normally a character boundary.
+ * @return The rendered column index.
  */
-void show_command_suggestions(void) {
-    clear_suggestion_area();
-    int start_y = E.screen_rows + BORDER_WIDTH;
-    wattron(stdscr, COLOR_PAIR(COLOR_PAIR_SUGGESTIONS));
+int editor_row_cx_to_rx(EditorLine *row, int cx) {
+    if (!row || cx <= 0) return 0;
+    if (cx > row->size) cx = row->size;
+
+    int from = 0;
+    RxIndex *index = line_rx_index(row);
+    if (index == NULL) return rx_advance(row, &from, cx, 0);
+
+    int k = cx / RX_INDEX_STRIDE;
+    rx_index_extend(row, index, k);
+    if (index->marks[k].cx > cx) k--;
+    from = index->marks[k].cx;
+    return rx_advance(row, &from, cx, index->marks[k].rx);
+}
 
-    mvprintw(start_y, BORDER_WIDTH, "Suggestions:");
-    
-    char buffer[MAX_STATUS_MESSAGE_LENGTH];
-    int current_col = BORDER_WIDTH;
-    int current_row = start_y + 1;
-
-    // Updated list of commands for suggestions
-    const char *common_commands[] = {
-        "S (Save)", "SA (Save As)", "F (Find)", "FN (Find Next)", "FP (Find Prev)",
-        "R (Replace)", "G (Go to Line)", "LN (Line Numbers)",
-        "DU (Duplicate Line)", "UL (Uppercase Line)", "LL (Lowercase Line)",
-        "DL (Delete Line)", "QW (Quit Without Save)", "I (Info)", "R (Recent Files)",
-        "KN (Normal KB Mode)", "TC (Text to Code)", "CT (Code to Text)",
-        "Z (Undo)", "Y (Redo)", ":: (Create Macro)", "? (Help)",
-        "h (Left)", "j (Down)", "k (Up)", "l (Right)" // Vim-like movements
-    };
-    int num_built_in = sizeof(common_commands) / sizeof(common_commands[0]);
+/**
+ * @brief Converts a rendered column index (rx) to a byte index (cx) within a line.
+ *
+ * Accounts for tabs and wide characters. This is useful for placing the cursor accurately.
+ * Long lines binary-search their display-column index for the last checkpoint
+ * at or before `rx` and scan from there.
+ *
+ * @param row Pointer to the EditorLine.
+ * @param rx The rendered column index (0-indexed).
+ * @return The start of the character covering `rx`, or row->size if the line is shorter.
+ */
+int editor_row_rx_to_cx(EditorLine *row, int rx) {
+    if (!row || rx < 0) return 0;
 
-    for (int i = 0; i < num_built_in; i++) {
-        // Use strncasecmp for case-insensitive comparison
-        if (E.cmd.length == 0 || strncasecmp(common_commands[i], E.cmd.sequence, (size_t)E.cmd.length) == 0) {
-            int len = (int)strlen(common_commands[i]);
-            if (current_col + len + 2 > E.screen_cols + BORDER_WIDTH) {
-                current_row++;
-                current_col = BORDER_WIDTH;
-                if (current_row >= start_y + SUGGESTION_ROWS) break;
-            }
-            mvprintw(current_row, current_col, "%s  ", common_commands[i]);
-            current_col += len + 2;
+    int cx = 0;
+    int cur_rx = 0;
+    RxIndex *index = line_rx_index(row);
+    if (index != NULL) {
+        int last = row->size / RX_INDEX_STRIDE;
+        while (index->count <= last && index->marks[index->count - 1].rx <= rx) {
+            rx_index_extend(row, index, index->count);
         }
-    }
-
-    for (int i = 0; i < E.macro_count; i++) {
-        if (E.cmd.length == 0 || strncasecmp(E.macros[i].sequence, E.cmd.sequence, (size_t)E.cmd.length) == 0) {
-            snprintf(buffer, sizeof(buffer), "%s ('%s')", E.macros[i].sequence, E.macros[i].action);
-            int len = (int)strlen(buffer);
-            if (current_col + len + 2 > E.screen_cols + BORDER_WIDTH) {
-                current_row++;
-                current_col = BORDER_WIDTH;
-                if (current_row >= start_y + SUGGESTION_ROWS) break;
-            }
-            mvprintw(current_row, current_col, "%s  ", buffer);
-            current_col += len + 2;
+        int lo = 0, hi = index->count - 1;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (index->marks[mid].rx <= rx) lo = mid;
+            else hi = mid - 1;
         }
+        cx = index->marks[lo].cx;
+        cur_rx = index->marks[lo].rx;
     }
 
-    wattroff(stdscr, COLOR_PAIR(COLOR_PAIR_SUGGESTIONS));
+    while (cx < row->size) {
+        int len;
+        cur_rx += line_char_width(row, cx, cur_rx, &len);
+        if (cur_rx > rx) return cx;
+        cx += len;
+    }
+    return cx;
 }
 
+// --- Line Pool Implementation ---
+//
+// A block comes off its size class's free list if there is one there, and
+// otherwise from the unused part of the newest slab. Each buffer has a pool
+// of its own. Slabs are kept until the buffer is closed or reloaded, and
+// they are then released with one free() each.
+
+/**
+ * @brief Picks the size class for a block of `bytes`.
+ *
+ * @return The smallest class that fits, or LINE_POOL_CLASSES if the block is
+ * too big for the pool.
+ */
+static int line_pool_class(size_t bytes) {
+    if (bytes > LINE_POOL_MAX_BYTES) return LINE_POOL_CLASSES;
+    int cls = 0;
+    while (((size_t)1 << (LINE_POOL_MIN_SHIFT + cls)) < bytes) cls++;
+    return cls;
+}
+
+/**
+ * @brief Hands out a block of size class `cls` from the current buffer's pool.
+ *
+ * @return The block, or NULL if a new slab could not be allocated.
+ */
+static void *line_pool_alloc(int cls) {
+    LinePool *pool = &E.pool;
+    size_t bytes = (size_t)1 << (LINE_POOL_MIN_SHIFT + cls);
+    void *block = pool->free_list[cls];
+    if (block != NULL) {
+        memcpy(&pool->free_list[cls], block, sizeof(void *));
+    } else {
+        if (pool->bump == NULL || (size_t)(pool->bump_end - pool->bump) < bytes) {
+            LineSlab *slab = malloc(LINE_SLAB_BYTES);
+            if (slab == NULL) return NULL;
+            slab->next = pool->slabs;
+            slab->bytes = LINE_SLAB_BYTES;
+            pool->slabs = slab;
+            pool->slab_count++;
+            pool->reserved += LINE_SLAB_BYTES;
+            pool->bump = (char *)(slab + 1);
+            pool->bump_end = (char *)slab + LINE_SLAB_BYTES;
+        }
+        block = pool->bump;
+        pool->bump += bytes;
+    }
+    pool->used += bytes;
+    return block;
+}
+
+/**
+ * @brief Puts a block back on its free list.
+ *
+ * @param block A block line_pool_alloc() handed out for the current buffer.
+ * @param cls Its size class.
+ */
+static void line_pool_free(void *block, int cls) {
+    LinePool *pool = &E.pool;
+    memcpy(block, &pool->free_list[cls], sizeof(void *));
+    pool->free_list[cls] = block;
+    pool->used -= (size_t)1 << (LINE_POOL_MIN_SHIFT + cls);
+}
+
+/**
+ * @brief Allocates a buffer for line text.
+ *
+ * @param capacity Bytes needed; rounded up to the block size actually handed out.
+ * @return The buffer, or NULL if memory ran out.
+ */
+static char *line_chars_alloc(int *capacity) {
+    int cls = line_pool_class((size_t)*capacity);
+    if (cls == LINE_POOL_CLASSES) {
+        char *chars = malloc((size_t)*capacity);
+        if (chars != NULL) E.pool.large += (size_t)*capacity;
+        return chars;
+    }
+    *capacity = 1 << (LINE_POOL_MIN_SHIFT + cls);
+    return line_pool_alloc(cls);
+}
+
+/**
+ * @brief Moves line text into a bigger buffer.
+ *
+ * @param chars The current buffer, from line_chars_alloc().
+ * @param old_capacity Its capacity.
+ * @param capacity Bytes needed; rounded up like line_chars_alloc() does.
+ * @param keep Leading bytes of `chars` to carry over.
+ * @return The new buffer, or NULL if memory ran out (`chars` is left alone).
+ */
+static char *line_chars_resize(char *chars, int old_capacity, int *capacity, int keep) {
+    if (old_capacity > LINE_POOL_MAX_BYTES) {
+        char *grown = realloc(chars, (size_t)*capacity);
+        if (grown != NULL) E.pool.large += (size_t)(*capacity - old_capacity);
+        return grown;
+    }
+    char *grown = line_chars_alloc(capacity);
+    if (grown == NULL) return NULL;
+    memcpy(grown, chars, (size_t)keep);
+    line_chars_free(chars, old_capacity);
+    return grown;
+}
+
+/**
+ * @brief Releases a buffer from line_chars_alloc().
+ *
+ * @param chars The buffer, or NULL.
+ * @param capacity Its capacity.
+ */
+static void line_chars_free(char *chars, int capacity) {
+    if (chars == NULL) return;
+    int cls = line_pool_class((size_t)capacity);
+    if (cls == LINE_POOL_CLASSES) {
+        free(chars);
+        E.pool.large -= (size_t)capacity;
+    } else {
+        line_pool_free(chars, cls);
+    }
+}
+
+/**
+ * @brief Makes sure a line's highlight array has room for `bytes` entries.
+ *
+ * Its old contents are not kept; the lexer rewrites the whole array.
+ *
+ * @return The array, or NULL if memory ran out (the old array is left alone).
+ */
+static uint8_t *line_hl_reserve(EditorLine *line, int bytes) {
+    int cls = line_pool_class((size_t)bytes);
+    if (line->hl != NULL && line->hl_class == cls && cls < LINE_POOL_CLASSES) return line->hl;
+    uint8_t *hl = cls < LINE_POOL_CLASSES ? line_pool_alloc(cls) : malloc((size_t)bytes);
+    if (hl == NULL) return NULL;
+    line_hl_free(line);
+    line->hl = hl;
+    line->hl_class = (uint8_t)cls;
+    return hl;
+}
+
+/**
+ * @brief Releases a line's highlight array, if it has one.
+ */
+static void line_hl_free(EditorLine *line) {
+    if (line->hl == NULL) return;
+    if (line->hl_class < LINE_POOL_CLASSES) {
+        line_pool_free(line->hl, line->hl_class);
+    } else {
+        free(line->hl);
+    }
+    line->hl = NULL;
+}
+
+/**
+ * @brief Frees every slab of a pool at once, leaving it empty.
+ *
+ * Blocks still handed out become invalid, so this only runs once the
+ * buffer's lines are gone.
+ */
+static void line_pool_release(LinePool *pool) {
+    LineSlab *slab = pool->slabs;
+    while (slab != NULL) {
+        LineSlab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    memset(pool, 0, sizeof(*pool));
+}
+
+/**
+ * @brief Formats a byte count as B, KB, MB or GB with one decimal.
+ */
+static void memory_format_bytes(char *out, size_t out_size, size_t bytes) {
+    if (bytes < 1024) {
+        snprintf(out, out_size, "%zu B", bytes);
+    } else if (bytes < 1024 * 1024) {
+        snprintf(out, out_size, "%.1f KB", bytes / 1024.0);
+    } else if (bytes < (size_t)1024 * 1024 * 1024) {
+        snprintf(out, out_size, "%.1f MB", bytes / (1024.0 * 1024.0));
+    } else {
+        snprintf(out, out_size, "%.1f GB", bytes / (1024.0 * 1024.0 * 1024.0));
+    }
+}
+
+/**
+ * @brief Shows how much memory the buffer's lines use against what their
+ * pool holds, and the same summed over all open buffers.
+ */
+void editor_show_memory_stats(void) {
+    size_t used = 0, reserved = 0, large = 0, mapped = 0;
+    for (int i = 0; i < E.buffer_count; i++) {
+        const LinePool *pool = i == E.buffer_current ? &E.pool : &E.buffers[i].pool;
+        used += pool->used;
+        reserved += pool->reserved;
+        large += pool->large;
+    }
+    for (const FileMapping *m = E.mappings; m != NULL; m = m->next) {
+        mapped += m->size;
+    }
+
+    char used_s[16], reserved_s[16], large_s[16], mapped_s[16];
+    memory_format_bytes(used_s, sizeof(used_s), E.pool.used);
+    memory_format_bytes(reserved_s, sizeof(reserved_s), E.pool.reserved);
+    memory_format_bytes(large_s, sizeof(large_s), E.pool.large);
+    memory_format_bytes(mapped_s, sizeof(mapped_s), E.map_size);
+    char message[MAX_STATUS_MESSAGE_LENGTH];
+    int len = snprintf(message, sizeof(message), "Lines %s/%s, %d slab%s, %s unpooled, %s mapped",
+                       used_s, reserved_s, E.pool.slab_count, E.pool.slab_count == 1 ? "" : "s",
+                       large_s, mapped_s);
+    if (E.buffer_count > 1 && len > 0 && (size_t)len < sizeof(message)) {
+        memory_format_bytes(used_s, sizeof(used_s), used);
+        memory_format_bytes(reserved_s, sizeof(reserved_s), reserved);
+        memory_format_bytes(large_s, sizeof(large_s), large);
+        memory_format_bytes(mapped_s, sizeof(mapped_s), mapped);
+        snprintf(message + len, sizeof(message) - (size_t)len, " | %d buffers %s/%s, %s, %s",
+                 E.buffer_count, used_s, reserved_s, large_s, mapped_s);
+    }
+    set_status_message("%s", message);
+}
+
+// --- UI Function Implementations ---
+
+/**
+ * @brief Sets a message to be displayed in the status bar.
+ *
+ * The message will be displayed for a short period.
+ *
+ * @param fmt Format string for the message (like printf).
+ * @param ... Variable arguments for the format string.
+ */
+void set_status_message(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(E.status_message, sizeof(E.status_message), fmt, ap);
+    va_end(ap);
+    E.status_message_time = editor_now_ms();
+}
+
+/**
+ * @brief Marks a range of lines as dirty, requiring a redraw.
+ *
+ * Only content changes need this: the renderer repaints the rows under the
+ * old and new cursor positions on its own.
+ *
+ * Also pulls the highlighting frontier back to `start`, so the next refresh
+ * re-checks the edited lines and whatever follows them.
+ *
+ * @param start The starting line index (inclusive).
+ * @param end The ending line index (inclusive).
+ */
+void mark_lines_dirty(int start, int end) {
+    if (start < 0) start = 0;
+    if (end >= E.num_lines) end = E.num_lines - 1;
+
+    if (start < E.hl_frontier) {
+        E.hl_frontier = start;
+    }
+    if (start < E.match_index.scan_from) {
+        E.match_index.scan_from = start;
+    }
+
+    if (E.dirty_line_start == -1 || start < E.dirty_line_start) {
+        E.dirty_line_start = start;
+    }
+    if (end > E.dirty_line_end) {
+        E.dirty_line_end = end;
+    }
+}
+
+/**
+ * @brief Brings highlighting up to date for the lines `first` to `last`.
+ *
+ * Walks forward from the frontier carrying the block comment state. Lines
+ * before `first` only need that state, so they are lexed without keeping a
+ * highlight array. A line is re-lexed only if its text changed since it was
+ * last lexed or it now starts in a different comment state, or if it is
+ * visible and its array was dropped; everything else reuses its cache.
+ *
+ * @param first Index of the first line that must be highlighted.
+ * @param last Index of the last line that must be highlighted.
+ */
+void editor_update_highlighting_range(int first, int last) {
+    if (last >= E.num_lines) last = E.num_lines - 1;
+    if (first < 0) first = 0;
+    if (first > last) return;
+
+    if (E.hl_frontier <= last) {
+        bool in_comment = E.hl_frontier > 0 ? editor_get_line(E.hl_frontier - 1)->hl_comment_out : false;
+        for (int i = E.hl_frontier; i <= last; i++) {
+            EditorLine *line = editor_get_line(i);
+            bool stale = line->hl_lexed_revision != line->hl_revision || line->hl_comment_in != in_comment;
+            if (i < first) {
+                if (stale) update_highlighting_state(line, in_comment);
+            } else if (stale || (E.is_code_file && line->hl == NULL)) {
+                update_highlighting(line, in_comment);
+            }
+            in_comment = line->hl_comment_out;
+        }
+        E.hl_frontier = last + 1;
+    }
+
+    // Lines the frontier had already passed may have had their arrays dropped since
+    E.hl_clock++;
+    for (int i = first; i <= last; i++) {
+        EditorLine *line = editor_get_line(i);
+        if (E.is_code_file && line->hl == NULL) {
+            update_highlighting(line, i > 0 ? editor_get_line(i - 1)->hl_comment_out : false);
+        }
+        int offset;
+        E.chunks[line_index_locate(i, &offset)]->hl_stamp = E.hl_clock;
+    }
+    highlight_cache_trim();
+}
+
+/**
+ * @brief Drops the highlight arrays of the least recently shown chunks until
+ * at most HL_CACHE_LINES lines hold one.
+ *
+ * Chunks highlighted in the current pass are never dropped.
+ */
+static void highlight_cache_trim(void) {
+    while (E.hl_cached_lines > HL_CACHE_LINES) {
+        int oldest = -1;
+        for (int c = 0; c < E.num_chunks; c++) {
+            unsigned stamp = E.chunks[c]->hl_stamp;
+            if (stamp != 0 && stamp != E.hl_clock && (oldest < 0 || stamp < E.chunks[oldest]->hl_stamp)) {
+                oldest = c;
+            }
+        }
+        if (oldest < 0) return;
+
+        LineChunk *chunk = E.chunks[oldest];
+        for (int i = 0; i < chunk->count; i++) {
+            editor_line_drop_highlight(&chunk->lines[i]);
+        }
+        chunk->hl_stamp = 0;
+    }
+}
+
+/**
+ * @brief Writes a run of characters that share one color pair and attribute set.
+ *
+ * @param run The characters to write; need not be NUL-terminated.
+ * @param len Number of wide characters in the run.
+ * @param color_pair The ncurses color pair for the whole run.
+ * @param attrs Extra attributes (e.g. A_REVERSE) for the whole run.
+ */
+static void emit_highlight_run(const wchar_t *run, int len, int color_pair, int attrs) {
+    if (len <= 0) return;
+    attron(COLOR_PAIR(color_pair) | attrs);
+    waddnwstr(stdscr, run, len);
+    attroff(COLOR_PAIR(color_pair) | attrs);
+}
+
+
+/**
+ * @brief Maps a HighlightType to its corresponding ncurses color pair.
+ *
+ * @param type The HighlightType enum value.
+ * @return The ncurses color pair ID.
+ */
+static int get_color_pair_for_highlight_type(HighlightType type) {
+    switch (type) {
+        case HL_COMMENT: return COLOR_PAIR_COMMENT;
+        case HL_STRING: return COLOR_PAIR_STRING;
+        case HL_NUMBER: return COLOR_PAIR_NUMBER;
+        case HL_OPERATOR: return COLOR_PAIR_OPERATOR;
+        case HL_KEYWORD: return COLOR_PAIR_KEYWORD;
+        default: return COLOR_PAIR_DEFAULT;
+    }
+}
+
+/**
+ * @brief Draws a single line of text to the ncurses window with syntax highlighting.
+ *
+ * @param line Pointer to the EditorLine to highlight.
+ * @param line_idx The 0-indexed index of the current line being drawn.
+ * @param screen_y The screen row where this line should be drawn.
+ * @param line_num_offset_x The horizontal offset for the actual line content due to line numbers.
+ */
+void editor_draw_line_highlighted(EditorLine *line, int line_idx, int screen_y, int line_num_offset_x) {
+    wmove(stdscr, screen_y, BORDER_WIDTH + line_num_offset_x);
+
+    // First character that reaches past the left edge, and the column it starts at
+    int chars_skipped = editor_row_rx_to_cx(line, E.scroll_x);
+    int rendered_x_at_scroll = editor_row_cx_to_rx(line, chars_skipped);
+
+    int current_render_x = rendered_x_at_scroll - E.scroll_x;
+    int editor_content_cols = E.screen_cols - 2 * BORDER_WIDTH;
+    if (E.show_line_numbers) {
+        editor_content_cols -= (snprintf(NULL, 0, "%d", E.num_lines > 0 ? E.num_lines : 1) + 1);
+    }
+
+    // Selected columns of this line, [sel_from, sel_to)
+    int sel_from = 0, sel_to = 0;
+    if (E.visual_mode) {
+        int sy, sx, ey, ex;
+        get_normalized_selection_coords(&sy, &sx, &ey, &ex);
+        if (line_idx >= sy && line_idx <= ey) {
+            sel_from = (line_idx == sy) ? sx : 0;
+            sel_to = (line_idx == ey) ? ex : line->size;
+        }
+    }
+
+    // Characters are decoded from UTF-8 and batched while the color and
+    // attributes stay the same
+    wchar_t run[256];
+    int run_len = 0;
+    int run_pair = COLOR_PAIR_DEFAULT;
+    int run_attrs = A_NORMAL;
+
+    int rx = rendered_x_at_scroll;
+    int i = chars_skipped;
+    while (i < line->size && current_render_x < editor_content_cols) {
+        int len;
+        int width = line_char_width(line, i, rx, &len);
+        uint32_t cp = (unsigned char)line->chars[i];
+        if (cp >= 0x80) {
+            utf8_decode(&line->chars[i], line->size - i, &cp);
+            if (wcwidth((wchar_t)cp) < 0) cp = 0xfffd;
+        }
+
+        if (width == 0) {
+            // A combining mark goes into the cell of the character before it
+            if (run_len > 0 && run_len < (int)(sizeof(run) / sizeof(run[0]))) {
+                run[run_len++] = (wchar_t)cp;
+            }
+            i += len;
+            continue;
+        }
+
+        int color_pair = get_color_pair_for_highlight_type(line->hl ? line->hl[i] : HL_NORMAL);
+        int attrs = A_NORMAL;
+        if (i >= sel_from && i < sel_to) {
+            color_pair = COLOR_PAIR_SELECTION;
+        }
+        bool is_cursor = (line_idx == E.cursor_y && i == E.cursor_x);
+
+        // Tabs, and wide characters cut off by either edge, become blanks
+        int cells = width;
+        if (current_render_x < 0) cells += current_render_x;
+        if (current_render_x + width > editor_content_cols) cells = editor_content_cols - current_render_x;
+        bool blank = cp == '\t' || cells < width;
+
+        for (int k = 0; k < (blank ? cells : 1); k++) {
+            int cell_pair = color_pair;
+            int cell_attrs = attrs;
+            if (is_cursor && k == 0) {
+                cell_pair = COLOR_PAIR_CURSOR;
+                cell_attrs = A_REVERSE;
+            }
+            if (cell_pair != run_pair || cell_attrs != run_attrs || run_len == (int)(sizeof(run) / sizeof(run[0]))) {
+                emit_highlight_run(run, run_len, run_pair, run_attrs);
+                run_len = 0;
+                run_pair = cell_pair;
+                run_attrs = cell_attrs;
+            }
+            run[run_len++] = blank ? L' ' : (wchar_t)cp;
+        }
+        current_render_x += width;
+        rx += width;
+        i += len;
+    }
+    emit_highlight_run(run, run_len, run_pair, run_attrs);
+
+    if (line_idx == E.cursor_y && E.cursor_x == line->size && current_render_x < editor_content_cols) {
+        emit_highlight_run(L" ", 1, COLOR_PAIR_CURSOR, A_REVERSE);
+        current_render_x++;
+    }
+
+    if (current_render_x < editor_content_cols) {
+        whline(stdscr, ' ', editor_content_cols - current_render_x);
+    }
+}
+
+/**
+ * @brief Clears the suggestion area at the bottom of the screen.
+ */
+void clear_suggestion_area(void) {
+    int start_y = E.screen_rows + BORDER_WIDTH;
+    for (int y = 0; y < SUGGESTION_ROWS; y++) {
+        mvhline(start_y + y, 0, ' ', (chtype)(E.screen_cols + 2 * BORDER_WIDTH));
+    }
+}
+
+/**
+ * @brief Displays command suggestions in a dedicated area.
+ */
+void show_command_suggestions(void) {
+    clear_suggestion_area();
+    int start_y = E.screen_rows + BORDER_WIDTH;
+    wattron(stdscr, COLOR_PAIR(COLOR_PAIR_SUGGESTIONS));
+
+    mvprintw(start_y, BORDER_WIDTH, "Suggestions:");
+
+    SuggestionLayout layout = { start_y, BORDER_WIDTH, start_y + 1 };
+    command_table_visit_prefix(E.cmd.sequence, draw_command_suggestion, &layout);
+
+    wattroff(stdscr, COLOR_PAIR(COLOR_PAIR_SUGGESTIONS));
+}
+
+/**
+ * @brief Draws one entry of the suggestion list; command_table_visit_prefix() callback.
+ *
+ * @param entry The command or macro to show.
+ * @param ctx The SuggestionLayout being filled.
+ * @return false once the suggestion area is full.
+ */
+static bool draw_command_suggestion(const CommandTrieNode *entry, void *ctx) {
+    SuggestionLayout *layout = ctx;
+    char buffer[MAX_STATUS_MESSAGE_LENGTH];
+    if (entry->command) {
+        snprintf(buffer, sizeof(buffer), "%s (%s)", entry->command->sequence, entry->command->description);
+    } else {
+        snprintf(buffer, sizeof(buffer), "%s ('%s')", E.macros[entry->macro].sequence, E.macros[entry->macro].action);
+    }
+    int len = (int)strlen(buffer);
+    if (layout->col + len + 2 > E.screen_cols + BORDER_WIDTH) {
+        layout->row++;
+        layout->col = BORDER_WIDTH;
+        if (layout->row >= layout->start_y + SUGGESTION_ROWS) return false;
+    }
+    mvprintw(layout->row, layout->col, "%s  ", buffer);
+    layout->col += len + 2;
+    return true;
+}
 
 /**
  * @brief Draws the UI hints panel at the bottom of the screen.
@@ -1232,7 +4030,7 @@ void editor_draw_hints(void) {
         hints_line2 = "Visual Mode ON. Move cursor to select.";
     } else {
         // Updated hints for normal mode
-        hints_line1 = "^S Save | ^O Open | ^F Find | ^\\ Cmd | ^Q Quit | ^H Help"; // Changed ^J to ^\
+        hints_line1 = "^S Save | ^O Open | ^F Find | ^\\ Cmd | ^Q Quit | ^H Help"; // Changed from ^J
         hints_line2 = "^C Copy | ^X Cut | ^P Paste | ^Z Undo | ^Y Redo | ^A Select All";
     }
     
@@ -1243,15 +4041,56 @@ void editor_draw_hints(void) {
 }
 
 
+/**
+ * @brief Draws one row of the text area.
+ *
+ * @param y The row index inside the text area (0 is the first line below the border).
+ * @param line_num_width Width of the line number gutter, 0 if hidden.
+ */
+static void editor_draw_row(int y, int line_num_width) {
+    int file_line_idx = y + E.scroll_y;
+    int screen_y = y + BORDER_WIDTH;
+
+    // Rows exposed by wscrl() come in blank, border included
+    mvaddch(screen_y, 0, ACS_VLINE | COLOR_PAIR(COLOR_PAIR_BORDER));
+    mvaddch(screen_y, E.screen_cols - 1, ACS_VLINE | COLOR_PAIR(COLOR_PAIR_BORDER));
+    mvhline(screen_y, BORDER_WIDTH, ' ', (chtype)(E.screen_cols - 2 * BORDER_WIDTH));
+
+    if (file_line_idx < E.num_lines) {
+        EditorLine *current_line = editor_get_line(file_line_idx);
+
+        if (E.show_line_numbers) {
+            wattron(stdscr, COLOR_PAIR(COLOR_PAIR_DEFAULT));
+            mvprintw(screen_y, BORDER_WIDTH, "%*d ", line_num_width - 1, file_line_idx + 1);
+            wattroff(stdscr, COLOR_PAIR(COLOR_PAIR_DEFAULT));
+        }
+
+        editor_draw_line_highlighted(current_line, file_line_idx, screen_y, line_num_width);
+    } else {
+        wattron(stdscr, COLOR_PAIR(COLOR_PAIR_DEFAULT));
+        mvaddch(screen_y, BORDER_WIDTH + line_num_width, '~');
+        wattroff(stdscr, COLOR_PAIR(COLOR_PAIR_DEFAULT));
+    }
+}
+
 /**
  * @brief Draws the main editor content to the screen.
  *
- * Clears the screen, draws visible lines with highlighting, and then draws
- * the status bar. Optimizes by redrawing only dirty lines.
+ * Only the damaged part of the text area is repainted: rows of lines marked
+ * dirty, the rows the cursor left and entered, and rows exposed by scrolling.
+ * A vertical scroll by less than a page shifts the existing rows with wscrl(),
+ * which ncurses turns into a terminal scrolling region. Everything is redrawn
+ * after a resize, a horizontal scroll or while a selection is shown.
  */
 void editor_refresh_screen(void) {
+    if (E.replay.active || (E.headless && !E.offscreen)) return; // Drawn once when the replay ends
+    double refresh_start = editor_now_ms();
+    if (E.latency.frame_open) {
+        E.latency.edit_ms = refresh_start - E.latency.key_ms - E.latency.input_ms;
+    }
     getmaxyx(stdscr, E.total_screen_rows, E.screen_cols);
     E.screen_rows = E.total_screen_rows - HINT_ROWS - 1 - SUGGESTION_ROWS - 2 * BORDER_WIDTH;
+    editor_load_through((E.cursor_y > E.scroll_y ? E.cursor_y : E.scroll_y) + E.screen_rows);
     
     int line_num_width = 0;
     if (E.show_line_numbers) {
@@ -1270,7 +4109,7 @@ void editor_refresh_screen(void) {
 
     int rx = 0;
     if (E.cursor_y < E.num_lines) {
-        rx = editor_row_cx_to_rx(&E.lines[E.cursor_y], E.cursor_x);
+        rx = editor_row_cx_to_rx(editor_get_line(E.cursor_y), E.cursor_x);
     }
     if (rx < E.scroll_x) {
         E.scroll_x = rx;
@@ -1279,46 +4118,82 @@ void editor_refresh_screen(void) {
         E.scroll_x = rx - editor_content_cols + 1;
     }
 
-    wattron(stdscr, COLOR_PAIR(COLOR_PAIR_BORDER));
-    box(stdscr, 0, 0);
-    wattroff(stdscr, COLOR_PAIR(COLOR_PAIR_BORDER));
-
+    int scroll_delta = E.scroll_y - E.drawn_scroll_y;
+    bool full = E.full_redraw ||
+                E.screen_rows != E.drawn_screen_rows || E.screen_cols != E.drawn_screen_cols ||
+                E.scroll_x != E.drawn_scroll_x || line_num_width != E.drawn_line_num_width ||
+                E.visual_mode || E.drawn_visual_mode ||
+                abs(scroll_delta) >= E.screen_rows;
 
-    E.in_multiline_comment_global = false;
-    for (int i = 0; i < E.scroll_y; i++) {
-        if (i < E.num_lines) {
-             update_highlighting(&E.lines[i]);
-        }
+    if (full) {
+        wattron(stdscr, COLOR_PAIR(COLOR_PAIR_BORDER));
+        box(stdscr, 0, 0);
+        wattroff(stdscr, COLOR_PAIR(COLOR_PAIR_BORDER));
     }
 
-    for (int y = 0; y < E.screen_rows; y++) {
-        int file_line_idx = y + E.scroll_y;
-        int screen_y = y + BORDER_WIDTH;
-
-        mvhline(screen_y, BORDER_WIDTH, ' ', (chtype)(E.screen_cols - 2 * BORDER_WIDTH));
+    double highlight_start = editor_now_ms();
+    editor_update_highlighting_range(E.scroll_y, E.scroll_y + E.screen_rows - 1);
+    double highlight_ms = editor_now_ms() - highlight_start;
 
-        if (file_line_idx < E.num_lines) {
-            const EditorLine *current_line = &E.lines[file_line_idx];
+    if (full) {
+        for (int y = 0; y < E.screen_rows; y++) {
+            editor_draw_row(y, line_num_width);
+        }
+    } else {
+        if (scroll_delta != 0) {
+            wsetscrreg(stdscr, BORDER_WIDTH, BORDER_WIDTH + E.screen_rows - 1);
+            scrollok(stdscr, TRUE);
+            wscrl(stdscr, scroll_delta);
+            scrollok(stdscr, FALSE);
+            wsetscrreg(stdscr, 0, E.total_screen_rows - 1);
+
+            int first = scroll_delta > 0 ? E.screen_rows - scroll_delta : 0;
+            int last = scroll_delta > 0 ? E.screen_rows - 1 : -scroll_delta - 1;
+            for (int y = first; y <= last; y++) {
+                editor_draw_row(y, line_num_width);
+            }
+        }
 
-            if (E.show_line_numbers) {
-                wattron(stdscr, COLOR_PAIR(COLOR_PAIR_DEFAULT));
-                mvprintw(screen_y, BORDER_WIDTH, "%*d ", line_num_width - 1, file_line_idx + 1);
-                wattroff(stdscr, COLOR_PAIR(COLOR_PAIR_DEFAULT));
+        int damage_start = E.dirty_line_start;
+        int damage_end = E.dirty_line_end;
+        // Lines were added or removed: everything below may have shifted
+        if (damage_start != -1 && E.num_lines != E.drawn_num_lines) {
+            damage_end = E.scroll_y + E.screen_rows - 1;
+        }
+        if (damage_start != -1) {
+            int first = damage_start > E.scroll_y ? damage_start - E.scroll_y : 0;
+            int last = damage_end - E.scroll_y;
+            if (last >= E.screen_rows) last = E.screen_rows - 1;
+            for (int y = first; y <= last; y++) {
+                editor_draw_row(y, line_num_width);
             }
+        }
 
-            editor_draw_line_highlighted(current_line, file_line_idx, screen_y, line_num_width);
-        } else {
-            wattron(stdscr, COLOR_PAIR(COLOR_PAIR_DEFAULT));
-            mvaddch(screen_y, BORDER_WIDTH + line_num_width, '~');
-            wattroff(stdscr, COLOR_PAIR(COLOR_PAIR_DEFAULT));
+        int cursor_rows[2] = { E.drawn_cursor_y - E.scroll_y, E.cursor_y - E.scroll_y };
+        for (int i = 0; i < 2; i++) {
+            if (cursor_rows[i] >= 0 && cursor_rows[i] < E.screen_rows) {
+                editor_draw_row(cursor_rows[i], line_num_width);
+            }
         }
     }
 
+    E.full_redraw = false;
+    E.drawn_scroll_y = E.scroll_y;
+    E.drawn_scroll_x = E.scroll_x;
+    E.drawn_cursor_y = E.cursor_y;
+    E.drawn_num_lines = E.num_lines;
+    E.drawn_line_num_width = line_num_width;
+    E.drawn_screen_rows = E.screen_rows;
+    E.drawn_screen_cols = E.screen_cols;
+    E.drawn_visual_mode = E.visual_mode;
+
     E.dirty_line_start = -1;
     E.dirty_line_end = -1;
 
     if (E.cmd.active && !E.cmd.show_help) {
         show_command_suggestions();
+    } else if (E.project.list_open) {
+        project_draw_list();
     } else {
         clear_suggestion_area();
     }
@@ -1329,7 +4204,9 @@ void editor_refresh_screen(void) {
     wattron(stdscr, COLOR_PAIR(COLOR_PAIR_STATUS_BAR));
     mvhline(status_bar_y, 0, ' ', (chtype)(E.screen_cols + 2 * BORDER_WIDTH));
     
-    if (E.cmd.active) {
+    if (E.project.list_open) {
+        project_draw_status(status_bar_y);
+    } else if (E.cmd.active) {
         if (E.cmd.show_help) {
             // Help screen is handled separately
         } else if (E.creative_mode) {
@@ -1346,22 +4223,52 @@ void editor_refresh_screen(void) {
             mvprintw(status_bar_y, BORDER_WIDTH, "%.20s | %s %s", 
                     E.filename ? E.filename : "[New]",
                     E.dirty ? "***" : "",
-                    E.is_code_file ? "</>" : "TXT");
+                    E.is_code_file ? E.syntax->def->name : "TXT");
         }
-    }
-
+        if (E.buffer_count > 1) {
+            printw(" | buffer %d/%d", E.buffer_current + 1, E.buffer_count);
+        }
+        if (E.search_regex) {
+            printw(" | regex");
+        }
+        if (editor_load_pending()) {
+            printw(" | indexing %d%%", (int)(E.map_indexed * 100 / E.map_size));
+        }
+        if (E.project.running && !E.project.replacing) {
+            pthread_mutex_lock(&E.project.lock);
+            printw(" | project search %ld matches", E.project.total_matches);
+            pthread_mutex_unlock(&E.project.lock);
+        }
+        if (match_index_active()) {
+            int nth, total;
+            bool complete = match_index_position(E.last_search_found_y, E.last_search_found_x, &nth, &total);
+            if (nth > 0) {
+                printw(" | %d of %d%s", nth, total, complete ? "" : "+");
+            } else {
+                printw(" | ? of %d+", total);
+            }
+        }
+    }
+
     char msg[MAX_STATUS_MESSAGE_LENGTH];
-    if (time(NULL) - E.status_message_time < 5) {
+    if (editor_now_ms() - E.status_message_time < STATUS_MESSAGE_MS) {
         snprintf(msg, sizeof(msg), "%s", E.status_message);
     } else {
         msg[0] = '\0';
     }
-    mvprintw(status_bar_y, E.screen_cols + 2 * BORDER_WIDTH - (int)strlen(msg) - BORDER_WIDTH, "%s", msg);
+    // Right-align the message, but never start it left of the border: a long
+    // prompt (the recent file list) would otherwise land off screen entirely.
+    int msg_x = E.screen_cols + 2 * BORDER_WIDTH - (int)strlen(msg) - BORDER_WIDTH;
+    mvprintw(status_bar_y, msg_x < BORDER_WIDTH ? BORDER_WIDTH : msg_x, "%s", msg);
     wattroff(stdscr, COLOR_PAIR(COLOR_PAIR_STATUS_BAR));
 
+    if (E.latency.overlay) {
+        latency_draw_overlay();
+    }
+
     int cursor_screen_y = E.cursor_y - E.scroll_y + BORDER_WIDTH;
     int cursor_screen_x = editor_row_cx_to_rx(
-        (E.cursor_y < E.num_lines ? &E.lines[E.cursor_y] : NULL), E.cursor_x) - E.scroll_x + BORDER_WIDTH;
+        (E.cursor_y < E.num_lines ? editor_get_line(E.cursor_y) : NULL), E.cursor_x) - E.scroll_x + BORDER_WIDTH;
     
     if (E.show_line_numbers) {
         cursor_screen_x += line_num_width;
@@ -1373,7 +4280,18 @@ void editor_refresh_screen(void) {
         show_command_help_screen();
     }
 
+    // Sent now rather than by the next getch(), which would flush anything
+    // drawn since and defeat the frame cap
+    wnoutrefresh(stdscr);
     doupdate();
+    E.drawn_ms = editor_now_ms();
+
+    if (E.latency.frame_open) {
+        E.latency.highlight_start_ms = highlight_start;
+        E.latency.highlight_ms = highlight_ms;
+        E.latency.draw_ms = editor_now_ms() - refresh_start - highlight_ms;
+        latency_frame_end();
+    }
 }
 
 /**
@@ -1409,10 +4327,13 @@ char *editor_prompt(const char *prompt_msg, char *buffer, size_t buf_size) {
             if (was_creative_mode) E.creative_mode = true;
             return NULL;
         } else if (c == KEY_BACKSPACE || c == 127) {
-            if (i > 0) {
-                buffer[--i] = '\0';
+            // Removes a whole UTF-8 character
+            while (i > 0) {
+                unsigned char removed = (unsigned char)buffer[--i];
+                buffer[i] = '\0';
+                if ((removed & 0xc0) != 0x80) break;
             }
-        } else if (isprint(c) && (size_t)i < buf_size - 1) {
+        } else if ((isprint(c) || (c >= 0x80 && c <= 0xff)) && (size_t)i < buf_size - 1) {
             buffer[i++] = (char)c;
             buffer[i] = '\0';
         }
@@ -1470,13 +4391,53 @@ void display_loading_screen(void) {
  */
 void editor_set_file_type(bool is_code) {
     E.is_code_file = is_code;
+    E.syntax = is_code ? syntax_language_for(E.filename) : NULL;
+    for (int i = 0; i < E.num_lines; i++) {
+        editor_get_line(i)->hl_lexed_revision = -1;
+    }
     mark_lines_dirty(0, E.num_lines - 1);
 }
 
+/**
+ * @brief Guesses from a file name whether it holds source code.
+ *
+ * @param filename The file name, or NULL for an unnamed buffer.
+ * @return true for a known source extension or build file name, false otherwise.
+ */
+bool editor_infer_file_type(const char *filename) {
+    static const char *code_extensions[] = {
+        "c", "h", "cc", "cpp", "cxx", "hh", "hpp", "hxx", "m", "mm", "cs", "java", "kt",
+        "scala", "swift", "go", "rs", "zig", "py", "rb", "pl", "php", "lua", "js", "mjs",
+        "ts", "jsx", "tsx", "sh", "bash", "zsh", "sql", "css", "html", "xml", "json",
+        "yaml", "yml", "toml", "mk", "cmake",
+    };
+    static const char *code_names[] = { "Makefile", "GNUmakefile", "CMakeLists.txt", "Dockerfile" };
+
+    if (!filename) return false;
+    const char *base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+
+    for (size_t i = 0; i < sizeof(code_names) / sizeof(code_names[0]); i++) {
+        if (strcmp(base, code_names[i]) == 0) return true;
+    }
+    const char *dot = strrchr(base, '.');
+    if (!dot || dot == base) return false;
+    for (size_t i = 0; i < sizeof(code_extensions) / sizeof(code_extensions[0]); i++) {
+        if (strcasecmp(dot + 1, code_extensions[i]) == 0) return true;
+    }
+    return false;
+}
+
 /**
  * @brief Prompts the user to choose between code or plain text file type.
+ *
+ * In fast-start and batch mode the type is inferred from the file name instead.
  */
 void prompt_file_type(void) {
+    if (E.headless || E.fast_start) {
+        editor_set_file_type(editor_infer_file_type(E.filename));
+        return;
+    }
     char choice_buf[MAX_STATUS_MESSAGE_LENGTH];
     char *result = editor_prompt("Is this a code file (C/Python/JS etc.) or plain text? (C/T): %s", choice_buf, sizeof(choice_buf));
     
@@ -1493,6 +4454,7 @@ void prompt_file_type(void) {
  * @brief Displays a full-screen help message.
  */
 void show_command_help_screen(void) {
+    if (E.headless) return;
     clear();
     wattron(stdscr, COLOR_PAIR(COLOR_PAIR_HINTS));
     
@@ -1519,7 +4481,7 @@ void show_command_help_screen(void) {
 
     mvprintw(row++, col, "Quick Commands (Ctrl+Key):");
     mvprintw(row++, col, "  Ctrl+S: Save current file");
-    mvprintw(row++, col, "  Ctrl+O: Open file");
+    mvprintw(row++, col, "  Ctrl+O: Open file in a new buffer");
     mvprintw(row++, col, "  Ctrl+Q: Quit (with confirmation)");
     mvprintw(row++, col, "  Ctrl+F: Find text");
     mvprintw(row++, col, "  Ctrl+G: Go to Line Number");
@@ -1527,7 +4489,7 @@ void show_command_help_screen(void) {
     mvprintw(row++, col, "  Ctrl+V: Toggle Visual (Selection) Mode");
     mvprintw(row++, col, "  Ctrl+C: Copy selected text/current line");
     mvprintw(row++, col, "  Ctrl+X: Cut selected text/current line");
-    mvprintw(row++, col, "  Ctrl+P: Paste text");
+    mvprintw(row++, col, "  Ctrl+P: Paste text; Ctrl+\\ PR pastes an older copy (registers 0-9)");
     mvprintw(row++, col, "  Ctrl+Z: Undo last action");
     mvprintw(row++, col, "  Ctrl+Y: Redo last undone action");
     mvprintw(row++, col, "  Ctrl+H: Show this Help screen");
@@ -1545,13 +4507,17 @@ void show_command_help_screen(void) {
     mvprintw(row++, col, "  FN: Find Next occurrence");
     mvprintw(row++, col, "  FP: Find Previous occurrence");
     mvprintw(row++, col, "  R: Find & Replace");
+    mvprintw(row++, col, "  G: Go to Line Number");
     mvprintw(row++, col, "  I: Show File Info");
     mvprintw(row++, col, "  DU: Duplicate Current Line");
     mvprintw(row++, col, "  DL: Delete Current Line");
     mvprintw(row++, col, "  UL: Uppercase Current Line");
     mvprintw(row++, col, "  LL: Lowercase Current Line");
     mvprintw(row++, col, "  LN: Toggle Line Numbers");
-    mvprintw(row++, col, "  R: Show Recently Opened Files");
+    mvprintw(row++, col, "  RF: Show Recently Opened Files");
+    mvprintw(row++, col, "  RL: Reload File from disk");
+    mvprintw(row++, col, "  BN/BP: Next/Previous Buffer; BL: Buffer List; BC: Close Buffer");
+    mvprintw(row++, col, "  MS: Show Line Memory Statistics");
     mvprintw(row++, col, "  QW: Quit Without Save (force)");
     mvprintw(row++, col, "  KN: Set Keyboard Mode Normal (WASD inserts)");
     mvprintw(row++, col, "  TC: Set File Type to Code");
@@ -1564,6 +4530,8 @@ void show_command_help_screen(void) {
     mvprintw(row++, col, "  Example: Type Ctrl+\\, then 'Q', then '::', then 'quit_confirm'.");
     mvprintw(row++, col, "  Now 'Ctrl+\\ Q' will prompt to quit with confirmation.");
     mvprintw(row++, col, "  Available actions for macros: 'upper', 'lower', 'duplicate', 'quit_confirm', 'save_file'.");
+    mvprintw(row++, col, "  MR: Start/stop recording keystrokes; MP: replay them N times or over lines first-last.");
+    mvprintw(row++, col, "  The action 'recorded' binds the last recording to the sequence.");
     row++;
 
     mvprintw(row++, col, "Press any key to return to editor...");
@@ -1571,6 +4539,7 @@ void show_command_help_screen(void) {
     wrefresh(stdscr);
     getch();
     clear();
+    E.full_redraw = true;
     E.cmd.show_help = false;
 }
 
@@ -1589,1681 +4558,7451 @@ void reset_command_mode(void) {
     set_status_message("");
 }
 
+// --- Command Table Implementation ---
+//
+// Built-in commands and user macros share one trie keyed on the case-folded
+// command sequence, so dispatch, Tab completion and the suggestion list all
+// resolve a sequence or prefix in O(sequence length).
+
 /**
- * @brief Executes a custom action string for a macro.
- * This function maps action strings to editor functions.
- *
- * @param action The string representing the action to perform.
+ * @brief Command handler: sets the keyboard mode to normal.
  */
-void execute_custom_command(const char* action) {
-    if (strcmp(action, "upper") == 0) {
-        editor_change_line_case(true);
-    } else if (strcmp(action, "lower") == 0) {
-        editor_change_line_case(false);
-    } else if (strcmp(action, "duplicate") == 0) {
-        editor_duplicate_line();
-    } else if (strcmp(action, "quit_confirm") == 0) {
-        editor_quit(false);
-    } else if (strcmp(action, "save_file") == 0) {
-        editor_save_file();
-    }
-    else {
-        set_status_message("Macro action '%s' executed (placeholder).", action);
-    }
+static void command_keyboard_normal(void) {
+    editor_set_keyboard_mode(NORMAL_KB_MODE);
+    set_status_message("Keyboard Mode: Normal.");
 }
 
 /**
- * @brief Executes the command sequence currently stored in E.cmd.sequence.
- * This is the core logic of the "Command Puzzle System".
+ * @brief Command handler: switches the file type to code.
  */
-void execute_command_sequence(void) {
-    char *seq = E.cmd.sequence;
-    
-    if (E.cmd.length == 0) {
-        set_status_message("Commands: S=Save, QW=QuitWithoutSave, SA=SaveAs, F=Find, ... (Tab:list)");
-        return;
-    }
+static void command_text_to_code(void) {
+    editor_set_file_type(true);
+    set_status_message("File type changed to: Code.");
+}
 
-    if (strcmp(seq, "::") == 0) {
-        enter_creative_mode();
-        return;
-    } else if (strcmp(seq, "?") == 0) {
-        E.cmd.show_help = !E.cmd.show_help;
-        return;
-    } else if (strcasecmp(seq, "KN") == 0) {
-        editor_set_keyboard_mode(NORMAL_KB_MODE);
-        set_status_message("Keyboard Mode: Normal.");
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "TC") == 0) {
-        editor_set_file_type(true);
-        set_status_message("File type changed to: Code.");
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "CT") == 0) {
-        editor_set_file_type(false);
-        set_status_message("File type changed to: Text.");
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "h") == 0) {
-        editor_move_cursor(KEY_LEFT);
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "j") == 0) {
-        editor_move_cursor(KEY_DOWN);
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "k") == 0) {
-        editor_move_cursor(KEY_UP);
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "l") == 0) {
-        editor_move_cursor(KEY_RIGHT);
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "I") == 0) {
-        editor_show_file_info();
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "FN") == 0) {
-        editor_find_next();
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "FP") == 0) {
-        editor_find_prev();
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "DU") == 0) {
-        editor_duplicate_line();
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "DL") == 0) { // New: Delete Line
-        if (E.num_lines > 1) {
-            char *deleted_content = strdup(E.lines[E.cursor_y].chars);
-            UndoAction ua = {
-                .type = UNDO_DELETE_BLOCK,
-                .y = E.cursor_y,
-                .x = 0,
-                .char_val = '\0',
-                .text_content = deleted_content,
-                .text_len = (int)strlen(deleted_content),
-                .num_lines_affected = 1
-            };
-            push_undo_action(ua);
-            editor_delete_line(E.cursor_y);
-            if (E.cursor_y >= E.num_lines && E.num_lines > 0) {
-                E.cursor_y = E.num_lines - 1;
-                E.cursor_x = E.lines[E.cursor_y].size;
-            } else if (E.num_lines == 0) {
-                editor_insert_line(0, "", 0); // Ensure at least one line
-                E.cursor_y = 0;
-                E.cursor_x = 0;
-            }
-            set_status_message("Line deleted.");
-        } else {
-            set_status_message("Cannot delete the last line.");
-        }
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "UL") == 0) {
-        editor_change_line_case(true);
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "LL") == 0) {
-        editor_change_line_case(false);
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "LN") == 0) {
-        editor_toggle_line_numbers();
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "R") == 0) {
-        editor_show_recent_files();
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "Z") == 0) {
-        editor_undo();
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "Y") == 0) {
-        editor_redo();
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "S") == 0) { // Added simple 'S' command for Save
-        editor_save_file();
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "SA") == 0) { // Save As
-        editor_save_as();
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "F") == 0) { // Find (initiate search)
-        editor_find();
-        reset_command_mode();
-        return;
-    } else if (strcasecmp(seq, "R") == 0) { // Replace
-        editor_find_replace();
-        reset_command_mode();
-        return;
-    }
+/**
+ * @brief Command handler: switches the file type to text.
+ */
+static void command_code_to_text(void) {
+    editor_set_file_type(false);
+    set_status_message("File type changed to: Text.");
+}
+
+/**
+ * @brief Command handler: moves the cursor left.
+ */
+static void command_move_left(void) {
+    editor_move_cursor(KEY_LEFT);
+}
 
+/**
+ * @brief Command handler: moves the cursor down.
+ */
+static void command_move_down(void) {
+    editor_move_cursor(KEY_DOWN);
+}
 
-    for (int i = 0; i < E.macro_count; i++) {
-        if (strcmp(seq, E.macros[i].sequence) == 0) {
-            execute_custom_command(E.macros[i].action);
-            reset_command_mode();
-            return;
+/**
+ * @brief Command handler: moves the cursor up.
+ */
+static void command_move_up(void) {
+    editor_move_cursor(KEY_UP);
+}
+
+/**
+ * @brief Command handler: moves the cursor right.
+ */
+static void command_move_right(void) {
+    editor_move_cursor(KEY_RIGHT);
+}
+
+/**
+ * @brief Command handler: deletes the current line, keeping at least one.
+ */
+static void command_delete_line(void) {
+    if (E.num_lines > 1) {
+        push_line_delete_undo(E.cursor_y);
+        editor_delete_line(E.cursor_y);
+        if (E.cursor_y >= E.num_lines && E.num_lines > 0) {
+            E.cursor_y = E.num_lines - 1;
+            E.cursor_x = editor_get_line(E.cursor_y)->size;
+        } else if (E.num_lines == 0) {
+            editor_insert_line(0, "", 0); // Ensure at least one line
+            E.cursor_y = 0;
+            E.cursor_x = 0;
+        } else if (E.cursor_x > editor_get_line(E.cursor_y)->size) {
+            E.cursor_x = editor_get_line(E.cursor_y)->size;
         }
+        set_status_message("Line deleted.");
+    } else {
+        set_status_message("Cannot delete the last line.");
     }
+}
 
-    if (strcasecmp(seq, "QW") == 0) {
-        editor_quit(true);
-    }
-    else {
-        set_status_message("Unknown command: Ctrl+\\ %s. Press ':' to save as macro.", seq);
-    }
+/**
+ * @brief Command handler: shows or hides the frame time overlay.
+ */
+static void command_latency_overlay(void) {
+    E.latency.overlay = !E.latency.overlay;
+    E.full_redraw = true; // Restores the top border when the overlay goes away
+    set_status_message("Profile overlay %s.", E.latency.overlay ? "on" : "off");
 }
 
 /**
- * @brief Handles input when in command puzzle mode.
- *
- * @param key The key pressed.
+ * @brief Command handler: uppercases the current line.
  */
-void handle_command_mode_input(int key) {
-    if (time(NULL) - E.cmd.last_key_time > (COMMAND_TIMEOUT_MS / 1000.0)) {
-        set_status_message("Command timeout.");
-        reset_command_mode();
-        return;
-    }
+static void command_upper_line(void) {
+    editor_change_line_case(true);
+}
 
-    if (key == ':' && E.cmd.length > 0) {
-        enter_creative_mode();
-        return;
-    }
+/**
+ * @brief Command handler: lowercases the current line.
+ */
+static void command_lower_line(void) {
+    editor_change_line_case(false);
+}
 
-    if (key == '\t') {
-        autocomplete_command(); // Call autocomplete on Tab
-        E.cmd.last_key_time = time(NULL);
-        return;
-    }
+/**
+ * @brief Command handler: quits without saving.
+ */
+static void command_quit_force(void) {
+    editor_quit(true);
+}
 
-    if (isprint(key) && E.cmd.length < MAX_COMMAND_SEQUENCE_LENGTH - 1) {
-        E.cmd.sequence[E.cmd.length++] = (char)key;
-        E.cmd.sequence[E.cmd.length] = '\0';
-        E.cmd.last_key_time = time(NULL);
-        // Do not execute_command_sequence here, only after full command or Enter
-        // This allows multi-character commands to be built
-    } else if (key == KEY_ENTER || key == '\n') {
-        execute_command_sequence(); // Execute on Enter
-        reset_command_mode(); // Reset after execution
-    }
-    else if (key == KEY_BACKSPACE || key == 127) { // Handle backspace in command mode
-        if (E.cmd.length > 0) {
-            E.cmd.length--;
-            E.cmd.sequence[E.cmd.length] = '\0';
-            E.cmd.last_key_time = time(NULL);
-            set_status_message("Command Mode: %s (Tab: suggestions, Esc: cancel)", E.cmd.sequence);
-        } else {
-            reset_command_mode(); // Exit if backspace on empty command
+/**
+ * @brief Command handler: quits, asking first if there are unsaved changes.
+ */
+static void command_quit_confirm(void) {
+    editor_quit(false);
+}
+
+// Built-in command sequences, in the order the suggestion list shows them
+static const EditorCommand builtin_commands[] = {
+    { "S",  "Save",               editor_save_file },
+    { "SA", "Save As",            editor_save_as },
+    { "F",  "Find",               editor_find },
+    { "FN", "Find Next",          editor_find_next },
+    { "FP", "Find Prev",          editor_find_prev },
+    { "R",  "Replace",            editor_find_replace },
+    { "G",  "Go to Line",         editor_goto_line },
+    { "LN", "Line Numbers",       editor_toggle_line_numbers },
+    { "DU", "Duplicate Line",     editor_duplicate_line },
+    { "UL", "Uppercase Line",     command_upper_line },
+    { "LL", "Lowercase Line",     command_lower_line },
+    { "DL", "Delete Line",        command_delete_line },
+    { "QW", "Quit Without Save",  command_quit_force },
+    { "I",  "Info",               editor_show_file_info },
+    { "RF", "Recent Files",       editor_show_recent_files },
+    { "RL", "Reload File",        editor_reload_file },
+    { "BN", "Next Buffer",        command_buffer_next },
+    { "BP", "Prev Buffer",        command_buffer_prev },
+    { "BL", "Buffer List",        editor_show_buffers },
+    { "BC", "Close Buffer",       buffer_close },
+    { "KN", "Normal KB Mode",     command_keyboard_normal },
+    { "TC", "Text to Code",       command_text_to_code },
+    { "CT", "Code to Text",       command_code_to_text },
+    { "Z",  "Undo",               editor_undo },
+    { "Y",  "Redo",               editor_redo },
+    { "MR", "Record Macro",       command_macro_record },
+    { "MP", "Play Macro",         command_macro_play },
+    { "PR", "Paste Register",     command_paste_register },
+    { "PF", "Profile Overlay",    command_latency_overlay },
+    { "MS", "Memory Stats",       editor_show_memory_stats },
+    { "PS", "Project Search",     command_project_search },
+    { "PX", "Project Replace",    command_project_replace },
+    { "PL", "Project List",       command_project_list },
+    { "RX", "Regex Search",       command_regex_toggle },
+    { "::", "Create Macro",       enter_creative_mode },
+    { "?",  "Help",               show_command_help_screen },
+    { "h",  "Left",               command_move_left }, // Vim-like movements
+    { "j",  "Down",               command_move_down },
+    { "k",  "Up",                 command_move_up },
+    { "l",  "Right",              command_move_right },
+};
+
+// Actions a macro can be bound to in creative mode
+static const MacroAction macro_actions[] = {
+    { "upper",        command_upper_line },
+    { "lower",        command_lower_line },
+    { "duplicate",    editor_duplicate_line },
+    { "quit_confirm", command_quit_confirm },
+    { "save_file",    editor_save_file },
+};
+
+/**
+ * @brief Maps a command character to its trie branch, folding case.
+ *
+ * @return Branch index, or -1 for characters commands cannot contain.
+ */
+static int command_trie_branch(char c) {
+    if (c < ' ' || c > '~') return -1;
+    return tolower((unsigned char)c) - ' ';
+}
+
+/**
+ * @brief Appends an empty node to the command trie.
+ *
+ * @return Index of the new node, or -1 on allocation failure.
+ */
+static int command_trie_new_node(void) {
+    CommandTrie *t = &E.command_trie;
+    if (t->count == t->allocated) {
+        int new_allocated = t->allocated == 0 ? 64 : t->allocated * 2;
+        CommandTrieNode *new_nodes = realloc(t->nodes, sizeof(CommandTrieNode) * (size_t)new_allocated);
+        if (new_nodes == NULL) return -1;
+        t->nodes = new_nodes;
+        t->allocated = new_allocated;
+    }
+    CommandTrieNode *node = &t->nodes[t->count];
+    memset(node->children, 0, sizeof(node->children));
+    node->command = NULL;
+    node->macro = -1;
+    return t->count++;
+}
+
+/**
+ * @brief Finds the node for `seq`, optionally creating the missing path.
+ *
+ * @param seq The command sequence or prefix.
+ * @param create Whether to add nodes that do not exist yet.
+ * @return Node index, or -1 if there is none (or it could not be created).
+ */
+static int command_trie_walk(const char *seq, bool create) {
+    if (E.command_trie.count == 0 && (!create || command_trie_new_node() != 0)) return -1;
+    int node = 0;
+    for (; *seq; seq++) {
+        int branch = command_trie_branch(*seq);
+        if (branch < 0) return -1;
+        int next = E.command_trie.nodes[node].children[branch];
+        if (next == 0) {
+            if (!create || (next = command_trie_new_node()) < 0) return -1;
+            E.command_trie.nodes[node].children[branch] = next;
         }
+        node = next;
     }
-    else if (key == 27) {
-        set_status_message("Command mode cancelled.");
-        reset_command_mode();
-    } else {
-        set_status_message("Command Mode: %s (Invalid key or sequence too long)", E.cmd.sequence);
-        E.cmd.last_key_time = time(NULL);
-    }
+    return node;
 }
 
 /**
- * @brief Autocompletes the current command sequence.
+ * @brief Builds the command trie from the built-in command table.
  */
-void autocomplete_command(void) {
-    const char* commands[] = {
-        "S", "SA", "F", "FN", "FP", "R", "G", "LN",
-        "DU", "UL", "LL", "DL", "QW", "I", "R",
-        "KN", "TC", "CT", "Z", "Y",
-        "h", "j", "k", "l", // Add Vim-like movements to autocomplete
-        NULL
-    };
-    
-    for (int i = 0; commands[i]; i++) {
-        // Use strncasecmp for case-insensitive comparison
-        if (strncasecmp(commands[i], E.cmd.sequence, (size_t)E.cmd.length) == 0) {
-            strcpy(E.cmd.sequence, commands[i]);
-            E.cmd.length = (int)strlen(commands[i]);
-            set_status_message("Command Mode: %s (Tab: suggestions, Esc: cancel)", E.cmd.sequence);
+void command_table_init(void) {
+    for (size_t i = 0; i < sizeof(builtin_commands) / sizeof(builtin_commands[0]); i++) {
+        int node = command_trie_walk(builtin_commands[i].sequence, true);
+        if (node < 0) {
+            set_status_message("Error: Failed to allocate command table.");
             return;
         }
+        E.command_trie.nodes[node].command = &builtin_commands[i];
     }
-    set_status_message("No autocomplete match for: %s", E.cmd.sequence);
 }
 
 /**
- * @brief Quits the editor.
+ * @brief Binds a command sequence to E.macros[macro].
  *
- * @param force_quit If true, quits without saving or confirmation.
+ * @return false if the sequence belongs to a built-in command or memory ran out.
  */
-void editor_quit(bool force_quit) {
-    if (E.dirty) {
-        if (show_confirmation_dialog("Save before quit?")) {
-            editor_save_file();
-            // If the file is still dirty after attempting to save (e.g., user cancelled save-as prompt)
-            if (E.dirty && !force_quit) {
-                set_status_message("Quit cancelled. File not saved.");
-                return;
-            }
-        } else if (!force_quit) { // User chose NOT to save, and it's not a forced quit
-            if (!show_confirmation_dialog("Discard unsaved changes and quit?")) {
-                set_status_message("Quit cancelled.");
-                return;
-            }
+bool command_table_add_macro(const char *seq, int macro) {
+    int node = command_trie_walk(seq, true);
+    if (node < 0 || E.command_trie.nodes[node].command != NULL) return false;
+    E.command_trie.nodes[node].macro = macro;
+    return true;
+}
+
+/**
+ * @brief Looks up the node bound to exactly `seq`.
+ *
+ * @return The node, or NULL if no command or macro uses the sequence.
+ */
+const CommandTrieNode *command_table_find(const char *seq) {
+    int node = command_trie_walk(seq, false);
+    if (node < 0) return NULL;
+    const CommandTrieNode *entry = &E.command_trie.nodes[node];
+    return (entry->command || entry->macro >= 0) ? entry : NULL;
+}
+
+/**
+ * @brief Calls `visit` for every command and macro whose sequence starts with
+ * `prefix`, in trie order, until it returns false.
+ */
+void command_table_visit_prefix(const char *prefix, bool (*visit)(const CommandTrieNode *, void *), void *ctx) {
+    int start = command_trie_walk(prefix, false);
+    if (start < 0) return;
+    // Depth-first with an explicit stack; sequences are short, so is the stack
+    struct { int node; int branch; } stack[MAX_COMMAND_SEQUENCE_LENGTH + 1];
+    int depth = 0;
+    stack[0].node = start;
+    stack[0].branch = -1;
+    while (depth >= 0) {
+        const CommandTrieNode *node = &E.command_trie.nodes[stack[depth].node];
+        if (stack[depth].branch < 0 && (node->command || node->macro >= 0) && !visit(node, ctx)) return;
+        int b = stack[depth].branch + 1;
+        while (b < COMMAND_TRIE_FANOUT && node->children[b] == 0) b++;
+        stack[depth].branch = b;
+        if (b == COMMAND_TRIE_FANOUT || depth == MAX_COMMAND_SEQUENCE_LENGTH) {
+            depth--;
+        } else {
+            depth++;
+            stack[depth].node = node->children[b];
+            stack[depth].branch = -1;
         }
     }
-    deinit_editor();
-    exit(0);
 }
 
 /**
- * @brief Saves the current editor content to a new file, prompting for filename.
+ * @brief Resolves a macro action name to its handler.
+ *
+ * @return The handler, or NULL if the action is unknown.
  */
-void editor_save_as(void) {
-    char filename_buf[MAX_STATUS_MESSAGE_LENGTH];
-    // Pre-fill filename_buf with current filename or empty string
-    snprintf(filename_buf, sizeof(filename_buf), "%s", E.filename ? E.filename : "");
-    
-    if (editor_prompt("Save as: %s", filename_buf, sizeof(filename_buf))) {
-        // Free old filename if it exists
-        if (E.filename) {
-            free(E.filename);
-        }
-        E.filename = strdup(filename_buf);
-        if (E.filename == NULL) {
-            set_status_message("Error: Failed to allocate memory for filename.");
+static CommandHandler macro_action_lookup(const char *action) {
+    for (size_t i = 0; i < sizeof(macro_actions) / sizeof(macro_actions[0]); i++) {
+        if (strcmp(action, macro_actions[i].name) == 0) return macro_actions[i].handler;
+    }
+    return NULL;
+}
+
+// --- Macro Recording Implementation ---
+//
+// Recording captures every key editor_read_key() hands out, prompts included.
+// Replaying feeds the keys back through the same function with rendering and
+// undo recording suspended; when the replay ends the whole change is pushed
+// as one undo step, computed by comparing the buffer against a snapshot.
+
+/**
+ * @brief Appends a key to the recording in progress.
+ */
+void macro_record_key(int key) {
+    MacroRecorder *r = &E.recorder;
+    if (r->count == r->allocated) {
+        int new_allocated = r->allocated == 0 ? 256 : r->allocated * 2;
+        int *new_keys = realloc(r->keys, sizeof(int) * (size_t)new_allocated);
+        if (new_keys == NULL) {
+            r->active = false;
+            set_status_message("Error: Out of memory; macro recording stopped.");
             return;
         }
-        editor_save_file();  // Use standard save function for actual writing
-    } else {
-        set_status_message("Save As cancelled.");
+        r->keys = new_keys;
+        r->allocated = new_allocated;
     }
+    r->keys[r->count++] = key;
 }
 
 /**
- * @brief Prompts for a filename and loads it into the editor.
+ * @brief Command handler: starts or stops recording keystrokes.
  */
-void editor_open_file(void) {
-    char filename_buf[MAX_STATUS_MESSAGE_LENGTH];
-    char* result = editor_prompt("Open file: %s", filename_buf, sizeof(filename_buf));
-    if (result) {
-        editor_load_file(filename_buf);
+static void command_macro_record(void) {
+    MacroRecorder *r = &E.recorder;
+    if (r->active) {
+        // Drop the Ctrl+\ MR Enter that stopped the recording
+        r->count = r->command_start;
+        r->active = false;
+        set_status_message("Recorded %d keys. MP replays them, or bind them with ':' and 'recorded'.", r->count);
     } else {
-        set_status_message("Open file cancelled.");
+        r->count = 0;
+        r->active = true;
+        set_status_message("Recording keystrokes... Ctrl+\\ MR to stop.");
     }
 }
 
 /**
- * @brief Implements basic search functionality.
- * Prompts user for a search query and moves cursor to the first match.
+ * @brief Command handler: replays the last recording a number of times or
+ * once per line of a range.
  */
-void editor_find(void) {
-    char query[MAX_STATUS_MESSAGE_LENGTH];
-    char *result = editor_prompt("Search: %s", query, sizeof(query));
-
-    if (result == NULL) {
-        E.search_active = false;
+static void command_macro_play(void) {
+    if (E.recorder.active) {
+        set_status_message("Stop recording (Ctrl+\\ MR) before replaying.");
         return;
     }
-
-    strncpy(E.last_search_query, query, sizeof(E.last_search_query) - 1);
-    E.last_search_query[sizeof(E.last_search_query) - 1] = '\0';
-    E.search_active = true;
-
-    E.last_search_found_y = E.cursor_y;
-    E.last_search_found_x = E.cursor_x;
-
-    editor_find_next();
-}
-
-/**
- * @brief Finds the next occurrence of the last search query.
- */
-void editor_find_next(void) {
-    if (!E.search_active || E.last_search_query[0] == '\0') {
-        set_status_message("No active search. Use Ctrl+F to start a new search.");
+    if (E.recorder.count == 0) {
+        set_status_message("No recorded macro. Ctrl+\\ MR starts recording.");
         return;
     }
 
-    int original_cx = E.cursor_x;
-    int original_cy = E.cursor_y;
-
-    int start_y = E.last_search_found_y;
-    int start_x = E.last_search_found_x + 1;
-
-    for (int y = start_y; y < E.num_lines; y++) {
-        int current_line_start_x = (y == start_y) ? start_x : 0;
-        
-        char *match = strstr(E.lines[y].chars + current_line_start_x, E.last_search_query);
-        if (match) {
-            E.cursor_y = y;
-            E.cursor_x = (int)(match - E.lines[y].chars);
-            E.last_search_found_y = E.cursor_y;
-            E.last_search_found_x = E.cursor_x;
-            set_status_message("Found '%s'", E.last_search_query);
-            mark_lines_dirty(original_cy, original_cy);
-            mark_lines_dirty(E.cursor_y, E.cursor_y);
-            return;
-        }
-    }
+    char buf[32];
+    if (editor_prompt("Replay: count, or line range first-last: %s", buf, sizeof(buf)) == NULL) return;
 
-    for (int y = 0; y <= start_y; y++) {
-        int current_line_end_x = (y == start_y) ? start_x : E.lines[y].size;
-        char *match = strstr(E.lines[y].chars, E.last_search_query);
-        if (match && (y < start_y || (y == start_y && (match - E.lines[y].chars) < current_line_end_x) )) {
-            E.cursor_y = y;
-            E.cursor_x = (int)(match - E.lines[y].chars);
-            E.last_search_found_y = E.cursor_y;
-            E.last_search_found_x = E.cursor_x;
-            set_status_message("Found '%s' (wrapped from beginning)", E.last_search_query);
-            mark_lines_dirty(original_cy, original_cy);
-            mark_lines_dirty(E.cursor_y, E.cursor_y);
+    int first, last, times;
+    if (sscanf(buf, "%d-%d", &first, &last) == 2) {
+        if (first < 1 || last < first) {
+            set_status_message("Invalid line range.");
             return;
         }
+        macro_replay(E.recorder.keys, E.recorder.count, 1, first - 1, last - 1);
+    } else if (sscanf(buf, "%d", &times) == 1 && times > 0) {
+        macro_replay(E.recorder.keys, E.recorder.count, times, -1, -1);
+    } else {
+        set_status_message("Invalid replay count.");
     }
-
-    set_status_message("'%s' not found.", E.last_search_query);
-    E.cursor_x = original_cx;
-    E.cursor_y = original_cy;
-    mark_lines_dirty(original_cy, original_cy);
-    E.search_active = false;
 }
 
 /**
- * @brief Finds the previous occurrence of the last search query.
+ * @brief Writes lines [from, to) of the buffer out as one text.
+ *
+ * @param leading Put each line's newline before it ("\nA\nB") instead of
+ * after it ("A\nB\n").
+ * @param dst Where the text goes, or NULL to only measure it.
+ * @return The length of the text.
  */
-void editor_find_prev(void) {
-    if (!E.search_active || E.last_search_query[0] == '\0') {
-        set_status_message("No active search. Use Ctrl+F to start a new search.");
-        return;
-    }
-
-    int original_cx = E.cursor_x;
-    int original_cy = E.cursor_y;
-
-    int start_y = E.last_search_found_y;
-    int start_x = E.last_search_found_x - 1;
-
-    for (int y = start_y; y >= 0; y--) {
-        int current_line_end_x = (y == start_y) ? start_x : E.lines[y].size - 1;
-        
-        for (int x = current_line_end_x; x >= 0; x--) {
-            if ((size_t)x + strlen(E.last_search_query) <= (size_t)E.lines[y].size) {
-                if (strncmp(E.lines[y].chars + x, E.last_search_query, strlen(E.last_search_query)) == 0) {
-                    E.cursor_y = y;
-                    E.cursor_x = x;
-                    E.last_search_found_y = E.cursor_y;
-                    E.last_search_found_x = E.cursor_x;
-                    set_status_message("Found '%s'", E.last_search_query);
-                    mark_lines_dirty(original_cy, original_cy);
-                    mark_lines_dirty(E.cursor_y, E.cursor_y);
-                    return;
-                }
-            }
+static size_t buffer_write_lines(int from, int to, bool leading, char *dst) {
+    size_t total = 0;
+    for (int i = from; i < to; i++) {
+        const EditorLine *line = editor_get_line(i);
+        if (dst != NULL) {
+            char *p = dst + total;
+            if (leading) *p++ = '\n';
+            memcpy(p, line->chars, (size_t)line->size);
+            if (!leading) p[line->size] = '\n';
         }
+        total += (size_t)line->size + 1;
     }
+    return total;
+}
 
-    for (int y = E.num_lines - 1; y >= start_y; y--) {
-        int current_line_start_x = (y == start_y) ? start_x : 0;
-        for (int x = E.lines[y].size - (int)strlen(E.last_search_query); x >= current_line_start_x; x--) {
-            if (x >= 0 && strncmp(E.lines[y].chars + x, E.last_search_query, strlen(E.last_search_query)) == 0) {
-                E.cursor_y = y;
-                E.cursor_x = x;
-                E.last_search_found_y = E.cursor_y;
-                E.last_search_found_x = E.cursor_x;
-                set_status_message("Found '%s' (wrapped from end)", E.last_search_query);
-                mark_lines_dirty(original_cy, original_cy);
-                mark_lines_dirty(E.cursor_y, E.cursor_y);
-                return;
-            }
+/**
+ * @brief Pushes what a replay changed as one undo step: the changed run of
+ * lines is deleted and re-inserted.
+ *
+ * The run lies between the E.replay.keep_head lines at the top and the
+ * E.replay.keep_tail lines at the bottom that no edit touched, as noted by
+ * journal_note_change(), so only its text goes into the record.
+ *
+ * @param old Snapshot of the whole buffer taken by clipboard_capture().
+ * @param old_lines Number of lines in the snapshot.
+ */
+static void macro_push_replay_undo(const ClipRegister *old, int old_lines) {
+    if (E.replay.keep_head == INT_MAX) return; // Nothing changed
+    const int new_lines = E.num_lines;
+    int limit = old_lines < new_lines ? old_lines : new_lines;
+    int head = E.replay.keep_head < limit ? E.replay.keep_head : limit;
+    int tail = E.replay.keep_tail < limit - head ? E.replay.keep_tail : limit - head;
+
+    // Untouched lines read the same in both versions, so they are measured on the buffer
+    size_t head_bytes = buffer_write_lines(0, head, false, NULL);
+    size_t tail_bytes = buffer_write_lines(new_lines - tail, new_lines, false, NULL);
+
+    // Anchor the block so both versions are whole-line texts: before the
+    // first unchanged bottom line, after the last unchanged top line, or the
+    // entire buffer. The snapshot has no newline after its last line.
+    UndoAction removed = { .type = UNDO_DELETE_BLOCK, .char_val = '\0' };
+    UndoAction added = { .type = UNDO_INSERT_BLOCK, .char_val = '\0' };
+    size_t old_from, old_to, new_len;
+    int edges; // Newlines beyond one per changed line, plus one for num_lines_affected
+    if (tail > 0) {
+        removed.y = head;
+        removed.x = 0;
+        old_from = head_bytes;
+        old_to = old->bytes + 1 - tail_bytes;
+        new_len = buffer_write_lines(head, new_lines - tail, false, NULL);
+        edges = 1;
+    } else if (head > 0) {
+        removed.y = head - 1;
+        removed.x = editor_get_line(head - 1)->size;
+        old_from = head_bytes - 1; // "\nA\nB": the newline ending the last unchanged line moves in front
+        old_to = old->bytes;
+        new_len = buffer_write_lines(head, new_lines, true, NULL);
+        edges = 1;
+    } else {
+        removed.y = 0;
+        removed.x = 0;
+        old_from = 0; // "A\nB" with no newline at either end
+        old_to = old->bytes;
+        new_len = buffer_write_lines(0, new_lines, false, NULL) - 1;
+        edges = 0;
+    }
+    added.y = removed.y;
+    added.x = removed.x;
+    removed.num_lines_affected = old_lines - head - tail + edges;
+    added.num_lines_affected = new_lines - head - tail + edges;
+
+    undo_begin_group();
+    if (old_to > old_from) {
+        char *payload = push_undo_record(removed, old_to - old_from);
+        if (payload != NULL) clipboard_read(old, old_from, old_to - old_from, payload);
+    }
+    if (new_len > 0) {
+        char *payload = push_undo_record(added, new_len);
+        if (payload != NULL && tail == 0 && head == 0) {
+            // Every line but the last is followed by its newline
+            size_t at = buffer_write_lines(0, new_lines - 1, false, payload);
+            const EditorLine *last = editor_get_line(new_lines - 1);
+            memcpy(payload + at, last->chars, (size_t)last->size);
+        } else if (payload != NULL) {
+            buffer_write_lines(head, new_lines - tail, tail == 0, payload);
         }
     }
-
-    set_status_message("'%s' not found.", E.last_search_query);
-    E.cursor_x = original_cx;
-    E.cursor_y = original_cy;
-    mark_lines_dirty(original_cy, original_cy);
-    E.search_active = false;
+    undo_end_group();
 }
 
 /**
- * @brief Implements Find and Replace functionality.
+ * @brief Replays recorded keys with rendering and per-edit undo suspended.
+ *
+ * @param keys The key stream to feed to editor_process_keypress().
+ * @param count Number of keys.
+ * @param times How many times to play the keys when no range is given.
+ * @param first_line First line of the range (0-based), or -1 for no range.
+ * @param last_line Last line of the range; each of its lines gets one run
+ * with the cursor at its start. Lines the macro adds or removes are
+ * accounted for, so every original line of the range is visited once.
  */
-void editor_find_replace(void) {
-    char find_buf[MAX_STATUS_MESSAGE_LENGTH];
-    char replace_buf[MAX_STATUS_MESSAGE_LENGTH];
-    
-    char* find = editor_prompt("Find: %s", find_buf, sizeof(find_buf));
-    if (!find) {
-        set_status_message("Find & Replace cancelled.");
+void macro_replay(const int *keys, int count, int times, int first_line, int last_line) {
+    if (E.replay.active) {
+        set_status_message("A macro cannot replay another macro.");
         return;
     }
-    
-    char* replace = editor_prompt("Replace with: %s", replace_buf, sizeof(replace_buf));
-    if (!replace) {
-        set_status_message("Find & Replace cancelled.");
+
+    // Replayed keys load lines as they go, which the undo step must not mistake for insertions.
+    // The snapshot copies edited lines only; unedited ones stay in the file mapping.
+    editor_load_all();
+    int snapshot_lines = E.num_lines;
+    const char *snapshot_base = E.map_base;
+    const char *snapshot_file = E.filename;
+    const UndoAction *snapshot_log = E.undo.records;
+    ClipRegister snapshot;
+    const EditorLine *last = editor_get_line(E.num_lines - 1);
+    if (!clipboard_capture(&snapshot, 0, 0, E.num_lines - 1, last->size)) {
+        set_status_message("Error: Out of memory for macro replay.");
         return;
     }
 
-    int find_len = (int)strlen(find);
-    int replace_len = (int)strlen(replace);
-    int occurrences = 0;
-
-    for (int y = 0; y < E.num_lines; y++) {
-        char *line_chars = E.lines[y].chars;
-        int line_size = E.lines[y].size;
-        char *current_pos = line_chars;
-
-        while ((current_pos = strstr(current_pos, find)) != NULL) {
-            int x_pos = (int)(current_pos - line_chars);
-
-            // Record undo action for the modification
-            // This is a simplified undo for replace. A more robust solution
-            // would involve storing the exact change (delete old, insert new)
-            // as a block. For now, we'll just record the line modification.
-            char *original_line_content = strdup(E.lines[y].chars);
-            UndoAction ua = {
-                .type = UNDO_MODIFY_LINE_CASE, // Reusing this type, but it means "line content changed"
-                .y = y,
-                .x = 0, // Not precise for replace, but indicates line change
-                .char_val = '\0',
-                .text_content = original_line_content,
-                .text_len = E.lines[y].size,
-                .num_lines_affected = 1
-            };
-            push_undo_action(ua);
-
-
-            // Calculate new line size
-            int new_line_size = line_size - find_len + replace_len;
-            if (new_line_size + 1 > E.lines[y].allocated) {
-                int new_allocated = new_line_size + 1 + MAX_LINE_LENGTH_BUFFER; // Add some buffer
-                E.lines[y].chars = realloc(E.lines[y].chars, (size_t)new_allocated);
-                E.lines[y].hl = realloc(E.lines[y].hl, sizeof(HighlightType) * (size_t)new_allocated);
-                if (E.lines[y].chars == NULL || E.lines[y].hl == NULL) {
-                    set_status_message("Error: Failed to reallocate line memory for replace.");
-                    free(original_line_content);
-                    return;
-                }
-                E.lines[y].allocated = new_allocated;
-                line_chars = E.lines[y].chars; // Update pointer after realloc
-            }
-
-            // Shift characters after the found string
-            memmove(line_chars + x_pos + replace_len,
-                    line_chars + x_pos + find_len,
-                    (size_t)(line_size - (x_pos + find_len) + 1)); // +1 for null terminator
-
-            // Copy replacement string
-            memcpy(line_chars + x_pos, replace, (size_t)replace_len);
+    int discards = E.undo.discards;
+    E.replay.active = true;
+    E.replay.keep_head = INT_MAX;
+    E.replay.keep_tail = INT_MAX;
+    E.replay.keys = keys;
+    E.undo.suspended++;
+    E.undo.run_open = false;
+
+    int runs = 0;
+    if (first_line < 0) {
+        for (; runs < times && E.replay.active; runs++) {
+            E.replay.count = count;
+            E.replay.pos = 0;
+            while (E.replay.pos < E.replay.count) editor_process_keypress();
+        }
+    } else {
+        for (int y = first_line; y >= 0 && y <= last_line && y < E.num_lines; runs++) {
+            int lines_before = E.num_lines;
+            E.cursor_y = y;
+            E.cursor_x = 0;
+            E.replay.count = count;
+            E.replay.pos = 0;
+            while (E.replay.pos < E.replay.count) editor_process_keypress();
+            int delta = E.num_lines - lines_before;
+            // A run that removed lines leaves the next one where it started, never above it
+            y = y + 1 + delta > y ? y + 1 + delta : y;
+            last_line += delta;
+        }
+    }
 
-            E.lines[y].size = new_line_size;
-            E.lines[y].chars[new_line_size] = '\0';
-            E.lines[y].hl_revision++;
-            E.dirty = true;
-            mark_lines_dirty(y, y);
+    E.undo.suspended--;
+    E.replay.active = false;
+    // A replayed command that loaded a file started a fresh history and unmapped the snapshot's lines
+    if (E.map_base == snapshot_base && E.filename == snapshot_file && E.undo.records == snapshot_log &&
+        E.undo.discards == discards) {
+        macro_push_replay_undo(&snapshot, snapshot_lines);
+    }
+    clipboard_register_free(&snapshot);
 
-            occurrences++;
-            current_pos = line_chars + x_pos + replace_len; // Continue search after replacement
-            line_size = E.lines[y].size; // Update line size for next iteration
-        }
+    if (E.cursor_y >= E.num_lines) E.cursor_y = E.num_lines - 1;
+    if (E.cursor_y < 0) E.cursor_y = 0;
+    E.full_redraw = true;
+    if (E.undo.discards == discards) {
+        set_status_message("Replayed %d keys %d time%s.", count, runs, runs == 1 ? "" : "s");
     }
-    set_status_message("Replaced %d occurrences.", occurrences);
 }
 
-
 /**
- * @brief Copies the current line to the clipboard.
+ * @brief Runs the action a macro is bound to.
+ *
+ * @param macro The macro to execute.
  */
-void editor_copy_line(void) {
-    if (E.cursor_y >= E.num_lines) {
-        set_status_message("Nothing to copy.");
-        return;
-    }
-    EditorLine *line = &E.lines[E.cursor_y];
-    if ((size_t)line->size + 1 > (size_t)E.clipboard_allocated) {
-        E.clipboard_allocated = line->size + 1;
-        E.clipboard_buffer = realloc(E.clipboard_buffer, (size_t)E.clipboard_allocated);
-        if (E.clipboard_buffer == NULL) {
-            set_status_message("Error: Failed to allocate clipboard memory.");
-            return;
-        }
+void execute_custom_command(const EditorMacro *macro) {
+    if (macro->keys) {
+        macro_replay(macro->keys, macro->key_count, 1, -1, -1);
+    } else if (macro->handler) {
+        macro->handler();
+    } else {
+        set_status_message("Macro action '%s' executed (placeholder).", macro->action);
     }
-    memcpy(E.clipboard_buffer, line->chars, (size_t)line->size);
-    E.clipboard_buffer[line->size] = '\0';
-    E.clipboard_size = line->size;
-    set_status_message("Line copied.");
 }
 
 /**
- * @brief Cuts the current line to the clipboard.
+ * @brief Executes the command sequence currently stored in E.cmd.sequence.
+ * This is the core logic of the "Command Puzzle System".
  */
-void editor_cut_line(void) {
-    if (E.cursor_y >= E.num_lines) {
-        set_status_message("Nothing to cut.");
+void execute_command_sequence(void) {
+    char *seq = E.cmd.sequence;
+    
+    if (E.cmd.length == 0) {
+        set_status_message("Commands: S=Save, QW=QuitWithoutSave, SA=SaveAs, F=Find, ... (Tab:list)");
         return;
     }
-    char *deleted_content = strdup(E.lines[E.cursor_y].chars);
-    UndoAction ua = {
-        .type = UNDO_DELETE_BLOCK,
-        .y = E.cursor_y,
-        .x = 0,
-        .char_val = '\0',
-        .text_content = deleted_content,
-        .text_len = (int)strlen(deleted_content),
-        .num_lines_affected = 1
-    };
-    push_undo_action(ua);
 
-    editor_copy_line();
-    editor_delete_line(E.cursor_y);
-    if (E.num_lines == 0) {
-        E.cursor_y = 0;
-        E.cursor_x = 0;
-        editor_insert_line(0, "", 0);
-    } else if (E.cursor_y >= E.num_lines) {
-        E.cursor_y = E.num_lines - 1;
-        E.cursor_x = E.lines[E.cursor_y].size;
+    const CommandTrieNode *entry = command_table_find(seq);
+    if (entry == NULL) {
+        set_status_message("Unknown command: Ctrl+\\ %s. Press ':' to save as macro.", seq);
+        return;
+    }
+    // Leave command mode first: handlers may prompt or replay keys
+    const EditorCommand *command = entry->command;
+    const EditorMacro *macro = command ? NULL : &E.macros[entry->macro];
+    reset_command_mode();
+    if (command) {
+        command->handler();
+    } else {
+        execute_custom_command(macro);
     }
-    set_status_message("Line cut.");
 }
 
 /**
- * @brief Inserts a block of text starting at (y,x). Handles newlines within text.
- * @param y The starting line index.
- * @param x The starting character index.
- * @param text The text block to insert.
- * @param text_len The length of the text block.
+ * @brief Handles input when in command puzzle mode.
+ *
+ * @param key The key pressed.
  */
-void editor_insert_text_block(int y, int x, const char *text, int text_len) {
-    if (text_len == 0) return;
-
-    char *temp_text = strdup(text);
-    if (!temp_text) {
-        set_status_message("Error: Memory allocation for text block.");
+void handle_command_mode_input(int key) {
+    if (editor_now_ms() - E.cmd.last_key_time > COMMAND_TIMEOUT_MS) {
+        set_status_message("Command timeout.");
+        reset_command_mode();
         return;
     }
 
-    char *current_segment = temp_text;
-    char *newline_pos;
-    int current_y = y;
-    int current_x = x;
-    int original_line_remainder_len = 0;
-    char *original_line_remainder = NULL;
+    if (key == ':' && E.cmd.length > 0) {
+        enter_creative_mode();
+        return;
+    }
 
-    if (current_y < E.num_lines && current_x < E.lines[current_y].size) {
-        original_line_remainder = strdup(&E.lines[current_y].chars[current_x]);
-        original_line_remainder_len = (int)strlen(original_line_remainder);
-        E.lines[current_y].size = current_x;
-        E.lines[current_y].chars[current_x] = '\0';
-        E.lines[current_y].hl_revision++;
+    if (key == '\t') {
+        autocomplete_command(); // Call autocomplete on Tab
+        E.cmd.last_key_time = editor_now_ms();
+        return;
     }
 
-    while (*current_segment != '\0') {
-        newline_pos = strchr(current_segment, '\n');
-        int segment_len;
-        if (newline_pos != NULL) {
-            segment_len = (int)(newline_pos - current_segment);
+    if (isprint(key) && E.cmd.length < MAX_COMMAND_SEQUENCE_LENGTH - 1) {
+        E.cmd.sequence[E.cmd.length++] = (char)key;
+        E.cmd.sequence[E.cmd.length] = '\0';
+        E.cmd.last_key_time = editor_now_ms();
+        // Do not execute_command_sequence here, only after full command or Enter
+        // This allows multi-character commands to be built
+    } else if (key == KEY_ENTER || key == '\n') {
+        execute_command_sequence(); // Execute on Enter
+        E.cmd.active = false; // Keep the status message the command left
+    }
+    else if (key == KEY_BACKSPACE || key == 127) { // Handle backspace in command mode
+        if (E.cmd.length > 0) {
+            E.cmd.length--;
+            E.cmd.sequence[E.cmd.length] = '\0';
+            E.cmd.last_key_time = editor_now_ms();
+            set_status_message("Command Mode: %s (Tab: suggestions, Esc: cancel)", E.cmd.sequence);
         } else {
-            segment_len = (int)strlen(current_segment);
+            reset_command_mode(); // Exit if backspace on empty command
         }
+    }
+    else if (key == 27) {
+        set_status_message("Command mode cancelled.");
+        reset_command_mode();
+    } else {
+        set_status_message("Command Mode: %s (Invalid key or sequence too long)", E.cmd.sequence);
+        E.cmd.last_key_time = editor_now_ms();
+    }
+}
 
-        if (current_y >= E.num_lines) {
-            editor_insert_line(current_y, current_segment, segment_len);
-        } else {
-            EditorLine *target_line = &E.lines[current_y];
-            if ((size_t)target_line->size + (size_t)segment_len + 1 > (size_t)target_line->allocated) {
-                int new_allocated = target_line->allocated + segment_len + 1;
-                target_line->chars = realloc(target_line->chars, (size_t)new_allocated);
-                target_line->hl = realloc(target_line->hl, sizeof(HighlightType) * (size_t)new_allocated);
-                if (target_line->chars == NULL || target_line->hl == NULL) { free(temp_text); free(original_line_remainder); return; }
-                target_line->allocated = new_allocated;
-            }
-            memmove(&target_line->chars[current_x + segment_len], &target_line->chars[current_x], (size_t)target_line->size - current_x + 1);
-            memcpy(&target_line->chars[current_x], current_segment, (size_t)segment_len);
-            target_line->size += segment_len;
-            target_line->chars[target_line->size] = '\0';
-            target_line->hl_revision++;
-        }
-
-        current_segment += segment_len;
-        if (newline_pos != NULL) {
-            current_y++;
-            current_x = 0;
-            current_segment++;
-        } else {
-            current_x += segment_len;
-        }
+/**
+ * @brief Autocompletes the current command sequence.
+ */
+void autocomplete_command(void) {
+    int node = command_trie_walk(E.cmd.sequence, false);
+    if (node < 0) {
+        set_status_message("No autocomplete match for: %s", E.cmd.sequence);
+        return;
     }
 
-    if (original_line_remainder != NULL && original_line_remainder_len > 0) {
-        if (current_y >= E.num_lines) {
-            editor_insert_line(current_y, original_line_remainder, original_line_remainder_len);
-        } else {
-            EditorLine *target_line = &E.lines[current_y];
-            if ((size_t)target_line->size + (size_t)original_line_remainder_len + 1 > (size_t)target_line->allocated) {
-                int new_allocated = target_line->allocated + original_line_remainder_len + 1;
-                target_line->chars = realloc(target_line->chars, (size_t)new_allocated);
-                target_line->hl = realloc(target_line->hl, sizeof(HighlightType) * (size_t)new_allocated);
-                if (target_line->chars == NULL || target_line->hl == NULL) { free(temp_text); free(original_line_remainder); return; }
-                target_line->allocated = new_allocated;
+    // Extend through the prefix every remaining command shares
+    while (E.cmd.length < MAX_COMMAND_SEQUENCE_LENGTH - 1) {
+        const CommandTrieNode *n = &E.command_trie.nodes[node];
+        if (n->command || n->macro >= 0) break;
+        int only = -1;
+        for (int b = 0; b < COMMAND_TRIE_FANOUT; b++) {
+            if (n->children[b] == 0) continue;
+            if (only != -1) {
+                only = -2;
+                break;
             }
-            memcpy(&target_line->chars[target_line->size], original_line_remainder, (size_t)original_line_remainder_len + 1);
-            target_line->size += original_line_remainder_len;
-            target_line->hl_revision++;
+            only = b;
         }
+        if (only < 0) break;
+        E.cmd.sequence[E.cmd.length++] = (char)(' ' + only);
+        E.cmd.sequence[E.cmd.length] = '\0';
+        node = n->children[only];
     }
 
-    free(temp_text);
-    free(original_line_remainder);
-    mark_lines_dirty(y, current_y);
+    // Show a completed sequence with the spelling it was registered under
+    const CommandTrieNode *n = &E.command_trie.nodes[node];
+    const char *canonical = n->command ? n->command->sequence : n->macro >= 0 ? E.macros[n->macro].sequence : NULL;
+    if (canonical) {
+        strcpy(E.cmd.sequence, canonical);
+        E.cmd.length = (int)strlen(canonical);
+    }
+    set_status_message("Command Mode: %s (Tab: suggestions, Esc: cancel)", E.cmd.sequence);
 }
 
-
 /**
- * @brief Deletes a block of text from (sy,sx) to (ey,ex).
- * Assumes (sy,sx) and (ey,ex) are normalized coordinates.
- * @param sy Start Y of deletion.
- * @param sx Start X of deletion.
- * @param ey End Y of deletion.
- * @param ex End X of deletion.
+ * @brief Quits the editor.
+ *
+ * @param force_quit If true, quits without saving or confirmation.
  */
-void editor_delete_text_block(int sy, int sx, int ey, int ex) {
-    if (sy < 0 || sy >= E.num_lines || ey < 0 || ey >= E.num_lines) return;
-
-    if (sy == ey) {
-        EditorLine *line = &E.lines[sy];
-        memmove(&line->chars[sx], &line->chars[ex], (size_t)line->size - ex + 1);
-        line->size -= (ex - sx);
-        line->hl_revision++;
-    } else {
-        EditorLine *start_line = &E.lines[sy];
-        start_line->size = sx;
-        start_line->chars[sx] = '\0';
-        start_line->hl_revision++;
-
-        EditorLine *end_line_to_append_from = &E.lines[ey];
-        
-        if ((size_t)start_line->size + (size_t)(end_line_to_append_from->size - ex) + 1 > (size_t)start_line->allocated) {
-            int new_allocated = start_line->allocated + (end_line_to_append_from->size - ex) + 1;
-            start_line->chars = realloc(start_line->chars, (size_t)new_allocated);
-            start_line->hl = realloc(start_line->hl, sizeof(HighlightType) * (size_t)new_allocated);
-            if (start_line->chars == NULL || start_line->hl == NULL) {
-                set_status_message("Error: Failed to reallocate memory for block deletion join.");
+void editor_quit(bool force_quit) {
+    for (int n = 0; n < E.buffer_count; n++) {
+        if (!buffer_is_dirty(n)) continue;
+        if (n != E.buffer_current) {
+            buffer_switch(n); // Show the file the questions are about
+            editor_refresh_screen();
+        }
+        if (show_confirmation_dialog("Save before quit?")) {
+            editor_save_file();
+            // If the file is still dirty after attempting to save (e.g., user cancelled save-as prompt)
+            if (E.dirty && !force_quit) {
+                set_status_message("Quit cancelled. File not saved.");
+                return;
+            }
+        } else if (!force_quit) { // User chose NOT to save, and it's not a forced quit
+            if (!show_confirmation_dialog("Discard unsaved changes and quit?")) {
+                set_status_message("Quit cancelled.");
                 return;
             }
-            start_line->allocated = new_allocated;
         }
-        memcpy(&start_line->chars[start_line->size], &end_line_to_append_from->chars[ex], (size_t)(end_line_to_append_from->size - ex + 1));
-        start_line->size += (end_line_to_append_from->size - ex);
-        start_line->hl_revision++;
-
-        for (int i = 0; i < (ey - sy); i++) {
-            editor_delete_line(sy + 1);
+        if (E.dirty) {
+            journal_discard(); // The changes were given up on purpose
         }
     }
-    mark_lines_dirty(sy, E.num_lines);
+    deinit_editor();
+    exit(0);
 }
 
-
 /**
- * @brief Pastes content from the clipboard.
+ * @brief Saves the current editor content to a new file, prompting for filename.
  */
-void editor_paste_line(void) {
-    if (E.clipboard_buffer == NULL || E.clipboard_size == 0) {
-        set_status_message("Clipboard is empty.");
-        return;
-    }
-
-    int pasted_num_lines = 1;
-    for (int i = 0; i < E.clipboard_size; i++) {
-        if (E.clipboard_buffer[i] == '\n') {
-            pasted_num_lines++;
+void editor_save_as(void) {
+    char filename_buf[MAX_STATUS_MESSAGE_LENGTH];
+    // Pre-fill filename_buf with current filename or empty string
+    snprintf(filename_buf, sizeof(filename_buf), "%s", E.filename ? E.filename : "");
+    
+    if (editor_prompt("Save as: %s", filename_buf, sizeof(filename_buf))) {
+        // Free old filename if it exists
+        if (E.filename) {
+            free(E.filename);
         }
-    }
-
-    UndoAction ua = {
-        .type = UNDO_INSERT_BLOCK,
-        .y = E.cursor_y,
-        .x = E.cursor_x,
-        .char_val = '\0',
-        .text_content = strdup(E.clipboard_buffer),
-        .text_len = E.clipboard_size,
-        .num_lines_affected = pasted_num_lines
-    };
-    push_undo_action(ua);
-
-    editor_insert_text_block(E.cursor_y, E.cursor_x, E.clipboard_buffer, E.clipboard_size);
-
-    int final_cursor_y = E.cursor_y;
-    int final_cursor_x = E.cursor_x;
-    for (int i = 0; i < E.clipboard_size; i++) {
-        if (E.clipboard_buffer[i] == '\n') {
-            final_cursor_y++;
-            final_cursor_x = 0;
-        } else {
-            final_cursor_x++;
+        E.filename = strdup(filename_buf);
+        if (E.filename == NULL) {
+            set_status_message("Error: Failed to allocate memory for filename.");
+            return;
         }
+        editor_save_file();  // Use standard save function for actual writing
+    } else {
+        set_status_message("Save As cancelled.");
     }
-    E.cursor_y = final_cursor_y;
-    E.cursor_x = final_cursor_x;
-
-    E.dirty = true;
-    set_status_message("Pasted.");
 }
 
 /**
- * @brief Displays information about the current file.
+ * @brief Prompts for a filename and opens it in a new buffer.
  */
-void editor_show_file_info(void) {
-    if (E.filename == NULL) {
-        set_status_message("No file loaded.");
-        return;
-    }
-
-    struct stat st;
-    if (stat(E.filename, &st) == -1) {
-        set_status_message("Error getting file info for %s: %s", E.filename, strerror(errno));
-        return;
+void editor_open_file(void) {
+    char filename_buf[MAX_STATUS_MESSAGE_LENGTH];
+    char* result = editor_prompt("Open file: %s", filename_buf, sizeof(filename_buf));
+    if (result) {
+        buffer_open(filename_buf);
+    } else {
+        set_status_message("Open file cancelled.");
     }
-
-    char ctime_str[64];
-    char mtime_str[64];
-    strftime(ctime_str, sizeof(ctime_str), "%Y-%m-%d %H:%M:%S", localtime(&st.st_ctime));
-    strftime(mtime_str, sizeof(mtime_str), "%Y-%m-%d %H:%M:%S", localtime(&st.st_mtime));
-
-    set_status_message("File: %s | Size: %ld bytes | Lines: %d | Created: %s | Modified: %s",
-                       E.filename, (long)st.st_size, E.num_lines, ctime_str, mtime_str);
 }
 
 /**
- * @brief Prompts for a line number and moves the cursor to that line.
+ * @brief Implements basic search functionality.
+ * Prompts user for a search query and moves cursor to the first match.
+ * The query is a regex while regex search is on (RX).
  */
-void editor_goto_line(void) {
-    char line_num_buf[MAX_STATUS_MESSAGE_LENGTH];
-    char *result = editor_prompt("Go to line: %s", line_num_buf, sizeof(line_num_buf));
+void editor_find(void) {
+    char query[MAX_STATUS_MESSAGE_LENGTH];
+    char *result = editor_prompt(E.search_regex ? "Regex search: %s" : "Search: %s", query, sizeof(query));
 
     if (result == NULL) {
-        set_status_message("Go to line cancelled.");
+        E.search_active = false;
         return;
     }
 
-    int target_line = atoi(result);
-    if (target_line <= 0) {
-        set_status_message("Invalid line number. Must be positive.");
+    SearchPattern pattern;
+    char error[MAX_STATUS_MESSAGE_LENGTH];
+    if (!search_pattern_init(&pattern, query, E.search_regex, error, sizeof(error))) {
+        set_status_message("Regex error: %s", error);
+        E.search_active = false;
         return;
     }
 
-    target_line--; 
+    strncpy(E.last_search_query, query, sizeof(E.last_search_query) - 1);
+    E.last_search_query[sizeof(E.last_search_query) - 1] = '\0';
+    E.last_search_regex = E.search_regex;
+    E.search_active = true;
+    match_index_set_query(E.last_search_query, E.last_search_regex);
 
-    if (target_line >= 0 && target_line < E.num_lines) {
-        mark_lines_dirty(E.cursor_y, E.cursor_y);
-        E.cursor_y = target_line;
-        E.cursor_x = 0;
-        mark_lines_dirty(E.cursor_y, E.cursor_y);
-        set_status_message("Moved to line %d.", target_line + 1);
-    } else {
-        set_status_message("Line %d is out of bounds (total lines: %d).", target_line + 1, E.num_lines);
-    }
-}
+    E.last_search_found_y = E.cursor_y;
+    E.last_search_found_x = E.cursor_x;
 
-/**
- * @brief Toggles the display of line numbers.
- */
-void editor_toggle_line_numbers(void) {
-    E.show_line_numbers = !E.show_line_numbers;
-    set_status_message("Line numbers: %s", E.show_line_numbers ? "ON" : "OFF");
-    mark_lines_dirty(0, E.num_lines - 1);
+    editor_find_next();
 }
 
 /**
- * @brief Displays a list of recently opened files and allows the user to select one.
+ * @brief Finds the next occurrence of the last search query.
  */
-void editor_show_recent_files(void) {
-    if (E.num_recent_files == 0) {
-        set_status_message("No recently opened files.");
+void editor_find_next(void) {
+    if (!E.search_active || E.last_search_query[0] == '\0') {
+        set_status_message("No active search. Use Ctrl+F to start a new search.");
         return;
     }
 
-    char prompt_msg[MAX_STATUS_MESSAGE_LENGTH * 2];
-    int offset = snprintf(prompt_msg, sizeof(prompt_msg), "Recent Files (Select #, ESC to cancel):");
-    for (int i = 0; i < E.num_recent_files; i++) {
-        offset += snprintf(prompt_msg + offset, sizeof(prompt_msg) - offset, "\n%d. %s", i + 1, E.recent_files[i]);
-    }
-    offset += snprintf(prompt_msg + offset, sizeof(prompt_msg) - offset, "\nSelect: %%s");
-
-    char choice_buf[10];
-    char *result = editor_prompt(prompt_msg, choice_buf, sizeof(choice_buf));
-
-    if (result == NULL) {
-        set_status_message("Recent files selection cancelled.");
+    SearchPattern pattern;
+    if (!search_pattern_init(&pattern, E.last_search_query, E.last_search_regex, NULL, 0)) {
+        set_status_message("Error: Out of memory compiling the search.");
         return;
     }
+    int start_y = E.last_search_found_y;
+    int start_x = E.last_search_found_x + 1;
 
-    int selection = atoi(result);
-    if (selection > 0 && selection <= E.num_recent_files) {
-        editor_load_file(E.recent_files[selection - 1]);
-    } else {
-        set_status_message("Invalid selection.");
+    int y = match_index_next_candidate(start_y, 1);
+    while (true) {
+        for (; y >= 0; y = match_index_next_candidate(y + 1, 1)) {
+            EditorLine *line = editor_get_line(y);
+            int from = (y == start_y) ? start_x : 0;
+            if (from > line->size) continue;
+            int x = search_first(&pattern, line->chars, line->size, from, line->size);
+            if (x >= 0) {
+                E.cursor_y = y;
+                E.cursor_x = x;
+                E.last_search_found_y = E.cursor_y;
+                E.last_search_found_x = E.cursor_x;
+                set_status_message("Found '%s'", E.last_search_query);
+                return;
+            }
+        }
+        // Load only as far as the next match in a partly loaded file
+        if (!editor_load_pending()) break;
+        int loaded = E.num_lines;
+        editor_load_through(loaded + LOAD_SLICE_LINES - 1);
+        y = match_index_next_candidate(loaded, 1);
+    }
+
+    for (int y = match_index_next_candidate(0, 1); y >= 0 && y <= start_y; y = match_index_next_candidate(y + 1, 1)) {
+        EditorLine *line = editor_get_line(y);
+        // On the starting line only matches before the start position are new
+        int to = y == start_y ? start_x - 1 : line->size;
+        int x = search_first(&pattern, line->chars, line->size, 0, to);
+        if (x >= 0) {
+            E.cursor_y = y;
+            E.cursor_x = x;
+            E.last_search_found_y = E.cursor_y;
+            E.last_search_found_x = E.cursor_x;
+            set_status_message("Found '%s' (wrapped from beginning)", E.last_search_query);
+            return;
+        }
     }
+
+    set_status_message("'%s' not found.", E.last_search_query);
+    E.search_active = false;
+    match_index_set_query("", false);
 }
 
 /**
- * @brief Enters creative mode to define a new macro.
- * Prompts the user for the action string associated with the current command sequence.
+ * @brief Finds the previous occurrence of the last search query.
  */
-void enter_creative_mode(void) {
-    if (E.macro_count >= MAX_MACROS) {
-        set_status_message("Max macros reached (%d). Cannot create more.", MAX_MACROS);
-        reset_command_mode();
+void editor_find_prev(void) {
+    if (!E.search_active || E.last_search_query[0] == '\0') {
+        set_status_message("No active search. Use Ctrl+F to start a new search.");
         return;
     }
-    if (E.cmd.length == 0) {
-        set_status_message("Cannot create macro for empty sequence.");
-        reset_command_mode();
+
+    SearchPattern pattern;
+    if (!search_pattern_init(&pattern, E.last_search_query, E.last_search_regex, NULL, 0)) {
+        set_status_message("Error: Out of memory compiling the search.");
         return;
     }
+    int start_y = E.last_search_found_y;
+    int start_x = E.last_search_found_x - 1;
 
-    E.creative_mode = true;
-    char action_buf[MAX_MACRO_ACTION_LENGTH];
-    char prompt_msg[MAX_STATUS_MESSAGE_LENGTH];
-    snprintf(prompt_msg, sizeof(prompt_msg), "Creative Mode: Enter action for '%s': %%s", E.cmd.sequence);
-
-    char *result = editor_prompt(prompt_msg, action_buf, sizeof(action_buf));
+    for (int y = match_index_next_candidate(start_y, -1); y >= 0; y = match_index_next_candidate(y - 1, -1)) {
+        EditorLine *line = editor_get_line(y);
+        // Matches must start at or before start_x on the starting line
+        int to = line->size;
+        if (y == start_y) {
+            if (start_x < 0) continue;
+            to = start_x;
+        }
+        int x = search_last(&pattern, line->chars, line->size, 0, to);
+        if (x >= 0) {
+            E.cursor_y = y;
+            E.cursor_x = x;
+            E.last_search_found_y = E.cursor_y;
+            E.last_search_found_x = E.cursor_x;
+            set_status_message("Found '%s'", E.last_search_query);
+            return;
+        }
+    }
 
-    if (result != NULL) {
-        strncpy(E.macros[E.macro_count].sequence, E.cmd.sequence, MAX_COMMAND_SEQUENCE_LENGTH - 1);
-        E.macros[E.macro_count].sequence[MAX_COMMAND_SEQUENCE_LENGTH - 1] = '\0';
-        strncpy(E.macros[E.macro_count].action, action_buf, MAX_MACRO_ACTION_LENGTH - 1);
-        E.macros[E.macro_count].action[MAX_MACRO_ACTION_LENGTH - 1] = '\0';
-        E.macro_count++;
-        set_status_message("Macro saved: '%s' => '%s'", E.macros[E.macro_count-1].sequence, E.macros[E.macro_count-1].action);
-    } else {
-        set_status_message("Macro creation cancelled.");
+    editor_load_all();
+    for (int y = match_index_next_candidate(E.num_lines - 1, -1); y >= 0 && y >= start_y; y = match_index_next_candidate(y - 1, -1)) {
+        EditorLine *line = editor_get_line(y);
+        int from = (y == start_y) ? (start_x > 0 ? start_x : 0) : 0;
+        if (from > line->size) continue;
+        int x = search_last(&pattern, line->chars, line->size, from, line->size);
+        if (x >= 0) {
+            E.cursor_y = y;
+            E.cursor_x = x;
+            E.last_search_found_y = E.cursor_y;
+            E.last_search_found_x = E.cursor_x;
+            set_status_message("Found '%s' (wrapped from end)", E.last_search_query);
+            return;
+        }
     }
-    reset_command_mode();
+
+    set_status_message("'%s' not found.", E.last_search_query);
+    E.search_active = false;
+    match_index_set_query("", false);
 }
 
 /**
- * @brief Duplicates the current line.
+ * @brief Replaces `n` non-overlapping ranges of one line in a single pass.
+ *
+ * The new text is assembled in one freshly allocated buffer that then
+ * becomes the line's storage, so the cost is linear in the line length no
+ * matter how many matches it has.
+ *
+ * @param y Index of the line.
+ * @param xs Start of each range, ascending, in the line's current coordinates.
+ * @param n Number of ranges.
+ * @param from_len Length of every range.
+ * @param to Replacement text.
+ * @param to_len Length of the replacement text.
+ * @return true on success, false if memory could not be allocated.
  */
-void editor_duplicate_line(void) {
-    if (E.cursor_y >= E.num_lines) {
-        set_status_message("Nothing to duplicate.");
-        return;
+static bool line_splice_matches(int y, const int *xs, int n, int from_len, const char *to, int to_len) {
+    EditorLine *line = editor_get_line(y);
+    long new_size = (long)line->size + (long)n * (to_len - from_len);
+    if (new_size < 0 || new_size >= INT_MAX) return false;
+    int capacity = new_size + 1 < MIN_LINE_ALLOCATION ? MIN_LINE_ALLOCATION : (int)new_size + 1;
+
+    char *out = line_chars_alloc(&capacity);
+    if (out == NULL) return false;
+
+    char *dst = out;
+    int src = 0;
+    for (int i = 0; i < n; i++) {
+        memcpy(dst, line->chars + src, (size_t)(xs[i] - src));
+        dst += xs[i] - src;
+        memcpy(dst, to, (size_t)to_len);
+        dst += to_len;
+        src = xs[i] + from_len;
+    }
+    memcpy(dst, line->chars + src, (size_t)(line->size - src));
+    out[new_size] = '\0';
+
+    editor_line_set_buffer(line, out, (int)new_size, capacity);
+    return true;
+}
+
+/**
+ * @brief Replaces every occurrence of `find` in the buffer.
+ *
+ * Each line is scanned once and rebuilt once. The whole operation is pushed
+ * as a single UNDO_REPLACE_ALL record holding the match positions, so one
+ * undo reverts it however many matches there were.
+ *
+ * @param find Text to look for; need not be NUL-terminated.
+ * @param find_len Length of `find`, > 0.
+ * @param replace Replacement text.
+ * @param replace_len Length of `replace`.
+ * @return Number of replacements made, or -1 if memory ran out (the lines
+ * already rewritten stay rewritten and the undo history is cleared).
+ */
+int editor_replace_all(const char *find, int find_len, const char *replace, int replace_len) {
+    ReplaceMatch *matches = NULL;
+    int count = 0, matches_allocated = 0;
+    int *xs = NULL;
+    int xs_allocated = 0;
+    int first_y = -1, last_y = -1;
+    bool failed = false;
+
+    editor_load_all();
+    for (int y = 0; y < E.num_lines && !failed; y++) {
+        EditorLine *line = editor_get_line(y);
+        const char *end = line->chars + line->size;
+        const char *pos = line->chars;
+        int n = 0;
+
+        while ((pos = text_search_forward(pos, (size_t)(end - pos), find, (size_t)find_len)) != NULL) {
+            if (n == xs_allocated) {
+                int new_allocated = xs_allocated ? xs_allocated * 2 : 64;
+                int *grown = realloc(xs, sizeof(int) * (size_t)new_allocated);
+                if (grown == NULL) { failed = true; break; }
+                xs = grown;
+                xs_allocated = new_allocated;
+            }
+            xs[n++] = (int)(pos - line->chars);
+            pos += find_len;
+        }
+        if (failed || n == 0) continue;
+
+        if (count + n > matches_allocated) {
+            int new_allocated = matches_allocated ? matches_allocated : 256;
+            while (new_allocated < count + n) new_allocated *= 2;
+            ReplaceMatch *grown = realloc(matches, sizeof(ReplaceMatch) * (size_t)new_allocated);
+            if (grown == NULL) { failed = true; break; }
+            matches = grown;
+            matches_allocated = new_allocated;
+        }
+        if (!line_splice_matches(y, xs, n, find_len, replace, replace_len)) { failed = true; break; }
+
+        for (int i = 0; i < n; i++) {
+            matches[count].y = y;
+            matches[count].x = xs[i];
+            count++;
+        }
+        if (first_y == -1) first_y = y;
+        last_y = y;
     }
-    EditorLine *line = &E.lines[E.cursor_y];
-    
-    editor_insert_line(E.cursor_y + 1, line->chars, line->size);
+    free(xs);
+
+    if (count > 0) {
+        E.dirty = true;
+        mark_lines_dirty(first_y, last_y);
+    }
+
+    if (failed) {
+        free(matches);
+        undo_discard_history("Error: Out of memory during replace; undo history cleared.");
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    ReplaceHeader header = { .find_len = find_len, .replace_len = replace_len, .count = count };
+    size_t payload_len = sizeof(header) + (size_t)find_len + (size_t)replace_len + sizeof(ReplaceMatch) * (size_t)count;
+    char *payload = payload_len < INT_MAX ? malloc(payload_len) : NULL;
+    if (payload == NULL) {
+        free(matches);
+        undo_discard_history("Replace too large to undo; undo history cleared.");
+        return count;
+    }
+    char *p = payload;
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    memcpy(p, find, (size_t)find_len);
+    p += find_len;
+    memcpy(p, replace, (size_t)replace_len);
+    p += replace_len;
+    memcpy(p, matches, sizeof(ReplaceMatch) * (size_t)count);
 
     UndoAction ua = {
-        .type = UNDO_INSERT_BLOCK,
-        .y = E.cursor_y + 1,
-        .x = 0,
+        .type = UNDO_REPLACE_ALL,
+        .y = matches[0].y,
+        .x = matches[0].x,
         .char_val = '\0',
-        .text_content = strdup(line->chars),
-        .text_len = line->size,
-        .num_lines_affected = 1
+        .text_content = payload,
+        .text_len = (int)payload_len,
+        .num_lines_affected = last_y - first_y + 1
     };
     push_undo_action(ua);
-    set_status_message("Line duplicated.");
+    free(payload);
+    free(matches);
+    return count;
 }
 
 /**
- * @brief Changes the case of characters in the current line.
+ * @brief Undoes or redoes an UNDO_REPLACE_ALL record, one pass per line.
  *
- * @param to_upper If true, converts to uppercase; otherwise, to lowercase.
+ * Match positions are stored in pre-replacement coordinates; when undoing,
+ * the k-th match on a line has moved by k times the length difference.
+ *
+ * @param action The UNDO_REPLACE_ALL record.
+ * @param reverse True to put the found text back, false to replace again.
  */
-void editor_change_line_case(bool to_upper) {
-    if (E.cursor_y >= E.num_lines) {
-        set_status_message("Nothing to change case.");
+static void replace_all_apply(const UndoAction *action, bool reverse) {
+    ReplaceHeader header;
+    memcpy(&header, action->text_content, sizeof(header));
+    const char *find = action->text_content + sizeof(header);
+    const char *replace = find + header.find_len;
+    const char *match_data = replace + header.replace_len;
+
+    const char *to = reverse ? find : replace;
+    int to_len = reverse ? header.find_len : header.replace_len;
+    int from_len = reverse ? header.replace_len : header.find_len;
+    int shift = reverse ? header.replace_len - header.find_len : 0;
+
+    int *xs = malloc(sizeof(int) * (size_t)header.count);
+    if (xs == NULL) {
+        set_status_message("Error: Out of memory applying replace history.");
         return;
     }
-    EditorLine *line = &E.lines[E.cursor_y];
-    
-    UndoAction ua = {
-        .type = UNDO_MODIFY_LINE_CASE,
-        .y = E.cursor_y,
-        .x = 0,
-        .char_val = '\0',
-        .text_content = strdup(line->chars),
-        .text_len = line->size,
-        .num_lines_affected = 1
-    };
-    push_undo_action(ua);
 
-    for (int i = 0; i < line->size; i++) {
-        if (to_upper) {
-            line->chars[i] = (char)toupper((unsigned char)line->chars[i]);
-        } else {
-            line->chars[i] = (char)tolower((unsigned char)line->chars[i]);
+    int i = 0;
+    while (i < header.count) {
+        ReplaceMatch m;
+        memcpy(&m, match_data + sizeof(ReplaceMatch) * (size_t)i, sizeof(m));
+        int y = m.y;
+        int n = 0;
+        while (i < header.count) {
+            memcpy(&m, match_data + sizeof(ReplaceMatch) * (size_t)i, sizeof(m));
+            if (m.y != y) break;
+            xs[n] = m.x + n * shift;
+            n++;
+            i++;
+        }
+        if (!line_splice_matches(y, xs, n, from_len, to, to_len)) {
+            set_status_message("Error: Out of memory applying replace history.");
+            break;
         }
     }
-    
-    mark_lines_dirty(E.cursor_y, E.cursor_y);
-    set_status_message(to_upper ? "Converted to uppercase." : "Converted to lowercase.");
+    free(xs);
 }
 
 /**
- * @brief Sets the current keyboard input mode.
+ * @brief Replaces `n` non-overlapping ranges of one line, each with its own
+ * text, in a single pass; the variable-length form of line_splice_matches().
  *
- * @param mode The KeyboardMode to set.
+ * @param ranges Ascending, in the line's current coordinates.
+ * @return true on success, false if memory could not be allocated.
  */
-void editor_set_keyboard_mode(KeyboardMode mode) {
-    E.keyboard_mode = mode;
+static bool line_splice_ranges(int y, const SpliceRange *ranges, int n) {
+    EditorLine *line = editor_get_line(y);
+    long new_size = line->size;
+    for (int i = 0; i < n; i++) {
+        new_size += ranges[i].to_len - ranges[i].len;
+    }
+    if (new_size < 0 || new_size >= INT_MAX) return false;
+    int capacity = new_size + 1 < MIN_LINE_ALLOCATION ? MIN_LINE_ALLOCATION : (int)new_size + 1;
+
+    char *out = line_chars_alloc(&capacity);
+    if (out == NULL) return false;
+
+    char *dst = out;
+    int src = 0;
+    for (int i = 0; i < n; i++) {
+        memcpy(dst, line->chars + src, (size_t)(ranges[i].x - src));
+        dst += ranges[i].x - src;
+        memcpy(dst, ranges[i].to, (size_t)ranges[i].to_len);
+        dst += ranges[i].to_len;
+        src = ranges[i].x + ranges[i].len;
+    }
+    memcpy(dst, line->chars + src, (size_t)(line->size - src));
+    out[new_size] = '\0';
+
+    editor_line_set_buffer(line, out, (int)new_size, capacity);
+    return true;
 }
 
 /**
- * @brief Moves the cursor to the beginning of the current or previous word.
+ * @brief Appends bytes to a growable buffer.
+ *
+ * @return false if memory ran out.
  */
-void move_to_word_start(void) {
-    if (E.cursor_y >= E.num_lines) return;
-    EditorLine *line = &E.lines[E.cursor_y];
-    int cx = E.cursor_x;
+static bool regex_replace_append(char **buf, size_t *len, size_t *allocated, const char *text, size_t text_len) {
+    if (*len + text_len > *allocated) {
+        size_t grown_allocated = *allocated ? *allocated : 256;
+        while (grown_allocated < *len + text_len) grown_allocated *= 2;
+        char *grown = realloc(*buf, grown_allocated);
+        if (grown == NULL) return false;
+        *buf = grown;
+        *allocated = grown_allocated;
+    }
+    if (text != NULL && text_len > 0) memcpy(*buf + *len, text, text_len);
+    *len += text_len;
+    return true;
+}
 
-    while (cx > 0 && !isalnum((unsigned char)line->chars[cx - 1]) && !isspace((unsigned char)line->chars[cx-1])) {
-        cx--;
+/**
+ * @brief Replaces every match of a regex in the buffer; the replacement can
+ * bring in the match and its groups with \0 to \9.
+ *
+ * Like editor_replace_all(), each line is scanned and rebuilt once, and one
+ * UNDO_REGEX_REPLACE_ALL record holds what every match was and became.
+ *
+ * @return Number of replacements made, or -1 if memory ran out (the lines
+ * already rewritten stay rewritten and the undo history is cleared).
+ */
+int editor_regex_replace_all(Regex *regex, const char *replace, int replace_len) {
+    RegexReplaceMatch *matches = NULL;
+    int count = 0, matches_allocated = 0;
+    SpliceRange *ranges = NULL;
+    int ranges_allocated = 0;
+    char *found = NULL, *replaced = NULL;
+    size_t found_len = 0, found_allocated = 0, replaced_len = 0, replaced_allocated = 0;
+    int first_y = -1, last_y = -1;
+    bool failed = false;
+
+    editor_load_all();
+    for (int y = 0; y < E.num_lines && !failed; y++) {
+        EditorLine *line = editor_get_line(y);
+        RegexMatch m;
+        regex_matches_begin(regex, line->chars, line->size, &m);
+        int line_first = count;
+        size_t line_replaced = replaced_len;
+
+        while (regex_matches_next(regex, line->chars, line->size, &m)) {
+            if (count == matches_allocated) {
+                int new_allocated = matches_allocated ? matches_allocated * 2 : 256;
+                RegexReplaceMatch *grown = realloc(matches, sizeof(RegexReplaceMatch) * (size_t)new_allocated);
+                if (grown == NULL) { failed = true; break; }
+                matches = grown;
+                matches_allocated = new_allocated;
+            }
+            size_t to_len = regex_expand(replace, (size_t)replace_len, line->chars, &m, NULL);
+            if (to_len >= INT_MAX ||
+                !regex_replace_append(&found, &found_len, &found_allocated, line->chars + m.start, (size_t)(m.end - m.start)) ||
+                !regex_replace_append(&replaced, &replaced_len, &replaced_allocated, NULL, to_len)) {
+                failed = true;
+                break;
+            }
+            regex_expand(replace, (size_t)replace_len, line->chars, &m, replaced + replaced_len - to_len);
+            matches[count++] = (RegexReplaceMatch){ y, m.start, m.end - m.start, (int)to_len };
+        }
+        int n = count - line_first;
+        if (failed || n == 0) continue;
+
+        if (n > ranges_allocated) {
+            int new_allocated = ranges_allocated ? ranges_allocated : 64;
+            while (new_allocated < n) new_allocated *= 2;
+            SpliceRange *grown = realloc(ranges, sizeof(SpliceRange) * (size_t)new_allocated);
+            if (grown == NULL) { failed = true; break; }
+            ranges = grown;
+            ranges_allocated = new_allocated;
+        }
+        const char *to = replaced + line_replaced;
+        for (int i = 0; i < n; i++) {
+            const RegexReplaceMatch *match = &matches[line_first + i];
+            ranges[i] = (SpliceRange){ match->x, match->found_len, to, match->replace_len };
+            to += match->replace_len;
+        }
+        if (!line_splice_ranges(y, ranges, n)) { failed = true; break; }
+        if (first_y == -1) first_y = y;
+        last_y = y;
+    }
+    free(ranges);
+
+    if (first_y >= 0) {
+        E.dirty = true;
+        mark_lines_dirty(first_y, last_y);
+    }
+    size_t payload_len = sizeof(ReplaceHeader) + found_len + replaced_len + sizeof(RegexReplaceMatch) * (size_t)count;
+    char *payload = NULL;
+    if (!failed && count > 0 && payload_len < INT_MAX) payload = malloc(payload_len);
+    if (payload != NULL) {
+        ReplaceHeader header = { .find_len = (int)found_len, .replace_len = (int)replaced_len, .count = count };
+        char *p = payload;
+        memcpy(p, &header, sizeof(header));
+        p += sizeof(header);
+        // Both stay NULL when every match and its replacement were empty
+        if (found != NULL) memcpy(p, found, found_len);
+        p += found_len;
+        if (replaced != NULL) memcpy(p, replaced, replaced_len);
+        p += replaced_len;
+        memcpy(p, matches, sizeof(RegexReplaceMatch) * (size_t)count);
+
+        UndoAction ua = {
+            .type = UNDO_REGEX_REPLACE_ALL,
+            .y = matches[0].y,
+            .x = matches[0].x,
+            .char_val = '\0',
+            .text_content = payload,
+            .text_len = (int)payload_len,
+            .num_lines_affected = last_y - first_y + 1
+        };
+        push_undo_action(ua);
+        free(payload);
     }
-    while (cx > 0 && isalnum((unsigned char)line->chars[cx - 1])) {
-        cx--;
+    free(found);
+    free(replaced);
+    free(matches);
+
+    if (failed) {
+        undo_discard_history("Error: Out of memory during replace; undo history cleared.");
+        return -1;
     }
-    mark_lines_dirty(E.cursor_y, E.cursor_y);
-    E.cursor_x = cx;
-    mark_lines_dirty(E.cursor_y, E.cursor_y);
+    if (count > 0 && payload == NULL) {
+        undo_discard_history("Replace too large to undo; undo history cleared.");
+    }
+    return count;
+}
+
+/**
+ * @brief Undoes or redoes an UNDO_REGEX_REPLACE_ALL record, one pass per line.
+ *
+ * Match positions are stored in pre-replacement coordinates; when undoing,
+ * each match has moved by what the replacements before it on its line
+ * added or removed.
+ *
+ * @param action The UNDO_REGEX_REPLACE_ALL record.
+ * @param reverse True to put the found text back, false to replace again.
+ */
+static void regex_replace_apply(const UndoAction *action, bool reverse) {
+    ReplaceHeader header;
+    memcpy(&header, action->text_content, sizeof(header));
+    const char *found = action->text_content + sizeof(header);
+    const char *replaced = found + header.find_len;
+    const char *match_data = replaced + header.replace_len;
+
+    SpliceRange *ranges = malloc(sizeof(SpliceRange) * (size_t)header.count);
+    if (ranges == NULL) {
+        set_status_message("Error: Out of memory applying replace history.");
+        return;
+    }
+
+    int i = 0;
+    while (i < header.count) {
+        RegexReplaceMatch m;
+        memcpy(&m, match_data + sizeof(RegexReplaceMatch) * (size_t)i, sizeof(m));
+        int y = m.y;
+        int n = 0, shift = 0;
+        while (i < header.count) {
+            memcpy(&m, match_data + sizeof(RegexReplaceMatch) * (size_t)i, sizeof(m));
+            if (m.y != y) break;
+            ranges[n++] = reverse ? (SpliceRange){ m.x + shift, m.replace_len, found, m.found_len }
+                                  : (SpliceRange){ m.x, m.found_len, replaced, m.replace_len };
+            shift += m.replace_len - m.found_len;
+            found += m.found_len;
+            replaced += m.replace_len;
+            i++;
+        }
+        if (!line_splice_ranges(y, ranges, n)) {
+            set_status_message("Error: Out of memory applying replace history.");
+            break;
+        }
+    }
+    free(ranges);
+}
+
+/**
+ * @brief Implements Find and Replace functionality.
+ */
+void editor_find_replace(void) {
+    char find_buf[MAX_STATUS_MESSAGE_LENGTH];
+    char replace_buf[MAX_STATUS_MESSAGE_LENGTH];
+    
+    char* find = editor_prompt(E.search_regex ? "Regex find: %s" : "Find: %s", find_buf, sizeof(find_buf));
+    if (!find) {
+        set_status_message("Find & Replace cancelled.");
+        return;
+    }
+    SearchPattern pattern;
+    char error[MAX_STATUS_MESSAGE_LENGTH];
+    if (!search_pattern_init(&pattern, find, E.search_regex, error, sizeof(error))) {
+        set_status_message("Regex error: %s", error);
+        return;
+    }
+    
+    char* replace = editor_prompt("Replace with: %s", replace_buf, sizeof(replace_buf));
+    if (!replace) {
+        set_status_message("Find & Replace cancelled.");
+        return;
+    }
+
+    int discards = E.undo.discards;
+    int occurrences;
+    if (pattern.regex != NULL) {
+        // The match index may have evicted it from the cache while the prompt waited for keys
+        if (!search_pattern_init(&pattern, find, true, NULL, 0)) return;
+        occurrences = editor_regex_replace_all(pattern.regex, replace, (int)strlen(replace));
+    } else {
+        occurrences = editor_replace_all(find, (int)strlen(find), replace, (int)strlen(replace));
+    }
+    // The replacements may have shortened the line under the cursor
+    if (E.cursor_y < E.num_lines && E.cursor_x > editor_get_line(E.cursor_y)->size) {
+        E.cursor_x = editor_get_line(E.cursor_y)->size;
+    }
+    // A warning that the undo history was lost stays on screen
+    if (occurrences >= 0 && E.undo.discards == discards) {
+        set_status_message("Replaced %d occurrences.", occurrences);
+    }
+}
+
+/**
+ * @brief Turns regex search on or off for the next find, replace or
+ * project search. Find next keeps the kind of search it was started with.
+ */
+void command_regex_toggle(void) {
+    E.search_regex = !E.search_regex;
+    set_status_message(E.search_regex ? "Regex search on; \\1 to \\9 in a replacement insert groups." : "Regex search off.");
+}
+
+/**
+ * @brief Copies the current line to the clipboard.
+ */
+void editor_copy_line(void) {
+    if (E.cursor_y >= E.num_lines) {
+        set_status_message("Nothing to copy.");
+        return;
+    }
+    if (!clipboard_copy_range(E.cursor_y, 0, E.cursor_y, editor_get_line(E.cursor_y)->size)) return;
+    set_status_message("Line copied.");
+}
+
+/**
+ * @brief Cuts the current line to the clipboard.
+ */
+void editor_cut_line(void) {
+    if (E.cursor_y >= E.num_lines) {
+        set_status_message("Nothing to cut.");
+        return;
+    }
+    push_line_delete_undo(E.cursor_y);
+
+    editor_copy_line();
+    editor_delete_line(E.cursor_y);
+    if (E.num_lines == 0) {
+        E.cursor_y = 0;
+        E.cursor_x = 0;
+        editor_insert_line(0, "", 0);
+    } else if (E.cursor_y >= E.num_lines) {
+        E.cursor_y = E.num_lines - 1;
+        E.cursor_x = editor_get_line(E.cursor_y)->size;
+    } else if (E.cursor_x > editor_get_line(E.cursor_y)->size) {
+        E.cursor_x = editor_get_line(E.cursor_y)->size;
+    }
+    set_status_message("Line cut.");
+}
+
+/**
+ * @brief Inserts pasted text at the cursor as one undoable edit and moves the
+ * cursor past it.
+ *
+ * @param text The text, with '\n' line breaks.
+ * @param len Length of the text, > 0.
+ */
+static void editor_insert_pasted(const char *text, int len) {
+    undo_begin_group();
+    if (E.cursor_y == E.num_lines) {
+        UndoAction ua = { .type = UNDO_INSERT_EMPTY_LINE, .y = E.num_lines, .x = 0, .char_val = '\0', .text_content = NULL, .text_len = 0, .num_lines_affected = 0 };
+        push_undo_action(ua);
+        editor_insert_line(E.num_lines, "", 0);
+    }
+
+    int lines = 1;
+    const char *last_newline = NULL;
+    for (const char *p = memchr(text, '\n', (size_t)len); p != NULL; p = memchr(p + 1, '\n', (size_t)(text + len - p - 1))) {
+        lines++;
+        last_newline = p;
+    }
+    UndoAction ua = {
+        .type = UNDO_INSERT_BLOCK,
+        .y = E.cursor_y,
+        .x = E.cursor_x,
+        .char_val = '\0',
+        .num_lines_affected = lines
+    };
+    char *payload = push_undo_record(ua, (size_t)len);
+    if (payload != NULL) {
+        memcpy(payload, text, (size_t)len);
+    }
+    int first_line = E.cursor_y;
+    editor_insert_text_block(E.cursor_y, E.cursor_x, text, len);
+    undo_end_group();
+
+    if (last_newline == NULL) {
+        E.cursor_x += len;
+    } else {
+        E.cursor_y += lines - 1;
+        E.cursor_x = (int)(text + len - last_newline - 1);
+    }
+    E.dirty = true;
+    mark_lines_dirty(first_line, lines > 1 ? E.num_lines : first_line);
+}
+
+/**
+ * @brief Reads a bracketed paste up to its end marker and inserts it.
+ *
+ * Called on KEY_PASTE_BEGIN. The pasted keys are read through
+ * editor_read_key(), so a paste recorded into a macro replays the same way.
+ * Carriage returns become line breaks; other control keys are dropped.
+ */
+void editor_paste_bracketed(void) {
+    char *text = NULL;
+    size_t len = 0, allocated = 0;
+    bool failed = false;
+    while (true) {
+        // Macros and scripts hand out Escape forever once they run out
+        if (E.replay.active ? E.replay.pos >= E.replay.count : E.headless && E.script.pos >= E.script.count) break;
+        int c = editor_read_key();
+        if (c == KEY_PASTE_END || c == ERR) break;
+        if (c == '\r') c = '\n';
+        if (c > 255 || (c < ' ' && c != '\n' && c != '\t') || failed) continue;
+        if (len == allocated) {
+            size_t grown = allocated ? allocated * 2 : 4096;
+            char *bigger = grown < INT_MAX ? realloc(text, grown) : NULL;
+            if (bigger == NULL) {
+                failed = true; // Keep reading so the rest of the paste is not typed in
+                continue;
+            }
+            text = bigger;
+            allocated = grown;
+        }
+        text[len++] = (char)c;
+    }
+
+    if (failed) {
+        set_status_message("Error: Paste too large; nothing was inserted.");
+    } else if (len > 0) {
+        editor_insert_pasted(text, (int)len);
+    }
+    free(text);
+}
+
+/**
+ * @brief Inserts a block of text starting at (y,x). Handles newlines within text.
+ * @param y The starting line index.
+ * @param x The starting character index.
+ * @param text The text block to insert.
+ * @param text_len The length of the text block.
+ */
+void editor_insert_text_block(int y, int x, const char *text, int text_len) {
+    if (text_len == 0 || y < 0) return;
+
+    if (y >= E.num_lines) {
+        editor_insert_line(E.num_lines, "", 0);
+        y = E.num_lines - 1;
+        x = 0;
+    }
+
+    const char *text_end = text + text_len;
+    const char *first_newline = memchr(text, '\n', (size_t)text_len);
+    int head_len = (int)((first_newline ? first_newline : text_end) - text);
+    EditorLine *line = editor_get_line(y);
+    if (x < 0 || x > line->size) return; // An undo record that no longer fits the line
+
+    if (first_newline == NULL) {
+        if (!editor_line_reserve(line, line->size + text_len + 1)) return;
+        memmove(&line->chars[x + text_len], &line->chars[x], (size_t)(line->size - x + 1));
+        memcpy(&line->chars[x], text, (size_t)text_len);
+        line->size += text_len;
+        editor_line_changed(line);
+        mark_lines_dirty(y, y);
+        return;
+    }
+
+    // Every newline in the block starts a line; the last one also takes the
+    // rest of line y. All of them go into the rope in one splice.
+    int count = 0;
+    for (const char *p = first_newline; p != NULL; p = memchr(p + 1, '\n', (size_t)(text_end - p - 1))) {
+        count++;
+    }
+    EditorLine *built = malloc(sizeof(EditorLine) * (size_t)count);
+    if (built == NULL) {
+        set_status_message("Error: Memory allocation for text block.");
+        return;
+    }
+    int n = 0;
+    bool ok = true;
+    for (const char *p = first_newline + 1; n < count; n++) {
+        const char *newline = memchr(p, '\n', (size_t)(text_end - p));
+        const char *seg_end = newline ? newline : text_end;
+        ok = editor_line_init(&built[n], p, (int)(seg_end - p));
+        if (ok && newline == NULL) {
+            ok = editor_line_append(&built[n], &line->chars[x], line->size - x);
+            if (!ok) editor_line_free(&built[n]);
+        }
+        if (!ok) break;
+        p = seg_end + 1;
+    }
+    ok = ok && editor_line_reserve(line, x + head_len + 1) && line_store_insert_range(y + 1, built, count);
+    if (!ok) {
+        while (n-- > 0) editor_line_free(&built[n]);
+        free(built);
+        set_status_message("Error: Memory allocation for text block.");
+        return;
+    }
+    free(built);
+
+    line = editor_get_line(y);
+    editor_line_truncate(line, x);
+    editor_line_append(line, text, head_len);
+    mark_lines_dirty(y, E.num_lines);
+}
+
+
+/**
+ * @brief Deletes a block of text from (sy,sx) to (ey,ex).
+ * Assumes (sy,sx) and (ey,ex) are normalized coordinates.
+ * @param sy Start Y of deletion.
+ * @param sx Start X of deletion.
+ * @param ey End Y of deletion.
+ * @param ex End X of deletion.
+ */
+void editor_delete_text_block(int sy, int sx, int ey, int ex) {
+    if (sy < 0 || sy >= E.num_lines || ey < 0 || ey >= E.num_lines) return;
+    // Undo records are not trusted to fit the lines
+    if (sx < 0 || sx > editor_get_line(sy)->size || ex < 0 || ex > editor_get_line(ey)->size) return;
+    if (sy > ey || (sy == ey && sx > ex)) return;
+
+    if (sy == ey) {
+        EditorLine *line = editor_get_line(sy);
+        if (!editor_line_reserve(line, line->size + 1)) return;
+        memmove(&line->chars[sx], &line->chars[ex], (size_t)line->size - ex + 1);
+        line->size -= (ex - sx);
+        editor_line_changed(line);
+    } else {
+        EditorLine *start_line = editor_get_line(sy);
+        const EditorLine *end_line = editor_get_line(ey);
+        if (!editor_line_reserve(start_line, sx + end_line->size - ex + 1)) return;
+        editor_line_truncate(start_line, sx);
+        editor_line_append(start_line, &end_line->chars[ex], end_line->size - ex);
+        line_store_remove_range(sy + 1, ey - sy);
+    }
+    mark_lines_dirty(sy, E.num_lines);
+}
+
+
+/**
+ * @brief Pastes the newest clipboard register.
+ */
+void editor_paste_line(void) {
+    editor_paste_register(0);
+}
+
+/**
+ * @brief Displays information about the current file.
+ */
+void editor_show_file_info(void) {
+    if (E.filename == NULL) {
+        set_status_message("No file loaded.");
+        return;
+    }
+
+    struct stat st;
+    if (stat(E.filename, &st) == -1) {
+        set_status_message("Error getting file info for %s: %s", E.filename, strerror(errno));
+        return;
+    }
+
+    editor_load_all();
+    char ctime_str[64];
+    char mtime_str[64];
+    strftime(ctime_str, sizeof(ctime_str), "%Y-%m-%d %H:%M:%S", localtime(&st.st_ctime));
+    strftime(mtime_str, sizeof(mtime_str), "%Y-%m-%d %H:%M:%S", localtime(&st.st_mtime));
+
+    set_status_message("File: %s | Size: %ld bytes | Lines: %d | Created: %s | Modified: %s",
+                       E.filename, (long)st.st_size, E.num_lines, ctime_str, mtime_str);
+}
+
+/**
+ * @brief Prompts for a line number and moves the cursor to that line.
+ */
+void editor_goto_line(void) {
+    char line_num_buf[MAX_STATUS_MESSAGE_LENGTH];
+    char *result = editor_prompt("Go to line: %s", line_num_buf, sizeof(line_num_buf));
+
+    if (result == NULL) {
+        set_status_message("Go to line cancelled.");
+        return;
+    }
+
+    int target_line = atoi(result);
+    if (target_line <= 0) {
+        set_status_message("Invalid line number. Must be positive.");
+        return;
+    }
+
+    target_line--; 
+    editor_load_through(target_line);
+
+    if (target_line >= 0 && target_line < E.num_lines) {
+        mark_lines_dirty(E.cursor_y, E.cursor_y);
+        E.cursor_y = target_line;
+        E.cursor_x = 0;
+        mark_lines_dirty(E.cursor_y, E.cursor_y);
+        set_status_message("Moved to line %d.", target_line + 1);
+    } else {
+        set_status_message("Line %d is out of bounds (total lines: %d).", target_line + 1, E.num_lines);
+    }
+}
+
+/**
+ * @brief Toggles the display of line numbers.
+ */
+void editor_toggle_line_numbers(void) {
+    E.show_line_numbers = !E.show_line_numbers;
+    set_status_message("Line numbers: %s", E.show_line_numbers ? "ON" : "OFF");
+    mark_lines_dirty(0, E.num_lines - 1);
+}
+
+/**
+ * @brief Displays a list of recently opened files and allows the user to select one.
+ */
+void editor_show_recent_files(void) {
+    if (E.num_recent_files == 0) {
+        set_status_message("No recently opened files.");
+        return;
+    }
+
+    int order[MAX_RECENT_FILES];
+    recent_files_order(order);
+
+    // Entries are stored as absolute paths so they survive a change of
+    // directory; list them relative to the working directory where possible
+    // so the prompt stays short, and double any '%' since the prompt is a
+    // format string.
+    char cwd[PATH_MAX];
+    size_t cwd_len = getcwd(cwd, sizeof(cwd)) != NULL ? strlen(cwd) : 0;
+    char prompt_msg[MAX_STATUS_MESSAGE_LENGTH * 2];
+    int offset = snprintf(prompt_msg, sizeof(prompt_msg), "Recent Files (Select #, ESC to cancel):");
+    for (int i = 0; i < E.num_recent_files && offset < (int)sizeof(prompt_msg); i++) {
+        const char *name = E.recent_files[order[i]].path;
+        if (cwd_len > 0 && strncmp(name, cwd, cwd_len) == 0 && name[cwd_len] == '/') {
+            name += cwd_len + 1;
+        }
+        offset += snprintf(prompt_msg + offset, sizeof(prompt_msg) - offset, "\n%d. ", i + 1);
+        if (offset >= (int)sizeof(prompt_msg)) break;
+        for (; *name != '\0' && offset < (int)sizeof(prompt_msg) - 2; name++) {
+            if (*name == '%') prompt_msg[offset++] = '%';
+            prompt_msg[offset++] = *name;
+        }
+        prompt_msg[offset] = '\0';
+    }
+    if (offset < (int)sizeof(prompt_msg)) {
+        snprintf(prompt_msg + offset, sizeof(prompt_msg) - offset, "\nSelect: %%s");
+    }
+
+    char choice_buf[10];
+    char *result = editor_prompt(prompt_msg, choice_buf, sizeof(choice_buf));
+
+    if (result == NULL) {
+        set_status_message("Recent files selection cancelled.");
+        return;
+    }
+
+    int selection = atoi(result);
+    if (selection > 0 && selection <= E.num_recent_files) {
+        buffer_open(E.recent_files[order[selection - 1]].path);
+    } else {
+        set_status_message("Invalid selection.");
+    }
+}
+
+/**
+ * @brief Enters creative mode to define a new macro.
+ * Prompts the user for the action string associated with the current command sequence.
+ */
+void enter_creative_mode(void) {
+    if (E.macro_count >= MAX_MACROS) {
+        set_status_message("Max macros reached (%d). Cannot create more.", MAX_MACROS);
+        reset_command_mode();
+        return;
+    }
+    if (E.cmd.length == 0) {
+        set_status_message("Cannot create macro for empty sequence.");
+        reset_command_mode();
+        return;
+    }
+
+    E.creative_mode = true;
+    char action_buf[MAX_MACRO_ACTION_LENGTH];
+    char prompt_msg[MAX_STATUS_MESSAGE_LENGTH];
+    snprintf(prompt_msg, sizeof(prompt_msg), "Creative Mode: Enter action for '%s': %%s", E.cmd.sequence);
+    // editor_prompt() resets the command state, sequence included
+    char sequence[MAX_COMMAND_SEQUENCE_LENGTH];
+    snprintf(sequence, sizeof(sequence), "%s", E.cmd.sequence);
+
+    char *result = editor_prompt(prompt_msg, action_buf, sizeof(action_buf));
+    reset_command_mode();
+
+    if (result == NULL) {
+        set_status_message("Macro creation cancelled.");
+        return;
+    }
+
+    bool recorded = strcmp(action_buf, "recorded") == 0 && E.recorder.count > 0 && !E.recorder.active;
+    if (macro_define(sequence, action_buf, recorded ? E.recorder.keys : NULL, recorded ? E.recorder.count : 0)) {
+        set_status_message("Macro saved: '%s' => '%s'", sequence, action_buf);
+    }
+}
+
+/**
+ * @brief Binds a command sequence to a macro, replacing the one it had.
+ *
+ * @param sequence The command sequence.
+ * @param action The action name, "recorded" to replay `keys`.
+ * @param keys Recorded key stream, copied; NULL for none.
+ * @param key_count Length of `keys`.
+ * @return false, with the reason in the status bar, if the macro was not defined.
+ */
+static bool macro_define(const char *sequence, const char *action, const int *keys, int key_count) {
+    // Redefining a macro replaces it in place
+    const CommandTrieNode *existing = command_table_find(sequence);
+    if (existing && existing->command) {
+        set_status_message("'%s' is a built-in command.", existing->command->sequence);
+        return false;
+    }
+    int slot = existing ? existing->macro : E.macro_count;
+    if (slot == MAX_MACROS) {
+        set_status_message("Max macros reached (%d). Cannot create more.", MAX_MACROS);
+        return false;
+    }
+    if (slot == E.macro_count && !command_table_add_macro(sequence, slot)) {
+        set_status_message("Error: Failed to register macro.");
+        return false;
+    }
+    EditorMacro *macro = &E.macros[slot];
+    free(macro->keys);
+    macro->keys = NULL;
+    macro->key_count = 0;
+    if (keys != NULL && key_count > 0) {
+        macro->keys = malloc(sizeof(int) * (size_t)key_count);
+        if (macro->keys == NULL) {
+            set_status_message("Error: Failed to copy the recorded macro.");
+            return false;
+        }
+        memcpy(macro->keys, keys, sizeof(int) * (size_t)key_count);
+        macro->key_count = key_count;
+    }
+    snprintf(macro->sequence, sizeof(macro->sequence), "%s", sequence);
+    snprintf(macro->action, sizeof(macro->action), "%s", action);
+    macro->handler = macro_action_lookup(macro->action);
+    if (slot == E.macro_count) E.macro_count++;
+    return true;
+}
+
+/**
+ * @brief Duplicates the current line.
+ */
+void editor_duplicate_line(void) {
+    if (E.cursor_y >= E.num_lines) {
+        set_status_message("Nothing to duplicate.");
+        return;
+    }
+    EditorLine *line = editor_get_line(E.cursor_y);
+
+    // Recorded as inserting "\n<line>" at the end of the current line
+    char *inserted = malloc((size_t)line->size + 2);
+    if (inserted == NULL) {
+        set_status_message("Error: Failed to allocate memory for duplicate.");
+        return;
+    }
+    inserted[0] = '\n';
+    memcpy(inserted + 1, line->chars, (size_t)line->size);
+    inserted[line->size + 1] = '\0';
+    UndoAction ua = {
+        .type = UNDO_INSERT_BLOCK,
+        .y = E.cursor_y,
+        .x = line->size,
+        .char_val = '\0',
+        .text_content = inserted,
+        .text_len = line->size + 1,
+        .num_lines_affected = 2
+    };
+    push_undo_action(ua);
+    free(inserted);
+
+    editor_insert_line(E.cursor_y + 1, line->chars, line->size);
+    set_status_message("Line duplicated.");
+}
+
+/**
+ * @brief Changes the case of characters in the current line.
+ *
+ * @param to_upper If true, converts to uppercase; otherwise, to lowercase.
+ */
+void editor_change_line_case(bool to_upper) {
+    if (E.cursor_y >= E.num_lines) {
+        set_status_message("Nothing to change case.");
+        return;
+    }
+    EditorLine *line = editor_get_line(E.cursor_y);
+    
+    UndoAction ua = {
+        .type = UNDO_MODIFY_LINE_CASE,
+        .y = E.cursor_y,
+        .x = 0,
+        .char_val = '\0',
+        .text_content = line->chars,
+        .text_len = line->size,
+        .num_lines_affected = 1
+    };
+    push_undo_action(ua);
+
+    if (!editor_line_reserve(line, line->size + 1)) return;
+    for (int i = 0; i < line->size; i++) {
+        if (to_upper) {
+            line->chars[i] = (char)toupper((unsigned char)line->chars[i]);
+        } else {
+            line->chars[i] = (char)tolower((unsigned char)line->chars[i]);
+        }
+    }
+    editor_line_changed(line);
+    
+    mark_lines_dirty(E.cursor_y, E.cursor_y);
+    set_status_message(to_upper ? "Converted to uppercase." : "Converted to lowercase.");
+}
+
+/**
+ * @brief Sets the current keyboard input mode.
+ *
+ * @param mode The KeyboardMode to set.
+ */
+void editor_set_keyboard_mode(KeyboardMode mode) {
+    E.keyboard_mode = mode;
+}
+
+/**
+ * @brief Tells whether a byte belongs to a word for word motion.
+ *
+ * Every byte of a multi-byte UTF-8 character counts, so accented and
+ * non-Latin words are stepped over whole.
+ */
+static bool is_word_byte(char c) {
+    return isalnum((unsigned char)c) || (unsigned char)c >= 0x80;
+}
+
+/**
+ * @brief Moves the cursor to the beginning of the current or previous word.
+ */
+void move_to_word_start(void) {
+    if (E.cursor_y >= E.num_lines) return;
+    EditorLine *line = editor_get_line(E.cursor_y);
+    int cx = E.cursor_x;
+
+    while (cx > 0 && !is_word_byte(line->chars[cx - 1]) && !isspace((unsigned char)line->chars[cx-1])) {
+        cx--;
+    }
+    while (cx > 0 && is_word_byte(line->chars[cx - 1])) {
+        cx--;
+    }
+    mark_lines_dirty(E.cursor_y, E.cursor_y);
+    E.cursor_x = cx;
+    mark_lines_dirty(E.cursor_y, E.cursor_y);
 }
 
 /**
  * @brief Moves the cursor to the end of the current or next word.
  */
-void move_to_word_end(void) {
-    if (E.cursor_y >= E.num_lines) return;
-    EditorLine *line = &E.lines[E.cursor_y];
-    int cx = E.cursor_x;
+void move_to_word_end(void) {
+    if (E.cursor_y >= E.num_lines) return;
+    EditorLine *line = editor_get_line(E.cursor_y);
+    int cx = E.cursor_x;
+
+    while (cx < line->size && !is_word_byte(line->chars[cx]) && !isspace((unsigned char)line->chars[cx])) {
+        cx++;
+    }
+    while (cx < line->size && is_word_byte(line->chars[cx])) {
+        cx++;
+    }
+    mark_lines_dirty(E.cursor_y, E.cursor_y);
+    E.cursor_x = cx;
+    mark_lines_dirty(E.cursor_y, E.cursor_y);
+}
+
+/**
+ * @brief Normalizes selection coordinates so that (sy, sx) is always the top-left
+ * and (ey, ex) is always the bottom-right of the selection.
+ * This handles cases where the user selects backwards.
+ * @param sy Pointer to store normalized start Y.
+ * @param sx Pointer to store normalized start X.
+ * @param ey Pointer to store normalized normalized end Y.
+ * @param ex Pointer to store normalized normalized end X.
+ */
+void get_normalized_selection_coords(int *sy, int *sx, int *ey, int *ex) {
+    if (E.visual_start_y < E.cursor_y) {
+        *sy = E.visual_start_y;
+        *sx = E.visual_start_x;
+        *ey = E.cursor_y;
+        *ex = E.cursor_x;
+    } else if (E.visual_start_y > E.cursor_y) {
+        *sy = E.cursor_y;
+        *sx = E.cursor_x;
+        *ey = E.visual_start_y;
+        *ex = E.visual_start_x;
+    } else {
+        *sy = E.visual_start_y;
+        *ey = E.cursor_y;
+        if (E.visual_start_x < E.cursor_x) {
+            *sx = E.visual_start_x;
+            *ex = E.cursor_x;
+        } else {
+            *sx = E.cursor_x;
+            *ex = E.visual_start_x;
+        }
+    }
+    // The anchor can be left past the end of a line that was shortened since
+    if (*sy >= 0 && *sy < E.num_lines && *sx > editor_get_line(*sy)->size) *sx = editor_get_line(*sy)->size;
+    if (*ey >= 0 && *ey < E.num_lines && *ex > editor_get_line(*ey)->size) *ex = editor_get_line(*ey)->size;
+}
+
+/**
+ * @brief Gets the content of the currently selected text.
+ * @param sy Start Y of selection.
+ * @param sx Start X of selection.
+ * @param ey End Y of selection.
+ * @param ex End X of selection.
+ * @param num_lines Pointer to store the number of lines in the selection.
+ * @return Dynamically allocated string containing the selected text, or NULL if error/empty.
+ */
+char *get_selection_content(int sy, int sx, int ey, int ex, int *num_lines) {
+    *num_lines = 0;
+    if (sy < 0 || sy >= E.num_lines || ey < 0 || ey >= E.num_lines) return NULL;
+
+    size_t total_len = 0;
+    for (int y = sy; y <= ey; y++) {
+        int start_col = (y == sy) ? sx : 0;
+        int end_col = (y == ey) ? ex : editor_get_line(y)->size;
+        if (end_col < start_col) end_col = start_col;
+        total_len += (size_t)(end_col - start_col);
+        if (y < ey) total_len++;
+        (*num_lines)++;
+    }
+
+    if (total_len == 0) return NULL;
+
+    char *buffer = malloc(total_len + 1);
+    if (buffer == NULL) {
+        set_status_message("Error: Failed to allocate memory for selection content.");
+        return NULL;
+    }
+
+    char *ptr = buffer;
+    for (int y = sy; y <= ey; y++) {
+        int start_col = (y == sy) ? sx : 0;
+        int end_col = (y == ey) ? ex : editor_get_line(y)->size;
+        if (end_col < start_col) end_col = start_col;
+        
+        memcpy(ptr, editor_get_line(y)->chars + start_col, (size_t)(end_col - start_col));
+        ptr += (end_col - start_col);
+        if (y < ey) {
+            *ptr++ = '\n';
+        }
+    }
+    *ptr = '\0';
+    return buffer;
+}
+
+/**
+ * @brief Checks if a given character coordinate (row, col) is within the current selection.
+ * @param row The row of the character.
+ * @param col The column of the character.
+ * @return True if the character is selected, false otherwise.
+ */
+bool is_char_in_selection(int row, int col) {
+    if (!E.visual_mode) return false;
+
+    int sy, sx, ey, ex;
+    get_normalized_selection_coords(&sy, &sx, &ey, &ex);
+
+    if (row < sy || row > ey) return false;
+
+    if (row == sy && row == ey) {
+        return (col >= sx && col < ex);
+    } else if (row == sy) {
+        return (col >= sx);
+    } else if (row == ey) {
+        return (col < ex);
+    } else {
+        return true;
+    }
+}
+
+/**
+ * @brief Toggles visual selection mode.
+ */
+void editor_toggle_visual_mode(void) {
+    E.visual_mode = !E.visual_mode;
+    if (E.visual_mode) {
+        E.visual_start_x = E.cursor_x;
+        E.visual_start_y = E.cursor_y;
+        set_status_message("Visual Mode ON. Move cursor to select. ESC to cancel.");
+    } else {
+        set_status_message("Visual Mode OFF.");
+    }
+    mark_lines_dirty(0, E.num_lines - 1);
+}
+
+/**
+ * @brief Copies the currently selected text to the clipboard.
+ */
+void editor_copy_selection(void) {
+    if (!E.visual_mode) {
+        editor_copy_line();
+        return;
+    }
+
+    int sy, sx, ey, ex;
+    get_normalized_selection_coords(&sy, &sx, &ey, &ex);
+    
+    if ((sy == ey && sx == ex) || ey >= E.num_lines) {
+        set_status_message("Empty selection. Nothing copied.");
+        editor_toggle_visual_mode();
+        return;
+    }
+    if (!clipboard_copy_range(sy, sx, ey, ex)) return;
+
+    set_status_message("Selection copied (%zu chars).", clipboard_register(0)->bytes);
+    editor_toggle_visual_mode();
+}
+
+/**
+ * @brief Deletes the currently selected text.
+ */
+void editor_delete_selection(void) {
+    if (!E.visual_mode) {
+        set_status_message("No selection to delete. Enter visual mode (Ctrl+V) first.");
+        return;
+    }
+
+    int sy, sx, ey, ex;
+    get_normalized_selection_coords(&sy, &sx, &ey, &ex);
+
+    int num_lines_in_selection;
+    char *deleted_content = get_selection_content(sy, sx, ey, ex, &num_lines_in_selection);
+
+    if (deleted_content == NULL) {
+        set_status_message("Empty selection. Nothing deleted.");
+        editor_toggle_visual_mode();
+        return;
+    }
+
+    UndoAction ua = {
+        .type = UNDO_DELETE_BLOCK,
+        .y = sy, .x = sx, .char_val = '\0',
+        .text_content = deleted_content,
+        .text_len = (int)strlen(deleted_content),
+        .num_lines_affected = num_lines_in_selection
+    };
+    push_undo_action(ua);
+    free(deleted_content);
+
+    editor_delete_text_block(sy, sx, ey, ex);
+
+    E.cursor_x = sx;
+    E.cursor_y = sy;
+    E.dirty = true;
+    mark_lines_dirty(sy, E.num_lines - 1);
+
+    set_status_message("Selection deleted.");
+    editor_toggle_visual_mode();
+}
+
+/**
+ * @brief Cuts the currently selected text to the clipboard.
+ */
+void editor_cut_selection(void) {
+    if (!E.visual_mode) {
+        editor_cut_line();
+        return;
+    }
+    int sy, sx, ey, ex;
+    get_normalized_selection_coords(&sy, &sx, &ey, &ex);
+
+    if ((sy == ey && sx == ex) || ey >= E.num_lines) {
+        set_status_message("Empty selection. Nothing cut.");
+        editor_toggle_visual_mode();
+        return;
+    }
+    if (!clipboard_copy_range(sy, sx, ey, ex)) return;
+
+    // The undo record takes its text from the register instead of a second copy of the selection
+    int discards = E.undo.discards;
+    const ClipRegister *reg = clipboard_register(0);
+    UndoAction ua = {
+        .type = UNDO_DELETE_BLOCK,
+        .y = sy, .x = sx, .char_val = '\0',
+        .num_lines_affected = reg->lines
+    };
+    char *payload = push_undo_record(ua, reg->bytes);
+    if (payload != NULL) {
+        clipboard_flatten(reg, payload);
+    }
+
+    editor_delete_text_block(sy, sx, ey, ex);
+
+    E.cursor_x = sx;
+    E.cursor_y = sy;
+    E.dirty = true;
+    mark_lines_dirty(sy, E.num_lines - 1);
+
+    if (E.undo.discards == discards) set_status_message("Selection cut.");
+    editor_toggle_visual_mode();
+}
+
+/**
+ * @brief Adds a filename to the list of recently opened files.
+ *
+ * Entries are stamped with the time of their last open instead of being kept
+ * in order, so reopening one only updates its stamp. A new file takes the
+ * slot of the oldest once the list is full, and that file's session goes.
+ *
+ * @param filename The path to the file to add.
+ */
+void add_to_recent_files(const char *filename) {
+    if (!filename) return;
+    char *path = realpath(filename, NULL);
+    if (path == NULL) path = strdup(filename);
+    if (path == NULL) {
+        set_status_message("Error: Failed to store recent file path.");
+        return;
+    }
+
+    for (int i = 0; i < E.num_recent_files; i++) {
+        if (strcmp(E.recent_files[i].path, path) == 0) {
+            E.recent_files[i].opened = session_now_ns();
+            free(path);
+            return;
+        }
+    }
+
+    int slot;
+    if (E.num_recent_files < MAX_RECENT_FILES) {
+        slot = E.num_recent_files++;
+    } else {
+        slot = 0;
+        for (int i = 1; i < E.num_recent_files; i++) {
+            if (E.recent_files[i].opened < E.recent_files[slot].opened) slot = i;
+        }
+        char *session = session_path_for(E.recent_files[slot].path);
+        if (session != NULL) unlink(session);
+        free(session);
+        free(E.recent_files[slot].path);
+    }
+    E.recent_files[slot] = (RecentFile){ path, session_now_ns() };
+}
+
+// --- Clipboard Register Implementation ---
+//
+// Copies go into a ring of CLIPBOARD_REGISTERS registers, register 0 being
+// the newest. A register references unedited text in the file mapping rather
+// than copying it, so copying a large selection of a freshly opened file
+// costs one piece per run of untouched lines. The ring keeps at most
+// CLIPBOARD_BYTE_BUDGET bytes of actual copies (the newest register is
+// always kept), and references into the mapping are turned into copies
+// before it is unmapped.
+
+/**
+ * @brief Returns the n-th newest register.
+ *
+ * @param n 0 for the newest copy, 1 for the one before, and so on.
+ * @return The register, or NULL if the ring holds fewer copies.
+ */
+static ClipRegister *clipboard_register(int n) {
+    if (n < 0 || n >= E.register_count) return NULL;
+    return &E.registers[(E.register_newest - n + CLIPBOARD_REGISTERS) % CLIPBOARD_REGISTERS];
+}
+
+/**
+ * @brief Releases a register and leaves it empty.
+ */
+static void clipboard_register_free(ClipRegister *reg) {
+    free(reg->pieces);
+    free(reg->owned);
+    memset(reg, 0, sizeof(*reg));
+}
+
+/**
+ * @brief Captures the text from (sy,sx) up to (ey,ex) into a register.
+ *
+ * The first pass only sizes the pieces and the copies, so the second can
+ * write them without ever reallocating a buffer pieces point into.
+ *
+ * @param reg Receives the text; overwritten without being freed.
+ * @return true on success, false if memory ran out (reg is left empty).
+ */
+static bool clipboard_capture(ClipRegister *reg, int sy, int sx, int ey, int ex) {
+    memset(reg, 0, sizeof(*reg));
+    for (int pass = 0; pass < 2; pass++) {
+        int count = 0;
+        size_t owned = 0;
+        bool last_owned = false;
+        const char *borrowed_end = NULL;
+
+        for (int y = sy; y <= ey; y++) {
+            const EditorLine *line = editor_get_line(y);
+            int to = (y == ey && ex < line->size) ? ex : line->size;
+            int from = (y == sy && sx < to) ? sx : (y == sy ? to : 0);
+            bool borrowed = line->allocated == 0;
+            // A mapped line still followed by its newline takes it along
+            bool newline_borrowed = borrowed && y < ey && to == line->size &&
+                                    line->chars + line->size < E.map_base + E.map_size && line->chars[line->size] == '\n';
+            struct {
+                const char *chars;
+                size_t len;
+                bool borrowed;
+            } parts[2] = {
+                { line->chars + from, (size_t)(to - from) + (newline_borrowed ? 1 : 0), borrowed },
+                { "\n", (y < ey && !newline_borrowed) ? 1 : 0, false },
+            };
+
+            for (int k = 0; k < 2; k++) {
+                if (parts[k].len == 0) continue;
+                bool extend = count > 0 && (parts[k].borrowed ? !last_owned && borrowed_end == parts[k].chars : last_owned);
+                if (!extend) {
+                    if (pass == 1) {
+                        reg->pieces[count].chars = parts[k].borrowed ? parts[k].chars : reg->owned + owned;
+                        reg->pieces[count].len = 0;
+                    }
+                    count++;
+                }
+                if (pass == 1) {
+                    if (!parts[k].borrowed) memcpy(reg->owned + owned, parts[k].chars, parts[k].len);
+                    reg->pieces[count - 1].len += parts[k].len;
+                    reg->bytes += parts[k].len;
+                }
+                if (parts[k].borrowed) {
+                    borrowed_end = parts[k].chars + parts[k].len;
+                } else {
+                    owned += parts[k].len;
+                }
+                last_owned = !parts[k].borrowed;
+            }
+        }
+
+        if (pass == 0) {
+            reg->pieces = malloc(sizeof(ClipPiece) * (size_t)(count > 0 ? count : 1));
+            reg->owned = owned > 0 ? malloc(owned) : NULL;
+            if (reg->pieces == NULL || (owned > 0 && reg->owned == NULL)) {
+                clipboard_register_free(reg);
+                return false;
+            }
+            reg->owned_size = owned;
+        } else {
+            reg->count = count;
+        }
+    }
+    reg->lines = ey - sy + 1;
+    return true;
+}
+
+/**
+ * @brief Copies the text from (sy,sx) up to (ey,ex) into a new newest register.
+ *
+ * @return true on success, false if memory ran out (status message set).
+ */
+bool clipboard_copy_range(int sy, int sx, int ey, int ex) {
+    ClipRegister reg;
+    if (!clipboard_capture(&reg, sy, sx, ey, ex)) {
+        set_status_message("Error: Failed to allocate clipboard memory.");
+        return false;
+    }
+
+    // With the ring full, the oldest register makes room
+    E.register_newest = (E.register_newest + 1) % CLIPBOARD_REGISTERS;
+    clipboard_register_free(&E.registers[E.register_newest]);
+    E.registers[E.register_newest] = reg;
+    if (E.register_count < CLIPBOARD_REGISTERS) E.register_count++;
+
+    size_t owned = 0;
+    for (int n = 0; n < E.register_count; n++) {
+        owned += clipboard_register(n)->owned_size;
+    }
+    while (E.register_count > 1 && owned > CLIPBOARD_BYTE_BUDGET) {
+        ClipRegister *oldest = clipboard_register(E.register_count - 1);
+        owned -= oldest->owned_size;
+        clipboard_register_free(oldest);
+        E.register_count--;
+    }
+    return true;
+}
+
+/**
+ * @brief Writes the text of a register into `dst`, which must hold reg->bytes bytes.
+ */
+static void clipboard_flatten(const ClipRegister *reg, char *dst) {
+    for (int i = 0; i < reg->count; i++) {
+        memcpy(dst, reg->pieces[i].chars, reg->pieces[i].len);
+        dst += reg->pieces[i].len;
+    }
+}
+
+/**
+ * @brief Writes `len` bytes of the text of a register, from offset `from`, into `dst`.
+ */
+static void clipboard_read(const ClipRegister *reg, size_t from, size_t len, char *dst) {
+    for (int i = 0; i < reg->count && len > 0; i++) {
+        if (from >= reg->pieces[i].len) {
+            from -= reg->pieces[i].len;
+            continue;
+        }
+        size_t n = reg->pieces[i].len - from < len ? reg->pieces[i].len - from : len;
+        memcpy(dst, reg->pieces[i].chars + from, n);
+        dst += n;
+        len -= n;
+        from = 0;
+    }
+}
+
+/**
+ * @brief Turns every register piece that points into a file mapping into a
+ * copy. Must run before the mapping goes away.
+ *
+ * @param base Start of the mapping.
+ * @param size Its length.
+ */
+void clipboard_detach_mapping(const char *base, size_t size) {
+    for (int n = 0; n < E.register_count; n++) {
+        ClipRegister *reg = clipboard_register(n);
+        bool borrowed = false;
+        for (int i = 0; i < reg->count && !borrowed; i++) {
+            borrowed = reg->pieces[i].chars >= base && reg->pieces[i].chars < base + size;
+        }
+        if (!borrowed) continue;
+
+        ClipPiece *piece = malloc(sizeof(ClipPiece));
+        char *text = malloc(reg->bytes);
+        if (piece == NULL || text == NULL) {
+            free(piece);
+            free(text);
+            clipboard_register_free(reg); // Stays in the ring as an empty register
+            continue;
+        }
+        clipboard_flatten(reg, text);
+        int lines = reg->lines;
+        size_t bytes = reg->bytes;
+        clipboard_register_free(reg);
+        piece->chars = text;
+        piece->len = bytes;
+        reg->pieces = piece;
+        reg->count = 1;
+        reg->owned = text;
+        reg->owned_size = bytes;
+        reg->bytes = bytes;
+        reg->lines = lines;
+    }
+}
+
+/**
+ * @brief Inserts the text of a register at (y,x).
+ *
+ * Whole lines coming from the file mapping are inserted as borrowed lines
+ * again, so pasting unedited text copies none of it; everything else is
+ * built with one allocation per line.
+ *
+ * @param y Line to insert at, which must exist.
+ * @param end_y Receives the line the inserted text ends on.
+ * @param end_x Receives the column just after the inserted text.
+ * @return true on success, false if memory ran out part way.
+ */
+static bool clipboard_paste(const ClipRegister *reg, int y, int x, int *end_y, int *end_x) {
+    EditorLine *first = editor_get_line(y);
+    int tail_len = first->size - x;
+    char *tail = NULL;
+    EditorLine *built = NULL;
+    int count = reg->lines - 1; // Lines after the first, put into the rope in one splice
+    if (tail_len > 0) {
+        tail = malloc((size_t)tail_len);
+    }
+    if (count > 0) {
+        built = malloc(sizeof(EditorLine) * (size_t)count);
+    }
+    if ((tail_len > 0 && tail == NULL) || (count > 0 && built == NULL)) {
+        free(tail);
+        free(built);
+        set_status_message("Error: Memory allocation for text block.");
+        return false;
+    }
+    if (tail_len > 0) {
+        memcpy(tail, &first->chars[x], (size_t)tail_len);
+        editor_line_truncate(first, x);
+    }
+
+    EditorLine *cur = first;
+    int n = 0;
+    int col = x;
+    bool need_line = false; // A newline was passed; the next text starts a new line
+    bool ok = true;
+
+    for (int i = 0; i < reg->count && ok; i++) {
+        const char *p = reg->pieces[i].chars;
+        const char *end = p + reg->pieces[i].len;
+        bool mapped = E.map_base != NULL && p >= E.map_base && end <= E.map_base + E.map_size;
+        while (p < end && ok) {
+            const char *newline = memchr(p, '\n', (size_t)(end - p));
+            const char *seg_end = newline ? newline : end;
+            int len = (int)(seg_end - p);
+            if (need_line) {
+                cur = &built[n];
+                if (mapped && newline) {
+                    *cur = (EditorLine){ .chars = (char *)p, .size = len, .allocated = 0, .hl = NULL, .hl_revision = 0, .hl_lexed_revision = -1, .match_revision = -1 };
+                } else {
+                    ok = editor_line_init(cur, p, len);
+                }
+                if (ok) n++;
+                col = len;
+                need_line = false;
+            } else {
+                ok = editor_line_append(cur, p, len);
+                col += len;
+            }
+            if (newline) need_line = true;
+            p = newline ? newline + 1 : end;
+        }
+    }
+    if (ok && need_line) {
+        cur = &built[n];
+        ok = editor_line_init(cur, "", 0);
+        if (ok) n++;
+        col = 0;
+    }
+    bool tail_kept = false; // The tail went back onto line y itself
+    if (ok && tail != NULL) {
+        ok = editor_line_append(cur, tail, tail_len);
+        tail_kept = ok && cur == first;
+    }
+    ok = ok && line_store_insert_range(y + 1, built, n);
+    if (!ok) {
+        // Put back the tail of the line and drop whatever was built
+        while (n-- > 0) editor_line_free(&built[n]);
+        first = editor_get_line(y);
+        if (tail != NULL && !tail_kept) editor_line_append(first, tail, tail_len);
+        set_status_message("Error: Memory allocation for text block.");
+    }
+    free(tail);
+    free(built);
+
+    E.dirty = true;
+    mark_lines_dirty(y, E.num_lines);
+    *end_y = ok ? y + n : y;
+    *end_x = ok ? col : first->size;
+    return ok;
+}
+
+/**
+ * @brief Pastes the n-th newest register at the cursor and moves the cursor
+ * past the pasted text.
+ *
+ * @param n Register number, 0 for the newest copy.
+ */
+void editor_paste_register(int n) {
+    const ClipRegister *reg = clipboard_register(n);
+    if (reg == NULL || reg->bytes == 0) {
+        set_status_message(n == 0 ? "Clipboard is empty." : "Register %d is empty.", n);
+        return;
+    }
+
+    int discards = E.undo.discards;
+    undo_begin_group();
+    if (E.cursor_y >= E.num_lines) {
+        // Pasting on the row past the end makes it a line first, undone along with the paste
+        UndoAction ua = { .type = UNDO_INSERT_EMPTY_LINE, .y = E.num_lines, .x = 0, .char_val = '\0', .text_content = NULL, .text_len = 0, .num_lines_affected = 0 };
+        push_undo_action(ua);
+        editor_insert_line(E.num_lines, "", 0);
+        E.cursor_y = E.num_lines - 1;
+        E.cursor_x = 0;
+    }
+    UndoAction ua = {
+        .type = UNDO_INSERT_BLOCK,
+        .y = E.cursor_y,
+        .x = E.cursor_x,
+        .char_val = '\0',
+        .num_lines_affected = reg->lines
+    };
+    char *payload = push_undo_record(ua, reg->bytes);
+    if (payload != NULL) {
+        clipboard_flatten(reg, payload);
+    }
+
+    int end_y = E.cursor_y, end_x = E.cursor_x;
+    bool ok = clipboard_paste(reg, E.cursor_y, E.cursor_x, &end_y, &end_x);
+    undo_end_group();
+    E.cursor_y = end_y;
+    E.cursor_x = end_x;
+    // A warning that the undo history was lost stays on screen
+    if (ok && E.undo.discards == discards) set_status_message("Pasted.");
+}
+
+/**
+ * @brief Command handler: asks for a register number and pastes it.
+ */
+static void command_paste_register(void) {
+    if (E.register_count == 0) {
+        set_status_message("Clipboard is empty.");
+        return;
+    }
+
+    char prompt[MAX_STATUS_MESSAGE_LENGTH];
+    snprintf(prompt, sizeof(prompt), "Paste register (0 = newest ... %d): %%s", E.register_count - 1);
+    char buf[16];
+    if (editor_prompt(prompt, buf, sizeof(buf)) == NULL) return;
+
+    char *end;
+    long n = strtol(buf, &end, 10);
+    if (end == buf || *end != '\0' || n < 0 || n >= E.register_count) {
+        set_status_message("No register %s.", buf);
+        return;
+    }
+    editor_paste_register((int)n);
+}
+
+// --- Search Kernel Implementation ---
+//
+// Substring search filters candidate positions a whole vector at a time by
+// comparing the needle's first and last bytes against two overlapping loads
+// of the haystack; only positions where both match are checked with memcmp.
+// The vector width is picked at compile time (AVX2, SSE2 or NEON) and the
+// scalar memchr/memrchr path handles the tail and other targets.
+
+#if defined(__AVX2__)
+#define SEARCH_VECTOR_BYTES 32
+#define SEARCH_MASK_BITS_PER_BYTE 1
+typedef __m256i SearchVector;
+
+static inline SearchVector search_splat(char c) {
+    return _mm256_set1_epi8(c);
+}
+
+static inline uint64_t search_candidates(const char *p, size_t needle_len, SearchVector first, SearchVector last) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)p);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(p + needle_len - 1));
+    return (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+}
+#elif defined(__SSE2__)
+#define SEARCH_VECTOR_BYTES 16
+#define SEARCH_MASK_BITS_PER_BYTE 1
+typedef __m128i SearchVector;
+
+static inline SearchVector search_splat(char c) {
+    return _mm_set1_epi8(c);
+}
+
+static inline uint64_t search_candidates(const char *p, size_t needle_len, SearchVector first, SearchVector last) {
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + needle_len - 1));
+    return (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+}
+#elif defined(__ARM_NEON)
+#define SEARCH_VECTOR_BYTES 16
+#define SEARCH_MASK_BITS_PER_BYTE 4 // NEON has no movemask: narrow each byte to a nibble
+typedef uint8x16_t SearchVector;
+
+static inline SearchVector search_splat(char c) {
+    return vdupq_n_u8((uint8_t)c);
+}
+
+static inline uint64_t search_candidates(const char *p, size_t needle_len, SearchVector first, SearchVector last) {
+    uint8x16_t a = vld1q_u8((const uint8_t *)p);
+    uint8x16_t b = vld1q_u8((const uint8_t *)(p + needle_len - 1));
+    uint8x16_t eq = vandq_u8(vceqq_u8(a, first), vceqq_u8(b, last));
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+#endif
+
+/**
+ * @brief Finds the first occurrence of `needle` in `hay`.
+ *
+ * @param hay Bytes to search; need not be NUL-terminated.
+ * @param hay_len Number of bytes in `hay`.
+ * @param needle Bytes to look for.
+ * @param needle_len Length of `needle`.
+ * @return Pointer to the first match, or NULL if there is none.
+ */
+const char *text_search_forward(const char *hay, size_t hay_len, const char *needle, size_t needle_len) {
+    if (needle_len == 0) return hay;
+    if (needle_len > hay_len) return NULL;
+    if (needle_len == 1) return memchr(hay, (unsigned char)needle[0], hay_len);
+
+    size_t last_start = hay_len - needle_len; // Last position a match can start at
+    size_t i = 0;
+#ifdef SEARCH_VECTOR_BYTES
+    SearchVector first = search_splat(needle[0]);
+    SearchVector last = search_splat(needle[needle_len - 1]);
+    for (; i + SEARCH_VECTOR_BYTES - 1 <= last_start; i += SEARCH_VECTOR_BYTES) {
+        uint64_t mask = search_candidates(hay + i, needle_len, first, last);
+        while (mask != 0) {
+            size_t offset = (size_t)__builtin_ctzll(mask) / SEARCH_MASK_BITS_PER_BYTE;
+            if (memcmp(hay + i + offset + 1, needle + 1, needle_len - 2) == 0) {
+                return hay + i + offset;
+            }
+            mask &= ~((((uint64_t)1 << SEARCH_MASK_BITS_PER_BYTE) - 1) << (offset * SEARCH_MASK_BITS_PER_BYTE));
+        }
+    }
+#endif
+    while (i <= last_start) {
+        const char *p = memchr(hay + i, (unsigned char)needle[0], last_start - i + 1);
+        if (p == NULL) return NULL;
+        if (memcmp(p + 1, needle + 1, needle_len - 1) == 0) return p;
+        i = (size_t)(p - hay) + 1;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Finds the last occurrence of `needle` that lies entirely inside `hay`.
+ *
+ * Scans from the end backwards, so finding the previous match costs the
+ * distance to it, not the length of everything before it.
+ *
+ * @param hay Bytes to search; need not be NUL-terminated.
+ * @param hay_len Number of bytes in `hay`.
+ * @param needle Bytes to look for.
+ * @param needle_len Length of `needle`.
+ * @return Pointer to the last match, or NULL if there is none.
+ */
+const char *text_search_backward(const char *hay, size_t hay_len, const char *needle, size_t needle_len) {
+    if (needle_len == 0) return hay + hay_len;
+    if (needle_len > hay_len) return NULL;
+    if (needle_len == 1) return memrchr(hay, (unsigned char)needle[0], hay_len);
+
+    size_t end = hay_len - needle_len + 1; // Candidate starts still to check are [0, end)
+#ifdef SEARCH_VECTOR_BYTES
+    SearchVector first = search_splat(needle[0]);
+    SearchVector last = search_splat(needle[needle_len - 1]);
+    while (end >= SEARCH_VECTOR_BYTES) {
+        size_t i = end - SEARCH_VECTOR_BYTES;
+        uint64_t mask = search_candidates(hay + i, needle_len, first, last);
+        while (mask != 0) {
+            size_t offset = (size_t)(63 - __builtin_clzll(mask)) / SEARCH_MASK_BITS_PER_BYTE;
+            if (memcmp(hay + i + offset + 1, needle + 1, needle_len - 2) == 0) {
+                return hay + i + offset;
+            }
+            mask &= ~((((uint64_t)1 << SEARCH_MASK_BITS_PER_BYTE) - 1) << (offset * SEARCH_MASK_BITS_PER_BYTE));
+        }
+        end = i;
+    }
+#endif
+    while (end > 0) {
+        const char *p = memrchr(hay, (unsigned char)needle[0], end);
+        if (p == NULL) return NULL;
+        if (memcmp(p + 1, needle + 1, needle_len - 1) == 0) return p;
+        end = (size_t)(p - hay);
+    }
+    return NULL;
+}
+
+// --- Regex Implementation ---
+//
+// The syntax: literal characters, . (one whole UTF-8 character), [...] and
+// [^...] classes with ASCII ranges, \d \w \s and their negations, ^ and $ at
+// the line ends, (...) groups, (?:...) groups that capture nothing, |,
+// and * + ? {m} {m,} {m,n}, each lazy when followed by ?. The compiled
+// pattern keeps its DFA states between searches, so find next on the same
+// query only extends the cache it built last time. A Regex is not
+// thread-safe; project search workers compile their own.
+
+/**
+ * @brief Appends a node to the parse tree.
+ *
+ * @return Index of the node, or -1 (with the parser error set) if memory ran out.
+ */
+static int regex_node(RegexParser *parser, RegexNodeType type, int a, int b) {
+    if (parser->node_count == parser->node_allocated) {
+        int grown_allocated = parser->node_allocated ? parser->node_allocated * 2 : 32;
+        RegexNode *grown = realloc(parser->nodes, sizeof(RegexNode) * (size_t)grown_allocated);
+        if (grown == NULL) {
+            parser->error = "out of memory";
+            return -1;
+        }
+        parser->nodes = grown;
+        parser->node_allocated = grown_allocated;
+    }
+    parser->nodes[parser->node_count] = (RegexNode){ type, a, b, 0, 0, true, 0 };
+    return parser->node_count++;
+}
+
+/**
+ * @brief Adds an empty byte set.
+ *
+ * @return Index of the set, or -1 (with the parser error set) if memory ran out.
+ */
+static int regex_new_set(RegexParser *parser) {
+    if (parser->set_count == parser->set_allocated) {
+        int grown_allocated = parser->set_allocated ? parser->set_allocated * 2 : 16;
+        uint32_t (*grown)[8] = realloc(parser->sets, sizeof(*grown) * (size_t)grown_allocated);
+        if (grown == NULL) {
+            parser->error = "out of memory";
+            return -1;
+        }
+        parser->sets = grown;
+        parser->set_allocated = grown_allocated;
+    }
+    memset(parser->sets[parser->set_count], 0, sizeof(parser->sets[0]));
+    return parser->set_count++;
+}
+
+/**
+ * @brief Adds the bytes lo to hi to a set.
+ */
+static void regex_set_add(uint32_t *set, int lo, int hi) {
+    for (int c = lo; c <= hi; c++) {
+        set[c >> 5] |= 1u << (c & 31);
+    }
+}
+
+/**
+ * @brief Tells whether a set holds a byte.
+ */
+static bool regex_set_has(const uint32_t *set, unsigned char c) {
+    return (set[c >> 5] >> (c & 31)) & 1;
+}
+
+/**
+ * @brief Makes a node matching one byte from lo to hi.
+ */
+static int regex_byte_node(RegexParser *parser, int lo, int hi) {
+    int set = regex_new_set(parser);
+    if (set < 0) return -1;
+    regex_set_add(parser->sets[set], lo, hi);
+    int n = regex_node(parser, REGEX_NODE_SET, 0, 0);
+    if (n >= 0) parser->nodes[n].value = set;
+    return n;
+}
+
+/**
+ * @brief Makes a node matching any one multi-byte UTF-8 character.
+ */
+static int regex_multibyte_node(RegexParser *parser) {
+    // Two, three or four bytes: a lead byte and that many minus one continuation bytes
+    static const int leads[3][2] = { { 0xC2, 0xDF }, { 0xE0, 0xEF }, { 0xF0, 0xF4 } };
+    int alt = -1;
+    for (int k = 0; k < 3; k++) {
+        int seq = regex_byte_node(parser, leads[k][0], leads[k][1]);
+        for (int i = 0; i <= k && seq >= 0; i++) {
+            int cont = regex_byte_node(parser, 0x80, 0xBF);
+            seq = cont < 0 ? -1 : regex_node(parser, REGEX_NODE_CONCAT, seq, cont);
+        }
+        if (seq < 0) return -1;
+        alt = alt < 0 ? seq : regex_node(parser, REGEX_NODE_ALT, alt, seq);
+        if (alt < 0) return -1;
+    }
+    return alt;
+}
+
+/**
+ * @brief Makes a node matching the character at the parse position, all the
+ * bytes of a UTF-8 sequence together, and moves past it.
+ */
+static int regex_char_node(RegexParser *parser) {
+    const char *p = parser->pos;
+    uint32_t cp;
+    int len = utf8_decode(p, (int)(parser->end - p), &cp);
+    parser->pos += len;
+    int n = regex_byte_node(parser, (unsigned char)p[0], (unsigned char)p[0]);
+    for (int i = 1; i < len && n >= 0; i++) {
+        int next = regex_byte_node(parser, (unsigned char)p[i], (unsigned char)p[i]);
+        n = next < 0 ? -1 : regex_node(parser, REGEX_NODE_CONCAT, n, next);
+    }
+    return n;
+}
+
+/**
+ * @brief Adds the ASCII part of a \d \w \s class, or of its negation, to a set.
+ *
+ * @param c The letter after the backslash.
+ * @param multibyte Set if the class also takes every non-ASCII character:
+ * \w does, like word motion, and so do \D and \S.
+ * @return false if `c` does not name a class.
+ */
+static bool regex_class_escape(char c, uint32_t *set, bool *multibyte) {
+    uint32_t ascii[8] = { 0 };
+    bool word_multibyte = false;
+    switch (tolower((unsigned char)c)) {
+        case 'd':
+            regex_set_add(ascii, '0', '9');
+            break;
+        case 'w':
+            regex_set_add(ascii, '0', '9');
+            regex_set_add(ascii, 'A', 'Z');
+            regex_set_add(ascii, 'a', 'z');
+            regex_set_add(ascii, '_', '_');
+            word_multibyte = true;
+            break;
+        case 's':
+            regex_set_add(ascii, ' ', ' ');
+            regex_set_add(ascii, '\t', '\r');
+            break;
+        default:
+            return false;
+    }
+    bool negated = isupper((unsigned char)c);
+    for (int i = 0; i < 4; i++) { // Bytes 0 to 127
+        set[i] |= negated ? ~ascii[i] : ascii[i];
+    }
+    if (word_multibyte != negated) *multibyte = true;
+    return true;
+}
+
+/**
+ * @brief Parses the escape at the parse position, just past its backslash.
+ */
+static int regex_parse_escape(RegexParser *parser) {
+    if (parser->pos == parser->end) {
+        parser->error = "trailing backslash";
+        return -1;
+    }
+    char c = *parser->pos;
+    uint32_t set[8] = { 0 };
+    bool multibyte = false;
+    if (regex_class_escape(c, set, &multibyte)) {
+        parser->pos++;
+        int n = regex_new_set(parser);
+        if (n < 0) return -1;
+        memcpy(parser->sets[n], set, sizeof(set));
+        int node = regex_node(parser, REGEX_NODE_SET, 0, 0);
+        if (node < 0) return -1;
+        parser->nodes[node].value = n;
+        if (!multibyte) return node;
+        int any = regex_multibyte_node(parser);
+        return any < 0 ? -1 : regex_node(parser, REGEX_NODE_ALT, node, any);
+    }
+    const char *special = strchr("tnr", c);
+    if (c != '\0' && special != NULL) {
+        parser->pos++;
+        char byte = c == 't' ? '\t' : c == 'n' ? '\n' : '\r';
+        return regex_byte_node(parser, (unsigned char)byte, (unsigned char)byte);
+    }
+    if (isalnum((unsigned char)c)) {
+        parser->error = isdigit((unsigned char)c) ? "backreferences are not supported" : "unknown escape";
+        return -1;
+    }
+    return regex_char_node(parser); // Escaped punctuation stands for itself
+}
+
+/**
+ * @brief Parses a [...] class, the parse position just past the bracket.
+ *
+ * ASCII members go into one byte set. Multi-byte characters become
+ * alternatives of their own, so they can be listed but not negated or used
+ * in ranges.
+ */
+static int regex_parse_class(RegexParser *parser) {
+    bool negated = parser->pos < parser->end && *parser->pos == '^';
+    if (negated) parser->pos++;
+    uint32_t set[8] = { 0 };
+    bool multibyte = false;
+    int members = -1; // Alternation of the multi-byte members
+    bool first = true;
+
+    while (true) {
+        if (parser->pos == parser->end) {
+            parser->error = "missing ]";
+            return -1;
+        }
+        unsigned char c = (unsigned char)*parser->pos;
+        if (c == ']' && !first) {
+            parser->pos++;
+            break;
+        }
+        first = false;
+        if (c >= 0x80) {
+            if (negated) {
+                parser->error = "negated classes cannot list non-ASCII characters";
+                return -1;
+            }
+            int member = regex_char_node(parser);
+            members = member < 0 ? -1 : members < 0 ? member : regex_node(parser, REGEX_NODE_ALT, members, member);
+            if (members < 0) return -1;
+            continue;
+        }
+        parser->pos++;
+        if (c == '\\') {
+            if (parser->pos == parser->end) continue; // Reported as a missing ]
+            char e = *parser->pos++;
+            if (regex_class_escape(e, set, &multibyte)) continue;
+            c = e == 't' ? '\t' : e == 'n' ? '\n' : e == 'r' ? '\r' : (unsigned char)e;
+            if (c >= 0x80 || (isalnum(c) && strchr("tnr", e) == NULL)) {
+                parser->error = "unknown escape";
+                return -1;
+            }
+        }
+        unsigned char hi = c;
+        if (parser->end - parser->pos >= 2 && parser->pos[0] == '-' && parser->pos[1] != ']') {
+            hi = (unsigned char)parser->pos[1];
+            if (hi == '\\' && parser->end - parser->pos >= 3) {
+                hi = (unsigned char)parser->pos[2];
+                parser->pos++;
+            }
+            parser->pos += 2;
+            if (hi >= 0x80 || hi < c) {
+                parser->error = hi >= 0x80 ? "ranges must be ASCII" : "range out of order";
+                return -1;
+            }
+        }
+        regex_set_add(set, c, hi);
+    }
+
+    if (negated) {
+        for (int i = 0; i < 4; i++) set[i] = ~set[i];
+        multibyte = !multibyte;
+    }
+    int n = regex_new_set(parser);
+    if (n < 0) return -1;
+    memcpy(parser->sets[n], set, sizeof(set));
+    int node = regex_node(parser, REGEX_NODE_SET, 0, 0);
+    if (node < 0) return -1;
+    parser->nodes[node].value = n;
+    if (multibyte) {
+        int any = regex_multibyte_node(parser);
+        node = any < 0 ? -1 : regex_node(parser, REGEX_NODE_ALT, node, any);
+    }
+    if (node >= 0 && members >= 0) node = regex_node(parser, REGEX_NODE_ALT, node, members);
+    return node;
+}
+
+/**
+ * @brief Parses one character, class, group or anchor.
+ */
+static int regex_parse_atom(RegexParser *parser) {
+    char c = *parser->pos;
+    switch (c) {
+        case '(': {
+            parser->pos++;
+            if (++parser->depth > REGEX_MAX_DEPTH) {
+                parser->error = "groups nested too deeply";
+                return -1;
+            }
+            int group = 0;
+            if (parser->end - parser->pos >= 2 && parser->pos[0] == '?' && parser->pos[1] == ':') {
+                parser->pos += 2;
+            } else {
+                group = ++parser->group_count;
+            }
+            int inner = regex_parse_alt(parser);
+            if (inner < 0) return -1;
+            if (parser->pos == parser->end || *parser->pos != ')') {
+                parser->error = "missing )";
+                return -1;
+            }
+            parser->pos++;
+            parser->depth--;
+            int n = regex_node(parser, REGEX_NODE_GROUP, inner, 0);
+            if (n >= 0) parser->nodes[n].value = group <= REGEX_MAX_GROUPS ? group : 0;
+            return n;
+        }
+        case '[':
+            parser->pos++;
+            return regex_parse_class(parser);
+        case '.': {
+            parser->pos++;
+            int ascii = regex_byte_node(parser, 0x00, 0x7F);
+            int any = ascii < 0 ? -1 : regex_multibyte_node(parser);
+            return any < 0 ? -1 : regex_node(parser, REGEX_NODE_ALT, ascii, any);
+        }
+        case '^':
+            parser->pos++;
+            return regex_node(parser, REGEX_NODE_BOL, 0, 0);
+        case '$':
+            parser->pos++;
+            return regex_node(parser, REGEX_NODE_EOL, 0, 0);
+        case '\\':
+            parser->pos++;
+            return regex_parse_escape(parser);
+        case '*':
+        case '+':
+        case '?':
+            parser->error = "nothing to repeat";
+            return -1;
+        default:
+            return regex_char_node(parser);
+    }
+}
+
+/**
+ * @brief Parses a {m}, {m,} or {m,n} count at the parse position.
+ *
+ * @return false, leaving the position alone, if there is no well-formed
+ * count there; the brace is then an ordinary character.
+ */
+static bool regex_parse_count(RegexParser *parser, int *min, int *max) {
+    const char *p = parser->pos + 1;
+    if (p >= parser->end || !isdigit((unsigned char)*p)) return false;
+    long lo = 0, hi;
+    while (p < parser->end && isdigit((unsigned char)*p) && lo <= REGEX_MAX_REPEAT) lo = lo * 10 + (*p++ - '0');
+    hi = lo;
+    if (p < parser->end && *p == ',') {
+        p++;
+        hi = -1;
+        if (p < parser->end && isdigit((unsigned char)*p)) {
+            hi = 0;
+            while (p < parser->end && isdigit((unsigned char)*p) && hi <= REGEX_MAX_REPEAT) hi = hi * 10 + (*p++ - '0');
+        }
+    }
+    if (p >= parser->end || *p != '}') return false;
+    parser->pos = p + 1;
+    *min = lo > REGEX_MAX_REPEAT ? REGEX_MAX_REPEAT + 1 : (int)lo;
+    *max = hi > REGEX_MAX_REPEAT ? REGEX_MAX_REPEAT + 1 : (int)hi;
+    return true;
+}
+
+/**
+ * @brief Parses an atom and the quantifiers after it.
+ */
+static int regex_parse_repeat(RegexParser *parser) {
+    int n = regex_parse_atom(parser);
+    while (n >= 0 && parser->pos < parser->end) {
+        int min, max;
+        char c = *parser->pos;
+        if (c == '*' || c == '+' || c == '?') {
+            parser->pos++;
+            min = c == '+' ? 1 : 0;
+            max = c == '?' ? 1 : -1;
+        } else if (c != '{' || !regex_parse_count(parser, &min, &max)) {
+            break;
+        }
+        if (min > REGEX_MAX_REPEAT || max > REGEX_MAX_REPEAT) {
+            parser->error = "repeat count too large";
+            return -1;
+        }
+        if (max >= 0 && max < min) {
+            parser->error = "repeat count out of order";
+            return -1;
+        }
+        bool greedy = true;
+        if (parser->pos < parser->end && *parser->pos == '?') {
+            greedy = false;
+            parser->pos++;
+        }
+        n = regex_node(parser, REGEX_NODE_REPEAT, n, 0);
+        if (n < 0) return -1;
+        parser->nodes[n].min = min;
+        parser->nodes[n].max = max;
+        parser->nodes[n].greedy = greedy;
+    }
+    return n;
+}
+
+/**
+ * @brief Parses a run of quantified atoms up to | or ) or the end.
+ */
+static int regex_parse_concat(RegexParser *parser) {
+    int n = regex_node(parser, REGEX_NODE_EMPTY, 0, 0);
+    bool empty = true;
+    while (n >= 0 && parser->pos < parser->end && *parser->pos != '|' && *parser->pos != ')') {
+        int next = regex_parse_repeat(parser);
+        if (next < 0) return -1;
+        n = empty ? next : regex_node(parser, REGEX_NODE_CONCAT, n, next);
+        empty = false;
+    }
+    return n;
+}
+
+/**
+ * @brief Parses alternatives separated by |.
+ */
+static int regex_parse_alt(RegexParser *parser) {
+    int n = regex_parse_concat(parser);
+    while (n >= 0 && parser->pos < parser->end && *parser->pos == '|') {
+        parser->pos++;
+        int next = regex_parse_concat(parser);
+        n = next < 0 ? -1 : regex_node(parser, REGEX_NODE_ALT, n, next);
+    }
+    return n;
+}
+
+/**
+ * @brief Number of instructions a node compiles to, saturating just past
+ * REGEX_MAX_PROGRAM.
+ *
+ * @param saves Count the capture saves, which only the forward program has.
+ */
+static long regex_node_size(const RegexNode *nodes, int n, bool saves) {
+    const RegexNode *node = &nodes[n];
+    long size;
+    switch (node->type) {
+        case REGEX_NODE_EMPTY:
+            return 0;
+        case REGEX_NODE_SET:
+        case REGEX_NODE_BOL:
+        case REGEX_NODE_EOL:
+            return 1;
+        case REGEX_NODE_CONCAT:
+            size = regex_node_size(nodes, node->a, saves) + regex_node_size(nodes, node->b, saves);
+            break;
+        case REGEX_NODE_ALT:
+            size = regex_node_size(nodes, node->a, saves) + regex_node_size(nodes, node->b, saves) + 2;
+            break;
+        case REGEX_NODE_GROUP:
+            size = regex_node_size(nodes, node->a, saves) + (saves && node->value > 0 ? 2 : 0);
+            break;
+        default: { // REGEX_NODE_REPEAT
+            long body = regex_node_size(nodes, node->a, saves);
+            size = node->min * body + (node->max < 0 ? body + 2 : (long)(node->max - node->min) * (body + 1));
+            break;
+        }
+    }
+    return size > REGEX_MAX_PROGRAM ? REGEX_MAX_PROGRAM + 1 : size;
+}
+
+/**
+ * @brief Compiles a node, forwards or with every concatenation reversed.
+ *
+ * The reversed program reads the input from its end, so ^ and $ trade
+ * places and there are no capture saves.
+ */
+static void regex_emit(const RegexNode *nodes, int n, RegexInst *prog, int *len, bool reverse) {
+    const RegexNode *node = &nodes[n];
+    switch (node->type) {
+        case REGEX_NODE_EMPTY:
+            break;
+        case REGEX_NODE_SET:
+            prog[(*len)++] = (RegexInst){ REGEX_SET, node->value, 0 };
+            break;
+        case REGEX_NODE_BOL:
+        case REGEX_NODE_EOL:
+            prog[(*len)++] = (RegexInst){ (node->type == REGEX_NODE_BOL) != reverse ? REGEX_BOL : REGEX_EOL, 0, 0 };
+            break;
+        case REGEX_NODE_CONCAT:
+            regex_emit(nodes, reverse ? node->b : node->a, prog, len, reverse);
+            regex_emit(nodes, reverse ? node->a : node->b, prog, len, reverse);
+            break;
+        case REGEX_NODE_ALT: {
+            int split = (*len)++;
+            regex_emit(nodes, node->a, prog, len, reverse);
+            int jmp = (*len)++;
+            prog[split] = (RegexInst){ REGEX_SPLIT, split + 1, *len };
+            regex_emit(nodes, node->b, prog, len, reverse);
+            prog[jmp] = (RegexInst){ REGEX_JMP, *len, 0 };
+            break;
+        }
+        case REGEX_NODE_GROUP: {
+            bool save = !reverse && node->value > 0;
+            if (save) prog[(*len)++] = (RegexInst){ REGEX_SAVE, 2 * node->value, 0 };
+            regex_emit(nodes, node->a, prog, len, reverse);
+            if (save) prog[(*len)++] = (RegexInst){ REGEX_SAVE, 2 * node->value + 1, 0 };
+            break;
+        }
+        case REGEX_NODE_REPEAT: {
+            for (int i = 0; i < node->min; i++) {
+                regex_emit(nodes, node->a, prog, len, reverse);
+            }
+            if (node->max < 0) {
+                int loop = (*len)++;
+                regex_emit(nodes, node->a, prog, len, reverse);
+                prog[(*len)++] = (RegexInst){ REGEX_JMP, loop, 0 };
+                prog[loop] = node->greedy ? (RegexInst){ REGEX_SPLIT, loop + 1, *len } : (RegexInst){ REGEX_SPLIT, *len, loop + 1 };
+            } else {
+                for (int i = node->min; i < node->max; i++) {
+                    int split = (*len)++;
+                    regex_emit(nodes, node->a, prog, len, reverse);
+                    prog[split] = node->greedy ? (RegexInst){ REGEX_SPLIT, split + 1, *len } : (RegexInst){ REGEX_SPLIT, *len, split + 1 };
+                }
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Splits the 256 byte values into classes no set tells apart, so DFA
+ * states need one transition per class rather than per byte.
+ */
+static void regex_byte_classes(Regex *re) {
+    memset(re->byte_class, 0, sizeof(re->byte_class));
+    re->class_count = 1;
+    for (int s = 0; s < re->set_count; s++) {
+        int remap[256][2];
+        memset(remap, -1, sizeof(remap));
+        int count = 0;
+        for (int c = 0; c < 256; c++) {
+            int *slot = &remap[re->byte_class[c]][regex_set_has(re->sets[s], (unsigned char)c)];
+            if (*slot < 0) *slot = count++;
+            re->byte_class[c] = (unsigned char)*slot;
+        }
+        re->class_count = count;
+    }
+    for (int c = 255; c >= 0; c--) {
+        re->class_byte[re->byte_class[c]] = (unsigned char)c;
+    }
+}
+
+/**
+ * @brief Compiles a pattern.
+ *
+ * @param error Receives a description of what is wrong with the pattern; may be NULL.
+ * @return The compiled pattern, to be freed with regex_free(), or NULL.
+ */
+Regex *regex_compile(const char *pattern, char *error, size_t error_size) {
+    RegexParser parser = { .pos = pattern, .end = pattern + strlen(pattern) };
+    Regex *re = NULL;
+    int root = regex_parse_alt(&parser);
+    if (root >= 0 && parser.pos < parser.end) {
+        parser.error = "unmatched )";
+        root = -1;
+    }
+    if (root >= 0 && (regex_node_size(parser.nodes, root, true) + 3 > REGEX_MAX_PROGRAM ||
+                      regex_node_size(parser.nodes, root, false) + 1 > REGEX_MAX_PROGRAM)) {
+        parser.error = "pattern too large";
+        root = -1;
+    }
+    if (root >= 0) {
+        re = calloc(1, sizeof(Regex));
+        if (re == NULL) parser.error = "out of memory";
+    }
+    if (re != NULL) {
+        re->sets = parser.sets;
+        re->set_count = parser.set_count;
+        parser.sets = NULL;
+        re->group_count = parser.group_count < REGEX_MAX_GROUPS ? parser.group_count : REGEX_MAX_GROUPS;
+        int fwd = (int)regex_node_size(parser.nodes, root, true) + 3;
+        int rev = (int)regex_node_size(parser.nodes, root, false) + 1;
+        re->prog = malloc(sizeof(RegexInst) * (size_t)fwd);
+        re->rprog = malloc(sizeof(RegexInst) * (size_t)rev);
+        if (re->prog != NULL && re->rprog != NULL) {
+            re->prog[re->prog_len++] = (RegexInst){ REGEX_SAVE, 0, 0 };
+            regex_emit(parser.nodes, root, re->prog, &re->prog_len, false);
+            re->prog[re->prog_len++] = (RegexInst){ REGEX_SAVE, 1, 0 };
+            re->prog[re->prog_len++] = (RegexInst){ REGEX_MATCH, 0, 0 };
+            regex_emit(parser.nodes, root, re->rprog, &re->rprog_len, true);
+            re->rprog[re->rprog_len++] = (RegexInst){ REGEX_MATCH, 0, 0 };
+        }
+        regex_byte_classes(re);
+
+        // Each visit pushes at most two stack entries and every state is visited once
+        re->vm_pcs[0] = malloc(sizeof(int) * (size_t)fwd);
+        re->vm_pcs[1] = malloc(sizeof(int) * (size_t)fwd);
+        re->vm_caps[0] = malloc(sizeof(int) * REGEX_CAPTURE_SLOTS * (size_t)fwd);
+        re->vm_caps[1] = malloc(sizeof(int) * REGEX_CAPTURE_SLOTS * (size_t)fwd);
+        re->vm_stack = malloc(sizeof(int) * 3 * (size_t)(2 * fwd + 1));
+        re->vm_seen = calloc((size_t)fwd, sizeof(unsigned));
+        re->dfa_list = malloc(sizeof(int) * (size_t)rev);
+        re->dfa_end_list = malloc(sizeof(int) * (size_t)rev);
+        re->dfa_stack = malloc(sizeof(int) * (size_t)(2 * rev + 1));
+        re->dfa_seen = calloc((size_t)rev, sizeof(unsigned));
+        re->state_allocated = 64;
+        re->states = malloc(sizeof(RegexDfaState) * (size_t)re->state_allocated);
+        re->next = malloc(sizeof(int) * (size_t)re->state_allocated * (size_t)re->class_count);
+        re->table_size = 2 * re->state_allocated;
+        re->table = malloc(sizeof(int) * (size_t)re->table_size);
+        re->dfa_pcs_allocated = 256;
+        re->dfa_pcs = malloc(sizeof(int) * (size_t)re->dfa_pcs_allocated);
+        if (re->prog == NULL || re->rprog == NULL || re->vm_pcs[0] == NULL || re->vm_pcs[1] == NULL ||
+            re->vm_caps[0] == NULL || re->vm_caps[1] == NULL || re->vm_stack == NULL || re->vm_seen == NULL ||
+            re->dfa_list == NULL || re->dfa_end_list == NULL || re->dfa_stack == NULL || re->dfa_seen == NULL ||
+            re->states == NULL || re->next == NULL || re->table == NULL || re->dfa_pcs == NULL) {
+            regex_free(re);
+            re = NULL;
+            parser.error = "out of memory";
+        } else {
+            regex_dfa_flush(re);
+        }
+    }
+    if (re == NULL && error != NULL && error_size > 0) {
+        snprintf(error, error_size, "%s", parser.error ? parser.error : "invalid pattern");
+    }
+    free(parser.nodes);
+    free(parser.sets);
+    return re;
+}
+
+/**
+ * @brief Frees a compiled pattern; NULL is ignored.
+ */
+void regex_free(Regex *re) {
+    if (re == NULL) return;
+    free(re->prog);
+    free(re->rprog);
+    free(re->sets);
+    free(re->states);
+    free(re->next);
+    free(re->dfa_pcs);
+    free(re->table);
+    free(re->dfa_list);
+    free(re->dfa_end_list);
+    free(re->dfa_stack);
+    free(re->dfa_seen);
+    free(re->vm_pcs[0]);
+    free(re->vm_pcs[1]);
+    free(re->vm_caps[0]);
+    free(re->vm_caps[1]);
+    free(re->vm_stack);
+    free(re->vm_seen);
+    free(re->starts);
+    free(re);
+}
+
+/**
+ * @brief Adds the program states reachable from `pc` without reading a byte
+ * to a DFA state under construction.
+ *
+ * The states kept are those that read a byte, the match, and the $ checks
+ * (in the reversed program: where the line starts) still waiting for the end.
+ * Call with a fresh re->dfa_gen for each state built.
+ */
+static void regex_dfa_closure(Regex *re, int pc, bool at_begin, bool at_end, int *list, int *count) {
+    int top = 0;
+    re->dfa_stack[top++] = pc;
+    while (top > 0) {
+        pc = re->dfa_stack[--top];
+        if (re->dfa_seen[pc] == re->dfa_gen) continue;
+        re->dfa_seen[pc] = re->dfa_gen;
+        const RegexInst *inst = &re->rprog[pc];
+        switch (inst->op) {
+            case REGEX_JMP:
+                re->dfa_stack[top++] = inst->x;
+                break;
+            case REGEX_SPLIT:
+                re->dfa_stack[top++] = inst->y;
+                re->dfa_stack[top++] = inst->x;
+                break;
+            case REGEX_SAVE:
+                re->dfa_stack[top++] = pc + 1;
+                break;
+            case REGEX_BOL:
+                if (at_begin) re->dfa_stack[top++] = pc + 1;
+                break;
+            case REGEX_EOL:
+                if (at_end) {
+                    re->dfa_stack[top++] = pc + 1;
+                } else {
+                    list[(*count)++] = pc;
+                }
+                break;
+            default:
+                list[(*count)++] = pc;
+                break;
+        }
+    }
+}
+
+/**
+ * @brief Starts the DFA cache over, keeping its memory.
+ */
+static void regex_dfa_flush(Regex *re) {
+    re->state_count = 0;
+    re->dfa_pcs_count = 0;
+    re->dfa_bytes = 0;
+    re->start_state = -1;
+    for (int i = 0; i < re->table_size; i++) re->table[i] = -1;
+}
+
+/**
+ * @brief Comparison function for qsort() on ints.
+ */
+static int regex_int_compare(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Finds the DFA state for a set of program states, adding it if new.
+ *
+ * @param pcs The program states, sorted; must not point into re->dfa_pcs.
+ * @return The state, or -1 if memory ran out.
+ */
+static int regex_dfa_add(Regex *re, const int *pcs, int count, bool begin) {
+    unsigned hash = begin ? 0x9E3779B9u : 2166136261u;
+    for (int i = 0; i < count; i++) {
+        hash = (hash ^ (unsigned)pcs[i]) * 16777619u;
+    }
+    unsigned mask = (unsigned)re->table_size - 1;
+    unsigned slot = hash & mask;
+    for (; re->table[slot] >= 0; slot = (slot + 1) & mask) {
+        const RegexDfaState *st = &re->states[re->table[slot]];
+        if (st->begin == begin && st->pc_count == count &&
+            memcmp(re->dfa_pcs + st->pcs, pcs, sizeof(int) * (size_t)count) == 0) {
+            return re->table[slot];
+        }
+    }
+
+    if (re->state_count == re->state_allocated) {
+        int grown_allocated = re->state_allocated * 2;
+        RegexDfaState *states = realloc(re->states, sizeof(RegexDfaState) * (size_t)grown_allocated);
+        if (states == NULL) return -1;
+        re->states = states;
+        int *next = realloc(re->next, sizeof(int) * (size_t)grown_allocated * (size_t)re->class_count);
+        if (next == NULL) return -1;
+        re->next = next;
+        int *table = malloc(sizeof(int) * (size_t)grown_allocated * 2);
+        if (table == NULL) return -1;
+        free(re->table);
+        re->table = table;
+        re->state_allocated = grown_allocated;
+        re->table_size = grown_allocated * 2;
+        mask = (unsigned)re->table_size - 1;
+        for (int i = 0; i < re->table_size; i++) re->table[i] = -1;
+        for (int i = 0; i < re->state_count; i++) { // Rehash
+            const RegexDfaState *st = &re->states[i];
+            unsigned h = st->begin ? 0x9E3779B9u : 2166136261u;
+            for (int k = 0; k < st->pc_count; k++) h = (h ^ (unsigned)re->dfa_pcs[st->pcs + k]) * 16777619u;
+            unsigned s = h & mask;
+            while (re->table[s] >= 0) s = (s + 1) & mask;
+            re->table[s] = i;
+        }
+        slot = hash & mask;
+        while (re->table[slot] >= 0) slot = (slot + 1) & mask;
+    }
+    if (re->dfa_pcs_count + count > re->dfa_pcs_allocated) {
+        int grown_allocated = re->dfa_pcs_allocated;
+        while (grown_allocated < re->dfa_pcs_count + count) grown_allocated *= 2;
+        int *grown = realloc(re->dfa_pcs, sizeof(int) * (size_t)grown_allocated);
+        if (grown == NULL) return -1;
+        re->dfa_pcs = grown;
+        re->dfa_pcs_allocated = grown_allocated;
+    }
+
+    int n = re->state_count++;
+    RegexDfaState *st = &re->states[n];
+    st->pcs = re->dfa_pcs_count;
+    st->pc_count = count;
+    st->begin = begin;
+    memcpy(re->dfa_pcs + st->pcs, pcs, sizeof(int) * (size_t)count);
+    re->dfa_pcs_count += count;
+    for (int c = 0; c < re->class_count; c++) {
+        re->next[n * re->class_count + c] = -1;
+    }
+    re->table[slot] = n;
+    re->dfa_bytes += sizeof(RegexDfaState) + sizeof(int) * (size_t)(re->class_count + count) + 2 * sizeof(int);
+
+    // Accepting where the line starts also follows the pending $ checks
+    st->accept = false;
+    int end_count = 0;
+    re->dfa_gen++;
+    for (int i = 0; i < count; i++) {
+        if (re->rprog[pcs[i]].op == REGEX_MATCH) st->accept = true;
+        regex_dfa_closure(re, pcs[i], begin, true, re->dfa_end_list, &end_count);
+    }
+    st->accept_end = st->accept;
+    for (int i = 0; i < end_count && !st->accept_end; i++) {
+        if (re->rprog[re->dfa_end_list[i]].op == REGEX_MATCH) st->accept_end = true;
+    }
+    return n;
+}
+
+/**
+ * @brief DFA state before anything has been read.
+ *
+ * @return The state, or -1 if memory ran out.
+ */
+static int regex_dfa_start(Regex *re) {
+    if (re->start_state < 0) {
+        int count = 0;
+        re->dfa_gen++;
+        regex_dfa_closure(re, 0, true, false, re->dfa_list, &count);
+        qsort(re->dfa_list, (size_t)count, sizeof(int), regex_int_compare);
+        re->start_state = regex_dfa_add(re, re->dfa_list, count, true);
+    }
+    return re->start_state;
+}
+
+/**
+ * @brief DFA state after reading one more byte, built on first use.
+ *
+ * A match may begin at any position, so the program's start state joins
+ * every state. Past REGEX_DFA_BUDGET the cache is flushed, which invalidates
+ * every state index; the returned one is valid in the new cache.
+ *
+ * @return The state, or -1 if memory ran out.
+ */
+static int regex_dfa_next(Regex *re, int state, unsigned char c) {
+    int cls = re->byte_class[c];
+    int next = re->next[state * re->class_count + cls];
+    if (next >= 0) return next;
+
+    const RegexDfaState *st = &re->states[state];
+    int count = 0;
+    re->dfa_gen++;
+    for (int i = 0; i < st->pc_count; i++) {
+        const RegexInst *inst = &re->rprog[re->dfa_pcs[st->pcs + i]];
+        if (inst->op == REGEX_SET && regex_set_has(re->sets[inst->x], re->class_byte[cls])) {
+            regex_dfa_closure(re, re->dfa_pcs[st->pcs + i] + 1, false, false, re->dfa_list, &count);
+        }
+    }
+    regex_dfa_closure(re, 0, false, false, re->dfa_list, &count);
+    qsort(re->dfa_list, (size_t)count, sizeof(int), regex_int_compare);
+
+    bool flushed = false;
+    if (re->dfa_bytes > REGEX_DFA_BUDGET) {
+        regex_dfa_flush(re);
+        flushed = true;
+    }
+    next = regex_dfa_add(re, re->dfa_list, count, false);
+    if (!flushed && next >= 0) re->next[state * re->class_count + cls] = next;
+    return next;
+}
+
+/**
+ * @brief Finds the positions in [from, to] of a line where a match starts,
+ * in one pass from the end of the line back to `from`.
+ *
+ * @param first Receives the first such position, if there is one.
+ * @param last Receives the last.
+ * @param collect Also list them, ascending, in re->starts.
+ * @return How many there are.
+ */
+static int regex_scan(Regex *re, const char *s, int len, int from, int to, int *first, int *last, bool collect) {
+    re->start_count = 0;
+    if (to > len) to = len;
+    if (from < 0) from = 0;
+    if (from > to) return 0;
+    int count = 0;
+    int state = regex_dfa_start(re);
+    for (int p = len; state >= 0; p--) {
+        const RegexDfaState *st = &re->states[state];
+        if (p <= to && (p == 0 ? st->accept_end : st->accept)) {
+            if (count++ == 0) *last = p;
+            *first = p;
+            if (collect) {
+                if (re->start_count == re->starts_allocated) {
+                    int grown_allocated = re->starts_allocated ? re->starts_allocated * 2 : 64;
+                    int *grown = realloc(re->starts, sizeof(int) * (size_t)grown_allocated);
+                    if (grown == NULL) break;
+                    re->starts = grown;
+                    re->starts_allocated = grown_allocated;
+                }
+                re->starts[re->start_count++] = p;
+            }
+        }
+        if (p == from) break;
+        state = regex_dfa_next(re, state, (unsigned char)s[p - 1]);
+    }
+    for (int i = 0, j = re->start_count - 1; i < j; i++, j--) {
+        int t = re->starts[i];
+        re->starts[i] = re->starts[j];
+        re->starts[j] = t;
+    }
+    return count;
+}
+
+/**
+ * @brief Starts counting the match starts of a line with regex_count_more().
+ */
+static void regex_count_begin(Regex *re, int len, RegexCount *count) {
+    count->pos = len;
+    count->state = regex_dfa_start(re);
+    count->total = 0;
+}
+
+/**
+ * @brief Counts the positions of a whole line where a match starts, as
+ * regex_scan() does, reading at most `budget` bytes per call. The DFA state
+ * is carried between calls, so nothing else may scan with `re` until the
+ * count is done.
+ *
+ * @return true once the count covers the line.
+ */
+static bool regex_count_more(Regex *re, const char *s, RegexCount *count, int budget) {
+    int stop = count->pos > budget ? count->pos - budget : 0;
+    while (count->state >= 0) {
+        const RegexDfaState *st = &re->states[count->state];
+        if (count->pos == 0) {
+            if (st->accept_end) count->total++;
+            return true;
+        }
+        if (count->pos == stop) return false;
+        if (st->accept) count->total++;
+        count->state = regex_dfa_next(re, count->state, (unsigned char)s[count->pos - 1]);
+        count->pos--;
+    }
+    return true; // Out of memory; keep what was found, as regex_scan() does
+}
+
+/**
+ * @brief Adds a Pike VM thread at `pc`, following jumps, splits, saves and
+ * anchors, to one of the thread lists. Threads keep priority order.
+ *
+ * @param caps The thread's captures; changed while following saves, then restored.
+ */
+static void regex_vm_add(Regex *re, int list, int pc, int *caps, int pos, int len) {
+    int *stack = re->vm_stack;
+    int top = 0;
+    // Entries are (pc, -1, 0) to visit, or (0, slot, value) to restore a capture
+    stack[top++] = pc;
+    stack[top++] = -1;
+    stack[top++] = 0;
+    while (top > 0) {
+        int value = stack[--top];
+        int slot = stack[--top];
+        pc = stack[--top];
+        if (slot >= 0) {
+            caps[slot] = value;
+            continue;
+        }
+        if (re->vm_seen[pc] == re->vm_gen) continue;
+        re->vm_seen[pc] = re->vm_gen;
+        const RegexInst *inst = &re->prog[pc];
+        int follow[2], follow_count = 0;
+        switch (inst->op) {
+            case REGEX_JMP:
+                follow[follow_count++] = inst->x;
+                break;
+            case REGEX_SPLIT:
+                follow[follow_count++] = inst->y;
+                follow[follow_count++] = inst->x;
+                break;
+            case REGEX_SAVE:
+                stack[top++] = 0;
+                stack[top++] = inst->x;
+                stack[top++] = caps[inst->x];
+                caps[inst->x] = pos;
+                follow[follow_count++] = pc + 1;
+                break;
+            case REGEX_BOL:
+                if (pos == 0) follow[follow_count++] = pc + 1;
+                break;
+            case REGEX_EOL:
+                if (pos == len) follow[follow_count++] = pc + 1;
+                break;
+            default:
+                re->vm_pcs[list][re->vm_count[list]++] = pc;
+                memcpy(re->vm_caps[list] + pc * REGEX_CAPTURE_SLOTS, caps, sizeof(int) * REGEX_CAPTURE_SLOTS);
+                break;
+        }
+        for (int i = 0; i < follow_count; i++) {
+            stack[top++] = follow[i];
+            stack[top++] = -1;
+            stack[top++] = 0;
+        }
+    }
+}
+
+/**
+ * @brief Runs the Pike VM from a position a match is known to start at.
+ *
+ * Alternatives and quantifiers are tried in order of preference: greedy
+ * ones take as much as they can, lazy ones as little.
+ *
+ * @param caps Receives REGEX_CAPTURE_SLOTS positions, -1 for groups that took no part.
+ * @return Where the match ends, or -1 if there is none from `start`.
+ */
+static int regex_match_at(Regex *re, const char *s, int len, int start, int *caps) {
+    int work[REGEX_CAPTURE_SLOTS];
+    for (int i = 0; i < REGEX_CAPTURE_SLOTS; i++) work[i] = -1;
+    int cur = 0;
+    re->vm_count[cur] = 0;
+    if (++re->vm_gen == 0) { // Marks from 2^32 generations ago would look current
+        memset(re->vm_seen, 0, sizeof(unsigned) * (size_t)re->prog_len);
+        re->vm_gen = 1;
+    }
+    regex_vm_add(re, cur, 0, work, start, len);
+
+    int end = -1;
+    for (int pos = start; re->vm_count[cur] > 0; pos++) {
+        int nxt = 1 - cur;
+        re->vm_count[nxt] = 0;
+        if (++re->vm_gen == 0) {
+            memset(re->vm_seen, 0, sizeof(unsigned) * (size_t)re->prog_len);
+            re->vm_gen = 1;
+        }
+        for (int i = 0; i < re->vm_count[cur]; i++) {
+            int pc = re->vm_pcs[cur][i];
+            int *thread_caps = re->vm_caps[cur] + pc * REGEX_CAPTURE_SLOTS;
+            const RegexInst *inst = &re->prog[pc];
+            if (inst->op == REGEX_MATCH) {
+                end = pos;
+                memcpy(caps, thread_caps, sizeof(int) * REGEX_CAPTURE_SLOTS);
+                break; // Threads after this one are less preferred
+            }
+            if (pos < len && regex_set_has(re->sets[inst->x], (unsigned char)s[pos])) {
+                regex_vm_add(re, nxt, pc + 1, thread_caps, pos + 1, len);
+            }
+        }
+        cur = nxt;
+    }
+    return end;
+}
+
+/**
+ * @brief Prepares to walk the matches of a line with regex_matches_next().
+ */
+void regex_matches_begin(Regex *re, const char *s, int len, RegexMatch *m) {
+    int first, last;
+    regex_scan(re, s, len, 0, len, &first, &last, true);
+    m->next = 0;
+    m->pos = 0;
+}
+
+/**
+ * @brief Finds the next match of the line at or after m->pos that does not
+ * overlap the previous one. An empty match moves the next one a byte on.
+ *
+ * @return false when there are no more.
+ */
+bool regex_matches_next(Regex *re, const char *s, int len, RegexMatch *m) {
+    while (m->next < re->start_count) {
+        int start = re->starts[m->next++];
+        if (start < m->pos) continue;
+        int end = regex_match_at(re, s, len, start, m->caps);
+        if (end < 0) continue;
+        m->start = start;
+        m->end = end;
+        m->pos = end > start ? end : start + 1;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Builds the replacement for a match: \0 to \9 stand for the match
+ * and its groups, \\ for a backslash; anything else is copied.
+ *
+ * @param s The line the match is in.
+ * @param out Receives the text; NULL to only measure it.
+ * @return Length of the replacement.
+ */
+size_t regex_expand(const char *tmpl, size_t tmpl_len, const char *s, const RegexMatch *m, char *out) {
+    size_t n = 0;
+    for (size_t i = 0; i < tmpl_len; i++) {
+        const char *piece = tmpl + i;
+        size_t piece_len = 1;
+        if (tmpl[i] == '\\' && i + 1 < tmpl_len) {
+            char c = tmpl[i + 1];
+            if (c >= '0' && c <= '9') {
+                int start = m->caps[2 * (c - '0')], end = m->caps[2 * (c - '0') + 1];
+                piece = s + (start > 0 ? start : 0);
+                piece_len = start >= 0 && end >= start ? (size_t)(end - start) : 0;
+                i++;
+            } else if (c == '\\') {
+                piece = tmpl + ++i;
+            }
+        }
+        if (out != NULL && piece_len > 0) memcpy(out + n, piece, piece_len);
+        n += piece_len;
+    }
+    return n;
+}
+
+/**
+ * @brief Compiled form of a pattern, reusing one of the last
+ * REGEX_CACHE_SLOTS compiled, so find next on the same query keeps its
+ * DFA states. Only the holder of the buffer lock may call this.
+ *
+ * @return The pattern, owned by the cache, or NULL if it does not compile.
+ */
+static Regex *regex_cache_get(const char *pattern, char *error, size_t error_size) {
+    RegexCache *cache = &E.regex_cache;
+    RegexCacheEntry *victim = &cache->entries[0];
+    for (int i = 0; i < REGEX_CACHE_SLOTS; i++) {
+        RegexCacheEntry *entry = &cache->entries[i];
+        if (entry->regex != NULL && strcmp(entry->pattern, pattern) == 0) {
+            entry->used = ++cache->tick;
+            return entry->regex;
+        }
+        if (entry->used < victim->used) victim = entry; // Free slots have used 0
+    }
+    Regex *re = regex_compile(pattern, error, error_size);
+    if (re == NULL) return NULL;
+    regex_free(victim->regex);
+    snprintf(victim->pattern, sizeof(victim->pattern), "%s", pattern);
+    victim->regex = re;
+    victim->used = ++cache->tick;
+    return re;
+}
+
+/**
+ * @brief Frees every cached pattern.
+ */
+static void regex_cache_clear(void) {
+    for (int i = 0; i < REGEX_CACHE_SLOTS; i++) {
+        regex_free(E.regex_cache.entries[i].regex);
+        E.regex_cache.entries[i].regex = NULL;
+        E.regex_cache.entries[i].used = 0;
+    }
+}
+
+/**
+ * @brief Sets up a search for `query`, compiling it if it is a regex.
+ *
+ * @param error Receives what is wrong with a regex that does not compile; may be NULL.
+ * @return false if the regex does not compile.
+ */
+static bool search_pattern_init(SearchPattern *pattern, const char *query, bool regex, char *error, size_t error_size) {
+    pattern->text = query;
+    pattern->len = strlen(query);
+    pattern->regex = regex ? regex_cache_get(query, error, error_size) : NULL;
+    return !regex || pattern->regex != NULL;
+}
+
+/**
+ * @brief First position in [from, to] of a line where a match starts.
+ *
+ * @return The position, or -1 if there is none.
+ */
+static int search_first(const SearchPattern *pattern, const char *s, int len, int from, int to) {
+    if (pattern->regex != NULL) {
+        int first, last;
+        return regex_scan(pattern->regex, s, len, from, to, &first, &last, false) > 0 ? first : -1;
+    }
+    size_t limit = (size_t)to + pattern->len < (size_t)len ? (size_t)to + pattern->len : (size_t)len;
+    if (from > to || (size_t)from > limit) return -1;
+    const char *match = text_search_forward(s + from, limit - (size_t)from, pattern->text, pattern->len);
+    return match ? (int)(match - s) : -1;
+}
+
+/**
+ * @brief Last position in [from, to] of a line where a match starts.
+ *
+ * @return The position, or -1 if there is none.
+ */
+static int search_last(const SearchPattern *pattern, const char *s, int len, int from, int to) {
+    if (pattern->regex != NULL) {
+        int first, last;
+        return regex_scan(pattern->regex, s, len, from, to, &first, &last, false) > 0 ? last : -1;
+    }
+    size_t limit = (size_t)to + pattern->len < (size_t)len ? (size_t)to + pattern->len : (size_t)len;
+    if (from > to || (size_t)from > limit) return -1;
+    const char *match = text_search_backward(s + from, limit - (size_t)from, pattern->text, pattern->len);
+    return match ? (int)(match - s) : -1;
+}
+
+/**
+ * @brief Counts the positions in [from, to] of a line where a match starts,
+ * overlapping matches included, as find next stops at each of them.
+ */
+static int search_count(const SearchPattern *pattern, const char *s, int len, int from, int to) {
+    if (pattern->regex != NULL) {
+        int first, last;
+        return regex_scan(pattern->regex, s, len, from, to, &first, &last, false);
+    }
+    size_t limit = (size_t)to + pattern->len < (size_t)len ? (size_t)to + pattern->len : (size_t)len;
+    if (from > to || (size_t)from > limit) return 0;
+    const char *pos = s + from;
+    const char *end = s + limit;
+    int count = 0;
+    while ((pos = text_search_forward(pos, (size_t)(end - pos), pattern->text, pattern->len)) != NULL) {
+        count++;
+        pos++;
+    }
+    return count;
+}
+
+// --- Syntax Lexer Implementation ---
+//
+// Each language is a plain LanguageDef. The first time a file of that language
+// is opened it is compiled into a byte class table and an open-addressing
+// keyword hash. The lexer then dispatches on one table lookup per token and
+// skips over identifier and whitespace runs a whole vector at a time with the
+// same vector types as the search kernel.
+
+static const LanguageDef syntax_definitions[] = {
+    {
+        .name = "C",
+        .extensions = "c h",
+        .keywords = "auto break case char const continue default do double else enum extern float for goto if "
+                    "inline int long register restrict return short signed sizeof static struct switch typedef "
+                    "union unsigned void volatile while _Bool _Atomic _Static_assert bool true false NULL "
+                    "include define undef ifdef ifndef elif endif pragma",
+        .line_comment = "//", .block_comment_start = "/*", .block_comment_end = "*/",
+        .quotes = "'\"",
+    },
+    {
+        .name = "C++",
+        .extensions = "cc cpp cxx hh hpp hxx",
+        .keywords = "auto break case char const continue default do double else enum extern float for goto if "
+                    "inline int long register return short signed sizeof static struct switch typedef union "
+                    "unsigned void volatile while bool true false nullptr class namespace template typename "
+                    "public private protected virtual override final new delete this operator using try catch "
+                    "throw noexcept constexpr consteval decltype explicit friend mutable static_cast "
+                    "dynamic_cast const_cast reinterpret_cast include define undef ifdef ifndef elif endif pragma",
+        .line_comment = "//", .block_comment_start = "/*", .block_comment_end = "*/",
+        .quotes = "'\"",
+    },
+    {
+        .name = "Python",
+        .extensions = "py pyw",
+        .keywords = "and as assert async await break class continue def del elif else except finally for from "
+                    "global if import in is lambda nonlocal not or pass raise return try while with yield "
+                    "None True False self",
+        .line_comment = "#",
+        .quotes = "'\"",
+    },
+    {
+        .name = "JavaScript",
+        .extensions = "js mjs cjs jsx ts tsx",
+        .keywords = "break case catch class const continue debugger default delete do else export extends "
+                    "finally for function if import in instanceof let new return super switch this throw try "
+                    "typeof var void while with yield async await of null undefined true false interface type "
+                    "enum implements private public protected readonly",
+        .line_comment = "//", .block_comment_start = "/*", .block_comment_end = "*/",
+        .quotes = "'\"`",
+    },
+    {
+        .name = "Java",
+        .extensions = "java kt scala cs",
+        .keywords = "abstract boolean break byte case catch char class const continue default do double else "
+                    "enum extends final finally float for if implements import instanceof int interface long "
+                    "native new package private protected public return short static super switch "
+                    "synchronized this throw throws try void volatile while true false null var val fun",
+        .line_comment = "//", .block_comment_start = "/*", .block_comment_end = "*/",
+        .quotes = "'\"",
+    },
+    {
+        .name = "Go",
+        .extensions = "go",
+        .keywords = "break case chan const continue default defer else fallthrough for func go goto if import "
+                    "interface map package range return select struct switch type var nil true false",
+        .line_comment = "//", .block_comment_start = "/*", .block_comment_end = "*/",
+        .quotes = "'\"`",
+    },
+    {
+        .name = "Rust",
+        .extensions = "rs",
+        .keywords = "as break const continue crate else enum extern false fn for if impl in let loop match mod "
+                    "move mut pub ref return self Self static struct super trait true type unsafe use where "
+                    "while async await dyn",
+        .line_comment = "//", .block_comment_start = "/*", .block_comment_end = "*/",
+        .quotes = "\"",
+    },
+    {
+        .name = "Shell",
+        .extensions = "sh bash zsh",
+        .keywords = "if then else elif fi case esac for while until do done in function return local export "
+                    "readonly shift exit",
+        .line_comment = "#",
+        .quotes = "'\"`",
+    },
+    {
+        .name = "Ruby",
+        .extensions = "rb",
+        .keywords = "alias and begin break case class def defined do else elsif end ensure false for if in "
+                    "module next nil not or redo rescue retry return self super then true undef unless until "
+                    "when while yield",
+        .line_comment = "#",
+        .quotes = "'\"",
+    },
+    {
+        .name = "Lua",
+        .extensions = "lua",
+        .keywords = "and break do else elseif end false for function goto if in local nil not or repeat "
+                    "return then true until while",
+        .line_comment = "--", .block_comment_start = "--[[", .block_comment_end = "]]",
+        .quotes = "'\"",
+    },
+    {
+        .name = "SQL",
+        .extensions = "sql",
+        .keywords = "select from where insert into values update set delete create table drop alter index "
+                    "view join inner left right outer on group by order having limit offset and or not null "
+                    "is in as distinct union all primary key foreign references default",
+        .line_comment = "--", .block_comment_start = "/*", .block_comment_end = "*/",
+        .quotes = "'\"",
+        .ignore_case = true,
+    },
+    {
+        .name = "Make",
+        .extensions = "mk Makefile GNUmakefile",
+        .keywords = "ifeq ifneq ifdef ifndef else endif include define endef export override",
+        .line_comment = "#",
+        .quotes = "'\"",
+    },
+    {
+        .name = "Config",
+        .extensions = "cmake CMakeLists.txt Dockerfile yaml yml toml",
+        .line_comment = "#",
+        .quotes = "'\"",
+    },
+};
+
+// Used for code files no definition claims: strings, numbers, operators and C-style comments
+static const LanguageDef syntax_generic = {
+    .name = "Code",
+    .extensions = "",
+    .line_comment = "//", .block_comment_start = "/*", .block_comment_end = "*/",
+    .quotes = "'\"`",
+};
+
+#define SYNTAX_LANGUAGES (sizeof(syntax_definitions) / sizeof(syntax_definitions[0]))
+static SyntaxLanguage syntax_languages[SYNTAX_LANGUAGES + 1]; // Compiled on first use; the last is the generic one
+
+/**
+ * @brief Hashes a keyword candidate (FNV-1a), folding case if the language ignores it.
+ */
+static unsigned syntax_hash(const char *s, int len, bool ignore_case) {
+    unsigned h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        h = (h ^ (ignore_case ? (unsigned char)tolower(c) : c)) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief Builds the class table and keyword hash of a language.
+ *
+ * @param lang The slot to fill in.
+ * @param def The definition to compile.
+ */
+static void syntax_compile(SyntaxLanguage *lang, const LanguageDef *def) {
+    memset(lang, 0, sizeof(*lang));
+    lang->def = def;
+    for (int c = 0; c < 256; c++) {
+        unsigned char cls = 0;
+        // ASCII only, to agree with the vector classifier whatever the locale
+        bool digit = c >= '0' && c <= '9';
+        if (digit || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_') cls |= LEX_WORD;
+        if (digit) cls |= LEX_DIGIT;
+        if (c == ' ' || c == '\t') cls |= LEX_SPACE;
+        if (c != 0 && strchr("+-*/%=<>!&|^~?:;,.()[]{}", c)) cls |= LEX_OPERATOR;
+        if (c != 0 && def->quotes && strchr(def->quotes, c)) cls |= LEX_QUOTE;
+        lang->classes[c] = cls;
+    }
+    if (def->line_comment) {
+        lang->line_comment_len = (int)strlen(def->line_comment);
+        lang->classes[(unsigned char)def->line_comment[0]] |= LEX_COMMENT;
+    }
+    if (def->block_comment_start && def->block_comment_end) {
+        lang->block_start_len = (int)strlen(def->block_comment_start);
+        lang->block_end_len = (int)strlen(def->block_comment_end);
+        lang->classes[(unsigned char)def->block_comment_start[0]] |= LEX_COMMENT;
+    }
+
+    const char *p = def->keywords;
+    int stored = 0;
+    while (p && *p && stored < LEX_KEYWORD_SLOTS / 2) {
+        while (*p == ' ') p++;
+        int len = (int)strcspn(p, " ");
+        if (len == 0) break;
+        unsigned slot = syntax_hash(p, len, def->ignore_case) & (LEX_KEYWORD_SLOTS - 1);
+        while (lang->keywords[slot].word != NULL) slot = (slot + 1) & (LEX_KEYWORD_SLOTS - 1);
+        lang->keywords[slot].word = p;
+        lang->keywords[slot].len = len;
+        lang->classes[(unsigned char)p[0]] |= LEX_KEYWORD_START;
+        if (def->ignore_case) lang->classes[(unsigned char)toupper((unsigned char)p[0])] |= LEX_KEYWORD_START;
+        if (stored == 0 || len < lang->keyword_min_len) lang->keyword_min_len = len;
+        if (len > lang->keyword_max_len) lang->keyword_max_len = len;
+        stored++;
+        p += len;
+    }
+}
+
+/**
+ * @brief Checks whether a word is a keyword of the language.
+ */
+static bool syntax_is_keyword(const SyntaxLanguage *lang, const char *s, int len) {
+    if (!(lang->classes[(unsigned char)s[0]] & LEX_KEYWORD_START) ||
+        len < lang->keyword_min_len || len > lang->keyword_max_len) return false;
+    unsigned slot = syntax_hash(s, len, lang->def->ignore_case) & (LEX_KEYWORD_SLOTS - 1);
+    for (; lang->keywords[slot].word != NULL; slot = (slot + 1) & (LEX_KEYWORD_SLOTS - 1)) {
+        const KeywordSlot *k = &lang->keywords[slot];
+        if (k->len == len && (lang->def->ignore_case ? strncasecmp(k->word, s, (size_t)len) : memcmp(k->word, s, (size_t)len)) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Picks the language of a file by its extension or name, compiling it on first use.
+ *
+ * @param filename The file name, or NULL for an unnamed buffer.
+ * @return The matching language, or the generic code language if none matches.
+ */
+const SyntaxLanguage *syntax_language_for(const char *filename) {
+    size_t index = SYNTAX_LANGUAGES;
+    const char *base = filename ? strrchr(filename, '/') : NULL;
+    base = base ? base + 1 : filename;
+    const char *dot = base ? strrchr(base, '.') : NULL;
+    const char *ext = dot && dot != base ? dot + 1 : NULL;
+
+    for (size_t i = 0; base && i < SYNTAX_LANGUAGES && index == SYNTAX_LANGUAGES; i++) {
+        for (const char *p = syntax_definitions[i].extensions; *p; ) {
+            size_t len = strcspn(p, " ");
+            if ((strlen(base) == len && strncmp(base, p, len) == 0) ||
+                (ext && strlen(ext) == len && strncasecmp(ext, p, len) == 0)) {
+                index = i;
+                break;
+            }
+            p += len;
+            while (*p == ' ') p++;
+        }
+    }
+
+    SyntaxLanguage *lang = &syntax_languages[index];
+    if (lang->def == NULL) {
+        syntax_compile(lang, index < SYNTAX_LANGUAGES ? &syntax_definitions[index] : &syntax_generic);
+    }
+    return lang;
+}
+
+#ifdef SEARCH_VECTOR_BYTES
+#define LEX_FULL_MASK (SEARCH_VECTOR_BYTES * SEARCH_MASK_BITS_PER_BYTE == 64 ? ~(uint64_t)0 \
+                       : ((uint64_t)1 << (SEARCH_VECTOR_BYTES * SEARCH_MASK_BITS_PER_BYTE)) - 1)
+
+#if defined(__AVX2__)
+static inline uint64_t lex_run_mask(const char *p, unsigned char cls) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hit;
+    if (cls == LEX_SPACE) {
+        hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+    } else {
+        // Unsigned range checks: (x - lo) saturating-minus (hi - lo) is zero exactly inside [lo, hi]
+        __m256i zero = _mm256_setzero_si256();
+        __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i alpha = _mm256_cmpeq_epi8(_mm256_subs_epu8(_mm256_sub_epi8(lower, _mm256_set1_epi8('a')), _mm256_set1_epi8('z' - 'a')), zero);
+        __m256i digit = _mm256_cmpeq_epi8(_mm256_subs_epu8(_mm256_sub_epi8(v, _mm256_set1_epi8('0')), _mm256_set1_epi8('9' - '0')), zero);
+        hit = _mm256_or_si256(_mm256_or_si256(alpha, digit), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+    }
+    return (uint32_t)_mm256_movemask_epi8(hit);
+}
+#elif defined(__SSE2__)
+static inline uint64_t lex_run_mask(const char *p, unsigned char cls) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i hit;
+    if (cls == LEX_SPACE) {
+        hit = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    } else {
+        // Unsigned range checks: (x - lo) saturating-minus (hi - lo) is zero exactly inside [lo, hi]
+        __m128i zero = _mm_setzero_si128();
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i alpha = _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(lower, _mm_set1_epi8('a')), _mm_set1_epi8('z' - 'a')), zero);
+        __m128i digit = _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(v, _mm_set1_epi8('0')), _mm_set1_epi8('9' - '0')), zero);
+        hit = _mm_or_si128(_mm_or_si128(alpha, digit), _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    }
+    return (uint32_t)_mm_movemask_epi8(hit);
+}
+#elif defined(__ARM_NEON)
+static inline uint64_t lex_run_mask(const char *p, unsigned char cls) {
+    uint8x16_t v = vld1q_u8((const uint8_t *)p);
+    uint8x16_t hit;
+    if (cls == LEX_SPACE) {
+        hit = vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')), vceqq_u8(v, vdupq_n_u8('\t')));
+    } else {
+        uint8x16_t alpha = vcleq_u8(vsubq_u8(vorrq_u8(v, vdupq_n_u8(0x20)), vdupq_n_u8('a')), vdupq_n_u8('z' - 'a'));
+        uint8x16_t digit = vcleq_u8(vsubq_u8(v, vdupq_n_u8('0')), vdupq_n_u8('9' - '0'));
+        hit = vorrq_u8(vorrq_u8(alpha, digit), vceqq_u8(v, vdupq_n_u8('_')));
+    }
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+}
+#endif
+#endif
+
+/**
+ * @brief Finds the end of a run of word or whitespace bytes.
+ *
+ * @param lang The language whose class table decides the scalar tail.
+ * @param s The line text.
+ * @param i Start of the run.
+ * @param len Length of the line.
+ * @param cls LEX_WORD or LEX_SPACE.
+ * @return Index of the first byte after the run.
+ */
+static int lex_skip_run(const SyntaxLanguage *lang, const char *s, int i, int len, unsigned char cls) {
+#ifdef SEARCH_VECTOR_BYTES
+    for (; i + SEARCH_VECTOR_BYTES <= len; i += SEARCH_VECTOR_BYTES) {
+        uint64_t mask = lex_run_mask(s + i, cls);
+        if (mask != LEX_FULL_MASK) {
+            return i + __builtin_ctzll(~mask) / SEARCH_MASK_BITS_PER_BYTE;
+        }
+    }
+#endif
+    while (i < len && (lang->classes[(unsigned char)s[i]] & cls)) i++;
+    return i;
+}
+
+/**
+ * @brief Checks whether `token` starts at s[i].
+ */
+static bool lex_token_at(const char *s, int i, int len, const char *token, int token_len) {
+    return token_len > 0 && i + token_len <= len && memcmp(s + i, token, (size_t)token_len) == 0;
+}
+
+/**
+ * @brief Finds where a block comment that is open at s[i] closes.
+ *
+ * @return Index just past the closing token, or -1 if the comment runs past the line.
+ */
+static int lex_block_comment_end(const SyntaxLanguage *lang, const char *s, int i, int len) {
+    const char *close = text_search_forward(s + i, (size_t)(len - i), lang->def->block_comment_end, (size_t)lang->block_end_len);
+    return close ? (int)(close - s) + lang->block_end_len : -1;
+}
+
+/**
+ * @brief Sets hl[from, to) to `type`, or does nothing when only the comment state is wanted.
+ */
+static inline void lex_mark(uint8_t *hl, int from, int to, HighlightType type) {
+    if (hl != NULL && to > from) memset(hl + from, type, (size_t)(to - from));
+}
+
+/**
+ * @brief Lexes one line with a language.
+ *
+ * @param lang The language to lex with.
+ * @param s The line text.
+ * @param len Length of the line.
+ * @param in_comment True if the line starts inside a block comment.
+ * @param hl Receives the HighlightType of each byte, or NULL to compute only the comment state.
+ * @return True if the line ends inside a block comment.
+ */
+static bool lex_line(const SyntaxLanguage *lang, const char *s, int len, bool in_comment, uint8_t *hl) {
+    lex_mark(hl, 0, len, HL_NORMAL);
+
+    int i = 0;
+    if (in_comment && lang->block_end_len > 0) {
+        int end = lex_block_comment_end(lang, s, 0, len);
+        lex_mark(hl, 0, end < 0 ? len : end, HL_COMMENT);
+        if (end < 0) return true;
+        i = end;
+    }
+
+    while (i < len) {
+        unsigned char c = (unsigned char)s[i];
+        unsigned char cls = lang->classes[c];
+
+        if (cls & LEX_SPACE) {
+            i = lex_skip_run(lang, s, i, len, LEX_SPACE);
+        } else if (cls & LEX_DIGIT) {
+            int start = i++;
+            while (i < len && ((lang->classes[(unsigned char)s[i]] & LEX_WORD) || s[i] == '.' ||
+                               ((s[i] == '+' || s[i] == '-') && (s[i - 1] == 'e' || s[i - 1] == 'E')))) {
+                i++;
+            }
+            lex_mark(hl, start, i, HL_NUMBER);
+        } else if (cls & LEX_WORD) {
+            int start = i;
+            i = lex_skip_run(lang, s, i, len, LEX_WORD);
+            if (hl != NULL && syntax_is_keyword(lang, s + start, i - start)) {
+                lex_mark(hl, start, i, HL_KEYWORD);
+            }
+        } else if ((cls & LEX_COMMENT) && lex_token_at(s, i, len, lang->def->block_comment_start, lang->block_start_len)) {
+            int end = lex_block_comment_end(lang, s, i + lang->block_start_len, len);
+            lex_mark(hl, i, end < 0 ? len : end, HL_COMMENT);
+            if (end < 0) return true;
+            i = end;
+        } else if ((cls & LEX_COMMENT) && lex_token_at(s, i, len, lang->def->line_comment, lang->line_comment_len)) {
+            lex_mark(hl, i, len, HL_COMMENT);
+            return false;
+        } else if (cls & LEX_QUOTE) {
+            // Runs to the matching quote or the end of the line; a backslash escapes the next byte
+            int start = i++;
+            while (i < len && (unsigned char)s[i] != c) {
+                i += s[i] == '\\' ? 2 : 1;
+            }
+            i = i < len ? i + 1 : len;
+            lex_mark(hl, start, i, HL_STRING);
+        } else {
+            if (cls & LEX_OPERATOR) lex_mark(hl, i, i + 1, HL_OPERATOR);
+            i++;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Updates the highlighting information for a given line.
+ *
+ * Lexes the line with the file's language into a one-byte-per-character
+ * highlight array sized to the text. The block comment state is passed in
+ * from the previous line and the resulting end state is cached on the line.
+ *
+ * @param line Pointer to the EditorLine to update.
+ * @param in_comment True if the line starts inside a block comment.
+ */
+void update_highlighting(EditorLine *line, bool in_comment) {
+    if (!E.is_code_file || E.syntax == NULL) {
+        update_highlighting_state(line, in_comment); // Plain text draws without an array
+        return;
+    }
+
+    bool cached = line->hl != NULL;
+    uint8_t *hl = line_hl_reserve(line, line->size > 0 ? line->size : 1);
+    if (hl == NULL) {
+        set_status_message("Error: Failed to allocate highlighting memory.");
+        return;
+    }
+    if (!cached) E.hl_cached_lines++;
+
+    line->hl_comment_out = lex_line(E.syntax, line->chars, line->size, in_comment, hl);
+    line->hl_lexed_revision = line->hl_revision;
+    E.latency.lines_lexed++;
+    line->hl_comment_in = in_comment;
+}
+
+/**
+ * @brief Brings only the comment state of a line up to date, for lines that
+ * are not on screen. Any cached highlight array is dropped.
+ *
+ * @param line Pointer to the EditorLine to update.
+ * @param in_comment True if the line starts inside a block comment.
+ */
+static void update_highlighting_state(EditorLine *line, bool in_comment) {
+    editor_line_drop_highlight(line);
+    bool code = E.is_code_file && E.syntax != NULL;
+    line->hl_comment_out = code && lex_line(E.syntax, line->chars, line->size, in_comment, NULL);
+    line->hl_lexed_revision = line->hl_revision;
+    E.latency.lines_lexed++;
+    line->hl_comment_in = in_comment;
+}
+
+// --- Match Index Implementation ---
+//
+// A worker thread counts the matches of the active search on every line and
+// keeps per-chunk totals, which gives the "n of N" counter and lets find
+// next/prev skip whole chunks without a match. Before that it finishes
+// splitting a lazily loaded file into lines. E.match_index.lock guards the
+// buffer: the main thread holds it at all times except while it waits for a
+// key, so the worker only ever runs while the editor is idle.
+
+/**
+ * @brief Starts the match index worker. The calling (main) thread keeps the
+ * buffer lock from here on.
+ */
+void match_index_start(void) {
+    MatchIndex *mi = &E.match_index;
+    pthread_mutex_init(&mi->lock, NULL);
+    pthread_cond_init(&mi->wake, NULL);
+    atomic_init(&mi->main_waiting, false);
+    mi->quit = false;
+    mi->query[0] = '\0';
+    mi->query_len = 0;
+    mi->generation = 0;
+    mi->scan_from = 0;
+    mi->compiled = NULL;
+    mi->partial_chars = NULL;
+    mi->position_chars = NULL;
+
+    pthread_mutex_lock(&mi->lock);
+    mi->running = pthread_create(&mi->thread, NULL, match_index_worker, NULL) == 0;
+}
+
+/**
+ * @brief Stops and joins the match index worker.
+ */
+void match_index_stop(void) {
+    MatchIndex *mi = &E.match_index;
+    if (!mi->running) return;
+    mi->quit = true;
+    pthread_cond_signal(&mi->wake);
+    pthread_mutex_unlock(&mi->lock);
+    pthread_join(mi->thread, NULL);
+    pthread_mutex_lock(&mi->lock);
+    mi->running = false;
+    regex_free(mi->compiled);
+    mi->compiled = NULL;
+}
+
+/**
+ * @brief Lets the worker run while the main thread waits for input.
+ */
+void editor_buffer_release(void) {
+    if (!E.match_index.running) return;
+    pthread_cond_signal(&E.match_index.wake);
+    pthread_mutex_unlock(&E.match_index.lock);
+}
+
+/**
+ * @brief Takes the buffer back from the worker once input has arrived.
+ */
+void editor_buffer_acquire(void) {
+    if (!E.match_index.running) return;
+    atomic_store(&E.match_index.main_waiting, true);
+    pthread_mutex_lock(&E.match_index.lock);
+    atomic_store(&E.match_index.main_waiting, false);
+}
+
+/**
+ * @brief Starts indexing `query`, discarding the counts for the previous one.
+ *
+ * @param query The search text; an empty string clears the index.
+ * @param regex The query is a regex; it must compile.
+ */
+void match_index_set_query(const char *query, bool regex) {
+    MatchIndex *mi = &E.match_index;
+    strncpy(mi->query, query, sizeof(mi->query) - 1);
+    mi->query[sizeof(mi->query) - 1] = '\0';
+    mi->query_len = strlen(mi->query);
+    mi->regex = regex;
+    mi->generation++;
+    mi->scan_from = 0;
+}
+
+/**
+ * @brief Tells whether there is an index that has not caught up with the buffer.
+ */
+bool match_index_pending(void) {
+    return E.match_index.query_len > 0 && E.match_index.scan_from < E.num_lines;
+}
+
+/**
+ * @brief Tells whether the index serves the current search query.
+ */
+static bool match_index_active(void) {
+    return E.search_active && E.match_index.query_len > 0 && E.match_index.regex == E.last_search_regex &&
+           strcmp(E.match_index.query, E.last_search_query) == 0;
+}
+
+/**
+ * @brief Tells whether a line's match count is up to date.
+ */
+static bool match_index_line_fresh(const EditorLine *line) {
+    return line->match_generation == E.match_index.generation && line->match_revision == line->hl_revision;
+}
+
+/**
+ * @brief Counts the matches of the indexed query on a line, overlapping ones
+ * included, as find next steps through them one column at a time.
+ *
+ * A regex takes a long line MATCH_INDEX_STEP_BYTES at a time and stops when
+ * the main thread waits for the lock or the slice runs out, to carry on from
+ * there next turn unless the line changed.
+ *
+ * @param scanned Bytes scanned this turn; increased by what this call read.
+ * @return The count, or -1 if the line was left half counted.
+ */
+static int match_index_count_line(const SearchPattern *pattern, const EditorLine *line, size_t *scanned) {
+    MatchIndex *mi = &E.match_index;
+    if (pattern->regex == NULL || line->size <= MATCH_INDEX_STEP_BYTES) {
+        *scanned += (size_t)line->size + 1;
+        return search_count(pattern, line->chars, line->size, 0, line->size);
+    }
+    if (mi->partial_chars != line->chars || mi->partial_size != line->size || mi->partial_revision != line->hl_revision) {
+        regex_count_begin(pattern->regex, line->size, &mi->partial);
+        mi->partial_chars = line->chars;
+        mi->partial_size = line->size;
+        mi->partial_revision = line->hl_revision;
+    }
+    while (!regex_count_more(pattern->regex, line->chars, &mi->partial, MATCH_INDEX_STEP_BYTES)) {
+        *scanned += MATCH_INDEX_STEP_BYTES;
+        if (*scanned >= MATCH_INDEX_SLICE_BYTES || atomic_load(&mi->main_waiting)) return -1;
+    }
+    mi->partial_chars = NULL;
+    return mi->partial.total;
+}
+
+/**
+ * @brief Brings lines from E.match_index.scan_from up to date until about
+ * MATCH_INDEX_SLICE_BYTES have been read or the main thread waits for the
+ * lock. A chunk left part way keeps the counts of its fresh lines and gets
+ * its total on a later turn. Must be called with the buffer lock held.
+ */
+static void match_index_scan_slice(void) {
+    MatchIndex *mi = &E.match_index;
+    SearchPattern pattern = { .text = mi->query, .len = mi->query_len, .regex = NULL };
+    if (mi->regex) {
+        // A private compile, as the DFA state of a half counted line must survive other searches
+        if (mi->compiled == NULL || mi->compiled_generation != mi->generation) {
+            regex_free(mi->compiled);
+            mi->compiled = regex_compile(mi->query, NULL, 0);
+            mi->compiled_generation = mi->generation;
+            mi->partial_chars = NULL;
+        }
+        if (mi->compiled == NULL) {
+            mi->query_len = 0; // Out of memory compiling it; stop indexing
+            return;
+        }
+        pattern.regex = mi->compiled;
+    }
+    size_t scanned = 0;
+    while (mi->scan_from < E.num_lines) {
+        int offset;
+        int ci = line_index_locate(mi->scan_from, &offset);
+        LineChunk *chunk = E.chunks[ci];
+        int total = 0;
+        for (int i = 0; i < chunk->count; i++) {
+            EditorLine *line = &chunk->lines[i];
+            if (!match_index_line_fresh(line)) {
+                if (scanned >= MATCH_INDEX_SLICE_BYTES || atomic_load(&mi->main_waiting)) return;
+                int count = match_index_count_line(&pattern, line, &scanned);
+                if (count < 0) return;
+                line->match_count = count;
+                line->match_generation = mi->generation;
+                line->match_revision = line->hl_revision;
+            }
+            total += line->match_count;
+        }
+        chunk->match_total = total;
+        mi->scan_from += chunk->count - offset;
+    }
+}
+
+/**
+ * @brief Worker thread body: indexes slices while the main thread waits for
+ * input, and sleeps when the index is complete.
+ */
+static void *match_index_worker(void *arg) {
+    (void)arg;
+    MatchIndex *mi = &E.match_index;
+    pthread_mutex_lock(&mi->lock);
+    while (!mi->quit) {
+        if (atomic_load(&mi->main_waiting) || (!editor_load_pending() && !match_index_pending())) {
+            pthread_cond_wait(&mi->wake, &mi->lock);
+            continue;
+        }
+        if (editor_load_pending()) {
+            editor_load_through(E.num_lines + LOAD_SLICE_LINES - 1); // One slice of a lazily loaded file
+        } else {
+            match_index_scan_slice();
+        }
+    }
+    pthread_mutex_unlock(&mi->lock);
+    return NULL;
+}
+
+/**
+ * @brief Next line at or after (step 1) or at or before (step -1) `y` that may
+ * hold a match of the active search, using the index to skip lines and chunks
+ * known to have none. Lines the index does not cover yet are always returned.
+ *
+ * @return The line index, or -1 if the buffer edge is reached first.
+ */
+static int match_index_next_candidate(int y, int step) {
+    bool indexed = match_index_active();
+    while (y >= 0 && y < E.num_lines) {
+        if (!indexed || y >= E.match_index.scan_from) return y;
+        int offset;
+        int ci = line_index_locate(y, &offset);
+        LineChunk *chunk = E.chunks[ci];
+        int chunk_start = y - offset;
+        if (chunk->match_total == 0 && chunk_start + chunk->count <= E.match_index.scan_from) {
+            y = step > 0 ? chunk_start + chunk->count : chunk_start - 1;
+            continue;
+        }
+        const EditorLine *line = &chunk->lines[offset];
+        if (!match_index_line_fresh(line) || line->match_count > 0) return y;
+        y += step;
+    }
+    return -1;
+}
+
+/**
+ * @brief Numbers the match starting at (y, x) among all matches in the buffer.
+ *
+ * @param nth Receives the 1-based number of the match, or 0 if the index does
+ * not reach line y yet.
+ * @param total Receives the number of matches indexed so far.
+ * @return true if the index covers the whole buffer, so `total` is final.
+ */
+bool match_index_position(int y, int x, int *nth, int *total) {
+    MatchIndex *mi = &E.match_index;
+    *nth = 0;
+    *total = 0;
+    SearchPattern pattern;
+    if (!search_pattern_init(&pattern, mi->query, mi->regex, NULL, 0)) return false;
+    int line_start = 0;
+    for (int c = 0; c < E.num_chunks; c++) {
+        const LineChunk *chunk = E.chunks[c];
+        int chunk_end = line_start + chunk->count;
+        if (chunk_end > mi->scan_from) break; // Chunk totals past the scan point are stale
+        if (y >= line_start && y < chunk_end) {
+            int before = 0;
+            for (int i = 0; i < y - line_start; i++) before += chunk->lines[i].match_count;
+            const EditorLine *line = &chunk->lines[y - line_start];
+            // Matches on the line starting before x, plus the one at x itself; a regex
+            // scans the whole line for them, so the count is kept for the next repaint
+            if (mi->position_chars != line->chars || mi->position_size != line->size ||
+                mi->position_revision != line->hl_revision || mi->position_generation != mi->generation ||
+                mi->position_x != x) {
+                mi->position_before = search_count(&pattern, line->chars, line->size, 0, x);
+                mi->position_chars = line->chars;
+                mi->position_size = line->size;
+                mi->position_revision = line->hl_revision;
+                mi->position_generation = mi->generation;
+                mi->position_x = x;
+            }
+            *nth = *total + before + mi->position_before;
+        }
+        *total += chunk->match_total;
+        line_start = chunk_end;
+    }
+    return mi->scan_from >= E.num_lines && !editor_load_pending();
+}
+
+// --- Autosave Journal Implementation ---
+//
+// Edits made since the last save are appended to a journal next to the file,
+// .NAME.~journal, so a session that dies loses at most the last
+// AUTOSAVE_DELAY_MS of work. The edit primitives narrow down the window of
+// lines that changed; once the editor has waited for a key long enough, the
+// main thread copies that window into a record and hands it to a writer
+// thread, which appends and flushes it. The main thread never touches the
+// journal file itself while editing. Saving the file deletes the journal,
+// and loading a file replays a journal written since the file last changed.
+
+#define JOURNAL_FNV_BASIS 2166136261u
+
+/**
+ * @brief Starts the journal writer thread.
+ */
+void journal_start(void) {
+    Journal *j = &E.journal;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->wake, NULL);
+    pthread_cond_init(&j->idle, NULL);
+    j->error = 0;
+    j->error_path = NULL;
+    j->head = NULL;
+    j->tail = NULL;
+    j->busy = false;
+    j->quit = false;
+    j->file.path = NULL;
+    j->file.opened = false;
+    j->file.rewrite = false;
+    journal_reset_changes();
+    j->running = pthread_create(&j->thread, NULL, journal_worker, NULL) == 0;
+}
+
+/**
+ * @brief Lets the writer finish the jobs already queued, then joins it.
+ */
+void journal_stop(void) {
+    Journal *j = &E.journal;
+    if (!j->running) return;
+    pthread_mutex_lock(&j->lock);
+    j->quit = true;
+    pthread_cond_signal(&j->wake);
+    pthread_mutex_unlock(&j->lock);
+    pthread_join(j->thread, NULL);
+    j->running = false;
+}
+
+/**
+ * @brief Hands a job to the writer thread.
+ *
+ * @param type What to do.
+ * @param path The journal, copied.
+ * @param keep Bytes of an existing journal JOURNAL_OPEN keeps.
+ * @param data Bytes to write, or NULL; the job takes ownership.
+ * @param len Length of `data`.
+ */
+static void journal_queue(JournalJobType type, const char *path, size_t keep, char *data, size_t len) {
+    Journal *j = &E.journal;
+    JournalJob *job = malloc(sizeof(JournalJob));
+    char *path_copy = strdup(path);
+    if (job == NULL || path_copy == NULL) {
+        free(job);
+        free(path_copy);
+        free(data);
+        pthread_mutex_lock(&j->lock);
+        j->error = ENOMEM;
+        free(j->error_path);
+        j->error_path = NULL;
+        pthread_mutex_unlock(&j->lock);
+        return;
+    }
+    job->type = type;
+    job->path = path_copy;
+    job->keep = keep;
+    job->data = data;
+    job->len = len;
+    job->next = NULL;
+
+    pthread_mutex_lock(&j->lock);
+    if (j->tail != NULL) {
+        j->tail->next = job;
+    } else {
+        j->head = job;
+    }
+    j->tail = job;
+    pthread_cond_signal(&j->wake);
+    pthread_mutex_unlock(&j->lock);
+}
+
+/**
+ * @brief Carries out one job on the writer thread.
+ *
+ * Every job opens and closes the journal it names, so the writer keeps no
+ * state between jobs and journals of several buffers can interleave.
+ *
+ * @return true on success, false with errno set.
+ */
+static bool journal_run_job(const JournalJob *job) {
+    if (job->type == JOURNAL_DISCARD) {
+        return unlink(job->path) == 0 || errno == ENOENT;
+    }
+    int fd = job->type == JOURNAL_OPEN ? open(job->path, O_WRONLY | O_CREAT, 0600) : open(job->path, O_WRONLY | O_APPEND);
+    if (fd == -1) return false;
+    struct iovec iov = { .iov_base = job->data, .iov_len = job->len };
+    bool ok = true;
+    if (job->type == JOURNAL_OPEN) {
+        ok = ftruncate(fd, (off_t)job->keep) == 0 && lseek(fd, 0, SEEK_END) != -1;
+    }
+    ok = ok && save_write_batch(fd, &iov, 1) && fdatasync(fd) == 0;
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return ok;
+}
+
+/**
+ * @brief Writer thread body: runs queued jobs in order until stopped with an
+ * empty queue.
+ */
+static void *journal_worker(void *arg) {
+    (void)arg;
+    Journal *j = &E.journal;
+    pthread_mutex_lock(&j->lock);
+    while (true) {
+        JournalJob *job = j->head;
+        if (job == NULL) {
+            if (j->quit) break;
+            pthread_cond_wait(&j->wake, &j->lock);
+            continue;
+        }
+        j->head = job->next;
+        if (j->head == NULL) j->tail = NULL;
+        j->busy = true;
+        pthread_mutex_unlock(&j->lock);
+
+        bool ok = journal_run_job(job);
+        int err = errno != 0 ? errno : EIO;
+        pthread_mutex_lock(&j->lock);
+        j->busy = false;
+        if (j->head == NULL) pthread_cond_broadcast(&j->idle);
+        if (!ok) {
+            j->error = err;
+            free(j->error_path);
+            j->error_path = job->path;
+            job->path = NULL;
+        }
+        free(job->path);
+        free(job->data);
+        free(job);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
+}
+
+/**
+ * @brief Waits until the writer has carried out every job queued so far.
+ */
+void journal_flush(void) {
+    Journal *j = &E.journal;
+    if (!j->running) return;
+    pthread_mutex_lock(&j->lock);
+    while (j->head != NULL || j->busy) {
+        pthread_cond_wait(&j->idle, &j->lock);
+    }
+    pthread_mutex_unlock(&j->lock);
+}
+
+/**
+ * @brief Continues an FNV-1a hash over `len` more bytes.
+ *
+ * @param hash The hash so far, JOURNAL_FNV_BASIS to start.
+ */
+static uint32_t journal_checksum(uint32_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Forgets the changes noted since the last snapshot.
+ */
+static void journal_reset_changes(void) {
+    E.journal.file.keep_head = INT_MAX;
+    E.journal.file.keep_tail = INT_MAX;
+    E.journal.file.line_delta = 0;
+}
+
+/**
+ * @brief Notes an edit for the next snapshot, and for the undo step of a
+ * macro replay in progress. Called after the buffer changed.
+ *
+ * @param at First line the edit touched.
+ * @param count Lines from `at` on whose text is new, 0 for a pure removal.
+ * @param delta Lines the edit added, negative if it removed lines.
+ */
+static void journal_note_change(int at, int count, int delta) {
+    // The lines the match index remembers may be gone, and their memory reused
+    E.match_index.partial_chars = NULL;
+    E.match_index.position_chars = NULL;
+    if (E.replay.active) {
+        if (at < E.replay.keep_head) E.replay.keep_head = at;
+        if (E.num_lines - at - count < E.replay.keep_tail) E.replay.keep_tail = E.num_lines - at - count;
+    }
+    Journal *j = &E.journal;
+    if (j->file.keep_head == INT_MAX) {
+        j->file.changed_ms = editor_now_ms();
+    }
+    if (at < j->file.keep_head) j->file.keep_head = at;
+    int tail = E.num_lines - at - count;
+    if (tail < j->file.keep_tail) j->file.keep_tail = tail;
+    j->file.line_delta += delta;
+}
+
+/**
+ * @brief Notes that a line's text changed, if the line is in the buffer.
+ *
+ * Edits nearly always go through editor_get_line() just before, so the line
+ * is found in the cached chunk; otherwise the chunks are searched. Lines that
+ * are still being built are not in any chunk and are noted when inserted.
+ */
+static void journal_note_line(const EditorLine *line) {
+    uintptr_t p = (uintptr_t)line;
+    int ci = E.chunk_cache_index;
+    int start = E.chunk_cache_start;
+    if (ci < 0 || ci >= E.num_chunks || p < (uintptr_t)E.chunks[ci]->lines ||
+        p >= (uintptr_t)(E.chunks[ci]->lines + E.chunks[ci]->count)) {
+        start = 0;
+        for (ci = 0; ci < E.num_chunks; ci++) {
+            const LineChunk *chunk = E.chunks[ci];
+            if (p >= (uintptr_t)chunk->lines && p < (uintptr_t)(chunk->lines + chunk->count)) break;
+            start += chunk->count;
+        }
+        if (ci == E.num_chunks) return;
+    }
+    journal_note_change(start + (int)(line - E.chunks[ci]->lines), 1, 0);
+}
+
+/**
+ * @brief Notes that `count` lines of the file were appended to the buffer by
+ * the lazy loader. They are unchanged, so they only lengthen the kept tail.
+ */
+static void journal_note_loaded(int count) {
+    if (E.journal.file.keep_head != INT_MAX) {
+        E.journal.file.keep_tail += count;
+    }
+}
+
+/**
+ * @brief Tells when the next snapshot is due.
+ *
+ * @return Milliseconds until then, 0 if it is due now, -1 if there is nothing to snapshot.
+ */
+int journal_due_ms(void) {
+    const Journal *j = &E.journal;
+    if (!j->running || j->file.path == NULL || !E.dirty || (j->file.keep_head == INT_MAX && !j->file.rewrite)) return -1;
+    double remaining = j->file.changed_ms + AUTOSAVE_DELAY_MS - editor_now_ms();
+    return remaining > 0 ? (int)remaining + 1 : 0;
+}
+
+/**
+ * @brief Copies the lines changed since the last snapshot into a record and
+ * queues it for the writer.
+ *
+ * Only copies memory; the writer thread does the I/O.
+ */
+void journal_snapshot(void) {
+    Journal *j = &E.journal;
+    if (journal_due_ms() < 0) return;
+
+    int first = j->file.keep_head;
+    int new_count = E.num_lines - j->file.keep_head - j->file.keep_tail;
+    int old_count = new_count - j->file.line_delta;
+    if (j->file.rewrite) {
+        editor_load_all();
+        if (E.map_load_failed) return;
+        first = 0;
+        new_count = E.num_lines;
+        old_count = -1; // The whole file
+    }
+
+    size_t bytes = 0;
+    for (int y = first; y < first + new_count; y++) {
+        bytes += (size_t)editor_get_line(y)->size + 1;
+    }
+    bool reopen = !j->file.opened || j->file.rewrite;
+    char *data = malloc(sizeof(JournalRecord) + bytes);
+    char *header = reopen ? malloc(sizeof(JournalHeader)) : NULL;
+    if (data == NULL || (reopen && header == NULL)) {
+        free(data);
+        free(header);
+        set_status_message("Autosave failed: out of memory.");
+        j->file.changed_ms = editor_now_ms(); // Try again after another delay
+        return;
+    }
+
+    if (reopen) j->file.records = 0;
+    JournalRecord record = { .checksum = 0, .sequence = j->file.records, .bytes = (int64_t)bytes, .first = first, .old_count = old_count, .new_count = new_count };
+    char *p = data + sizeof(record);
+    for (int y = first; y < first + new_count; y++) {
+        const EditorLine *line = editor_get_line(y);
+        memcpy(p, line->chars, (size_t)line->size);
+        p += line->size;
+        *p++ = '\n';
+    }
+    record.checksum = journal_checksum(journal_checksum(JOURNAL_FNV_BASIS, &record, sizeof(record)), data + sizeof(record), bytes);
+    memcpy(data, &record, sizeof(record));
+
+    if (reopen) {
+        memcpy(header, &j->file.base, sizeof(JournalHeader));
+        journal_queue(JOURNAL_OPEN, j->file.path, 0, header, sizeof(JournalHeader));
+        j->file.opened = true;
+        j->file.rewrite = false;
+    }
+    journal_queue(JOURNAL_APPEND, j->file.path, 0, data, sizeof(record) + bytes);
+    j->file.records++;
+    journal_reset_changes();
+}
+
+/**
+ * @brief Shows a failure the writer ran into since the last call.
+ *
+ * Records may be missing from the journal that failed, so it is started over
+ * with a copy of its whole buffer once that buffer's next snapshot is due.
+ */
+void journal_report_error(void) {
+    Journal *j = &E.journal;
+    pthread_mutex_lock(&j->lock);
+    int err = j->error;
+    char *path = j->error_path;
+    j->error = 0;
+    j->error_path = NULL;
+    pthread_mutex_unlock(&j->lock);
+    if (err == 0) return;
+
+    set_status_message("Autosave failed: %s", strerror(err));
+    for (int i = 0; i < E.buffer_count; i++) {
+        JournalFile *file = i == E.buffer_current ? &j->file : &E.buffers[i].journal;
+        bool failed = path == NULL ? i == E.buffer_current : file->path != NULL && strcmp(file->path, path) == 0;
+        if (failed) {
+            file->rewrite = true;
+            file->changed_ms = editor_now_ms();
+        }
+    }
+    free(path);
+}
+
+/**
+ * @brief Builds the journal path for a file: .NAME.~journal in its directory,
+ * after resolving symlinks.
+ *
+ * @return A malloc'd path, or NULL if memory ran out.
+ */
+static char *journal_path_for(const char *filename) {
+    char *target = realpath(filename, NULL);
+    const char *path = target ? target : filename;
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash ? (int)(slash - path) + 1 : 0;
+    size_t size = (size_t)dir_len + strlen(path + dir_len) + sizeof(".~journal") + 1;
+    char *journal = malloc(size);
+    if (journal != NULL) {
+        snprintf(journal, size, "%.*s.%s.~journal", dir_len, path, path + dir_len);
+    }
+    free(target);
+    return journal;
+}
+
+/**
+ * @brief Tells whether a parked buffer already journals to `path`, which is
+ * the case when the same file is open twice. Only its first buffer keeps a
+ * journal, so two buffers never write into one.
+ */
+static bool journal_path_taken(const char *path) {
+    for (int i = 0; i < E.buffer_count; i++) {
+        if (i != E.buffer_current && E.buffers[i].journal.path != NULL && strcmp(E.buffers[i].journal.path, path) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Fills in the header that ties a journal to the file as it is on disk now.
+ */
+static void journal_stat_base(const char *filename, JournalHeader *base) {
+    memset(base, 0, sizeof(*base));
+    memcpy(base->magic, JOURNAL_MAGIC, sizeof(base->magic));
+    struct stat st;
+    if (stat(filename, &st) == 0) {
+        base->base_size = (int64_t)st.st_size;
+        base->base_mtime_sec = (int64_t)st.st_mtim.tv_sec;
+        base->base_mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+    } else {
+        base->base_size = -1;
+    }
+}
+
+/**
+ * @brief Applies the records of a journal to the freshly loaded buffer.
+ *
+ * Stops at the first record that is cut short or fails its checksum, which
+ * is where a crash interrupted the writer, or that does not follow on from
+ * the one before.
+ *
+ * @param data The journal's contents.
+ * @param len Length of `data`.
+ * @param valid Receives the length of the journal up to the last record applied.
+ * @return Records applied, or -1 if the journal belongs to another version of the file.
+ */
+static int journal_replay(const char *data, size_t len, size_t *valid) {
+    *valid = 0;
+    if (len < sizeof(JournalHeader) || memcmp(data, &E.journal.file.base, sizeof(JournalHeader)) != 0) return -1;
+    size_t pos = sizeof(JournalHeader);
+    *valid = pos;
+    int records = 0;
+
+    while (len - pos >= sizeof(JournalRecord)) {
+        JournalRecord record;
+        memcpy(&record, data + pos, sizeof(record));
+        const char *lines = data + pos + sizeof(record);
+        if (record.bytes < 0 || (uint64_t)record.bytes > len - pos - sizeof(record)) break;
+        uint32_t checksum = record.checksum;
+        record.checksum = 0;
+        if (journal_checksum(journal_checksum(JOURNAL_FNV_BASIS, &record, sizeof(record)), lines, (size_t)record.bytes) != checksum) break;
+        if (record.sequence != (uint32_t)records) break; // A record after one that was lost
+
+        if (record.old_count == -1 && record.first == 0) {
+            editor_load_all();
+            record.old_count = E.num_lines;
+        } else if (record.first >= 0 && record.old_count >= 0 && record.first + record.old_count < INT_MAX) {
+            editor_load_through((int)(record.first + record.old_count));
+        } else {
+            break;
+        }
+        if (record.first + record.old_count > E.num_lines || record.new_count < 0 || record.new_count > INT_MAX - E.num_lines) break;
+
+        int count = (int)record.new_count;
+        EditorLine *built = malloc(sizeof(EditorLine) * (size_t)(count > 0 ? count : 1));
+        const char *p = lines;
+        const char *end = lines + record.bytes;
+        int n = 0;
+        bool ok = built != NULL;
+        while (ok && n < count) {
+            const char *newline = memchr(p, '\n', (size_t)(end - p));
+            if (newline == NULL) break;
+            ok = editor_line_init(&built[n], p, (int)(newline - p));
+            if (!ok) break;
+            n++;
+            p = newline + 1;
+        }
+        // New lines go in before the old ones come out, so running out of memory leaves the buffer alone
+        bool parsed = ok && n == count && p == end;
+        if (!parsed || !line_store_insert_range((int)record.first, built, n)) {
+            for (int i = 0; i < n; i++) editor_line_free(&built[i]);
+            free(built);
+            if (parsed || !ok) set_status_message("Error: Out of memory recovering %s.", E.filename);
+            break;
+        }
+        free(built);
+        line_store_remove_range((int)record.first + n, (int)record.old_count);
+
+        records++;
+        pos += sizeof(record) + (size_t)record.bytes;
+        *valid = pos;
+    }
+    return records;
+}
+
+/**
+ * @brief Points the journal at the file just loaded and replays that file's
+ * journal if one was written since the file last changed.
+ *
+ * The recovered changes are not undoable; the buffer is left modified, so
+ * saving keeps them and quitting without saving throws them away.
+ */
+void journal_attach(void) {
+    Journal *j = &E.journal;
+    journal_reset_changes();
+    if (!j->running) return;
+    free(j->file.path);
+    j->file.path = journal_path_for(E.filename);
+    j->file.opened = false;
+    j->file.rewrite = false;
+    journal_stat_base(E.filename, &j->file.base);
+    if (j->file.path == NULL) return;
+    if (journal_path_taken(j->file.path)) {
+        free(j->file.path);
+        j->file.path = NULL;
+        return;
+    }
+
+    journal_flush(); // A buffer closed or reloaded without saving may still be deleting this journal
+    struct stat st;
+    if (stat(j->file.path, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) return;
+    if (j->file.base.base_size >= 0 &&
+        (st.st_mtim.tv_sec < j->file.base.base_mtime_sec ||
+         (st.st_mtim.tv_sec == j->file.base.base_mtime_sec && st.st_mtim.tv_nsec < j->file.base.base_mtime_nsec))) {
+        return; // The file was written after the journal
+    }
+
+    size_t len = (size_t)st.st_size;
+    char *data = malloc(len);
+    FILE *fp = data ? fopen(j->file.path, "rb") : NULL;
+    bool read_ok = fp != NULL && fread(data, 1, len, fp) == len;
+    if (fp != NULL) fclose(fp);
+    if (!read_ok) {
+        free(data);
+        return;
+    }
+    size_t valid;
+    int records = journal_replay(data, len, &valid);
+    free(data);
+    if (records <= 0) return; // Left alone until the first snapshot overwrites it
+
+    journal_queue(JOURNAL_OPEN, j->file.path, valid, NULL, 0);
+    j->file.opened = true;
+    j->file.records = (uint32_t)records;
+    journal_reset_changes();
+    E.dirty = true;
+    mark_lines_dirty(0, E.num_lines - 1);
+    set_status_message("Recovered %d unsaved change%s from %s", records, records == 1 ? "" : "s", j->file.path);
+}
+
+/**
+ * @brief Deletes the journal after the file was saved and ties the next one
+ * to the saved version.
+ */
+void journal_saved(void) {
+    Journal *j = &E.journal;
+    journal_reset_changes();
+    if (!j->running) return;
+    journal_discard();
+    free(j->file.path);
+    j->file.path = journal_path_for(E.filename);
+    journal_stat_base(E.filename, &j->file.base);
+    if (j->file.path != NULL && journal_path_taken(j->file.path)) {
+        free(j->file.path);
+        j->file.path = NULL;
+    }
+}
+
+/**
+ * @brief Deletes the journal, for quitting without saving.
+ */
+void journal_discard(void) {
+    Journal *j = &E.journal;
+    if (j->running && j->file.path != NULL && j->file.opened) {
+        journal_queue(JOURNAL_DISCARD, j->file.path, 0, NULL, 0);
+    }
+    j->file.opened = false;
+    j->file.rewrite = false;
+    journal_reset_changes();
+}
+
+// --- Buffer List Implementation ---
+//
+// E always holds the buffer on screen. The others wait in E.buffers with
+// their rope, mapping reference, cursor, undo log and journal exactly as they
+// were left, so switching moves a few pointers and redraws; nothing is read,
+// split or highlighted again. E.buffers stays NULL until a second buffer
+// is opened.
+
+/**
+ * @brief Copies the per-file state of the buffer on screen into its slot.
+ */
+static void buffer_park(EditorBuffer *buf) {
+    buf->chunks = E.chunks;
+    buf->num_chunks = E.num_chunks;
+    buf->allocated_chunks = E.allocated_chunks;
+    buf->chunk_tree = E.chunk_tree;
+    buf->num_lines = E.num_lines;
+    buf->mapping = E.mapping;
+    buf->map_indexed = E.map_indexed;
+    buf->map_load_failed = E.map_load_failed;
+    buf->pool = E.pool;
+    buf->cursor_x = E.cursor_x;
+    buf->cursor_y = E.cursor_y;
+    buf->scroll_y = E.scroll_y;
+    buf->scroll_x = E.scroll_x;
+    buf->filename = E.filename;
+    buf->dirty = E.dirty;
+    buf->hl_frontier = E.hl_frontier;
+    buf->hl_cached_lines = E.hl_cached_lines;
+    buf->is_code_file = E.is_code_file;
+    buf->syntax = E.syntax;
+    buf->undo = E.undo;
+    buf->journal = E.journal.file;
+}
+
+/**
+ * @brief Moves a parked buffer back into E.
+ */
+static void buffer_unpark(const EditorBuffer *buf) {
+    E.chunks = buf->chunks;
+    E.num_chunks = buf->num_chunks;
+    E.allocated_chunks = buf->allocated_chunks;
+    E.chunk_tree = buf->chunk_tree;
+    E.chunk_cache_index = -1;
+    E.chunk_cache_start = 0;
+    E.num_lines = buf->num_lines;
+    E.mapping = buf->mapping;
+    E.map_base = buf->mapping ? buf->mapping->base : NULL;
+    E.map_size = buf->mapping ? buf->mapping->size : 0;
+    E.map_indexed = buf->map_indexed;
+    E.map_load_failed = buf->map_load_failed;
+    E.pool = buf->pool;
+    E.cursor_x = buf->cursor_x;
+    E.cursor_y = buf->cursor_y;
+    E.scroll_y = buf->scroll_y;
+    E.scroll_x = buf->scroll_x;
+    E.filename = buf->filename;
+    E.dirty = buf->dirty;
+    E.hl_frontier = buf->hl_frontier;
+    E.hl_cached_lines = buf->hl_cached_lines;
+    E.is_code_file = buf->is_code_file;
+    E.syntax = buf->syntax;
+    E.undo = buf->undo;
+    E.journal.file = buf->journal;
+    buffer_reset_view();
+}
+
+/**
+ * @brief Drops the screen, selection and search state that belonged to the
+ * buffer previously on screen.
+ */
+static void buffer_reset_view(void) {
+    E.full_redraw = true;
+    E.dirty_line_start = -1;
+    E.dirty_line_end = -1;
+    E.visual_mode = false;
+    E.search_active = false;
+    E.last_search_found_y = -1;
+    E.last_search_found_x = -1;
+    // Match counts cached on the lines belong to whichever buffer they were counted in
+    E.match_index.generation++;
+    E.match_index.scan_from = 0;
+}
+
+/**
+ * @brief Starts an empty, unnamed buffer in E. Whatever E held must have been
+ * parked or freed.
+ */
+static void buffer_reset(void) {
+    E.chunks = NULL;
+    E.num_chunks = 0;
+    E.allocated_chunks = 0;
+    E.chunk_tree = NULL;
+    E.chunk_cache_index = -1;
+    E.chunk_cache_start = 0;
+    E.num_lines = 0;
+    E.mapping = NULL;
+    E.map_base = NULL;
+    E.map_size = 0;
+    E.map_indexed = 0;
+    E.map_load_failed = false;
+    memset(&E.pool, 0, sizeof(E.pool));
+    E.cursor_x = 0;
+    E.cursor_y = 0;
+    E.scroll_y = 0;
+    E.scroll_x = 0;
+    E.filename = NULL;
+    E.dirty = false;
+    E.hl_frontier = 0;
+    E.hl_cached_lines = 0;
+    E.is_code_file = false;
+    E.syntax = NULL;
+    memset(&E.undo, 0, sizeof(E.undo));
+    init_undo_redo();
+    memset(&E.journal.file, 0, sizeof(E.journal.file));
+    journal_reset_changes();
+    buffer_reset_view();
+}
+
+/**
+ * @brief Frees the lines, name, undo log and journal path of the buffer in E,
+ * after noting in its session where the user left off.
+ */
+static void buffer_free_current(void) {
+    session_store();
+    editor_free_lines();
+    free(E.filename);
+    E.filename = NULL;
+    if (E.undo.records != NULL) undo_release_all();
+    free(E.undo.records);
+    free(E.undo.arena);
+    E.undo.records = NULL;
+    E.undo.arena = NULL;
+    free(E.journal.file.path);
+    E.journal.file.path = NULL;
+}
+
+/**
+ * @brief Tells whether buffer `n` has unsaved changes.
+ */
+static bool buffer_is_dirty(int n) {
+    return n == E.buffer_current ? E.dirty : E.buffers[n].dirty;
+}
+
+/**
+ * @brief Parks the buffer on screen and puts a new empty one in E.
+ *
+ * @return false if memory ran out, with the current buffer left as it was.
+ */
+static bool buffer_add(void) {
+    EditorBuffer *buffers = realloc(E.buffers, sizeof(EditorBuffer) * (size_t)(E.buffer_count + 1));
+    if (buffers == NULL) {
+        set_status_message("Error: Out of memory opening another buffer.");
+        return false;
+    }
+    E.buffers = buffers;
+    journal_snapshot(); // Its pending edits, before they stop being in E
+    buffer_park(&E.buffers[E.buffer_current]);
+    E.buffer_current = E.buffer_count++;
+    buffer_reset();
+    return true;
+}
+
+/**
+ * @brief Puts buffer `n` on screen.
+ */
+void buffer_switch(int n) {
+    if (n < 0 || n >= E.buffer_count || n == E.buffer_current) return;
+    journal_snapshot();
+    buffer_park(&E.buffers[E.buffer_current]);
+    E.buffer_current = n;
+    buffer_unpark(&E.buffers[n]);
+    set_status_message("Buffer %d of %d: %s", n + 1, E.buffer_count, E.filename ? E.filename : "[New]");
+}
+
+/**
+ * @brief Opens a file in a buffer of its own, keeping the others open.
+ *
+ * An untouched unnamed buffer, like the one the editor starts with when given
+ * no file, is reused instead. Opening a file another buffer already holds
+ * shares that buffer's mapping as long as the file is unchanged on disk.
+ */
+void buffer_open(const char *filename) {
+    char *name = strdup(filename); // May be one of the recent files, which the load reorders
+    if (name == NULL) {
+        set_status_message("Error: Failed to allocate memory for filename.");
+        return;
+    }
+    if ((E.filename != NULL || E.dirty) && !buffer_add()) {
+        free(name);
+        return;
+    }
+    editor_load_file(name);
+    free(name);
+}
+
+/**
+ * @brief Closes the buffer on screen, asking first if it has unsaved changes.
+ *
+ * Closing the last buffer leaves an empty unnamed one.
+ */
+void buffer_close(void) {
+    if (E.dirty) {
+        if (!show_confirmation_dialog("Discard unsaved changes to this buffer?")) {
+            set_status_message("Close cancelled.");
+            return;
+        }
+        journal_discard();
+    }
+    buffer_free_current();
+
+    if (E.buffer_count == 1) {
+        buffer_reset();
+        editor_insert_line(0, "", 0);
+        E.dirty = false;
+        journal_reset_changes();
+        set_status_message("NEW FILE - Press Ctrl+S to save. Ctrl+H for help.");
+        return;
+    }
+    int closed = E.buffer_current;
+    memmove(&E.buffers[closed], &E.buffers[closed + 1], sizeof(EditorBuffer) * (size_t)(E.buffer_count - closed - 1));
+    E.buffer_count--;
+    E.buffer_current = closed < E.buffer_count ? closed : closed - 1;
+    buffer_unpark(&E.buffers[E.buffer_current]);
+    set_status_message("Buffer closed. Buffer %d of %d: %s", E.buffer_current + 1, E.buffer_count,
+                       E.filename ? E.filename : "[New]");
+}
+
+/**
+ * @brief Frees every buffer, for shutdown.
+ */
+static void buffer_free_all(void) {
+    if (E.buffers == NULL) {
+        buffer_free_current();
+        return;
+    }
+    buffer_park(&E.buffers[E.buffer_current]);
+    for (int i = 0; i < E.buffer_count; i++) {
+        buffer_unpark(&E.buffers[i]);
+        buffer_free_current();
+    }
+    free(E.buffers);
+    E.buffers = NULL;
+    E.buffer_count = 1;
+    E.buffer_current = 0;
+}
+
+/**
+ * @brief Command handler: switches to the next buffer, wrapping around.
+ */
+static void command_buffer_next(void) {
+    if (E.buffer_count == 1) {
+        set_status_message("Only one buffer is open.");
+        return;
+    }
+    buffer_switch((E.buffer_current + 1) % E.buffer_count);
+}
+
+/**
+ * @brief Command handler: switches to the previous buffer, wrapping around.
+ */
+static void command_buffer_prev(void) {
+    if (E.buffer_count == 1) {
+        set_status_message("Only one buffer is open.");
+        return;
+    }
+    buffer_switch((E.buffer_current + E.buffer_count - 1) % E.buffer_count);
+}
+
+/**
+ * @brief Lists the open buffers and switches to the one the user picks.
+ */
+void editor_show_buffers(void) {
+    char prompt_msg[MAX_STATUS_MESSAGE_LENGTH * 2];
+    int offset = snprintf(prompt_msg, sizeof(prompt_msg), "Buffers (Select #, ESC to cancel):");
+    for (int i = 0; i < E.buffer_count && offset < (int)sizeof(prompt_msg); i++) {
+        const char *name = i == E.buffer_current ? E.filename : E.buffers[i].filename;
+        offset += snprintf(prompt_msg + offset, sizeof(prompt_msg) - offset, "\n%c%d. %s%s",
+                           i == E.buffer_current ? '*' : ' ', i + 1, name ? name : "[New]",
+                           buffer_is_dirty(i) ? " (modified)" : "");
+    }
+    if (offset < (int)sizeof(prompt_msg)) {
+        snprintf(prompt_msg + offset, sizeof(prompt_msg) - offset, "\nSelect: %%s");
+    }
+
+    char choice_buf[10];
+    char *result = editor_prompt(prompt_msg, choice_buf, sizeof(choice_buf));
+    if (result == NULL) {
+        set_status_message("Buffer selection cancelled.");
+        return;
+    }
+    int selection = atoi(result);
+    if (selection > 0 && selection <= E.buffer_count) {
+        buffer_switch(selection - 1);
+    } else {
+        set_status_message("Invalid selection.");
+    }
+}
+
+/**
+ * @brief Loads the buffer's file again from disk, asking first if that
+ * throws away unsaved changes.
+ */
+void editor_reload_file(void) {
+    if (E.filename == NULL) {
+        set_status_message("Nothing to reload: the buffer has no file.");
+        return;
+    }
+    if (E.dirty) {
+        if (!show_confirmation_dialog("Discard unsaved changes and reload?")) {
+            set_status_message("Reload cancelled.");
+            return;
+        }
+        journal_discard();
+    }
+    char *name = strdup(E.filename); // editor_load_file() frees E.filename
+    if (name == NULL) {
+        set_status_message("Error: Failed to allocate memory for filename.");
+        return;
+    }
+    editor_load_file(name);
+    free(name);
+}
+
+// --- Session Cache Implementation ---
+//
+// Each recent file has a session in E.session_dir, written when its buffer
+// is closed or the editor quits and read back the next time the file is
+// opened, as long as the file still has the size and modification time the
+// session was written for. It holds the cursor, scroll position and file type,
+// and while the buffer matched the file, where every line starts and the
+// block comment state the lexer had reached, so a large file comes back
+// split and highlighted at the old viewport without being read through. The
+// session files double as the list of recent files, which session_start()
+// rebuilds from them; the user's macros live next to them.
+
+/**
+ * @brief Finds the session directory and reads back the recent files and
+ * macros of earlier runs.
+ *
+ * Uses $XDG_CACHE_HOME/unied, or ~/.cache/unied. Nothing is created until
+ * there is something to write.
+ */
+void session_start(void) {
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char dir[PATH_MAX];
+    if (cache != NULL && cache[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s/unied", cache);
+    } else if (home != NULL && home[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s/.cache/unied", home);
+    } else {
+        return;
+    }
+    E.session_dir = strdup(dir);
+    if (E.session_dir == NULL) return;
+
+    DIR *d = opendir(E.session_dir);
+    struct dirent *entry;
+    while (d != NULL && (entry = readdir(d)) != NULL) {
+        size_t name_len = strlen(entry->d_name);
+        if (entry->d_name[0] == '.' || name_len <= strlen(".session") ||
+            strcmp(entry->d_name + name_len - strlen(".session"), ".session") != 0) {
+            continue; // Temporary files of a save in progress among them
+        }
+        char *file = project_join(E.session_dir, entry->d_name);
+        FILE *fp = file ? fopen(file, "rb") : NULL;
+        SessionHeader header;
+        char *path = NULL;
+        if (fp != NULL && fread(&header, sizeof(header), 1, fp) == 1 &&
+            memcmp(header.magic, SESSION_MAGIC, sizeof(header.magic)) == 0 && header.path_len < PATH_MAX) {
+            path = malloc(header.path_len + 1);
+            if (path != NULL && fread(path, 1, header.path_len, fp) == header.path_len) {
+                path[header.path_len] = '\0';
+            } else {
+                free(path);
+                path = NULL;
+            }
+        }
+        if (fp != NULL) fclose(fp);
+
+        // Sessions beyond the newest MAX_RECENT_FILES, left by other runs, are dropped
+        int slot = E.num_recent_files;
+        if (path != NULL && slot == MAX_RECENT_FILES) {
+            slot = 0;
+            for (int i = 1; i < E.num_recent_files; i++) {
+                if (E.recent_files[i].opened < E.recent_files[slot].opened) slot = i;
+            }
+            if (E.recent_files[slot].opened < header.opened) {
+                char *oldest = session_path_for(E.recent_files[slot].path);
+                if (oldest != NULL) unlink(oldest);
+                free(oldest);
+                free(E.recent_files[slot].path);
+            } else {
+                slot = -1;
+            }
+        }
+        if (path != NULL && slot >= 0) {
+            E.recent_files[slot] = (RecentFile){ path, header.opened };
+            if (slot == E.num_recent_files) E.num_recent_files++;
+        } else if (file != NULL) {
+            unlink(file);
+            free(path);
+        }
+        free(file);
+    }
+    if (d != NULL) closedir(d);
+    macros_load();
+}
+
+/**
+ * @brief Reads the wall clock, which stamps recent files across runs.
+ *
+ * @return Nanoseconds since the epoch.
+ */
+static int64_t session_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * @brief Names the session file of a path: a hash of it, since paths hold slashes.
+ *
+ * @param path Absolute path of the file.
+ * @return A new string, or NULL without a session directory or memory.
+ */
+static char *session_path_for(const char *path) {
+    if (E.session_dir == NULL) return NULL;
+    uint32_t hash = journal_checksum(JOURNAL_FNV_BASIS, path, strlen(path));
+    size_t size = strlen(E.session_dir) + sizeof("/01234567.session");
+    char *file = malloc(size);
+    if (file != NULL) {
+        snprintf(file, size, "%s/%08x.session", E.session_dir, hash);
+    }
+    return file;
+}
+
+/**
+ * @brief Creates the session directory, and the cache directory it sits in.
+ *
+ * @return false if it does not exist and could not be made.
+ */
+static bool session_dir_make(void) {
+    if (mkdir(E.session_dir, 0700) == 0 || errno == EEXIST) return true;
+    char *slash = strrchr(E.session_dir, '/');
+    if (errno != ENOENT || slash == NULL || slash == E.session_dir) return false;
+    *slash = '\0';
+    bool parent = mkdir(E.session_dir, 0700) == 0 || errno == EEXIST;
+    *slash = '/';
+    return parent && (mkdir(E.session_dir, 0700) == 0 || errno == EEXIST);
+}
+
+/**
+ * @brief Checksums and atomically writes a file of the session directory.
+ *
+ * @param path The file.
+ * @param iov Its contents, in order; consumed by the write.
+ * @param count Entries in `iov`.
+ * @param checksum The header's checksum field, somewhere in `iov`; filled in.
+ * @return false with errno set if the file could not be written.
+ */
+static bool session_write(const char *path, struct iovec *iov, int count, uint32_t *checksum) {
+    *checksum = 0;
+    uint32_t hash = JOURNAL_FNV_BASIS;
+    for (int i = 0; i < count; i++) {
+        hash = journal_checksum(hash, iov[i].iov_base, iov[i].iov_len);
+    }
+    *checksum = hash;
+    if (!session_dir_make()) return false;
+    AtomicSave save;
+    if (!atomic_save_begin(&save, path)) return false;
+    bool ok = save_write_batch(save.fd, iov, count);
+    return atomic_save_commit(&save, ok);
+}
+
+/**
+ * @brief Reads a whole file of the session directory and checks its checksum.
+ *
+ * @param path The file.
+ * @param data Receives its contents, to be freed by the caller.
+ * @param len Receives its length.
+ * @param checksum_at Offset of the uint32_t checksum field in the file.
+ * @return false if it is missing, unreadable, shorter than its header or corrupt.
+ */
+static bool session_read_file(const char *path, unsigned char **data, size_t *len, size_t header_size, size_t checksum_at) {
+    *data = NULL;
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return false;
+    struct stat st;
+    bool ok = fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size >= header_size;
+    *len = ok ? (size_t)st.st_size : 0;
+    *data = ok ? malloc(*len) : NULL;
+    ok = *data != NULL && fread(*data, 1, *len, fp) == *len;
+    fclose(fp);
+
+    uint32_t stored = 0;
+    if (ok) {
+        memcpy(&stored, *data + checksum_at, sizeof(stored));
+        memset(*data + checksum_at, 0, sizeof(stored));
+    }
+    if (!ok || journal_checksum(JOURNAL_FNV_BASIS, *data, *len) != stored) {
+        free(*data);
+        *data = NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Reads the session of a file, if there is one for its current version.
+ *
+ * @param filename The file about to be loaded.
+ * @param session Receives the session; free session->data when done with it.
+ * @return false if there is no usable session for the file as it is on disk now.
+ */
+static bool session_read(const char *filename, Session *session) {
+    if (E.session_dir == NULL) return false;
+    char *path = realpath(filename, NULL);
+    char *file = path ? session_path_for(path) : NULL;
+    unsigned char *data = NULL;
+    size_t len = 0;
+    bool ok = file != NULL && session_read_file(file, &data, &len, sizeof(SessionHeader), offsetof(SessionHeader, checksum));
+    free(file);
+
+    SessionHeader *header = &session->header;
+    if (ok) {
+        memcpy(header, data, sizeof(*header));
+        uint64_t expected = sizeof(*header) + (uint64_t)header->path_len + (uint64_t)header->index_bytes +
+                            ((uint64_t)header->lexed_lines + 7) / 8;
+        ok = memcmp(header->magic, SESSION_MAGIC, sizeof(header->magic)) == 0 &&
+             header->path_len == strlen(path) && memcmp(data + sizeof(*header), path, header->path_len) == 0 &&
+             header->index_bytes >= 0 && header->lexed_lines >= 0 && header->index_lines >= -1 && expected == len;
+    }
+    struct stat st;
+    ok = ok && stat(path, &st) == 0 && header->size == (int64_t)st.st_size &&
+         header->mtime_sec == (int64_t)st.st_mtim.tv_sec && header->mtime_nsec == (int64_t)st.st_mtim.tv_nsec;
+    free(path);
+    if (!ok) {
+        free(data);
+        return false;
+    }
+    session->data = data;
+    session->index = data + sizeof(*header) + header->path_len;
+    session->lexed = session->index + header->index_bytes;
+    return true;
+}
 
-    while (cx < line->size && !isalnum((unsigned char)line->chars[cx]) && !isspace((unsigned char)line->chars[cx])) {
-        cx++;
+/**
+ * @brief Writes the session of the buffer in E, if its file is a recent one.
+ *
+ * The cursor and scroll position are always kept. The line index and the
+ * comment states describe the text, so they are only written while the buffer
+ * holds exactly what the file on disk does: unmodified since it was loaded or
+ * saved, and the file untouched since. The index also needs the whole file
+ * split into lines, and the comment states only go as far as the lexer did.
+ */
+static void session_store(void) {
+    if (E.session_dir == NULL || E.filename == NULL) return;
+    char *path = realpath(E.filename, NULL);
+    if (path == NULL) return;
+    int slot = -1;
+    for (int i = 0; i < E.num_recent_files; i++) {
+        if (strcmp(E.recent_files[i].path, path) == 0) slot = i;
     }
-    while (cx < line->size && isalnum((unsigned char)line->chars[cx])) {
-        cx++;
+    struct stat st;
+    if (slot < 0 || stat(path, &st) == -1) {
+        free(path); // Files that fell off the recent list keep no session
+        return;
     }
-    mark_lines_dirty(E.cursor_y, E.cursor_y);
-    E.cursor_x = cx;
-    mark_lines_dirty(E.cursor_y, E.cursor_y);
+
+    SessionHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SESSION_MAGIC, sizeof(header.magic));
+    header.path_len = (uint32_t)strlen(path);
+    header.size = (int64_t)st.st_size;
+    header.mtime_sec = (int64_t)st.st_mtim.tv_sec;
+    header.mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+    header.opened = E.recent_files[slot].opened;
+    header.cursor_x = E.cursor_x;
+    header.cursor_y = E.cursor_y;
+    header.scroll_x = E.scroll_x;
+    header.scroll_y = E.scroll_y;
+    header.code_file = E.is_code_file ? 1 : 0;
+    header.index_lines = -1;
+
+    const JournalHeader *base = &E.journal.file.base;
+    bool in_sync = !E.dirty && base->base_size == header.size &&
+                   base->base_mtime_sec == header.mtime_sec && base->base_mtime_nsec == header.mtime_nsec;
+
+    // Every line but the last ends in a '\n'; the last may also have lost a '\r'
+    unsigned char *index = NULL;
+    if (in_sync && !editor_load_pending() && !E.map_load_failed && E.num_lines > 0) {
+        index = malloc((size_t)E.num_lines * 5);
+    }
+    if (index != NULL) {
+        int64_t total = 0;
+        int y = 0;
+        for (int c = 0; c < E.num_chunks; c++) {
+            const LineChunk *chunk = E.chunks[c];
+            for (int i = 0; i < chunk->count; i++, y++) {
+                uint32_t size = (uint32_t)chunk->lines[i].size;
+                total += size;
+                if (y == E.num_lines - 1) break;
+                total++;
+                do {
+                    index[header.index_bytes++] = (unsigned char)((size & 0x7f) | (size >= 0x80 ? 0x80 : 0));
+                    size >>= 7;
+                } while (size != 0);
+            }
+        }
+        if (header.size - total == 0 || header.size - total == 1) {
+            header.index_lines = E.num_lines;
+        } else {
+            header.index_bytes = 0;
+        }
+    }
+
+    unsigned char *lexed = NULL;
+    if (in_sync && E.is_code_file) {
+        int count = E.hl_frontier < E.num_lines ? E.hl_frontier : E.num_lines;
+        lexed = calloc((size_t)count / 8 + 1, 1);
+        for (int c = 0, y = 0; lexed != NULL && c < E.num_chunks && y < count; c++) {
+            const LineChunk *chunk = E.chunks[c];
+            for (int i = 0; i < chunk->count && y < count; i++, y++) {
+                if (chunk->lines[i].hl_comment_out) lexed[y >> 3] |= (unsigned char)(1 << (y & 7));
+            }
+        }
+        if (lexed != NULL) header.lexed_lines = count;
+    }
+
+    char *file = session_path_for(path);
+    struct iovec iov[4] = {
+        { &header, sizeof(header) },
+        { path, header.path_len },
+        { index, (size_t)header.index_bytes },
+        { lexed, ((size_t)header.lexed_lines + 7) / 8 },
+    };
+    if (file != NULL) session_write(file, iov, 4, &header.checksum);
+    free(file);
+    free(lexed);
+    free(index);
+    free(path);
 }
 
 /**
- * @brief Normalizes selection coordinates so that (sy, sx) is always the top-left
- * and (ey, ex) is always the bottom-right of the selection.
- * This handles cases where the user selects backwards.
- * @param sy Pointer to store normalized start Y.
- * @param sx Pointer to store normalized start X.
- * @param ey Pointer to store normalized normalized end Y.
- * @param ex Pointer to store normalized normalized end X.
+ * @brief Lays out every line of the freshly mapped file from the line index
+ * of its session, instead of searching the text for newlines.
+ *
+ * @param session The file's session.
+ * @return false if the index is missing, does not fit the mapping (a line it
+ * lists does not end in a '\n') or memory ran out; lines laid out until then
+ * stay, and E.map_indexed says where they end.
  */
-void get_normalized_selection_coords(int *sy, int *sx, int *ey, int *ex) {
-    if (E.visual_start_y < E.cursor_y) {
-        *sy = E.visual_start_y;
-        *sx = E.visual_start_x;
-        *ey = E.cursor_y;
-        *ex = E.cursor_x;
-    } else if (E.visual_start_y > E.cursor_y) {
-        *sy = E.cursor_y;
-        *sx = E.cursor_x;
-        *ey = E.visual_start_y;
-        *ex = E.visual_start_x;
-    } else {
-        *sy = E.visual_start_y;
-        *ey = E.cursor_y;
-        if (E.visual_start_x < E.cursor_x) {
-            *sx = E.visual_start_x;
-            *ex = E.cursor_x;
+static bool editor_load_indexed(const Session *session) {
+    const SessionHeader *header = &session->header;
+    if (header->index_lines <= 0 || header->size != (int64_t)E.map_size || E.num_lines != 0) return false;
+
+    // The whole index must add up before any line goes in
+    const unsigned char *p = session->index;
+    const unsigned char *end = p + header->index_bytes;
+    uint64_t offset = 0;
+    for (int y = 0; y < header->index_lines - 1; y++) {
+        uint64_t size = 0;
+        for (int shift = 0; ; shift += 7) {
+            if (p == end || shift > 28) return false;
+            size |= (uint64_t)(*p & 0x7f) << shift;
+            if ((*p++ & 0x80) == 0) break;
+        }
+        // A file rewritten with the same size would still add up, so each line must end where its '\n' is
+        if (size > INT_MAX || size >= E.map_size - offset || E.map_base[offset + size] != '\n') return false;
+        offset += size + 1;
+    }
+    if (p != end || E.map_size - offset > INT_MAX) return false;
+
+    // Chunks are filled whole, straight from the index
+    LineChunk *chunk = NULL;
+    const char *text = E.map_base;
+    bool ok = true;
+    p = session->index;
+    for (int y = 0; y < header->index_lines; y++) {
+        int size;
+        if (y < header->index_lines - 1) {
+            uint32_t value = 0;
+            for (int shift = 0; ; shift += 7) {
+                value |= (uint32_t)(*p & 0x7f) << shift;
+                if ((*p++ & 0x80) == 0) break;
+            }
+            size = (int)value;
         } else {
-            *sx = E.cursor_x;
-            *ex = E.visual_start_x;
+            // Trimmed like editor_load_more() trims the last line
+            size = (int)(E.map_base + E.map_size - text);
+            if (size > 0 && (text[size - 1] == '\n' || text[size - 1] == '\r')) size--;
+        }
+        if (chunk == NULL || chunk->count == LINE_CHUNK_CAPACITY) {
+            chunk = line_chunk_insert(E.num_chunks);
+            if (chunk == NULL) {
+                ok = false;
+                break;
+            }
+        }
+        chunk->lines[chunk->count++] = (EditorLine){ .chars = (char *)text, .size = size, .allocated = 0, .hl = NULL, .hl_revision = 0, .hl_lexed_revision = -1, .match_revision = -1 };
+        E.num_lines++;
+        text = y < header->index_lines - 1 ? text + size + 1 : E.map_base + E.map_size;
+        E.map_indexed = (size_t)(text - E.map_base);
+    }
+    line_index_rebuild();
+    journal_note_loaded(E.num_lines);
+    return ok;
+}
+
+/**
+ * @brief Hands the comment states of the session to the lines they belong
+ * to, so highlighting the restored viewport lexes only what is on screen.
+ *
+ * @param session The session of the file just loaded.
+ */
+static void session_restore_lexer(const Session *session) {
+    int count = session->header.lexed_lines < E.num_lines ? session->header.lexed_lines : E.num_lines;
+    if (!E.is_code_file || count == 0) return;
+    bool in_comment = false;
+    for (int c = 0, y = 0; c < E.num_chunks && y < count; c++) {
+        LineChunk *chunk = E.chunks[c];
+        for (int i = 0; i < chunk->count && y < count; i++, y++) {
+            EditorLine *line = &chunk->lines[i];
+            line->hl_comment_in = in_comment;
+            line->hl_comment_out = (session->lexed[y >> 3] >> (y & 7)) & 1;
+            line->hl_lexed_revision = line->hl_revision;
+            in_comment = line->hl_comment_out;
         }
     }
+    E.hl_frontier = count;
 }
 
 /**
- * @brief Gets the content of the currently selected text.
- * @param sy Start Y of selection.
- * @param sx Start X of selection.
- * @param ey End Y of selection.
- * @param ex End X of selection.
- * @param num_lines Pointer to store the number of lines in the selection.
- * @return Dynamically allocated string containing the selected text, or NULL if error/empty.
+ * @brief Puts the cursor and scroll position back where the session left them.
+ *
+ * @param session The session of the file just loaded.
  */
-char *get_selection_content(int sy, int sx, int ey, int ex, int *num_lines) {
-    *num_lines = 0;
-    if (sy < 0 || sy >= E.num_lines || ey < 0 || ey >= E.num_lines) return NULL;
+static void session_restore_view(const Session *session) {
+    const SessionHeader *header = &session->header;
+    int y = header->cursor_y > 0 ? header->cursor_y : 0;
+    int top = header->scroll_y > 0 ? header->scroll_y : 0;
+    editor_load_through((y > top ? y : top) + E.screen_rows);
+    if (E.num_lines == 0) return;
+    if (y >= E.num_lines) y = E.num_lines - 1;
+    if (top > y) top = y;
+
+    // The buffer may have been edited when the session was written
+    const EditorLine *line = editor_get_line(y);
+    int x = header->cursor_x < 0 ? 0 : header->cursor_x > line->size ? line->size : header->cursor_x;
+    while (x > 0 && x < line->size && ((unsigned char)line->chars[x] & 0xC0) == 0x80) x--;
+    E.cursor_y = y;
+    E.cursor_x = x;
+    E.scroll_y = top;
+    E.scroll_x = header->scroll_x > 0 ? header->scroll_x : 0;
+}
 
-    size_t total_len = 0;
-    for (int y = sy; y <= ey; y++) {
-        int start_col = (y == sy) ? sx : 0;
-        int end_col = (y == ey) ? ex : E.lines[y].size;
-        if (end_col < start_col) end_col = start_col;
-        total_len += (size_t)(end_col - start_col);
-        if (y < ey) total_len++;
-        (*num_lines)++;
+/**
+ * @brief Lists the recent files newest first.
+ *
+ * @param order Receives E.num_recent_files indices into E.recent_files.
+ */
+static void recent_files_order(int *order) {
+    for (int i = 0; i < E.num_recent_files; i++) {
+        int j = i;
+        while (j > 0 && E.recent_files[order[j - 1]].opened < E.recent_files[i].opened) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
     }
+}
 
-    if (total_len == 0) return NULL;
+/**
+ * @brief Defines the macros saved by an earlier run.
+ */
+static void macros_load(void) {
+    char *file = project_join(E.session_dir, "macros");
+    unsigned char *data;
+    size_t len;
+    bool ok = file != NULL && session_read_file(file, &data, &len, sizeof(MacroFileHeader), offsetof(MacroFileHeader, checksum));
+    free(file);
+    if (!ok) return;
+
+    MacroFileHeader header;
+    memcpy(&header, data, sizeof(header));
+    size_t pos = sizeof(header);
+    for (uint32_t n = 0; memcmp(header.magic, SESSION_MACROS_MAGIC, sizeof(header.magic)) == 0 &&
+                         n < header.count && len - pos >= sizeof(MacroFileRecord); n++) {
+        MacroFileRecord record;
+        memcpy(&record, data + pos, sizeof(record));
+        pos += sizeof(record);
+        if (record.key_count < 0 || (size_t)record.key_count > (len - pos) / sizeof(int32_t) ||
+            memchr(record.sequence, '\0', sizeof(record.sequence)) == NULL || record.sequence[0] == '\0' ||
+            memchr(record.action, '\0', sizeof(record.action)) == NULL) {
+            break;
+        }
+        int *keys = record.key_count > 0 ? malloc(sizeof(int) * (size_t)record.key_count) : NULL;
+        for (int i = 0; keys != NULL && i < record.key_count; i++) {
+            int32_t key;
+            memcpy(&key, data + pos + sizeof(int32_t) * (size_t)i, sizeof(key));
+            keys[i] = key;
+        }
+        pos += sizeof(int32_t) * (size_t)record.key_count;
+        macro_define(record.sequence, record.action, keys, keys != NULL ? record.key_count : 0);
+        free(keys);
+    }
+    free(data);
+}
 
-    char *buffer = malloc(total_len + 1);
-    if (buffer == NULL) {
-        set_status_message("Error: Failed to allocate memory for selection content.");
-        return NULL;
+/**
+ * @brief Saves the user's macros for the next run.
+ */
+static void macros_store(void) {
+    if (E.session_dir == NULL || E.macro_count == 0) return;
+    size_t len = sizeof(MacroFileHeader);
+    for (int i = 0; i < E.macro_count; i++) {
+        len += sizeof(MacroFileRecord) + sizeof(int32_t) * (size_t)E.macros[i].key_count;
+    }
+    unsigned char *data = calloc(len, 1);
+    char *file = project_join(E.session_dir, "macros");
+    if (data == NULL || file == NULL) {
+        free(data);
+        free(file);
+        return;
     }
 
-    char *ptr = buffer;
-    for (int y = sy; y <= ey; y++) {
-        int start_col = (y == sy) ? sx : 0;
-        int end_col = (y == ey) ? ex : E.lines[y].size;
-        if (end_col < start_col) end_col = start_col;
-        
-        memcpy(ptr, E.lines[y].chars + start_col, (size_t)(end_col - start_col));
-        ptr += (end_col - start_col);
-        if (y < ey) {
-            *ptr++ = '\n';
+    MacroFileHeader header = { .count = (uint32_t)E.macro_count };
+    memcpy(header.magic, SESSION_MACROS_MAGIC, sizeof(header.magic));
+    memcpy(data, &header, sizeof(header));
+    size_t pos = sizeof(header);
+    for (int i = 0; i < E.macro_count; i++) {
+        const EditorMacro *macro = &E.macros[i];
+        MacroFileRecord record;
+        memset(&record, 0, sizeof(record));
+        snprintf(record.sequence, sizeof(record.sequence), "%s", macro->sequence);
+        snprintf(record.action, sizeof(record.action), "%s", macro->action);
+        record.key_count = macro->key_count;
+        memcpy(data + pos, &record, sizeof(record));
+        pos += sizeof(record);
+        for (int k = 0; k < macro->key_count; k++) {
+            int32_t key = macro->keys[k];
+            memcpy(data + pos, &key, sizeof(key));
+            pos += sizeof(key);
         }
     }
-    *ptr = '\0';
-    return buffer;
+    struct iovec iov = { data, len };
+    session_write(file, &iov, 1, (uint32_t *)(data + offsetof(MacroFileHeader, checksum)));
+    free(file);
+    free(data);
 }
 
+// --- Project Search Implementation ---
+//
+// PS searches every file under the working directory, PX does the same and
+// then offers to replace every match. Hidden files and directories are
+// skipped, .git among them, as are symlinks and files with a NUL byte near
+// the start. The threads only touch E.project, under its own lock, so the
+// editor stays responsive while they run.
+
 /**
- * @brief Checks if a given character coordinate (row, col) is within the current selection.
- * @param row The row of the character.
- * @param col The column of the character.
- * @return True if the character is selected, false otherwise.
+ * @brief Builds the path of a directory entry.
+ *
+ * @return A new string, without a leading "./", or NULL if memory ran out.
  */
-bool is_char_in_selection(int row, int col) {
-    if (!E.visual_mode) return false;
+static char *project_join(const char *dir, const char *name) {
+    if (strcmp(dir, ".") == 0) return strdup(name);
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    char *path = malloc(dir_len + name_len + 2);
+    if (path == NULL) return NULL;
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len + 1);
+    return path;
+}
 
-    int sy, sx, ey, ex;
-    get_normalized_selection_coords(&sy, &sx, &ey, &ex);
+/**
+ * @brief Hands a file to the searchers, waiting while the queue is full.
+ *
+ * @param path The file; the queue takes it over.
+ * @return false if the search was cancelled (the path is freed).
+ */
+static bool project_queue_push(char *path) {
+    ProjectSearch *ps = &E.project;
+    pthread_mutex_lock(&ps->lock);
+    while (ps->queue_count == PROJECT_QUEUE_SLOTS && !atomic_load(&ps->cancel)) {
+        pthread_cond_wait(&ps->queue_room, &ps->lock);
+    }
+    if (atomic_load(&ps->cancel)) {
+        pthread_mutex_unlock(&ps->lock);
+        free(path);
+        return false;
+    }
+    ps->queue[(ps->queue_head + ps->queue_count) % PROJECT_QUEUE_SLOTS] = path;
+    ps->queue_count++;
+    pthread_cond_signal(&ps->queue_ready);
+    pthread_mutex_unlock(&ps->lock);
+    return true;
+}
 
-    if (row < sy || row > ey) return false;
+/**
+ * @brief Takes the next file to search, waiting while the walk is behind.
+ *
+ * @return The path, which the caller frees, or NULL once the walk is over and
+ * the queue empty, or the search was cancelled.
+ */
+static char *project_queue_pop(void) {
+    ProjectSearch *ps = &E.project;
+    pthread_mutex_lock(&ps->lock);
+    while (ps->queue_count == 0 && !ps->walk_done && !atomic_load(&ps->cancel)) {
+        pthread_cond_wait(&ps->queue_ready, &ps->lock);
+    }
+    char *path = NULL;
+    if (ps->queue_count > 0 && !atomic_load(&ps->cancel)) {
+        path = ps->queue[ps->queue_head];
+        ps->queue_head = (ps->queue_head + 1) % PROJECT_QUEUE_SLOTS;
+        ps->queue_count--;
+        pthread_cond_signal(&ps->queue_room);
+    }
+    pthread_mutex_unlock(&ps->lock);
+    return path;
+}
 
-    if (row == sy && row == ey) {
-        return (col >= sx && col < ex);
-    } else if (row == sy) {
-        return (col >= sx);
-    } else if (row == ey) {
-        return (col < ex);
+/**
+ * @brief Walker thread body: queues every regular file under the working
+ * directory, depth first.
+ */
+static void *project_walk(void *arg) {
+    (void)arg;
+    ProjectSearch *ps = &E.project;
+    int depth = 0, allocated = 16;
+    char **stack = malloc(sizeof(char *) * (size_t)allocated);
+    char *root = strdup(".");
+    if (stack != NULL && root != NULL) {
+        stack[depth++] = root;
     } else {
-        return true;
+        free(root);
+    }
+
+    while (depth > 0 && !atomic_load(&ps->cancel)) {
+        char *dir = stack[--depth];
+        DIR *d = opendir(dir);
+        struct dirent *entry;
+        while (d != NULL && (entry = readdir(d)) != NULL && !atomic_load(&ps->cancel)) {
+            if (entry->d_name[0] == '.') continue; // Hidden, ".git" and the editor's own journals included
+            char *path = project_join(dir, entry->d_name);
+            if (path == NULL) continue;
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                type = lstat(path, &st) == -1 ? DT_UNKNOWN : S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type == DT_REG) {
+                project_queue_push(path);
+            } else if (type == DT_DIR && (depth < allocated || (stack = realloc(stack, sizeof(char *) * (size_t)(allocated *= 2))) != NULL)) {
+                stack[depth++] = path;
+            } else {
+                free(path);
+            }
+        }
+        if (d != NULL) closedir(d);
+        free(dir);
+        if (stack == NULL) break;
     }
+    while (depth > 0 && stack != NULL) {
+        free(stack[--depth]);
+    }
+    free(stack);
+
+    pthread_mutex_lock(&ps->lock);
+    ps->walk_done = true;
+    pthread_cond_broadcast(&ps->queue_ready);
+    pthread_mutex_unlock(&ps->lock);
+    return NULL;
 }
 
 /**
- * @brief Toggles visual selection mode.
+ * @brief Maps a whole file read-only.
+ *
+ * @param data Receives the mapping, or NULL for an empty file.
+ * @param size Receives its size.
+ * @return false with errno set if the file could not be read.
  */
-void editor_toggle_visual_mode(void) {
-    E.visual_mode = !E.visual_mode;
-    if (E.visual_mode) {
-        E.visual_start_x = E.cursor_x;
-        E.visual_start_y = E.cursor_y;
-        set_status_message("Visual Mode ON. Move cursor to select. ESC to cancel.");
-    } else {
-        set_status_message("Visual Mode OFF.");
+static bool project_map_file(const char *path, char **data, size_t *size) {
+    *data = NULL;
+    *size = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return false;
+    struct stat st;
+    bool stat_ok = fstat(fd, &st) == 0;
+    if (!stat_ok || !S_ISREG(st.st_mode)) {
+        int saved_errno = stat_ok ? EINVAL : errno;
+        close(fd);
+        errno = saved_errno;
+        return false;
+    }
+    if (st.st_size > 0) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            int saved_errno = errno;
+            close(fd);
+            errno = saved_errno;
+            return false;
+        }
+        *data = map;
+        *size = (size_t)st.st_size;
     }
-    mark_lines_dirty(0, E.num_lines - 1);
+    close(fd);
+    return true;
 }
 
 /**
- * @brief Copies the currently selected text to the clipboard.
+ * @brief Finds the next match at or after `pos` in a mapped file.
+ *
+ * Regex matches are found one line at a time, as in the editor, so that ^
+ * and $ mean the ends of a line and no match spans two.
+ *
+ * @param match_len Receives the length of the match.
+ * @return The match, or NULL if there is none.
  */
-void editor_copy_selection(void) {
-    if (!E.visual_mode) {
-        editor_copy_line();
-        return;
+static const char *project_next_match(ProjectScan *scan, const char *pos, size_t *match_len) {
+    const ProjectSearch *ps = &E.project;
+    if (scan->regex == NULL) {
+        *match_len = ps->query_len;
+        return pos < scan->end ? text_search_forward(pos, (size_t)(scan->end - pos), ps->query, ps->query_len) : NULL;
+    }
+    while (pos <= scan->end) {
+        if (scan->line == NULL || pos > scan->line_end) {
+            // pos is where a line starts; a final newline ends the last line rather than starting one
+            if (pos == scan->end && pos > scan->data && pos[-1] == '\n') return NULL;
+            const char *newline = memchr(pos, '\n', (size_t)(scan->end - pos));
+            scan->line = pos;
+            scan->line_end = newline ? newline : scan->end;
+            regex_matches_begin(scan->regex, scan->line, (int)(scan->line_end - scan->line), &scan->match);
+        }
+        int len = (int)(scan->line_end - scan->line);
+        if (pos - scan->line > scan->match.pos) scan->match.pos = (int)(pos - scan->line);
+        if (regex_matches_next(scan->regex, scan->line, len, &scan->match)) {
+            *match_len = (size_t)(scan->match.end - scan->match.start);
+            return scan->line + scan->match.start;
+        }
+        if (scan->line_end == scan->end) return NULL;
+        pos = scan->line_end + 1;
     }
+    return NULL;
+}
 
-    int sy, sx, ey, ex;
-    get_normalized_selection_coords(&sy, &sx, &ey, &ex);
-    
-    int num_lines_in_selection;
-    char *selection_content = get_selection_content(sy, sx, ey, ex, &num_lines_in_selection);
-
-    if (selection_content == NULL) {
-        set_status_message("Empty selection. Nothing copied.");
-        editor_toggle_visual_mode();
-        return;
+/**
+ * @brief Searches one file and appends its matches to the result list.
+ *
+ * Matches do not overlap, the same ones editor_replace_all() would replace.
+ *
+ * @param path The file; taken over by the result list or freed.
+ * @param regex The worker's compiled query; NULL for a literal one, or if it
+ * could not be compiled, and then the file is skipped.
+ */
+static void project_search_file(char *path, Regex *regex) {
+    ProjectSearch *ps = &E.project;
+    char *data;
+    size_t size;
+    ProjectMatch *found = NULL;
+    int found_count = 0, found_allocated = 0;
+    long total = 0;
+
+    if ((regex != NULL || !ps->regex) && project_map_file(path, &data, &size) && data != NULL &&
+        memchr(data, '\0', size < PROJECT_BINARY_PROBE ? size : PROJECT_BINARY_PROBE) == NULL) {
+        madvise(data, size, MADV_SEQUENTIAL);
+        const char *end = data + size;
+        const char *line_start = data;
+        const char *counted = data; // Newlines before this have been counted
+        int line = 0;
+        ProjectScan scan = { .data = data, .end = end, .regex = regex };
+        size_t match_len;
+        const char *pos = data;
+        while (!atomic_load(&ps->cancel) && (pos = project_next_match(&scan, pos, &match_len)) != NULL) {
+            const char *newline;
+            while ((newline = memchr(counted, '\n', (size_t)(pos - counted))) != NULL) {
+                line++;
+                line_start = counted = newline + 1;
+            }
+            counted = pos;
+            total++;
+
+            if (found_count < PROJECT_MAX_MATCHES) {
+                if (found_count == found_allocated) {
+                    int grown_allocated = found_allocated ? found_allocated * 2 : 16;
+                    ProjectMatch *grown = realloc(found, sizeof(ProjectMatch) * (size_t)grown_allocated);
+                    if (grown == NULL) break;
+                    found = grown;
+                    found_allocated = grown_allocated;
+                }
+                const char *line_end = memchr(pos, '\n', (size_t)(end - pos));
+                if (line_end == NULL) line_end = end;
+                const char *text = line_start;
+                while (text < line_end && (*text == ' ' || *text == '\t')) text++;
+                size_t len = (size_t)(line_end - text);
+                if (len > PROJECT_PREVIEW_BYTES) {
+                    len = PROJECT_PREVIEW_BYTES;
+                    while (len > 0 && ((unsigned char)text[len] & 0xC0) == 0x80) len--; // Whole characters only
+                }
+                char *preview = malloc(len + 1);
+                if (preview != NULL) {
+                    for (size_t i = 0; i < len; i++) {
+                        preview[i] = (unsigned char)text[i] < ' ' ? ' ' : text[i];
+                    }
+                    preview[len] = '\0';
+                }
+                found[found_count++] = (ProjectMatch){ 0, line, (int)(pos - line_start), preview };
+            }
+            pos += match_len > 0 ? match_len : 1;
+        }
     }
-
-    if (strlen(selection_content) + 1 > (size_t)E.clipboard_allocated) {
-        E.clipboard_allocated = (int)strlen(selection_content) + 1;
-        E.clipboard_buffer = realloc(E.clipboard_buffer, (size_t)E.clipboard_allocated);
-        if (E.clipboard_buffer == NULL) {
-            set_status_message("Error: Failed to allocate clipboard memory for selection.");
-            free(selection_content);
-            return;
+    if (data != NULL) munmap(data, size);
+
+    pthread_mutex_lock(&ps->lock);
+    ps->files_scanned++;
+    int kept = 0;
+    if (total > 0 && ps->file_count == ps->file_allocated) {
+        int grown_allocated = ps->file_allocated ? ps->file_allocated * 2 : 64;
+        ProjectFile *grown = realloc(ps->files, sizeof(ProjectFile) * (size_t)grown_allocated);
+        if (grown != NULL) {
+            ps->files = grown;
+            ps->file_allocated = grown_allocated;
+        }
+    }
+    if (total > 0 && ps->file_count < ps->file_allocated) {
+        int file = ps->file_count++;
+        ps->files[file] = (ProjectFile){ path, total };
+        path = NULL;
+        ps->total_matches += total;
+
+        kept = found_count;
+        if (kept > PROJECT_MAX_MATCHES - ps->match_count) kept = PROJECT_MAX_MATCHES - ps->match_count;
+        if (ps->match_count + kept > ps->match_allocated) {
+            int grown_allocated = ps->match_allocated ? ps->match_allocated : 256;
+            while (grown_allocated < ps->match_count + kept) grown_allocated *= 2;
+            ProjectMatch *grown = realloc(ps->matches, sizeof(ProjectMatch) * (size_t)grown_allocated);
+            if (grown != NULL) {
+                ps->matches = grown;
+                ps->match_allocated = grown_allocated;
+            } else {
+                kept = 0;
+            }
+        }
+        for (int i = 0; i < kept; i++) {
+            found[i].file = file;
+            ps->matches[ps->match_count++] = found[i];
         }
     }
+    pthread_mutex_unlock(&ps->lock);
 
-    memcpy(E.clipboard_buffer, selection_content, strlen(selection_content) + 1);
-    E.clipboard_size = (int)strlen(selection_content);
-    free(selection_content);
+    for (int i = kept; i < found_count; i++) {
+        free(found[i].preview);
+    }
+    free(found);
+    free(path);
+}
 
-    set_status_message("Selection copied (%zu chars).", (size_t)E.clipboard_size);
-    editor_toggle_visual_mode();
+/**
+ * @brief Search worker thread body.
+ */
+static void *project_search_worker(void *arg) {
+    (void)arg;
+    // Compiled patterns are not shared between threads
+    Regex *regex = E.project.regex ? regex_compile(E.project.query, NULL, 0) : NULL;
+    char *path;
+    while ((path = project_queue_pop()) != NULL) {
+        project_search_file(path, regex);
+    }
+    regex_free(regex);
+    pthread_mutex_lock(&E.project.lock);
+    E.project.workers_busy--;
+    pthread_mutex_unlock(&E.project.lock);
+    return NULL;
 }
 
 /**
- * @brief Deletes the currently selected text.
+ * @brief Replaces every match in one file through the atomic save path.
+ *
+ * The file is searched again, so changes since the search are honoured.
+ *
+ * @param path The file.
+ * @param regex The worker's compiled query, NULL for a literal one.
+ * @param replaced Receives the number of matches replaced.
+ * @param error Receives errno if the file could not be rewritten.
+ * @return 1 if the file was rewritten, 0 if it was skipped, -1 on failure.
  */
-void editor_delete_selection(void) {
-    if (!E.visual_mode) {
-        set_status_message("No selection to delete. Enter visual mode (Ctrl+V) first.");
-        return;
+static int project_replace_file(const char *path, Regex *regex, long *replaced, int *error) {
+    ProjectSearch *ps = &E.project;
+    *replaced = 0;
+    if (ps->regex && regex == NULL) {
+        *error = ENOMEM;
+        return -1;
     }
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        *error = errno;
+        return -1;
+    }
+    for (int i = 0; i < ps->open_file_count; i++) {
+        if (ps->open_files[i].dev == st.st_dev && ps->open_files[i].ino == st.st_ino) return 0;
+    }
+
+    char *data;
+    size_t size;
+    if (!project_map_file(path, &data, &size)) {
+        *error = errno;
+        return -1;
+    }
+    const char *end = data + size;
+    ProjectScan scan = { .data = data, .end = end, .regex = regex };
+    size_t match_len;
+    const char *match = data ? project_next_match(&scan, data, &match_len) : NULL;
+    if (match == NULL) {
+        if (data != NULL) munmap(data, size);
+        return 0;
+    }
+
+    AtomicSave save;
+    if (!atomic_save_begin(&save, path)) {
+        *error = errno;
+        munmap(data, size);
+        return -1;
+    }
+    // The unchanged stretches go out straight from the mapping. Expanded regex
+    // replacements collect in `expanded`, which is only grown or reused once
+    // the batch pointing into it has been written.
+    struct iovec iov[SAVE_IOV_BATCH];
+    int count = 0;
+    bool ok = true;
+    char *expanded = NULL;
+    size_t expanded_len = 0, expanded_allocated = 0;
+    const char *pos = data;
+    while (ok && match != NULL) {
+        size_t to_len = regex ? regex_expand(ps->replacement, ps->replacement_len, scan.line, &scan.match, NULL) : 0;
+        if (count + 2 > SAVE_IOV_BATCH || expanded_len + to_len > expanded_allocated) {
+            ok = save_write_batch(save.fd, iov, count);
+            count = 0;
+            expanded_len = 0;
+        }
+        if (ok && to_len > expanded_allocated) {
+            free(expanded);
+            expanded_allocated = to_len > 4096 ? to_len : 4096;
+            expanded = malloc(expanded_allocated);
+            if (expanded == NULL) {
+                expanded_allocated = 0;
+                errno = ENOMEM;
+                ok = false;
+            }
+        }
+        if (!ok) break;
+        iov[count++] = (struct iovec){ (char *)pos, (size_t)(match - pos) };
+        if (regex != NULL) {
+            regex_expand(ps->replacement, ps->replacement_len, scan.line, &scan.match, expanded + expanded_len);
+            iov[count++] = (struct iovec){ expanded + expanded_len, to_len };
+            expanded_len += to_len;
+        } else {
+            iov[count++] = (struct iovec){ ps->replacement, ps->replacement_len };
+        }
+        (*replaced)++;
+        pos = match + match_len;
+        // After an empty match the next one may not start at the same place
+        match = project_next_match(&scan, match_len > 0 ? pos : pos + 1, &match_len);
+    }
+    iov[count++] = (struct iovec){ (char *)pos, (size_t)(end - pos) };
+    ok = ok && save_write_batch(save.fd, iov, count);
+    ok = atomic_save_commit(&save, ok);
+    *error = errno;
+    free(expanded);
+    munmap(data, size);
+    if (!ok) *replaced = 0;
+    return ok ? 1 : -1;
+}
 
-    int sy, sx, ey, ex;
-    get_normalized_selection_coords(&sy, &sx, &ey, &ex);
-
-    int num_lines_in_selection;
-    char *deleted_content = get_selection_content(sy, sx, ey, ex, &num_lines_in_selection);
-
-    if (deleted_content == NULL) {
-        set_status_message("Empty selection. Nothing deleted.");
-        editor_toggle_visual_mode();
-        return;
+/**
+ * @brief Replace worker thread body: rewrites files off the result list
+ * until none are left.
+ */
+static void *project_replace_worker(void *arg) {
+    (void)arg;
+    ProjectSearch *ps = &E.project;
+    Regex *regex = ps->regex ? regex_compile(ps->query, NULL, 0) : NULL;
+    pthread_mutex_lock(&ps->lock);
+    while (!atomic_load(&ps->cancel) && ps->next_file < ps->file_count) {
+        const char *path = ps->files[ps->next_file++].path;
+        pthread_mutex_unlock(&ps->lock);
+        long replaced;
+        int error = 0;
+        int result = project_replace_file(path, regex, &replaced, &error);
+        pthread_mutex_lock(&ps->lock);
+        ps->replaced += replaced;
+        if (result > 0) {
+            ps->files_written++;
+        } else if (result == 0) {
+            ps->files_skipped++;
+        } else {
+            ps->files_failed++;
+            ps->last_error = error;
+        }
     }
+    ps->workers_busy--;
+    pthread_mutex_unlock(&ps->lock);
+    regex_free(regex);
+    return NULL;
+}
 
-    UndoAction ua = {
-        .type = UNDO_DELETE_BLOCK,
-        .y = sy, .x = sx, .char_val = '\0',
-        .text_content = deleted_content,
-        .text_len = (int)strlen(deleted_content),
-        .num_lines_affected = num_lines_in_selection
-    };
-    push_undo_action(ua);
-
-    editor_delete_text_block(sy, sx, ey, ex);
+/**
+ * @brief Starts a pool of one worker per CPU, and the walker if asked.
+ *
+ * @return false if not even one worker could be started.
+ */
+static bool project_threads_start(void *(*worker)(void *), bool walk) {
+    ProjectSearch *ps = &E.project;
+    pthread_mutex_init(&ps->lock, NULL);
+    pthread_cond_init(&ps->queue_ready, NULL);
+    pthread_cond_init(&ps->queue_room, NULL);
+    atomic_store(&ps->cancel, false);
+    ps->queue_head = 0;
+    ps->queue_count = 0;
+    ps->walk_done = false;
+    ps->worker_count = 0;
+    ps->running = true;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    if (cpus > PROJECT_MAX_WORKERS) cpus = PROJECT_MAX_WORKERS;
+    ps->workers_busy = (int)cpus;
+    for (int i = 0; i < cpus; i++) {
+        if (pthread_create(&ps->workers[ps->worker_count], NULL, worker, NULL) == 0) {
+            ps->worker_count++;
+        } else {
+            pthread_mutex_lock(&ps->lock);
+            ps->workers_busy--;
+            pthread_mutex_unlock(&ps->lock);
+        }
+    }
+    ps->walking = walk && ps->worker_count > 0 && pthread_create(&ps->walker, NULL, project_walk, NULL) == 0;
+    if (walk && !ps->walking) {
+        // Without a walker the workers would wait forever for paths
+        pthread_mutex_lock(&ps->lock);
+        ps->walk_done = true;
+        pthread_cond_broadcast(&ps->queue_ready);
+        pthread_mutex_unlock(&ps->lock);
+    }
+    if (ps->worker_count == 0 || (walk && !ps->walking)) {
+        project_threads_join();
+        return false;
+    }
+    return true;
+}
 
-    E.cursor_x = sx;
-    E.cursor_y = sy;
-    E.dirty = true;
-    mark_lines_dirty(sy, E.num_lines - 1);
+/**
+ * @brief Joins the walker and the workers once they are done or cancelled.
+ */
+static void project_threads_join(void) {
+    ProjectSearch *ps = &E.project;
+    if (!ps->running) return;
+    if (ps->walking) pthread_join(ps->walker, NULL);
+    for (int i = 0; i < ps->worker_count; i++) {
+        pthread_join(ps->workers[i], NULL);
+    }
+    for (; ps->queue_count > 0; ps->queue_count--) {
+        free(ps->queue[ps->queue_head]);
+        ps->queue_head = (ps->queue_head + 1) % PROJECT_QUEUE_SLOTS;
+    }
+    pthread_cond_destroy(&ps->queue_room);
+    pthread_cond_destroy(&ps->queue_ready);
+    pthread_mutex_destroy(&ps->lock);
+    ps->walking = false;
+    ps->worker_count = 0;
+    ps->running = false;
+}
 
-    set_status_message("Selection deleted.");
-    editor_toggle_visual_mode();
+/**
+ * @brief Cancels a project search or replace that is still running and waits
+ * for its threads. The results found so far are kept.
+ */
+void project_search_stop(void) {
+    ProjectSearch *ps = &E.project;
+    if (!ps->running) return;
+    pthread_mutex_lock(&ps->lock);
+    atomic_store(&ps->cancel, true);
+    pthread_cond_broadcast(&ps->queue_ready);
+    pthread_cond_broadcast(&ps->queue_room);
+    pthread_mutex_unlock(&ps->lock);
+    project_threads_join();
 }
 
 /**
- * @brief Cuts the currently selected text to the clipboard.
+ * @brief Frees the result list of the last project search.
  */
-void editor_cut_selection(void) {
-    if (!E.visual_mode) {
-        editor_cut_line();
-        return;
-    }
-    editor_copy_selection();
+void project_search_clear(void) {
+    ProjectSearch *ps = &E.project;
+    project_search_stop();
+    for (int i = 0; i < ps->file_count; i++) {
+        free(ps->files[i].path);
+    }
+    for (int i = 0; i < ps->match_count; i++) {
+        free(ps->matches[i].preview);
+    }
+    free(ps->files);
+    free(ps->matches);
+    free(ps->open_files);
+    ps->files = NULL;
+    ps->matches = NULL;
+    ps->open_files = NULL;
+    ps->file_count = ps->file_allocated = 0;
+    ps->match_count = ps->match_allocated = 0;
+    ps->open_file_count = 0;
+    ps->total_matches = 0;
+    ps->files_scanned = 0;
+    ps->selected = 0;
+    ps->list_top = 0;
+}
 
-    E.visual_mode = true; 
+/**
+ * @brief Starts searching the working directory, replacing the last results.
+ *
+ * @param query Text to look for, a regex while regex search is on.
+ * @param replacement Text replace all puts in its place, NULL for a plain search.
+ * @return false if the regex does not compile or no thread could be started.
+ */
+static bool project_search_start(const char *query, const char *replacement) {
+    ProjectSearch *ps = &E.project;
+    SearchPattern pattern;
+    char error[MAX_STATUS_MESSAGE_LENGTH];
+    if (!search_pattern_init(&pattern, query, E.search_regex, error, sizeof(error))) {
+        set_status_message("Regex error: %s", error);
+        return false;
+    }
+    project_search_clear();
+    snprintf(ps->query, sizeof(ps->query), "%s", query);
+    ps->query_len = strlen(ps->query);
+    ps->has_replacement = replacement != NULL;
+    snprintf(ps->replacement, sizeof(ps->replacement), "%s", replacement ? replacement : "");
+    ps->replacement_len = strlen(ps->replacement);
+    ps->regex = E.search_regex;
+    ps->replacing = false;
+    if (!project_threads_start(project_search_worker, true)) {
+        set_status_message("Error: Could not start the project search threads.");
+        return false;
+    }
+    return true;
+}
 
-    int sy, sx, ey, ex;
-    get_normalized_selection_coords(&sy, &sx, &ey, &ex);
-    
-    int num_lines_in_selection;
-    char *deleted_content = get_selection_content(sy, sx, ey, ex, &num_lines_in_selection);
+/**
+ * @brief Reaps the threads of a finished search or replace; editor_read_key()
+ * polls it so the list keeps filling in while it waits for a key.
+ *
+ * @return true while threads were running at the previous call, so one more
+ * repaint shows the final counts.
+ */
+bool project_search_poll(void) {
+    ProjectSearch *ps = &E.project;
+    if (!ps->running) return false;
+    pthread_mutex_lock(&ps->lock);
+    bool done = ps->workers_busy == 0;
+    pthread_mutex_unlock(&ps->lock);
+    if (!done) return true;
+
+    project_threads_join();
+    if (ps->replacing) {
+        char message[MAX_STATUS_MESSAGE_LENGTH];
+        int len = snprintf(message, sizeof(message), "Replaced %ld matches in %d files", ps->replaced, ps->files_written);
+        if (ps->files_skipped > 0 && len < (int)sizeof(message)) {
+            len += snprintf(message + len, sizeof(message) - (size_t)len, ", %d skipped", ps->files_skipped);
+        }
+        if (ps->files_failed > 0 && len < (int)sizeof(message)) {
+            snprintf(message + len, sizeof(message) - (size_t)len, ", %d failed: %s", ps->files_failed, strerror(ps->last_error));
+        }
+        set_status_message("%s", message);
+        project_search_clear(); // The listed positions no longer hold
+        ps->list_open = false;
+    }
+    return true;
+}
 
-    if (deleted_content == NULL) {
-        set_status_message("Empty selection. Nothing cut.");
-        editor_toggle_visual_mode();
+/**
+ * @brief Replaces every match of a finished project replace search, in
+ * parallel. Files open in a buffer are left alone.
+ */
+static void project_replace_all(void) {
+    ProjectSearch *ps = &E.project;
+    if (!ps->has_replacement) {
+        set_status_message("Start with PX (Project Replace) to replace matches.");
+        return;
+    }
+    if (ps->running) {
+        set_status_message("Still searching; replace once the search has finished.");
+        return;
+    }
+    if (ps->file_count == 0) {
+        set_status_message("Nothing to replace.");
+        return;
+    }
+    char question[MAX_STATUS_MESSAGE_LENGTH];
+    snprintf(question, sizeof(question), "Replace %ld matches in %d files?", ps->total_matches, ps->file_count);
+    ps->list_open = false; // The question takes the status bar
+    bool confirmed = show_confirmation_dialog(question);
+    ps->list_open = true;
+    if (!confirmed) {
+        set_status_message("Replace cancelled.");
         return;
     }
 
-    UndoAction ua = {
-        .type = UNDO_DELETE_BLOCK,
-        .y = sy, .x = sx, .char_val = '\0',
-        .text_content = deleted_content,
-        .text_len = (int)strlen(deleted_content),
-        .num_lines_affected = num_lines_in_selection
-    };
-    push_undo_action(ua);
-
-    editor_delete_text_block(sy, sx, ey, ex);
+    free(ps->open_files);
+    ps->open_files = malloc(sizeof(ProjectOpenFile) * (size_t)E.buffer_count);
+    ps->open_file_count = 0;
+    for (int i = 0; i < E.buffer_count && ps->open_files != NULL; i++) {
+        const char *name = i == E.buffer_current ? E.filename : E.buffers[i].filename;
+        struct stat st;
+        if (name != NULL && stat(name, &st) == 0) {
+            ps->open_files[ps->open_file_count++] = (ProjectOpenFile){ st.st_dev, st.st_ino };
+        }
+    }
+    ps->replacing = true;
+    ps->next_file = 0;
+    ps->replaced = 0;
+    ps->files_written = ps->files_skipped = ps->files_failed = 0;
+    if (!project_threads_start(project_replace_worker, false)) {
+        ps->replacing = false;
+        set_status_message("Error: Could not start the project replace threads.");
+    }
+}
 
-    E.cursor_x = sx;
-    E.cursor_y = sy;
-    E.dirty = true;
-    mark_lines_dirty(sy, E.num_lines - 1);
+/**
+ * @brief Opens the file of a listed match, or switches to its buffer, and
+ * puts the cursor on the match. Find next then continues from there.
+ */
+static void project_open_match(int n) {
+    ProjectSearch *ps = &E.project;
+    if (ps->running) pthread_mutex_lock(&ps->lock);
+    bool valid = n >= 0 && n < ps->match_count;
+    char *path = valid ? strdup(ps->files[ps->matches[n].file].path) : NULL;
+    int line = valid ? ps->matches[n].line : 0;
+    int col = valid ? ps->matches[n].col : 0;
+    if (ps->running) pthread_mutex_unlock(&ps->lock);
+    if (path == NULL) return;
+
+    struct stat target;
+    int open_in = -1;
+    bool exists = stat(path, &target) == 0;
+    for (int i = 0; i < E.buffer_count && open_in < 0 && exists; i++) {
+        const char *name = i == E.buffer_current ? E.filename : E.buffers[i].filename;
+        struct stat st;
+        if (name != NULL && stat(name, &st) == 0 && st.st_dev == target.st_dev && st.st_ino == target.st_ino) {
+            open_in = i;
+        }
+    }
+    if (open_in < 0) {
+        buffer_open(path);
+    } else if (open_in != E.buffer_current) {
+        buffer_switch(open_in);
+    }
 
-    set_status_message("Selection cut.");
-    editor_toggle_visual_mode();
+    editor_load_through(line);
+    if (line < E.num_lines) {
+        mark_lines_dirty(E.cursor_y, E.cursor_y);
+        E.cursor_y = line;
+        E.cursor_x = col <= editor_get_line(line)->size ? col : 0;
+        mark_lines_dirty(E.cursor_y, E.cursor_y);
+        snprintf(E.last_search_query, sizeof(E.last_search_query), "%s", ps->query);
+        E.last_search_regex = ps->regex;
+        E.search_active = true;
+        match_index_set_query(E.last_search_query, E.last_search_regex);
+        E.last_search_found_y = E.cursor_y;
+        E.last_search_found_x = E.cursor_x;
+        set_status_message("Match %d of %d: %s:%d", n + 1, ps->match_count, path, line + 1);
+    }
+    free(path);
 }
 
 /**
- * @brief Adds a filename to the list of recently opened files.
- * Handles duplicates and maintains maximum list size.
- * @param filename The path to the file to add.
+ * @brief Draws the part of the result list around the selection into the
+ * suggestion area.
  */
-void add_to_recent_files(const char *filename) {
-    if (!filename) return;
+static void project_draw_list(void) {
+    ProjectSearch *ps = &E.project;
+    clear_suggestion_area();
+    int start_y = E.screen_rows + BORDER_WIDTH;
+    int width = E.screen_cols;
+    if (ps->running) pthread_mutex_lock(&ps->lock);
+    if (ps->selected >= ps->match_count) ps->selected = ps->match_count > 0 ? ps->match_count - 1 : 0;
+    if (ps->selected < ps->list_top) ps->list_top = ps->selected;
+    if (ps->selected >= ps->list_top + SUGGESTION_ROWS) ps->list_top = ps->selected - SUGGESTION_ROWS + 1;
+    for (int row = 0; row < SUGGESTION_ROWS && ps->list_top + row < ps->match_count; row++) {
+        int n = ps->list_top + row;
+        const ProjectMatch *m = &ps->matches[n];
+        char text[PROJECT_PREVIEW_BYTES + 2 * MAX_STATUS_MESSAGE_LENGTH];
+        snprintf(text, sizeof(text), "%c %s:%d: %s", n == ps->selected ? '>' : ' ',
+                 ps->files[m->file].path, m->line + 1, m->preview ? m->preview : "");
+        int attrs = n == ps->selected ? A_REVERSE : A_NORMAL;
+        wattron(stdscr, COLOR_PAIR(COLOR_PAIR_SUGGESTIONS) | attrs);
+        mvaddnstr(start_y + row, BORDER_WIDTH, text, width);
+        wattroff(stdscr, COLOR_PAIR(COLOR_PAIR_SUGGESTIONS) | attrs);
+    }
+    if (ps->running) pthread_mutex_unlock(&ps->lock);
+}
 
-    for (int i = 0; i < E.num_recent_files; i++) {
-        if (E.recent_files[i] && strcmp(E.recent_files[i], filename) == 0) {
-            char *temp = E.recent_files[i];
-            for (int j = i; j > 0; j--) {
-                E.recent_files[j] = E.recent_files[j-1];
-            }
-            E.recent_files[0] = temp;
-            return;
-        }
+/**
+ * @brief Writes the project search progress into the status bar.
+ *
+ * @param y Row of the status bar.
+ */
+static void project_draw_status(int y) {
+    ProjectSearch *ps = &E.project;
+    if (ps->running) pthread_mutex_lock(&ps->lock);
+    if (ps->replacing) {
+        mvprintw(y, BORDER_WIDTH, "Replacing '%s': %d of %d files done (Esc: stop)", ps->query,
+                 ps->files_written + ps->files_skipped + ps->files_failed, ps->file_count);
+    } else {
+        mvprintw(y, BORDER_WIDTH, "'%s': %ld matches in %d files, %ld searched%s | Enter: open%s, Esc: close",
+                 ps->query, ps->total_matches, ps->file_count, ps->files_scanned,
+                 ps->running ? " (searching)" : "", ps->has_replacement ? ", r: replace all" : "");
     }
+    if (ps->running) pthread_mutex_unlock(&ps->lock);
+}
 
-    if (E.num_recent_files == MAX_RECENT_FILES) {
-        free(E.recent_files[MAX_RECENT_FILES - 1]);
-        for (int i = MAX_RECENT_FILES - 1; i > 0; i--) {
-            E.recent_files[i] = E.recent_files[i-1];
+/**
+ * @brief Shows the result list until a match is opened or the list is closed.
+ *
+ * Up/Down and Page Up/Down move the selection while the list fills in.
+ */
+static void project_list_run(void) {
+    ProjectSearch *ps = &E.project;
+    ps->list_open = true;
+    set_status_message(""); // The list has the whole status bar
+    while (ps->list_open) {
+        editor_refresh_screen();
+        int c = editor_read_key();
+        if (ps->running) pthread_mutex_lock(&ps->lock);
+        int count = ps->match_count;
+        if (ps->running) pthread_mutex_unlock(&ps->lock);
+        if (ps->replacing) {
+            // Only Esc does anything until the files are written
+            if (c == 27) project_search_stop();
+            project_search_poll();
+            continue;
+        }
+        switch (c) {
+            case KEY_UP:
+                if (ps->selected > 0) ps->selected--;
+                break;
+            case KEY_DOWN:
+                if (ps->selected < count - 1) ps->selected++;
+                break;
+            case KEY_PPAGE:
+                ps->selected = ps->selected > SUGGESTION_ROWS ? ps->selected - SUGGESTION_ROWS : 0;
+                break;
+            case KEY_NPAGE:
+                ps->selected = ps->selected + SUGGESTION_ROWS < count ? ps->selected + SUGGESTION_ROWS : (count > 0 ? count - 1 : 0);
+                break;
+            case KEY_ENTER:
+            case '\n':
+                if (count > 0) {
+                    ps->list_open = false;
+                    project_open_match(ps->selected); // The search goes on; PL shows the list again
+                }
+                break;
+            case 'r':
+            case 'R':
+                project_replace_all();
+                break;
+            case 27:
+                project_search_stop();
+                ps->list_open = false;
+                set_status_message("'%s': %ld matches in %d files.", ps->query, ps->total_matches, ps->file_count);
+                break;
         }
-        E.num_recent_files--;
     }
+    E.full_redraw = true;
+}
 
-    E.recent_files[0] = strdup(filename);
-    if (E.recent_files[0] == NULL) {
-        set_status_message("Error: Failed to store recent file path.");
+/**
+ * @brief Prompts for text and searches every file under the working directory.
+ */
+void command_project_search(void) {
+    char query[MAX_STATUS_MESSAGE_LENGTH];
+    if (editor_prompt(E.search_regex ? "Regex search project: %s" : "Search project: %s", query, sizeof(query)) == NULL) return;
+    if (project_search_start(query, NULL)) project_list_run();
+}
+
+/**
+ * @brief Prompts for text and its replacement, and lists the matches under the
+ * working directory with the option to replace them all.
+ */
+void command_project_replace(void) {
+    char query[MAX_STATUS_MESSAGE_LENGTH];
+    char replacement[MAX_STATUS_MESSAGE_LENGTH];
+    if (editor_prompt(E.search_regex ? "Regex find in project: %s" : "Find in project: %s", query, sizeof(query)) == NULL) return;
+    if (editor_prompt("Replace with: %s", replacement, sizeof(replacement)) == NULL) return;
+    if (project_search_start(query, replacement)) project_list_run();
+}
+
+/**
+ * @brief Shows the result list of the last project search again.
+ */
+void command_project_list(void) {
+    if (E.project.query_len == 0) {
+        set_status_message("No project search yet. Use PS to start one.");
         return;
     }
-    E.num_recent_files++;
+    project_list_run();
 }
 
 // --- Undo/Redo Implementation ---
 
 /**
- * @brief Initializes the undo/redo history stacks.
+ * @brief Initializes the undo log, or empties it if it already exists.
  */
 void init_undo_redo(void) {
-    for (int i = 0; i < E.undo_head; i++) {
-        free_undo_action(&E.undo_history[i]);
-    }
-    for (int i = 0; i < E.redo_head; i++) {
-        free_undo_action(&E.redo_history[i]);
+    if (E.undo.records != NULL) {
+        undo_release_all();
+    } else {
+        E.undo.records = malloc(sizeof(UndoAction) * UNDO_RING_CAPACITY);
+        E.undo.arena = malloc(UNDO_ARENA_BYTES);
+        if (E.undo.records == NULL || E.undo.arena == NULL) {
+            free(E.undo.records);
+            free(E.undo.arena);
+            E.undo.records = NULL;
+            E.undo.arena = NULL;
+            set_status_message("Error: Failed to allocate undo history; undo disabled.");
+        }
     }
-    E.undo_head = 0;
-    E.redo_head = 0;
+    E.undo.first = 0;
+    E.undo.count = 0;
+    E.undo.current = 0;
+    E.undo.arena_head = 0;
+    E.undo.arena_tail = 0;
+    E.undo.live_payloads = 0;
+    E.undo.owned_bytes = 0;
+    E.undo.group_depth = 0;
+    E.undo.open_group = 0;
+    E.undo.run_open = false;
 }
 
 /**
- * @brief Frees dynamically allocated memory within an UndoAction struct.
- * @param action Pointer to the UndoAction to free.
+ * @brief Returns the i-th record of the undo log, 0 being the oldest.
+ *
+ * @param i Logical index, 0 <= i < E.undo.count.
+ * @return Pointer to the record inside the ring.
+ */
+static UndoAction *undo_record_at(int i) {
+    return &E.undo.records[(E.undo.first + i) % UNDO_RING_CAPACITY];
+}
+
+/**
+ * @brief Releases the payload of a record that is leaving the log.
+ *
+ * An owned payload is freed; an arena payload is only uncounted, and the
+ * caller moves the arena tail or head past its bytes.
+ *
+ * @param action The record being forgotten.
  */
-void free_undo_action(UndoAction *action) {
-    if (action->text_content) {
+static void undo_release_payload(UndoAction *action) {
+    if (action->text_content == NULL) return;
+    if (action->owned) {
+        E.undo.owned_bytes -= (size_t)action->text_len + 1;
         free(action->text_content);
-        action->text_content = NULL;
+        action->owned = false;
+    } else {
+        E.undo.live_payloads--;
     }
+    action->text_content = NULL;
 }
 
 /**
- * @brief Pushes an action onto the undo history stack.
- * Clears the redo history when a new action is pushed.
- * @param action The UndoAction to push.
+ * @brief Frees the owned payloads of every record, before the log is emptied
+ * or freed.
  */
-void push_undo_action(UndoAction action) {
-    if (E.undo_head == MAX_UNDO_HISTORY) {
-        free_undo_action(&E.undo_history[0]);
-        for (int i = 0; i < MAX_UNDO_HISTORY - 1; i++) {
-            E.undo_history[i] = E.undo_history[i+1];
-        }
-        E.undo_head--;
+static void undo_release_all(void) {
+    for (int i = 0; i < E.undo.count; i++) {
+        UndoAction *a = undo_record_at(i);
+        if (a->owned) undo_release_payload(a);
     }
+}
 
-    if (action.text_content) {
-        E.undo_history[E.undo_head].text_content = strdup(action.text_content);
-        if (E.undo_history[E.undo_head].text_content == NULL) {
-            set_status_message("Error: Failed to allocate undo history memory.");
-            return;
+/**
+ * @brief Forgets the oldest record and releases its payload from the arena tail.
+ */
+static void undo_drop_oldest(void) {
+    if (E.undo.count == 0) return;
+    undo_release_payload(undo_record_at(0));
+    E.undo.first = (E.undo.first + 1) % UNDO_RING_CAPACITY;
+    E.undo.count--;
+    if (E.undo.current > 0) E.undo.current--;
+
+    if (E.undo.live_payloads == 0) {
+        E.undo.arena_head = 0;
+        E.undo.arena_tail = 0;
+        return;
+    }
+    for (int i = 0; i < E.undo.count; i++) {
+        UndoAction *a = undo_record_at(i);
+        if (a->text_content != NULL && !a->owned) {
+            E.undo.arena_tail = (size_t)(a->text_content - E.undo.arena);
+            break;
         }
-    } else {
-        E.undo_history[E.undo_head].text_content = NULL;
     }
-    E.undo_history[E.undo_head].type = action.type;
-    E.undo_history[E.undo_head].y = action.y;
-    E.undo_history[E.undo_head].x = action.x;
-    E.undo_history[E.undo_head].char_val = action.char_val;
-    E.undo_history[E.undo_head].text_len = action.text_len;
-    E.undo_history[E.undo_head].num_lines_affected = action.num_lines_affected;
-
-    E.undo_head++;
-    clear_redo_history();
 }
 
 /**
- * @brief Pushes an action onto the redo history stack.
- * @param action The UndoAction to push.
+ * @brief Reserves `n` contiguous bytes at the arena head, evicting the oldest
+ * records until they fit.
+ *
+ * Must only be called with no redo records, so everything evicted is history.
+ * Records of the undo group still being built are never evicted.
+ *
+ * @param n Number of bytes needed.
+ * @return Pointer to the reserved bytes, or NULL if `n` exceeds the arena or
+ * only evicting the open group would make room.
  */
-void push_redo_action(UndoAction action) {
-    if (E.redo_head == MAX_UNDO_HISTORY) {
-        free_undo_action(&E.redo_history[0]);
-        for (int i = 0; i < MAX_UNDO_HISTORY - 1; i++) {
-            E.redo_history[i] = E.redo_history[i+1];
+static char *undo_arena_alloc(size_t n) {
+    if (n > UNDO_ARENA_BYTES) return NULL;
+    while (true) {
+        size_t at;
+        bool fits;
+        if (E.undo.live_payloads == 0) {
+            E.undo.arena_head = 0;
+            E.undo.arena_tail = 0;
+            at = 0;
+            fits = true;
+        } else if (E.undo.arena_head > E.undo.arena_tail) {
+            // Live bytes are [tail, head): use the end, else wrap to the front
+            if (E.undo.arena_head + n <= UNDO_ARENA_BYTES) {
+                at = E.undo.arena_head;
+                fits = true;
+            } else {
+                at = 0;
+                fits = n <= E.undo.arena_tail;
+            }
+        } else {
+            // Wrapped: the free gap is [head, tail)
+            at = E.undo.arena_head;
+            fits = E.undo.arena_head + n <= E.undo.arena_tail;
         }
-        E.redo_head--;
-    }
-
-    if (action.text_content) {
-        E.redo_history[E.redo_head].text_content = strdup(action.text_content);
-        if (E.redo_history[E.redo_head].text_content == NULL) {
-            set_status_message("Error: Failed to allocate redo history memory.");
-            return;
+        if (fits) {
+            E.undo.arena_head = at + n;
+            return E.undo.arena + at;
         }
-    } else {
-        E.redo_history[E.redo_head].text_content = NULL;
+        if (E.undo.group_depth > 0 && undo_record_at(0)->group == E.undo.open_group) return NULL;
+        undo_drop_oldest();
     }
-    E.redo_history[E.redo_head].type = action.type;
-    E.redo_history[E.redo_head].y = action.y;
-    E.redo_history[E.redo_head].x = action.x;
-    E.redo_history[E.redo_head].char_val = action.char_val;
-    E.redo_history[E.redo_head].text_len = action.text_len;
-    E.redo_history[E.redo_head].num_lines_affected = action.num_lines_affected;
-
-    E.redo_head++;
 }
 
 /**
- * @brief Clears the redo history stack and frees associated memory.
+ * @brief Grows the payload of the newest record in place by `extra` bytes.
+ *
+ * Works only while that payload is the last thing allocated in the arena and
+ * the bytes after it are free; callers start a new record otherwise.
+ *
+ * @param action The newest record in the log.
+ * @param extra Number of bytes to add.
+ * @return true if the payload was grown (text_len updated, NUL moved).
  */
-void clear_redo_history(void) {
-    for (int i = 0; i < E.redo_head; i++) {
-        free_undo_action(&E.redo_history[i]);
-    }
-    E.redo_head = 0;
+static bool undo_payload_extend(UndoAction *action, int extra) {
+    if (action->text_content == NULL || action->owned) return false;
+    size_t end = (size_t)(action->text_content - E.undo.arena) + (size_t)action->text_len + 1;
+    if (end != E.undo.arena_head) return false;
+    size_t new_end = end + (size_t)extra;
+    size_t limit = E.undo.arena_head > E.undo.arena_tail ? UNDO_ARENA_BYTES : E.undo.arena_tail;
+    if (new_end > limit) return false;
+
+    E.undo.arena_head = new_end;
+    action->text_len += extra;
+    action->text_content[action->text_len] = '\0';
+    return true;
 }
 
 /**
- * @brief Performs an undo operation.
+ * @brief Gives a payload a block of its own, evicting the oldest records
+ * while such blocks would pass UNDO_OVERSIZE_BYTES, but never those of the
+ * undo group still being built.
+ *
+ * @param n Number of bytes needed.
+ * @return The block, or NULL if it could not be allocated.
  */
-void editor_undo(void) {
-    if (E.undo_head == 0) {
-        set_status_message("Nothing to undo.");
-        return;
-    }
-
-    E.undo_head--;
-    UndoAction ua = E.undo_history[E.undo_head];
+static char *undo_oversize_alloc(size_t n) {
+    while (E.undo.count > 0 && E.undo.owned_bytes > 0 && E.undo.owned_bytes + n > UNDO_OVERSIZE_BYTES) {
+        if (E.undo.group_depth > 0 && undo_record_at(0)->group == E.undo.open_group) break;
+        undo_drop_oldest();
+    }
+    char *payload = malloc(n);
+    if (payload != NULL) E.undo.owned_bytes += n;
+    return payload;
+}
 
-    int original_cursor_y = E.cursor_y;
-    int original_cursor_x = E.cursor_x;
-    char *current_content_for_redo = NULL;
-    int current_len_for_redo = 0;
+/**
+ * @brief Throws the undo history away after an edit could not be recorded,
+ * since older records would no longer match the text.
+ *
+ * E.undo.discards counts these, so a caller about to report success can
+ * tell that it should leave the warning on screen instead.
+ *
+ * @param message Status message explaining why.
+ */
+void undo_discard_history(const char *message) {
+    init_undo_redo();
+    E.undo.discards++;
+    set_status_message("%s", message);
+}
 
+/**
+ * @brief Records an edit whose text payload the caller writes in place.
+ *
+ * Lets large payloads go straight into the undo arena without being joined
+ * into a temporary string first; one bigger than the arena is kept in a
+ * block of its own. Pushing discards everything that could have been redone.
+ *
+ * @param action The UndoAction to push; text_content is ignored.
+ * @param payload_len Length of the payload, or (size_t)-1 for none.
+ * @return Where the caller must write `payload_len` bytes (the NUL after them
+ * is already set), or NULL if there is nothing to write because the edit is
+ * not recorded.
+ */
+static char *push_undo_record(UndoAction action, size_t payload_len) {
+    if (E.undo.records == NULL || E.undo.suspended) return NULL;
 
-    switch (ua.type) {
-        case UNDO_INSERT_CHAR: {
-            editor_line_delete_char(&E.lines[ua.y], ua.x);
-            E.cursor_y = ua.y;
-            E.cursor_x = ua.x;
-            break;
-        }
-        case UNDO_DELETE_CHAR: {
-            editor_line_insert_char(&E.lines[ua.y], ua.x, ua.char_val);
-            E.cursor_y = ua.y;
-            E.cursor_x = ua.x + 1;
-            break;
-        }
-        case UNDO_INSERT_EMPTY_LINE: {
-            editor_delete_line(ua.y);
-            E.cursor_y = ua.y;
-            E.cursor_x = 0;
-            if (E.num_lines == 0) { editor_insert_line(0, "", 0); E.cursor_y = 0; E.cursor_x = 0; }
-            else if (E.cursor_y >= E.num_lines) E.cursor_y = E.num_lines - 1;
-            break;
-        }
-        case UNDO_SPLIT_LINE: {
-            EditorLine *line_to_join = &E.lines[ua.y];
-            EditorLine *next_line = &E.lines[ua.y + 1];
+    clear_redo_history();
+    E.undo.run_open = false;
 
-            if ((size_t)line_to_join->size + (size_t)next_line->size + 1 > (size_t)line_to_join->allocated) {
-                int new_allocated = line_to_join->allocated + next_line->size + 1;
-                line_to_join->chars = realloc(line_to_join->chars, (size_t)new_allocated);
-                line_to_join->hl = realloc(line_to_join->hl, sizeof(HighlightType) * (size_t)new_allocated);
-                if (line_to_join->chars == NULL || line_to_join->hl == NULL) { set_status_message("Error: Failed to reallocate line memory for undo join."); break; }
-                line_to_join->allocated = new_allocated;
-            }
-            memcpy(&line_to_join->chars[line_to_join->size], next_line->chars, (size_t)next_line->size + 1);
-            line_to_join->size += next_line->size;
-            line_to_join->hl_revision++;
+    if (E.undo.count == UNDO_RING_CAPACITY) {
+        undo_drop_oldest();
+    }
 
-            editor_delete_line(ua.y + 1);
-            E.cursor_y = ua.y;
-            E.cursor_x = ua.x;
-            break;
+    char *payload = NULL;
+    action.owned = false;
+    if (payload_len != (size_t)-1) {
+        if (payload_len >= INT_MAX) {
+            undo_discard_history("Change too large to undo; undo history cleared.");
+            return NULL;
         }
-        case UNDO_JOIN_LINES: {
-            editor_insert_line(ua.y + 1, ua.text_content, ua.text_len);
-            EditorLine *line_before_break = &E.lines[ua.y];
-            line_before_break->size = ua.x;
-            line_before_break->chars[ua.x] = '\0';
-            line_before_break->hl_revision++;
-            E.cursor_y = ua.y + 1;
-            E.cursor_x = 0;
-            break;
+        if (payload_len + 1 <= UNDO_ARENA_BYTES) {
+            payload = undo_arena_alloc(payload_len + 1);
         }
-        case UNDO_INSERT_BLOCK: {
-            int sy = ua.y;
-            int sx = ua.x;
-            int ey = sy + ua.num_lines_affected - 1;
-            int ex = sx;
-            if (ua.num_lines_affected == 1) {
-                ex = sx + ua.text_len;
-            } else {
-                const char *last_line_start = ua.text_content;
-                const char *temp_ptr = ua.text_content;
-                while (*temp_ptr != '\0') {
-                    if (*temp_ptr == '\n') {
-                        last_line_start = temp_ptr + 1;
-                    }
-                    temp_ptr++;
-                }
-                ex = (int)strlen(last_line_start);
+        if (payload != NULL) {
+            E.undo.live_payloads++;
+        } else {
+            payload = undo_oversize_alloc(payload_len + 1);
+            if (payload == NULL) {
+                undo_discard_history("Error: Out of memory; undo history cleared.");
+                return NULL;
             }
-            editor_delete_text_block(sy, sx, ey, ex);
-            E.cursor_y = sy;
-            E.cursor_x = sx;
-            break;
+            action.owned = true;
         }
-        case UNDO_DELETE_BLOCK: {
-            editor_insert_text_block(ua.y, ua.x, ua.text_content, ua.text_len);
-            E.cursor_y = ua.y;
-            E.cursor_x = ua.x;
-            break;
-        }
-        case UNDO_MODIFY_LINE_CASE: {
-            current_content_for_redo = strdup(E.lines[ua.y].chars);
-            current_len_for_redo = E.lines[ua.y].size;
+        payload[payload_len] = '\0';
+        action.text_len = (int)payload_len;
+    }
 
-            free(E.lines[ua.y].chars);
-            E.lines[ua.y].chars = strdup(ua.text_content);
-            E.lines[ua.y].size = ua.text_len;
-            E.lines[ua.y].allocated = ua.text_len + 1;
-            E.lines[ua.y].hl_revision++;
+    action.text_content = payload;
+    action.group = E.undo.group_depth > 0 ? E.undo.open_group : 0;
+    *undo_record_at(E.undo.count) = action;
+    E.undo.count++;
+    E.undo.current = E.undo.count;
+    return payload;
+}
 
-            E.cursor_y = ua.y;
-            E.cursor_x = ua.x;
-            break;
-        }
+/**
+ * @brief Records an edit in the undo log.
+ *
+ * The text payload, if any, is copied into the undo arena, so callers keep
+ * ownership of what they pass in.
+ *
+ * @param action The UndoAction to push.
+ */
+void push_undo_action(UndoAction action) {
+    size_t payload_len = action.text_content ? (size_t)action.text_len : (size_t)-1;
+    char *payload = push_undo_record(action, payload_len);
+    if (payload != NULL && action.text_content != NULL) {
+        memcpy(payload, action.text_content, (size_t)action.text_len);
     }
-    E.dirty = true;
-    mark_lines_dirty(0, E.num_lines - 1);
-    set_status_message("Undo successful.");
+}
+
+/**
+ * @brief Starts an undo group: records pushed until the matching
+ * undo_end_group() are undone and redone as one step. Groups nest.
+ */
+void undo_begin_group(void) {
+    if (E.undo.group_depth++ == 0) {
+        E.undo.open_group = ++E.undo.next_group;
+        if (E.undo.open_group <= 0) E.undo.open_group = E.undo.next_group = 1;
+    }
+}
 
-    UndoAction redo_ua;
-    redo_ua.y = original_cursor_y;
-    redo_ua.x = original_cursor_x;
-    redo_ua.char_val = ua.char_val;
-    redo_ua.text_len = ua.text_len;
-    redo_ua.num_lines_affected = ua.num_lines_affected;
+/**
+ * @brief Ends the undo group opened by undo_begin_group().
+ */
+void undo_end_group(void) {
+    if (E.undo.group_depth > 0 && --E.undo.group_depth == 0) {
+        E.undo.open_group = 0;
+    }
+}
 
-    switch (ua.type) {
-        case UNDO_INSERT_CHAR: redo_ua.type = UNDO_DELETE_CHAR; redo_ua.char_val = ua.char_val; redo_ua.text_content = NULL; break;
-        case UNDO_DELETE_CHAR: redo_ua.type = UNDO_INSERT_CHAR; redo_ua.char_val = ua.char_val; redo_ua.text_content = NULL; break;
-        case UNDO_INSERT_EMPTY_LINE: redo_ua.type = UNDO_INSERT_EMPTY_LINE; redo_ua.text_content = NULL; redo_ua.text_len = 0; redo_ua.num_lines_affected = 0; break;
-        case UNDO_SPLIT_LINE: redo_ua.type = UNDO_SPLIT_LINE; redo_ua.text_content = strdup(ua.text_content); redo_ua.text_len = ua.text_len; redo_ua.num_lines_affected = 0; break;
-        case UNDO_JOIN_LINES: redo_ua.type = UNDO_JOIN_LINES; redo_ua.text_content = strdup(ua.text_content); redo_ua.text_len = ua.text_len; redo_ua.num_lines_affected = 0; break;
-        case UNDO_INSERT_BLOCK: redo_ua.type = UNDO_INSERT_BLOCK; redo_ua.text_content = strdup(ua.text_content); redo_ua.text_len = ua.text_len; redo_ua.num_lines_affected = ua.num_lines_affected; break;
-        case UNDO_DELETE_BLOCK: redo_ua.type = UNDO_DELETE_BLOCK; redo_ua.text_content = strdup(ua.text_content); redo_ua.text_len = ua.text_len; redo_ua.num_lines_affected = ua.num_lines_affected; break;
-        case UNDO_MODIFY_LINE_CASE: redo_ua.type = UNDO_MODIFY_LINE_CASE; redo_ua.text_content = current_content_for_redo; redo_ua.text_len = current_len_for_redo; redo_ua.num_lines_affected = 1; break;
+/**
+ * @brief Records a typed character, extending the current insert run when the
+ * character lands right after it.
+ *
+ * @param y Line the character is inserted into.
+ * @param x Position of the character in that line.
+ * @param c The character.
+ */
+void undo_record_insert_char(int y, int x, char c) {
+    if (E.undo.suspended) return;
+    if (E.undo.run_open && E.undo.count > 0 && E.undo.current == E.undo.count) {
+        UndoAction *top = undo_record_at(E.undo.count - 1);
+        if (top->type == UNDO_INSERT_BLOCK && top->num_lines_affected == 1 && top->y == y &&
+            top->x + top->text_len == x && undo_payload_extend(top, 1)) {
+            top->text_content[top->text_len - 1] = c;
+            return;
+        }
     }
-    push_redo_action(redo_ua);
 
-    free_undo_action(&ua);
+    UndoAction ua = { .type = UNDO_INSERT_BLOCK, .y = y, .x = x, .char_val = '\0', .text_content = &c, .text_len = 1, .num_lines_affected = 1 };
+    push_undo_action(ua);
+    E.undo.run_open = true;
 }
 
 /**
- * @brief Performs a redo operation.
+ * @brief Records a single deleted character, extending the current delete run
+ * when the deletion is adjacent to it.
+ *
+ * @param y Line the character is deleted from.
+ * @param x Position of the deleted character.
+ * @param c The deleted character.
+ * @param backward True for Backspace (run grows to the left), false for Delete.
  */
-void editor_redo(void) {
-    if (E.redo_head == 0) {
-        set_status_message("Nothing to redo.");
-        return;
+void undo_record_delete_char(int y, int x, char c, bool backward) {
+    if (E.undo.suspended) return;
+    if (E.undo.run_open && E.undo.count > 0 && E.undo.current == E.undo.count) {
+        UndoAction *top = undo_record_at(E.undo.count - 1);
+        if (top->type == UNDO_DELETE_BLOCK && top->num_lines_affected == 1 && top->y == y &&
+            top->x == (backward ? x + 1 : x) && undo_payload_extend(top, 1)) {
+            if (backward) {
+                memmove(top->text_content + 1, top->text_content, (size_t)top->text_len - 1);
+                top->text_content[0] = c;
+                top->x = x;
+            } else {
+                top->text_content[top->text_len - 1] = c;
+            }
+            return;
+        }
     }
 
-    E.redo_head--;
-    UndoAction ra = E.redo_history[E.redo_head];
+    UndoAction ua = { .type = UNDO_DELETE_BLOCK, .y = y, .x = x, .char_val = '\0', .text_content = &c, .text_len = 1, .num_lines_affected = 1 };
+    push_undo_action(ua);
+    E.undo.run_open = true;
+}
 
-    int original_cursor_y = E.cursor_y;
-    int original_cursor_x = E.cursor_x;
-    char *current_content_for_undo = NULL;
-    int current_len_for_undo = 0;
+/**
+ * @brief Records the removal of a whole line as a text block deletion.
+ *
+ * The line's newline is included so undo recreates the line rather than
+ * pasting its text into a neighbour. Call before deleting the line.
+ *
+ * @param y Index of the line about to be deleted.
+ */
+void push_line_delete_undo(int y) {
+    EditorLine *line = editor_get_line(y);
+    if (line == NULL) return;
 
+    char *text = malloc((size_t)line->size + 2);
+    if (text == NULL) {
+        set_status_message("Error: Failed to allocate undo history memory.");
+        return;
+    }
+    UndoAction ua = { .type = UNDO_DELETE_BLOCK, .char_val = '\0', .text_content = text, .text_len = line->size + 1, .num_lines_affected = 2 };
+    if (y + 1 < E.num_lines) {
+        // "<line>\n" starting at the beginning of the line
+        memcpy(text, line->chars, (size_t)line->size);
+        text[line->size] = '\n';
+        ua.y = y;
+        ua.x = 0;
+    } else if (y > 0) {
+        // Last line: "\n<line>" starting at the end of the previous one
+        text[0] = '\n';
+        memcpy(text + 1, line->chars, (size_t)line->size);
+        ua.y = y - 1;
+        ua.x = editor_get_line(y - 1)->size;
+    } else {
+        // Only line: it is replaced by an empty line, so just its text goes
+        memcpy(text, line->chars, (size_t)line->size);
+        ua.y = 0;
+        ua.x = 0;
+        ua.text_len = line->size;
+        ua.num_lines_affected = 1;
+    }
+    text[ua.text_len] = '\0';
+    push_undo_action(ua);
+    free(text);
+}
 
-    switch (ra.type) {
-        case UNDO_INSERT_CHAR: {
-            editor_line_insert_char(&E.lines[ra.y], ra.x, ra.char_val);
-            E.cursor_y = ra.y;
-            E.cursor_x = ra.x + 1;
-            break;
-        }
-        case UNDO_DELETE_CHAR: {
-            editor_line_delete_char(&E.lines[ra.y], ra.x);
-            E.cursor_y = ra.y;
-            E.cursor_x = ra.x;
-            break;
+/**
+ * @brief Discards the records that could have been redone and rewinds the
+ * arena head over their payloads.
+ */
+void clear_redo_history(void) {
+    for (int i = E.undo.count - 1; i >= E.undo.current; i--) {
+        UndoAction *a = undo_record_at(i);
+        if (a->text_content != NULL && !a->owned) {
+            E.undo.arena_head = (size_t)(a->text_content - E.undo.arena);
         }
+        undo_release_payload(a);
+    }
+    E.undo.count = E.undo.current;
+    if (E.undo.live_payloads == 0) {
+        E.undo.arena_head = 0;
+        E.undo.arena_tail = 0;
+    }
+}
+
+/**
+ * @brief Computes where the text of a block record ends.
+ *
+ * @param action An UNDO_INSERT_BLOCK or UNDO_DELETE_BLOCK record.
+ * @param ey Pointer to store the line of the end position.
+ * @param ex Pointer to store the column of the end position.
+ */
+static void undo_block_end(const UndoAction *action, int *ey, int *ex) {
+    const char *last_nl = memrchr(action->text_content, '\n', (size_t)action->text_len);
+    *ey = action->y + action->num_lines_affected - 1;
+    if (last_nl == NULL) {
+        *ex = action->x + action->text_len;
+    } else {
+        *ex = (int)(action->text_content + action->text_len - (last_nl + 1));
+    }
+}
+
+/**
+ * @brief Applies a record to the buffer, either undoing or redoing it.
+ *
+ * @param action The record to apply.
+ * @param reverse True to undo the edit, false to make it again.
+ */
+static void undo_apply(UndoAction *action, bool reverse) {
+    int ey, ex;
+    switch (action->type) {
         case UNDO_INSERT_EMPTY_LINE: {
-            editor_insert_line(ra.y, "", 0);
-            E.cursor_y = ra.y + 1;
-            E.cursor_x = 0;
-            break;
-        }
-        case UNDO_SPLIT_LINE: {
-            EditorLine *line = &E.lines[ra.y];
-            editor_insert_line(ra.y + 1, &line->chars[ra.x], line->size - ra.x);
-            line = &E.lines[ra.y];
-            line->size = ra.x;
-            line->chars[line->size] = '\0';
-            line->hl_revision++;
-            E.cursor_y = ra.y + 1;
+            if (reverse) {
+                editor_delete_line(action->y);
+                if (E.num_lines == 0) editor_insert_line(0, "", 0);
+                E.cursor_y = action->y < E.num_lines ? action->y : E.num_lines - 1;
+            } else {
+                editor_insert_line(action->y, "", 0);
+                E.cursor_y = action->y + 1;
+            }
             E.cursor_x = 0;
             break;
         }
+        case UNDO_SPLIT_LINE:
         case UNDO_JOIN_LINES: {
-            E.cursor_x = E.lines[ra.y].size;
-            EditorLine *line_to_delete = &E.lines[ra.y + 1];
-            
-            EditorLine *prev_line = &E.lines[ra.y];
-            if ((size_t)prev_line->size + (size_t)line_to_delete->size + 1 > (size_t)prev_line->allocated) {
-                int new_allocated = prev_line->allocated + line_to_delete->size + 1;
-                prev_line->chars = realloc(prev_line->chars, (size_t)new_allocated);
-                prev_line->hl = realloc(prev_line->hl, sizeof(HighlightType) * (size_t)new_allocated);
-                if (prev_line->chars == NULL || prev_line->hl == NULL) { set_status_message("Error: Failed to reallocate line memory for redo join."); break; }
-                prev_line->allocated = new_allocated;
-            }
-            memcpy(&prev_line->chars[prev_line->size], line_to_delete->chars, (size_t)line_to_delete->size + 1);
-            prev_line->size += line_to_delete->size;
-            prev_line->hl_revision++;
-            
-            editor_delete_line(ra.y + 1);
-            E.cursor_y = ra.y;
-            E.cursor_x = ra.x;
-            break;
-        }
-        case UNDO_INSERT_BLOCK: {
-            editor_insert_text_block(ra.y, ra.x, ra.text_content, ra.text_len);
-            E.cursor_y = ra.y;
-            E.cursor_x = ra.x;
+            bool split = (action->type == UNDO_SPLIT_LINE) != reverse;
+            EditorLine *line = editor_get_line(action->y);
+            if (split) {
+                editor_insert_line(action->y + 1, &line->chars[action->x], line->size - action->x);
+                line = editor_get_line(action->y);
+                editor_line_truncate(line, action->x);
+                E.cursor_y = action->y + 1;
+                E.cursor_x = 0;
+            } else {
+                EditorLine *next_line = editor_get_line(action->y + 1);
+                if (!editor_line_append(line, next_line->chars, next_line->size)) break;
+                editor_delete_line(action->y + 1);
+                E.cursor_y = action->y;
+                E.cursor_x = action->x;
+            }
             break;
         }
+        case UNDO_INSERT_BLOCK:
         case UNDO_DELETE_BLOCK: {
-            int sy = ra.y;
-            int sx = ra.x;
-            int ey = sy + ra.num_lines_affected - 1;
-            int ex = sx;
-            if (ra.num_lines_affected == 1) {
-                ex = sx + ra.text_len;
+            bool insert = (action->type == UNDO_INSERT_BLOCK) != reverse;
+            undo_block_end(action, &ey, &ex);
+            if (insert) {
+                editor_insert_text_block(action->y, action->x, action->text_content, action->text_len);
+                E.cursor_y = ey;
+                E.cursor_x = ex;
             } else {
-                const char *last_line_start = ra.text_content;
-                const char *temp_ptr = ra.text_content;
-                while (*temp_ptr != '\0') {
-                    if (*temp_ptr == '\n') {
-                        last_line_start = temp_ptr + 1;
-                    }
-                    temp_ptr++;
-                }
-                ex = (int)strlen(last_line_start);
+                editor_delete_text_block(action->y, action->x, ey, ex);
+                E.cursor_y = action->y;
+                E.cursor_x = action->x;
             }
-            editor_delete_text_block(sy, sx, ey, ex);
-            E.cursor_y = sy;
-            E.cursor_x = sx;
+            break;
+        }
+        case UNDO_REPLACE_ALL: {
+            replace_all_apply(action, reverse);
+            E.cursor_y = action->y;
+            E.cursor_x = action->x;
+            break;
+        }
+        case UNDO_REGEX_REPLACE_ALL: {
+            regex_replace_apply(action, reverse);
+            E.cursor_y = action->y;
+            E.cursor_x = action->x;
             break;
         }
         case UNDO_MODIFY_LINE_CASE: {
-            current_content_for_undo = strdup(E.lines[ra.y].chars);
-            current_len_for_undo = E.lines[ra.y].size;
-
-            free(E.lines[ra.y].chars);
-            E.lines[ra.y].chars = strdup(ra.text_content);
-            E.lines[ra.y].size = ra.text_len;
-            E.lines[ra.y].allocated = ra.text_len + 1;
-            E.lines[ra.y].hl_revision++;
-
-            E.cursor_y = ra.y;
-            E.cursor_x = ra.x;
+            // The payload holds the other version of the line; swap the two
+            EditorLine *line = editor_get_line(action->y);
+            if (line->size != action->text_len || !editor_line_reserve(line, line->size + 1)) break;
+            for (int i = 0; i < line->size; i++) {
+                char c = line->chars[i];
+                line->chars[i] = action->text_content[i];
+                action->text_content[i] = c;
+            }
+            editor_line_changed(line);
+            E.cursor_y = action->y;
+            E.cursor_x = action->x;
             break;
         }
     }
-    E.dirty = true;
-    mark_lines_dirty(0, E.num_lines - 1);
-    set_status_message("Redo successful.");
+    mark_lines_dirty(action->y, E.num_lines - 1);
+}
+
+/**
+ * @brief Performs an undo operation.
+ */
+void editor_undo(void) {
+    if (E.undo.suspended) {
+        set_status_message("Undo is not available inside a macro.");
+        return;
+    }
+    if (E.undo.current == 0) {
+        set_status_message("Nothing to undo.");
+        return;
+    }
 
-    UndoAction undo_ra;
-    undo_ra.y = original_cursor_y;
-    undo_ra.x = original_cursor_x;
-    undo_ra.char_val = ra.char_val;
-    undo_ra.text_len = ra.text_len;
-    undo_ra.num_lines_affected = ra.num_lines_affected;
+    E.undo.run_open = false;
+    int group = undo_record_at(E.undo.current - 1)->group;
+    do {
+        E.undo.current--;
+        undo_apply(undo_record_at(E.undo.current), true);
+    } while (group != 0 && E.undo.current > 0 && undo_record_at(E.undo.current - 1)->group == group);
+
+    E.dirty = true;
+    set_status_message("Undo successful.");
+}
 
-    switch (ra.type) {
-        case UNDO_INSERT_CHAR: undo_ra.type = UNDO_DELETE_CHAR; undo_ra.char_val = ra.char_val; undo_ra.text_content = NULL; break;
-        case UNDO_DELETE_CHAR: undo_ra.type = UNDO_INSERT_CHAR; undo_ra.char_val = ra.char_val; undo_ra.text_content = NULL; break;
-        case UNDO_INSERT_EMPTY_LINE: undo_ra.type = UNDO_INSERT_EMPTY_LINE; undo_ra.text_content = NULL; undo_ra.text_len = 0; undo_ra.num_lines_affected = 0; break;
-        case UNDO_SPLIT_LINE: undo_ra.type = UNDO_SPLIT_LINE; undo_ra.text_content = strdup(ra.text_content); undo_ra.text_len = ra.text_len; undo_ra.num_lines_affected = 0; break;
-        case UNDO_JOIN_LINES: undo_ra.type = UNDO_JOIN_LINES; undo_ra.text_content = strdup(ra.text_content); undo_ra.text_len = ra.text_len; undo_ra.num_lines_affected = 0; break;
-        case UNDO_INSERT_BLOCK: undo_ra.type = UNDO_INSERT_BLOCK; undo_ra.text_content = strdup(ra.text_content); undo_ra.text_len = ra.text_len; undo_ra.num_lines_affected = ra.num_lines_affected; break;
-        case UNDO_DELETE_BLOCK: undo_ra.type = UNDO_DELETE_BLOCK; undo_ra.text_content = strdup(ra.text_content); undo_ra.text_len = ra.text_len; undo_ra.num_lines_affected = ra.num_lines_affected; break;
-        case UNDO_MODIFY_LINE_CASE: undo_ra.type = UNDO_MODIFY_LINE_CASE; undo_ra.text_content = current_content_for_undo; undo_ra.text_len = current_len_for_undo; undo_ra.num_lines_affected = 1; break;
+/**
+ * @brief Performs a redo operation.
+ */
+void editor_redo(void) {
+    if (E.undo.suspended) {
+        set_status_message("Redo is not available inside a macro.");
+        return;
+    }
+    if (E.undo.current == E.undo.count) {
+        set_status_message("Nothing to redo.");
+        return;
     }
-    push_undo_action(undo_ra);
 
-    free_undo_action(&ra);
+    E.undo.run_open = false;
+    int group = undo_record_at(E.undo.current)->group;
+    do {
+        undo_apply(undo_record_at(E.undo.current), false);
+        E.undo.current++;
+    } while (group != 0 && E.undo.current < E.undo.count && undo_record_at(E.undo.current)->group == group);
+
+    E.dirty = true;
+    set_status_message("Redo successful.");
 }
 
 /**
  * @brief Selects all text in the editor.
  */
 void editor_select_all(void) {
+    editor_load_all();
     if (E.num_lines == 0) {
         set_status_message("No text to select.");
         return;
@@ -3272,7 +12011,7 @@ void editor_select_all(void) {
     E.visual_start_x = 0;
     E.visual_start_y = 0;
     E.cursor_y = E.num_lines - 1;
-    E.cursor_x = E.lines[E.num_lines - 1].size;
+    E.cursor_x = editor_get_line(E.num_lines - 1)->size;
     set_status_message("All text selected. Use Ctrl+C/Ctrl+X to copy/cut.");
     mark_lines_dirty(0, E.num_lines - 1);
 }
@@ -3284,6 +12023,9 @@ void editor_select_all(void) {
  */
 void editor_process_keypress(void) {
     int c = editor_read_key();
+    // Keep a page beyond the cursor loaded so moving and editing never reach
+    // the end of a partly loaded file
+    editor_load_through((E.cursor_y > E.scroll_y ? E.cursor_y : E.scroll_y) + 2 * E.screen_rows);
 
     if (E.cmd.active) {
         handle_command_mode_input(c);
@@ -3301,10 +12043,11 @@ void editor_process_keypress(void) {
             editor_open_file();
             break;
         case CTRL('\\'): // Ctrl+\ for Command mode (changed from Ctrl+J)
+            E.recorder.command_start = E.recorder.count - 1;
             E.cmd.active = true;
             E.cmd.length = 0;
             E.cmd.sequence[0] = '\0';
-            E.cmd.last_key_time = time(NULL);
+            E.cmd.last_key_time = editor_now_ms();
             set_status_message("Command Mode: (type command sequence)");
             break;
         case CTRL('f'): // Ctrl+F for Find
@@ -3342,7 +12085,7 @@ void editor_process_keypress(void) {
             break;
         case KEY_END:
             if (E.cursor_y < E.num_lines) {
-                E.cursor_x = E.lines[E.cursor_y].size;
+                E.cursor_x = editor_get_line(E.cursor_y)->size;
             }
             break;
         case KEY_PPAGE: // Page Up
@@ -3365,8 +12108,9 @@ void editor_process_keypress(void) {
             move_to_word_start();
             break;
         case CTRL('e'): // Move to end of file
+            editor_load_all();
             E.cursor_y = E.num_lines > 0 ? E.num_lines - 1 : 0;
-            E.cursor_x = E.lines[E.cursor_y].size;
+            E.cursor_x = editor_get_line(E.cursor_y)->size;
             break;
         case KEY_LEFT:
         case KEY_RIGHT:
@@ -3379,40 +12123,35 @@ void editor_process_keypress(void) {
             editor_delete_char();
             break;
         case KEY_DC: // Delete key
-            if (E.cursor_x < E.lines[E.cursor_y].size) {
-                editor_line_delete_char(&E.lines[E.cursor_y], E.cursor_x);
+            if (E.cursor_y >= E.num_lines) {
+                break; // Nothing under the cursor past the last line
+            } else if (E.cursor_x < editor_get_line(E.cursor_y)->size) {
+                EditorLine *line = editor_get_line(E.cursor_y);
+                for (int n = line_next_char(line, E.cursor_x) - E.cursor_x; n > 0; n--) {
+                    undo_record_delete_char(E.cursor_y, E.cursor_x, line->chars[E.cursor_x], false);
+                    editor_line_delete_char(line, E.cursor_x);
+                }
                 E.dirty = true;
                 mark_lines_dirty(E.cursor_y, E.cursor_y);
             } else if (E.cursor_y < E.num_lines - 1) { // Delete at end of line joins with next
-                char *deleted_content = strdup(E.lines[E.cursor_y+1].chars);
-                int current_line_size = E.lines[E.cursor_y].size;
+                int current_line_size = editor_get_line(E.cursor_y)->size;
 
                 UndoAction ua = {
                     .type = UNDO_JOIN_LINES,
                     .y = E.cursor_y,
                     .x = current_line_size,
                     .char_val = '\0',
-                    .text_content = deleted_content,
-                    .text_len = (int)strlen(deleted_content),
+                    .text_content = NULL,
+                    .text_len = 0,
                     .num_lines_affected = 0
                 };
                 push_undo_action(ua);
 
-                EditorLine *current_line = &E.lines[E.cursor_y];
-                EditorLine *next_line = &E.lines[E.cursor_y + 1];
-                if ((size_t)current_line->size + (size_t)next_line->size + 1 > (size_t)current_line->allocated) {
-                    int new_allocated = current_line->allocated + next_line->size + 1;
-                    current_line->chars = realloc(current_line->chars, (size_t)new_allocated);
-                    current_line->hl = realloc(current_line->hl, sizeof(HighlightType) * (size_t)new_allocated);
-                    if (current_line->chars == NULL || current_line->hl == NULL) {
-                        set_status_message("Error: Failed to reallocate line memory for join (DEL).");
-                        return;
-                    }
-                    current_line->allocated = new_allocated;
+                EditorLine *current_line = editor_get_line(E.cursor_y);
+                EditorLine *next_line = editor_get_line(E.cursor_y + 1);
+                if (!editor_line_append(current_line, next_line->chars, next_line->size)) {
+                    return;
                 }
-                memcpy(&current_line->chars[current_line->size], next_line->chars, (size_t)next_line->size + 1);
-                current_line->size += next_line->size;
-                current_line->hl_revision++;
                 editor_delete_line(E.cursor_y + 1);
                 E.dirty = true;
                 mark_lines_dirty(E.cursor_y, E.cursor_y);
@@ -3422,8 +12161,14 @@ void editor_process_keypress(void) {
         case '\n':
             editor_insert_newline();
             break;
+        case KEY_PASTE_BEGIN:
+            editor_paste_bracketed();
+            break;
+        case KEY_PASTE_END: // Stray end marker, nothing to do
+            break;
         default:
-            if (isprint(c)) {
+            // Bytes of a UTF-8 character arrive one at a time
+            if (isprint(c) || (c >= 0x80 && c <= 0xff)) {
                 editor_insert_char(c);
             }
             break;
@@ -3431,6 +12176,800 @@ void editor_process_keypress(void) {
 }
 
 
+// --- Batch Mode Implementation ---
+// `unied --batch script file...` runs a script against each file with the
+// same buffer code the editor uses, without ever starting ncurses. A script
+// compiles to the keystrokes a user would type, which editor_read_key() hands
+// out instead of reading the terminal. Every file is edited in a forked worker
+// process, since the editor state is one global, and up to one worker per CPU
+// runs at a time.
+
+/**
+ * @brief Appends one key to a compiled script.
+ *
+ * @param script The script to extend.
+ * @param key The key code.
+ * @return true on success, false if memory ran out.
+ */
+static bool batch_append_key(BatchScript *script, int key) {
+    if (script->count == script->allocated) {
+        int allocated = script->allocated ? script->allocated * 2 : 256;
+        int *keys = realloc(script->keys, (size_t)allocated * sizeof(int));
+        if (!keys) return false;
+        script->keys = keys;
+        script->allocated = allocated;
+    }
+    script->keys[script->count++] = key;
+    return true;
+}
+
+/**
+ * @brief Appends typed text to a compiled script.
+ *
+ * With `escapes`, \n, \t, \e, \\ and \xHH stand for Enter, Tab, Escape, a
+ * backslash and an arbitrary byte.
+ *
+ * @param script The script to extend.
+ * @param text The text to type.
+ * @param escapes Whether backslash escapes are decoded.
+ * @return true on success, false on a bad escape or if memory ran out.
+ */
+static bool batch_append_text(BatchScript *script, const char *text, bool escapes) {
+    for (const char *p = text; *p; p++) {
+        int key = (unsigned char)*p;
+        if (escapes && *p == '\\') {
+            p++;
+            switch (*p) {
+                case 'n': key = '\n'; break;
+                case 't': key = '\t'; break;
+                case 'e': key = 27; break;
+                case '\\': key = '\\'; break;
+                case 'x':
+                    if (!isxdigit((unsigned char)p[1]) || !isxdigit((unsigned char)p[2])) return false;
+                    char hex[3] = { p[1], p[2], '\0' };
+                    key = (int)strtol(hex, NULL, 16);
+                    p += 2;
+                    break;
+                default:
+                    return false;
+            }
+        }
+        if (!batch_append_key(script, key)) return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Maps a key name from a `key` directive to its key code.
+ *
+ * @param name A name such as "down", "pgdn", "enter" or "ctrl-e".
+ * @return The key code, or -1 if the name is unknown.
+ */
+static int batch_key_by_name(const char *name) {
+    static const struct {
+        const char *name;
+        int key;
+    } names[] = {
+        { "up", KEY_UP }, { "down", KEY_DOWN }, { "left", KEY_LEFT }, { "right", KEY_RIGHT },
+        { "home", KEY_HOME }, { "end", KEY_END }, { "pgup", KEY_PPAGE }, { "pgdn", KEY_NPAGE },
+        { "backspace", 127 }, { "delete", KEY_DC }, { "enter", '\n' }, { "tab", '\t' },
+        { "esc", 27 },
+    };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcasecmp(name, names[i].name) == 0) return names[i].key;
+    }
+    if (strncasecmp(name, "ctrl-", 5) == 0 && isalpha((unsigned char)name[5]) && name[6] == '\0') {
+        return CTRL(tolower((unsigned char)name[5]));
+    }
+    return -1;
+}
+
+/**
+ * @brief Compiles one script line into keystrokes.
+ *
+ * @param script The script to extend.
+ * @param line The line, without its newline; modified in place.
+ * @param error Receives a description of what is wrong with the line.
+ * @return true on success, false if the line is invalid.
+ */
+static bool batch_compile_line(BatchScript *script, char *line, const char **error) {
+    while (isspace((unsigned char)*line)) line++;
+    if (*line == '\0' || *line == '#') return true;
+
+    char *arg = line;
+    while (*arg && !isspace((unsigned char)*arg)) arg++;
+    if (*arg) *arg++ = '\0'; // Everything after the first blank is the argument, verbatim
+    const char *verb = line;
+    bool ok = true;
+    *error = "invalid escape or out of memory";
+
+    if (strcmp(verb, "keys") == 0) {
+        ok = batch_append_text(script, arg, true);
+    } else if (strcmp(verb, "key") == 0) {
+        for (char *name = strtok(arg, " \t"); name; name = strtok(NULL, " \t")) {
+            int key = batch_key_by_name(name);
+            if (key < 0) {
+                *error = "unknown key name";
+                return false;
+            }
+            ok = ok && batch_append_key(script, key);
+        }
+    } else if (strcmp(verb, "cmd") == 0 || strcmp(verb, "record") == 0 || strcmp(verb, "stop") == 0) {
+        const char *sequence = strcmp(verb, "cmd") == 0 ? strtok(arg, " \t") : "MR";
+        if (!sequence) {
+            *error = "missing command sequence";
+            return false;
+        }
+        ok = batch_append_key(script, CTRL('\\')) && batch_append_text(script, sequence, false) &&
+             batch_append_key(script, '\n');
+    } else if (strcmp(verb, "find") == 0) {
+        // The prompt does not take an empty answer and would swallow the lines after it
+        if (*arg == '\0') {
+            *error = "missing search text";
+            return false;
+        }
+        ok = batch_append_key(script, CTRL('f')) && batch_append_text(script, arg, true) &&
+             batch_append_key(script, '\n');
+    } else if (strcmp(verb, "replace") == 0) {
+        // sed-style: the first character delimits the search and replacement text
+        char delimiter = arg[0];
+        char *find = arg + 1;
+        char *with = delimiter ? strchr(find, delimiter) : NULL;
+        if (!with) {
+            *error = "expected replace /find/replacement/";
+            return false;
+        }
+        *with++ = '\0';
+        char *end = strchr(with, delimiter);
+        if (end) *end = '\0';
+        if (*find == '\0' || *with == '\0') {
+            *error = "replace needs non-empty search and replacement text";
+            return false;
+        }
+        ok = batch_append_key(script, CTRL('\\')) && batch_append_text(script, "R\n", false) &&
+             batch_append_text(script, find, true) && batch_append_key(script, '\n') &&
+             batch_append_text(script, with, true) && batch_append_key(script, '\n');
+    } else if (strcmp(verb, "goto") == 0 || strcmp(verb, "play") == 0) {
+        const char *number = strtok(arg, " \t");
+        if (!number) {
+            *error = "missing line number or repeat count";
+            return false;
+        }
+        if (strcmp(verb, "goto") == 0) {
+            ok = batch_append_key(script, CTRL('g'));
+        } else {
+            ok = batch_append_key(script, CTRL('\\')) && batch_append_text(script, "MP\n", false);
+        }
+        ok = ok && batch_append_text(script, number, false) && batch_append_key(script, '\n');
+    } else if (strcmp(verb, "save") == 0) {
+        ok = batch_append_key(script, CTRL('s'));
+    } else {
+        *error = "unknown directive";
+        return false;
+    }
+    return ok;
+}
+
+/**
+ * @brief Reads and compiles a batch script, reporting the first bad line on stderr.
+ *
+ * @param path Path of the script, or "-" for standard input.
+ * @param script Receives the compiled keystrokes.
+ * @return true on success, false on error.
+ */
+static bool batch_load_script(const char *path, BatchScript *script) {
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "unied: cannot open script %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    int line_no = 0;
+    bool ok = true;
+
+    while (ok && (linelen = getline(&line, &linecap, fp)) != -1) {
+        line_no++;
+        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
+            line[--linelen] = '\0';
+        }
+        const char *error = NULL;
+        if (!batch_compile_line(script, line, &error)) {
+            fprintf(stderr, "unied: %s:%d: %s\n", path, line_no, error);
+            ok = false;
+        }
+    }
+    free(line);
+    if (fp != stdin) fclose(fp);
+    return ok;
+}
+
+/**
+ * @brief Runs a compiled script against one file and saves it if it changed.
+ *
+ * Meant to run in a worker process: it reuses the state the parent set up and
+ * leaves it behind. Prints one result line per file.
+ *
+ * @param script The compiled script.
+ * @param path The file to edit.
+ * @return 0 on success, 1 if the file could not be read or saved.
+ */
+static int batch_process_file(const BatchScript *script, const char *path) {
+    // editor_load_file() starts an empty buffer for a missing file, which a
+    // batch run must not mistake for success
+    if (access(path, R_OK) != 0) {
+        fprintf(stderr, "%s: Error: %s\n", path, strerror(errno));
+        return 1;
+    }
+    editor_load_file(path);
+
+    E.script.keys = script->keys;
+    E.script.count = script->count;
+    E.script.pos = 0;
+    E.script.active = true;
+    while (E.script.pos < E.script.count) {
+        editor_process_keypress();
+    }
+
+    if (!E.dirty) {
+        printf("%s: %s\n", path, E.status_message);
+        return 0;
+    }
+    editor_save_file();
+    if (E.dirty) {
+        fprintf(stderr, "%s: %s\n", path, E.status_message);
+        return 1;
+    }
+    printf("%s: %s\n", path, E.status_message);
+    return 0;
+}
+
+/**
+ * @brief Frees the slot of a worker that has finished. A worker a signal
+ * killed never printed its result line, so its file is named here.
+ *
+ * @param workers Pid of the worker in each slot, 0 for a free slot.
+ * @param paths File each slot's worker processes.
+ * @return true if the worker failed.
+ */
+static bool batch_worker_failed(pid_t pid, int status, pid_t *workers, const char **paths, int slots) {
+    for (int i = 0; i < slots; i++) {
+        if (workers[i] != pid) continue;
+        workers[i] = 0;
+        if (WIFSIGNALED(status)) fprintf(stderr, "%s: worker killed by signal %d\n", paths[i], WTERMSIG(status));
+        break;
+    }
+    return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+/**
+ * @brief Entry point for `unied --batch script [-j jobs] file...`.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments; argv[1] is "--batch".
+ * @return 0 if every file was processed, 1 if any failed, 2 on a usage error.
+ */
+static int batch_main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s --batch script [-j jobs] file...\n", argv[0]);
+        return 2;
+    }
+
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int first_file = 3;
+    if (first_file + 1 < argc && (strcmp(argv[first_file], "-j") == 0 || strcmp(argv[first_file], "--jobs") == 0)) {
+        jobs = strtol(argv[first_file + 1], NULL, 10);
+        first_file += 2;
+    }
+    if (first_file < argc && strcmp(argv[first_file], "--") == 0) first_file++;
+    if (jobs < 1) jobs = 1;
+    if (first_file >= argc) {
+        fprintf(stderr, "Usage: %s --batch script [-j jobs] file...\n", argv[0]);
+        return 2;
+    }
+
+    BatchScript script = { NULL, 0, 0 };
+    if (!batch_load_script(argv[2], &script)) {
+        free(script.keys);
+        return 2;
+    }
+
+    E.headless = true;
+    init_editor_state();
+    E.screen_rows = BATCH_SCREEN_ROWS;
+    E.screen_cols = BATCH_SCREEN_COLS;
+    E.total_screen_rows = BATCH_SCREEN_ROWS;
+
+    int slots = argc - first_file < jobs ? argc - first_file : (int)jobs;
+    pid_t *workers = calloc((size_t)slots, sizeof(pid_t));
+    const char **paths = calloc((size_t)slots, sizeof(char *));
+    if (workers == NULL || paths == NULL) {
+        fprintf(stderr, "Error: Out of memory for %d workers.\n", slots);
+        free(workers);
+        free(paths);
+        free(script.keys);
+        return 1;
+    }
+
+    int failures = 0;
+    int running = 0;
+    int status;
+    pid_t done;
+    for (int i = first_file; i < argc; i++) {
+        if (running == slots) {
+            if ((done = wait(&status)) > 0) {
+                running--;
+                if (batch_worker_failed(done, status, workers, paths, slots)) failures++;
+            }
+        }
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "%s: Error: cannot start worker: %s\n", argv[i], strerror(errno));
+            failures++;
+            continue;
+        }
+        if (pid == 0) {
+            int result = batch_process_file(&script, argv[i]);
+            fflush(stdout);
+            fflush(stderr);
+            _exit(result);
+        }
+        for (int slot = 0; slot < slots; slot++) {
+            if (workers[slot] != 0) continue;
+            workers[slot] = pid;
+            paths[slot] = argv[i];
+            break;
+        }
+        running++;
+    }
+    while (running > 0 && (done = wait(&status)) > 0) {
+        running--;
+        if (batch_worker_failed(done, status, workers, paths, slots)) failures++;
+    }
+
+    free(workers);
+    free(paths);
+    free(script.keys);
+    return failures ? 1 : 0;
+}
+
+// --- Bench Mode Implementation ---
+// `unied --bench` times the real buffer, highlighter, search, replace, undo
+// and render code on synthetic files. Each workload is generated into a
+// temporary .c file and run in a forked worker, like a batch file, so its peak
+// RSS is its own. Input comes from key scripts as in batch mode. Only the
+// render timings draw, into a null terminal, so prompts do not count towards
+// search and edit latency. Results are printed one JSON object per line.
+
+static const char *const bench_workload_names[BENCH_WORKLOAD_COUNT] = {
+    "long-lines", "short-lines", "tab-heavy", "comment-heavy"
+};
+
+// Tokens generated lines are made of; "needle" is what search and replace look for
+static const char *const bench_tokens[] = {
+    "int", "return", "if", "while", "for", "static", "const", "char",
+    "value", "count", "buffer", "index", "result", "next_item", "0", "42",
+    "0x1f", "3.14", "\"text\"", "'c'", "+", "==", "->", "(", ")", "{", "}", ";"
+};
+#define BENCH_TOKEN_COUNT ((int)(sizeof(bench_tokens) / sizeof(bench_tokens[0])))
+
+/**
+ * @brief Returns the next value of a xorshift64 generator.
+ *
+ * @param state Generator state, nonzero.
+ * @return A pseudo-random 64-bit value.
+ */
+static uint64_t bench_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/**
+ * @brief Writes about `len` bytes of space-separated tokens.
+ *
+ * @param out The file to write to.
+ * @param state Random generator state.
+ * @param len Bytes to write; the last token may run past it.
+ * @param tabs Separate tokens with tabs as often as with spaces.
+ * @return Number of bytes written.
+ */
+static int bench_put_tokens(FILE *out, uint64_t *state, int len, bool tabs) {
+    int written = 0;
+    while (written < len) {
+        uint64_t r = bench_random(state);
+        const char *token = (r & 0xff) == 0 ? "needle" : bench_tokens[(r >> 8) % BENCH_TOKEN_COUNT];
+        if (written > 0) {
+            fputc(tabs && (r & 0x100000) ? '\t' : ' ', out);
+            written++;
+        }
+        fputs(token, out);
+        written += (int)strlen(token);
+    }
+    return written;
+}
+
+/**
+ * @brief Writes one synthetic workload of at least `bytes` bytes.
+ *
+ * The same kind and size always produce the same file.
+ *
+ * @param out The file to write to.
+ * @param kind The workload to generate.
+ * @param bytes How much to write.
+ * @return true on success, false if writing failed.
+ */
+static bool bench_generate(FILE *out, BenchWorkload kind, size_t bytes) {
+    uint64_t state = 0x9e3779b97f4a7c15ULL + (uint64_t)kind;
+    bool in_block_comment = false;
+    size_t written = 0;
+    while (written < bytes && !ferror(out)) {
+        uint64_t r = bench_random(&state);
+        int len = (int)((r >> 8) % 72);
+        switch (kind) {
+        case BENCH_LONG_LINES:
+            written += (size_t)bench_put_tokens(out, &state, 64 * 1024 + (int)(r % (960 * 1024)), false);
+            break;
+        case BENCH_SHORT_LINES:
+            written += (size_t)bench_put_tokens(out, &state, (int)(r % 40), false);
+            break;
+        case BENCH_TAB_HEAVY:
+            for (int i = (int)(r % 8); i >= 0; i--, written++) fputc('\t', out);
+            written += (size_t)bench_put_tokens(out, &state, len, true);
+            break;
+        case BENCH_COMMENT_HEAVY:
+            if (in_block_comment) {
+                fputs(" * ", out);
+                written += 3 + (size_t)bench_put_tokens(out, &state, len, false);
+                if (r % 8 == 0) {
+                    fputs(" */", out);
+                    written += 3;
+                    in_block_comment = false;
+                }
+            } else if (r % 3 == 0) {
+                fputs("// ", out);
+                written += 3 + (size_t)bench_put_tokens(out, &state, len, false);
+            } else if (r % 3 == 1) {
+                fputs("/*", out);
+                written += 2;
+                in_block_comment = true;
+            } else {
+                fputs("    ", out);
+                written += 4 + (size_t)bench_put_tokens(out, &state, len, false);
+            }
+            break;
+        default:
+            break;
+        }
+        fputc('\n', out);
+        written++;
+    }
+    return fflush(out) == 0 && !ferror(out);
+}
+
+/**
+ * @brief Makes a BENCH_SCREEN_ROWS x BENCH_SCREEN_COLS ncurses screen that writes to /dev/null.
+ *
+ * Uses $TERM's terminfo entry, or xterm's if TERM is not set.
+ *
+ * @return true if the screen was created, false if there is no usable terminfo.
+ */
+static bool bench_screen_open(void) {
+    FILE *out = fopen("/dev/null", "w");
+    FILE *in = fopen("/dev/null", "r");
+    const char *term = getenv("TERM");
+    SCREEN *screen = (out && in) ? newterm(term && term[0] ? term : "xterm", out, in) : NULL;
+    if (screen == NULL) {
+        if (out) fclose(out);
+        if (in) fclose(in);
+        return false;
+    }
+    set_term(screen);
+    resizeterm(BENCH_SCREEN_ROWS, BENCH_SCREEN_COLS);
+    idlok(stdscr, TRUE);
+    init_color_pairs();
+    return true;
+}
+
+/**
+ * @brief Feeds keys to the editor as if typed and processes them all.
+ *
+ * @param keys The keys to type.
+ * @param count Number of keys.
+ */
+static void bench_run_keys(const int *keys, int count) {
+    E.script.keys = keys;
+    E.script.count = count;
+    E.script.pos = 0;
+    E.script.active = true;
+    while (E.script.pos < E.script.count) {
+        editor_process_keypress();
+    }
+}
+
+/**
+ * @brief Moves the cursor to a random position in the buffer.
+ *
+ * @param state Random generator state.
+ */
+static void bench_place_cursor(uint64_t *state) {
+    E.cursor_y = (int)(bench_random(state) % (uint64_t)E.num_lines);
+    E.cursor_x = (int)(bench_random(state) % (uint64_t)(editor_get_line(E.cursor_y)->size + 1));
+}
+
+/**
+ * @brief qsort() comparator for latency samples.
+ *
+ * @param a Pointer to the first double.
+ * @param b Pointer to the second double.
+ * @return Negative, zero or positive as `a` is less than, equal to or greater than `b`.
+ */
+static int bench_compare_us(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Summarizes the latency samples of one operation.
+ *
+ * @param result Where to store the summary.
+ * @param op Name of the operation.
+ * @param samples_us Latency of each run in microseconds; sorted in place.
+ * @param count Number of samples, > 0.
+ */
+static void bench_summarize(BenchResult *result, const char *op, double *samples_us, int count) {
+    double total_us = 0;
+    for (int i = 0; i < count; i++) total_us += samples_us[i];
+    qsort(samples_us, (size_t)count, sizeof(double), bench_compare_us);
+    result->op = op;
+    result->ops = count;
+    result->ops_per_sec = total_us > 0 ? count * 1e6 / total_us : 0;
+    result->p50_us = samples_us[(count - 1) * 50 / 100];
+    result->p99_us = samples_us[(count - 1) * 99 / 100];
+}
+
+/**
+ * @brief Generates one workload, times every operation on it and prints the results.
+ *
+ * Meant to run in a worker process: it leaves the editor state behind.
+ *
+ * @param kind The workload.
+ * @param bytes Size of the generated file; the last line may run past it.
+ * @param ops Edits to time; renders and searches run a fifth as often.
+ * @param render Whether a null terminal is set up to time rendering on.
+ * @return 0 on success, 1 if the input could not be generated or loaded.
+ */
+static int bench_run_workload(BenchWorkload kind, size_t bytes, int ops, bool render) {
+    const char *name = bench_workload_names[kind];
+    const char *dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/unied-bench-XXXXXX.c", dir && dir[0] ? dir : "/tmp");
+    int fd = mkstemps(path, 2);
+    FILE *out = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (out == NULL) {
+        fprintf(stderr, "%s: Error: cannot create input: %s\n", name, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    bool generated = bench_generate(out, kind, bytes);
+    bytes = (size_t)ftell(out);
+    fclose(out);
+    if (!generated) {
+        fprintf(stderr, "%s: Error: cannot write input: %s\n", name, strerror(errno));
+        unlink(path);
+        return 1;
+    }
+
+    BenchResult results[BENCH_MAX_RESULTS];
+    int result_count = 0;
+    int light_ops = ops / 5 > 0 ? ops / 5 : 1;
+    double *samples = malloc(sizeof(double) * (size_t)ops);
+    if (samples == NULL) {
+        fprintf(stderr, "%s: Error: out of memory\n", name);
+        unlink(path);
+        return 1;
+    }
+
+    double start = editor_now_ms();
+    editor_load_file(path);
+    editor_load_all();
+    samples[0] = (editor_now_ms() - start) * 1000.0;
+    bench_summarize(&results[result_count++], "load", samples, 1);
+    unlink(path);
+    if (E.map_load_failed || E.num_lines == 0) {
+        fprintf(stderr, "%s: Error: %s\n", name, E.status_message);
+        free(samples);
+        return 1;
+    }
+
+    uint64_t state = 0x2545f4914f6cdd1dULL;
+    if (render) {
+        E.offscreen = true;
+        // A jump redraws every row and lexes lines that have no highlight cached
+        for (int i = 0; i < light_ops; i++) {
+            bench_place_cursor(&state);
+            start = editor_now_ms();
+            editor_refresh_screen();
+            samples[i] = (editor_now_ms() - start) * 1000.0;
+        }
+        bench_summarize(&results[result_count++], "render_jump", samples, light_ops);
+
+        E.cursor_y = 0;
+        E.cursor_x = 0;
+        editor_refresh_screen();
+        const int page_down[] = { KEY_NPAGE };
+        for (int i = 0; i < light_ops; i++) {
+            start = editor_now_ms();
+            bench_run_keys(page_down, 1);
+            editor_refresh_screen();
+            samples[i] = (editor_now_ms() - start) * 1000.0;
+        }
+        bench_summarize(&results[result_count++], "render_page_down", samples, light_ops);
+        E.offscreen = false;
+    }
+
+    const int find[] = { CTRL('f'), 'n', 'e', 'e', 'd', 'l', 'e', '\n' };
+    for (int i = 0; i < light_ops; i++) {
+        bench_place_cursor(&state);
+        start = editor_now_ms();
+        bench_run_keys(find, (int)(sizeof(find) / sizeof(find[0])));
+        samples[i] = (editor_now_ms() - start) * 1000.0;
+    }
+    bench_summarize(&results[result_count++], "search", samples, light_ops);
+
+    const int insert[] = { 'x' };
+    for (int i = 0; i < ops; i++) {
+        bench_place_cursor(&state);
+        start = editor_now_ms();
+        bench_run_keys(insert, 1);
+        samples[i] = (editor_now_ms() - start) * 1000.0;
+    }
+    bench_summarize(&results[result_count++], "insert_char", samples, ops);
+
+    const int undo[] = { CTRL('z') };
+    for (int i = 0; i < ops; i++) {
+        start = editor_now_ms();
+        bench_run_keys(undo, 1);
+        samples[i] = (editor_now_ms() - start) * 1000.0;
+    }
+    bench_summarize(&results[result_count++], "undo", samples, ops);
+
+    const int redo[] = { CTRL('y') };
+    for (int i = 0; i < ops; i++) {
+        start = editor_now_ms();
+        bench_run_keys(redo, 1);
+        samples[i] = (editor_now_ms() - start) * 1000.0;
+    }
+    bench_summarize(&results[result_count++], "redo", samples, ops);
+
+    // Alternate directions so every run has the same matches to replace
+    const int replace_up[] = { CTRL('\\'), 'R', '\n', 'n', 'e', 'e', 'd', 'l', 'e', '\n', 'N', 'E', 'E', 'D', 'L', 'E', '\n' };
+    const int replace_down[] = { CTRL('\\'), 'R', '\n', 'N', 'E', 'E', 'D', 'L', 'E', '\n', 'n', 'e', 'e', 'd', 'l', 'e', '\n' };
+    int replace_ops = light_ops < 4 ? light_ops : 4;
+    for (int i = 0; i < replace_ops; i++) {
+        start = editor_now_ms();
+        bench_run_keys(i % 2 ? replace_down : replace_up, (int)(sizeof(replace_up) / sizeof(replace_up[0])));
+        samples[i] = (editor_now_ms() - start) * 1000.0;
+    }
+    bench_summarize(&results[result_count++], "replace_all", samples, replace_ops);
+    free(samples);
+
+    struct rusage usage;
+    long peak_rss_kb = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : -1;
+    for (int i = 0; i < result_count; i++) {
+        printf("{\"workload\":\"%s\",\"bytes\":%zu,\"lines\":%d,\"op\":\"%s\",\"ops\":%d,"
+               "\"ops_per_sec\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"peak_rss_kb\":%ld}\n",
+               name, bytes, E.num_lines, results[i].op, results[i].ops,
+               results[i].ops_per_sec, results[i].p50_us, results[i].p99_us, peak_rss_kb);
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses a byte count with an optional K, M or G suffix (powers of 1024).
+ *
+ * @param arg The text to parse, e.g. "64M".
+ * @param bytes Where to store the result.
+ * @return true if `arg` is a size from 1K to 1G, false otherwise.
+ */
+static bool bench_parse_size(const char *arg, size_t *bytes) {
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (errno != 0 || end == arg) return false;
+    switch (toupper((unsigned char)*end)) {
+    case 'K': n <<= 10; end++; break;
+    case 'M': n <<= 20; end++; break;
+    case 'G': n <<= 30; end++; break;
+    default: break;
+    }
+    if (*end != '\0' || n < 1024ULL || n > (1ULL << 30)) return false;
+    *bytes = (size_t)n;
+    return true;
+}
+
+/**
+ * @brief Entry point for `unied --bench [--size N] [--ops N] [workload...]`.
+ *
+ * Runs the named workloads, or all of them, one worker process at a time so
+ * their timings do not compete.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments; argv[1] is "--bench".
+ * @return 0 if every workload ran, 1 if any failed, 2 on a usage error.
+ */
+static int bench_main(int argc, char *argv[]) {
+    size_t bytes = BENCH_DEFAULT_BYTES;
+    long ops = BENCH_DEFAULT_OPS;
+    bool selected[BENCH_WORKLOAD_COUNT] = { false };
+    bool any_selected = false;
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            if (!bench_parse_size(argv[++i], &bytes)) {
+                fprintf(stderr, "%s: Error: --size must be from 1K to 1G\n", argv[0]);
+                return 2;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) {
+            ops = strtol(argv[++i], NULL, 10);
+            if (ops < 1 || ops > UNDO_RING_CAPACITY) {
+                fprintf(stderr, "%s: Error: --ops must be from 1 to %d\n", argv[0], UNDO_RING_CAPACITY);
+                return 2;
+            }
+            continue;
+        }
+        int kind = 0;
+        while (kind < BENCH_WORKLOAD_COUNT && strcmp(argv[i], bench_workload_names[kind]) != 0) kind++;
+        if (kind == BENCH_WORKLOAD_COUNT) {
+            fprintf(stderr, "Usage: %s --bench [--size N[K|M|G]] [--ops N] [long-lines|short-lines|tab-heavy|comment-heavy]...\n", argv[0]);
+            return 2;
+        }
+        selected[kind] = true;
+        any_selected = true;
+    }
+
+    int failures = 0;
+    for (int kind = 0; kind < BENCH_WORKLOAD_COUNT; kind++) {
+        if (any_selected && !selected[kind]) continue;
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "%s: Error: cannot start worker: %s\n", bench_workload_names[kind], strerror(errno));
+            failures++;
+            continue;
+        }
+        if (pid == 0) {
+            E.headless = true;
+            init_editor_state();
+            bool render = bench_screen_open();
+            if (!render) {
+                fprintf(stderr, "%s: no terminfo entry, render timings skipped\n", bench_workload_names[kind]);
+            }
+            E.screen_rows = BENCH_SCREEN_ROWS - HINT_ROWS - 1 - SUGGESTION_ROWS - 2 * BORDER_WIDTH;
+            E.screen_cols = BENCH_SCREEN_COLS;
+            E.total_screen_rows = BENCH_SCREEN_ROWS;
+            int result = bench_run_workload((BenchWorkload)kind, bytes, (int)ops, render);
+            fflush(stdout);
+            fflush(stderr);
+            _exit(result);
+        }
+        int status;
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) failures++;
+    }
+    return failures ? 1 : 0;
+}
+
 /**
  * @brief Main function of the Unied editor.
  *
@@ -3440,28 +12979,70 @@ void editor_process_keypress(void) {
  *
  * @param argc The number of command-line arguments.
  * @param argv An array of strings representing the command-line arguments.
- * Expected: argv[1] is the path to the file to open (optional).
+ * Expected: an optional path to the file to open, optionally preceded by
+ * --fast, --startup-profile and --trace FILE; "--batch" followed by a script and the
+ * files to run it on; or "--bench" followed by its options.
  * @return 0 on successful execution, non-zero on error.
  */
 int main(int argc, char *argv[]) {
-    // Initialize ncurses early for loading screen
-    initscr();
-    if (has_colors()) {
-        start_color();
-        init_pair(COLOR_PAIR_DEFAULT, COLOR_WHITE, COLOR_BLACK);
+    // Text is UTF-8 whatever the environment says, so fall back to a UTF-8
+    // locale for ncursesw and wcwidth() when the user's is not one
+    setlocale(LC_CTYPE, "");
+    if (strcmp(nl_langinfo(CODESET), "UTF-8") != 0) {
+        setlocale(LC_CTYPE, "C.UTF-8");
+    }
+    mapping_catch_faults();
+
+    if (argc >= 2 && strcmp(argv[1], "--batch") == 0) {
+        return batch_main(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0) {
+        return bench_main(argc, argv);
+    }
+
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--fast") == 0) {
+            E.fast_start = true;
+        } else if (strcmp(argv[i], "--startup-profile") == 0) {
+            E.startup.enabled = true;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            if (!latency_trace_open(argv[++i])) {
+                fprintf(stderr, "%s: Error: cannot write trace file %s: %s\n", argv[0], argv[i], strerror(errno));
+                return 2;
+            }
+        } else if (!path) {
+            path = argv[i];
+        }
     }
-    noecho();
-    curs_set(0); // Hide cursor during loading
-    refresh();
 
-    display_loading_screen(); // Show loading animation
+    double phase_start = editor_now_ms();
+    if (!E.fast_start) {
+        // Initialize ncurses early for loading screen
+        initscr();
+        if (has_colors()) {
+            start_color();
+            init_pair(COLOR_PAIR_DEFAULT, COLOR_WHITE, COLOR_BLACK);
+        }
+        noecho();
+        curs_set(0); // Hide cursor during loading
+        refresh();
 
-    endwin(); // Deinitialize ncurses to re-init with full settings
-    
+        display_loading_screen(); // Show loading animation
+
+        endwin(); // Deinitialize ncurses to re-init with full settings
+    }
+    double phase_end = editor_now_ms();
+    E.startup.splash_ms = phase_end - phase_start;
+
+    phase_start = phase_end;
     init_editor(); // Initialize editor with full ncurses settings
+    phase_end = editor_now_ms();
+    E.startup.ncurses_ms = phase_end - phase_start;
 
-    if (argc >= 2) {
-        editor_load_file(argv[1]);
+    phase_start = phase_end;
+    if (path) {
+        editor_load_file(path);
     } else {
         // If no filename provided, start with one empty line
         editor_insert_line(0, "", 0);
@@ -3471,11 +13052,24 @@ int main(int argc, char *argv[]) {
         mark_lines_dirty(0,0); // Mark the initial empty line dirty for redraw
         prompt_file_type(); // Prompt for file type on new file
     }
+    phase_end = editor_now_ms();
+    E.startup.load_ms = phase_end - phase_start;
+
+    phase_start = phase_end;
+    editor_refresh_screen();
+    E.startup.paint_ms = editor_now_ms() - phase_start;
+    if (E.startup.enabled) {
+        char report[MAX_STATUS_MESSAGE_LENGTH];
+        startup_profile_format(report, sizeof(report));
+        set_status_message("%s", report);
+    }
 
     // Main editor loop
     while (true) {
         editor_refresh_screen();
         editor_process_keypress();
+        editor_drain_input();
+        mapping_check();
     }
 
     // deinit_editor() is called inside editor_process_keypress when quitting
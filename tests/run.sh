@@ -0,0 +1,32 @@
+#!/bin/sh
+# Batch mode regression tests. Each NAME.script runs against a copy of
+# NAME.in (or seed.txt when there is none), which must then match NAME.out.
+#
+#   gcc -Wall -Wextra main.c -o unied -lncursesw -pthread
+#   sh tests/run.sh ./unied
+unied=${1:-./unied}
+dir=$(dirname "$0")
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+export HOME="$work"
+failed=0
+for script in "$dir"/*.script; do
+    name=$(basename "$script" .script)
+    input="$dir/$name.in"
+    [ -f "$input" ] || input="$dir/seed.txt"
+    cp "$input" "$work/$name.txt"
+    "$unied" --batch "$script" "$work/$name.txt" >"$work/$name.log" 2>&1
+    status=$?
+    if [ $status -ne 0 ]; then
+        echo "FAIL $name: exit status $status"
+        cat "$work/$name.log"
+        failed=1
+    elif ! cmp -s "$work/$name.txt" "$dir/$name.out"; then
+        echo "FAIL $name: output differs"
+        diff "$dir/$name.out" "$work/$name.txt"
+        failed=1
+    else
+        echo "ok   $name"
+    fi
+done
+exit $failed